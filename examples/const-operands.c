@@ -0,0 +1,41 @@
+/**
+ * Regression test for instruction selection in Consolite C.
+ * Each expression below has a constant or register variable as its right
+ * operand, which is loaded straight into a register, so none of them
+ * spills its left operand to the stack and pops it back. Each value
+ * printed is drawn as a pixel in the next column, at the height of the
+ * value. Takes no input.
+ *
+ * Expect: 13 2 6 5 1 13 4 11
+ * Forbid: POP [LMN]
+ */
+
+uint16 column = 0;
+uint16 total = 10;
+uint16[8] a;
+
+void out(uint16 value) {
+  PIXEL(column, value);
+  column = column + 1;
+}
+
+void main() {
+  uint16 x = total;
+  uint16 y;
+  uint16 z;
+  COLOR(0xff);
+  x = (x + 3) & 0xf;
+  y = x - 11;
+  total = total - 4;
+  a[y] = 5;
+  z = a[y] | 8;
+  a[5] = 1;
+  out(x);
+  out(y);
+  out(total);
+  out(a[y]);
+  out(a[5]);
+  out(z);
+  out((a[y] << 1) - 6);
+  out((total == 6) * 11);
+}
@@ -0,0 +1,51 @@
+/**
+ * Regression test for loop fusion in Consolite C.
+ * Each pair of loops below has the same header, but they must not be
+ * fused into one loop that alternates between them. In the first pair
+ * each iteration calls out(), which prints in order, and in the second
+ * pair the first loop calls tick(), which changes what the second loop
+ * reads. Each value printed is drawn as a pixel in the next column, at
+ * the height of the value. Takes no input.
+ *
+ * Expect: 1 2 3 4 10 20 30 40 1 2 3 4 4 5 6 7
+ */
+
+uint16 column = 0;
+uint16[4] a = { 1, 2, 3, 4 };
+uint16[4] b = { 10, 20, 30, 40 };
+uint16[4] c;
+uint16[4] d;
+uint16 count = 0;
+
+void out(uint16 value) {
+  PIXEL(column, value);
+  column = column + 1;
+}
+
+uint16 tick() {
+  count = count + 1;
+  return count;
+}
+
+void main() {
+  uint16 i;
+  COLOR(0xff);
+  for (i = 0; i < 4; i = i + 1) {
+    out(a[i]);
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    out(b[i]);
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    c[i] = tick();
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    d[i] = count + i;
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    out(c[i]);
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    out(d[i]);
+  }
+}
@@ -0,0 +1,50 @@
+/**
+ * Regression test for loop unswitching in Consolite C.
+ * The conditions "mode == 1" and "flags[0] == 1" look like they don't
+ * change in their loops, but flip() changes mode and clear() changes
+ * flags, so the tests can't be moved out of the loops. Each value printed
+ * is drawn as a pixel in the next column, at the height of the value.
+ * Takes no input.
+ *
+ * Expect: 1 2 2 2 3 4 4 4
+ */
+
+uint16 column = 0;
+uint16 mode = 1;
+uint16[1] flags = { 1 };
+
+void out(uint16 value) {
+  PIXEL(column, value);
+  column = column + 1;
+}
+
+void flip() {
+  mode = 0;
+}
+
+uint16 clear() {
+  flags[0] = 0;
+  return 1;
+}
+
+void main() {
+  uint16 i;
+  uint16 cleared;
+  COLOR(0xff);
+  for (i = 0; i < 4; i = i + 1) {
+    if (mode == 1) {
+      out(1);
+    } else {
+      out(2);
+    }
+    flip();
+  }
+  for (i = 0; i < 4; i = i + 1) {
+    if (flags[0] == 1) {
+      out(3);
+    } else {
+      out(4);
+    }
+    cleared = clear();
+  }
+}
@@ -4,28 +4,157 @@
  */
 
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
 #include "parser.h"
+#include "machine.h"
+#include "peephole.h"
 
 void usage(char *program_name) {
-  std::cout << "Usage: " << program_name << " SRC DEST" << std::endl;
+  std::cout << "Usage: " << program_name << " [OPTIONS] SRC DEST" << std::endl
+            << "Options:" << std::endl
+            << "  -Os                      Share repeated instruction "
+            << "sequences to make the output smaller." << std::endl
+            << "  -fno-specialize          Don't specialize functions for "
+            << "constant arguments." << std::endl
+            << "  -fspecialize-budget=N    Let specialized functions add at "
+            << "most N bytes." << std::endl
+            << "  -funroll-budget=N        Let a fully unrolled loop take up "
+            << "at most N bytes." << std::endl
+            << "  -funswitch-budget=N      Let unswitching a loop add at "
+            << "most N bytes." << std::endl
+            << "  -ffuse-budget=N          Let fusing loops add at most N "
+            << "bytes." << std::endl
+            << "  -fbounds-check           Stop the program if an array "
+            << "index is out of bounds." << std::endl
+            << "  -flazy-parse             Only parse and output functions "
+            << "that main() can reach." << std::endl
+            << "  -fcheck-unreachable      Still check the functions that "
+            << "-flazy-parse leaves out." << std::endl
+            << "  -machine=FILE            Generate code for the machine "
+            << "described in FILE." << std::endl
+            << "  -print-machine           Print the description of the "
+            << "default machine." << std::endl
+            << "  -fno-peephole            Don't replace instruction "
+            << "sequences using the peephole table." << std::endl
+            << "  -peephole=FILE           Use the peephole table in FILE."
+            << std::endl
+            << "  -print-peephole          Print the default peephole "
+            << "table." << std::endl
+            << "  -line-map=FILE           Write the source line of each "
+            << "line of output to FILE." << std::endl
+            << "  -compression-report=FILE Write the bytes and cycles of "
+            << "compressed arrays to FILE." << std::endl;
+}
+
+/**
+ * Returns true if arg starts with the given prefix, and sets value to
+ * the integer following the prefix.
+ */
+bool intOption(const char *arg, const char *prefix, int& value) {
+  size_t len = strlen(prefix);
+  if (0 != strncmp(arg, prefix, len)) {
+    return false;
+  }
+  value = atoi(arg + len);
+  return true;
 }
 
 int main(int argc, char **argv) {
-  if (3 != argc) {
+  CompilerOptions options;
+  const char *machineFile = nullptr;
+  const char *peepholeFile = nullptr;
+  const char *lineMapFile = nullptr;
+  const char *compressionReportFile = nullptr;
+  char *src = nullptr;
+  char *dest = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if ('-' != argv[i][0]) {
+      if (!src) {
+        src = argv[i];
+      } else if (!dest) {
+        dest = argv[i];
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (0 == strcmp(argv[i], "-Os")) {
+      // Loops that are unrolled or unswitched make the output bigger.
+      options.optimizeSize = true;
+      options.unrollBudget = 0;
+      options.unswitchBudget = 0;
+    } else if (0 == strcmp(argv[i], "-fno-specialize")) {
+      options.specialize = false;
+    } else if (0 == strcmp(argv[i], "-fbounds-check")) {
+      options.boundsCheck = true;
+    } else if (0 == strcmp(argv[i], "-flazy-parse")) {
+      options.lazyParse = true;
+    } else if (0 == strcmp(argv[i], "-fcheck-unreachable")) {
+      options.checkUnreachable = true;
+    } else if (0 == strcmp(argv[i], "-fno-peephole")) {
+      options.peephole = false;
+    } else if (intOption(argv[i], "-fspecialize-budget=",
+                         options.specializeBudget) ||
+               intOption(argv[i], "-funroll-budget=",
+                         options.unrollBudget) ||
+               intOption(argv[i], "-funswitch-budget=",
+                         options.unswitchBudget) ||
+               intOption(argv[i], "-ffuse-budget=",
+                         options.fuseBudget)) {
+      continue;
+    } else if (0 == strncmp(argv[i], "-machine=", strlen("-machine="))) {
+      machineFile = argv[i] + strlen("-machine=");
+    } else if (0 == strcmp(argv[i], "-print-machine")) {
+      std::cout << Machine::defaultDescription();
+      return 0;
+    } else if (0 == strncmp(argv[i], "-peephole=", strlen("-peephole="))) {
+      peepholeFile = argv[i] + strlen("-peephole=");
+    } else if (0 == strcmp(argv[i], "-print-peephole")) {
+      std::cout << Peephole::defaultTable();
+      return 0;
+    } else if (0 == strncmp(argv[i], "-line-map=", strlen("-line-map="))) {
+      lineMapFile = argv[i] + strlen("-line-map=");
+    } else if (0 == strncmp(argv[i], "-compression-report=",
+                            strlen("-compression-report="))) {
+      compressionReportFile = argv[i] + strlen("-compression-report=");
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!src || !dest) {
     usage(argv[0]);
     return 1;
   }
 
   try {
+    // Loads the description of the machine to generate code for
+    if (machineFile && !Machine::current().load(machineFile)) {
+      return 1;
+    }
+    // Loads the table of instruction sequences to replace
+    if (peepholeFile && !Peephole::current().load(peepholeFile)) {
+      return 1;
+    }
     // Creates a stream of tokens from the input file
-    Tokenizer tokenizer(argv[1]);
+    Tokenizer tokenizer(src);
     // Parses the tokens into an abstract syntax tree
-    Parser parser(&tokenizer);
+    Parser parser(&tokenizer, options);
     if (!parser.parse()) {
       return 1;
     }
     // Compiles the syntax tree to the output file
-    if (!parser.output(argv[2])) {
+    if (!parser.output(dest)) {
+      return 1;
+    }
+    // Maps the output back to the source, for profiling
+    if (lineMapFile && !parser.writeLineMap(lineMapFile, src)) {
+      return 1;
+    }
+    // Weighs the bytes compressed arrays save against the time it takes
+    // to expand them
+    if (compressionReportFile &&
+        !parser.writeCompressionReport(compressionReportFile)) {
       return 1;
     }
   } catch (char const *error) {
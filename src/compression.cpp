@@ -0,0 +1,299 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <algorithm>
+#include <map>
+#include "compression.h"
+#include "machine.h"
+#include "parser.h"
+#include "util.h"
+
+// The largest counts that fit in the headers of the commands.
+static const size_t MAX_LITERAL = 0x3fff;
+static const size_t MAX_FILL = 0x3fff;
+static const size_t MAX_COPY = 0x7fff;
+// Shorter fills and copies take up as much room as the elements do.
+static const size_t MIN_FILL = 3;
+static const size_t MIN_COPY = 3;
+// How many earlier positions with the same hash are tried for a copy,
+// which bounds the time spent on big arrays.
+static const int MAX_CHAIN = 256;
+
+/**
+ * Returns a hash of the three elements starting at the given position.
+ */
+static size_t hashAt(const std::vector<uint16_t>& words, size_t pos) {
+  return (words[pos] * 0x9e37u ^ words[pos + 1] * 0x85ebu ^
+          words[pos + 2]) & 0xffffu;
+}
+
+/**
+ * Compresses the elements with a greedy search: at each position the
+ * longest fill or copy that starts there is taken, and elements that start
+ * neither are gathered into literal commands. Copies are found by keeping,
+ * for each hash of three elements, a chain of the earlier positions that
+ * start with them.
+ */
+std::vector<uint16_t> compressWords(const std::vector<uint16_t>& words,
+                                    Encoding encoding) {
+  std::vector<uint16_t> stream;
+  size_t literalStart = 0;
+  auto flushLiterals = [&](size_t end) {
+    while (literalStart < end) {
+      size_t count = std::min(end - literalStart, MAX_LITERAL);
+      stream.push_back(count);
+      stream.insert(stream.end(), words.begin() + literalStart,
+                    words.begin() + literalStart + count);
+      literalStart += count;
+    }
+  };
+  const size_t none = SIZE_MAX;
+  std::vector<size_t> head;
+  std::vector<size_t> prev;
+  if (LZ_ENCODING == encoding) {
+    head.assign(0x10000, none);
+    prev.assign(words.size(), none);
+  }
+  auto insert = [&](size_t pos) {
+    if (LZ_ENCODING == encoding && pos + 2 < words.size()) {
+      size_t hash = hashAt(words, pos);
+      prev[pos] = head[hash];
+      head[hash] = pos;
+    }
+  };
+  size_t pos = 0;
+  while (pos < words.size()) {
+    size_t fill = 1;
+    while (pos + fill < words.size() && fill < MAX_FILL &&
+           words[pos + fill] == words[pos]) {
+      fill++;
+    }
+    size_t copy = 0;
+    size_t distance = 0;
+    if (LZ_ENCODING == encoding && pos + 2 < words.size()) {
+      size_t candidate = head[hashAt(words, pos)];
+      for (int i = 0; i < MAX_CHAIN && none != candidate; i++) {
+        size_t length = 0;
+        while (pos + length < words.size() && length < MAX_COPY &&
+               words[candidate + length] == words[pos + length]) {
+          length++;
+        }
+        if (length > copy) {
+          copy = length;
+          distance = pos - candidate;
+        }
+        candidate = prev[candidate];
+      }
+    }
+    size_t length = 1;
+    if (MIN_FILL <= fill && copy <= fill) {
+      flushLiterals(pos);
+      stream.push_back(0x4000 | fill);
+      stream.push_back(words[pos]);
+      length = fill;
+    } else if (MIN_COPY <= copy) {
+      flushLiterals(pos);
+      stream.push_back(0x8000 | copy);
+      stream.push_back(distance);
+      length = copy;
+    }
+    for (size_t i = 0; i < length; i++) {
+      insert(pos + i);
+    }
+    pos += length;
+    if (1 < length) {
+      literalStart = pos;
+    }
+  }
+  flushLiterals(words.size());
+  stream.push_back(0);
+  return stream;
+}
+
+/**
+ * Returns the name of the encoding.
+ */
+std::string encodingName(Encoding encoding) {
+  return LZ_ENCODING == encoding ? "lz" : "rle";
+}
+
+// The blocks of instructions that the decompression routine is made of,
+// which are shared by outputDecompress() and decompressCycles() so that
+// the cycle count matches the routine. Arguments starting with '$' are
+// filled in when the routine is output, and "SCALE R" stands for the
+// instructions that multiply R by the data size, see scaleInsts(). The
+// stream is read through M and the buffer is written through N, with A
+// holding the header and B the end of the elements that the command
+// writes.
+static const std::vector<std::string> ENTRY = {
+  "PUSH A", "PUSH B", "PUSH C", "MOVI C $size"
+};
+static const std::vector<std::string> HEAD = {
+  "LOAD A M", "ADD M C", "TST A A", "JEQ $done"
+};
+static const std::vector<std::string> COPY_TEST = { "JS $copy" };
+static const std::vector<std::string> FILL_TEST = {
+  "MOVI L 0x4000", "CMP A L", "JAE $fill"
+};
+static const std::vector<std::string> LITERAL_SETUP = {
+  "SCALE A", "MOV B N", "ADD B A"
+};
+static const std::vector<std::string> LITERAL_LOOP = {
+  "LOAD L M", "ADD M C", "STOR L N", "ADD N C", "CMP N B",
+  "JB $literal_loop"
+};
+static const std::vector<std::string> FILL_SETUP = {
+  "SUB A L", "LOAD L M", "ADD M C", "SCALE A", "MOV B N", "ADD B A"
+};
+static const std::vector<std::string> FILL_LOOP = {
+  "STOR L N", "ADD N C", "CMP N B", "JB $fill_loop"
+};
+static const std::vector<std::string> COPY_SETUP = {
+  "MOVI L 0x7fff", "AND A L", "LOAD L M", "ADD M C", "PUSH M",
+  "SCALE L", "MOV M N", "SUB M L", "SCALE A", "MOV B N", "ADD B A"
+};
+static const std::vector<std::string> COPY_LOOP = {
+  "LOAD L M", "ADD M C", "STOR L N", "ADD N C", "CMP N B", "JB $copy_loop"
+};
+static const std::vector<std::string> COPY_END = { "POP M" };
+static const std::vector<std::string> NEXT = { "JMPI $next" };
+static const std::vector<std::string> EXIT = {
+  "POP C", "POP B", "POP A", "RET"
+};
+
+/**
+ * Returns the instructions that multiply the register by the data size,
+ * which is in C. When the size is a power of two and doubling the register
+ * that many times is quicker than MUL, the register is added to itself
+ * instead, which is a single ADD for the reference core.
+ */
+static std::vector<std::string> scaleInsts(const std::string& reg) {
+  const Machine& machine = Machine::current();
+  int size = machine.dataSize();
+  std::vector<std::string> insts;
+  while (0 == size % 2) {
+    insts.push_back("ADD " + reg + " " + reg);
+    size /= 2;
+  }
+  if (1 != size ||
+      machine.cycles("MUL") <= (int)insts.size() * machine.cycles("ADD")) {
+    insts = { "MUL " + reg + " C" };
+  }
+  return insts;
+}
+
+/**
+ * Returns the instructions of the block, with each SCALE replaced.
+ */
+static std::vector<std::string> expand(
+      const std::vector<std::string>& block) {
+  std::vector<std::string> insts;
+  for (const std::string& inst : block) {
+    if (0 == inst.compare(0, 6, "SCALE ")) {
+      std::vector<std::string> scale = scaleInsts(inst.substr(6));
+      insts.insert(insts.end(), scale.begin(), scale.end());
+    } else {
+      insts.push_back(inst);
+    }
+  }
+  return insts;
+}
+
+/**
+ * Returns the number of cycles the block takes to run once.
+ */
+static int blockCycles(const std::vector<std::string>& block) {
+  const Machine& machine = Machine::current();
+  int cycles = 0;
+  for (const std::string& inst : expand(block)) {
+    cycles += machine.cycles(inst.substr(0, inst.find(' ')));
+  }
+  return cycles;
+}
+
+/**
+ * Adds up the cycles of the blocks that each command of the stream runs.
+ */
+int decompressCycles(const std::vector<uint16_t>& stream, bool copies) {
+  const Machine& machine = Machine::current();
+  int tests = blockCycles(HEAD) + blockCycles(FILL_TEST) +
+              (copies ? blockCycles(COPY_TEST) : 0);
+  int cycles = machine.cycles("CALL") + blockCycles(ENTRY) +
+               blockCycles(HEAD) + blockCycles(EXIT);
+  size_t i = 0;
+  while (i < stream.size() && 0 != stream[i]) {
+    int count = stream[i];
+    if (0x8000 & count) {
+      count &= 0x7fff;
+      cycles += blockCycles(HEAD) + blockCycles(COPY_TEST) +
+                blockCycles(COPY_SETUP) + count * blockCycles(COPY_LOOP) +
+                blockCycles(COPY_END) + blockCycles(NEXT);
+      i += 2;
+    } else if (0x4000 & count) {
+      count &= 0x3fff;
+      cycles += tests + blockCycles(FILL_SETUP) +
+                count * blockCycles(FILL_LOOP) + blockCycles(NEXT);
+      i += 2;
+    } else {
+      cycles += tests + blockCycles(LITERAL_SETUP) +
+                count * blockCycles(LITERAL_LOOP) + blockCycles(NEXT);
+      i += 1 + count;
+    }
+  }
+  return cycles;
+}
+
+/**
+ * Outputs the decompression routine, with a label before each block that
+ * is jumped to.
+ */
+int outputDecompress(Parser *parser, const std::string& label, bool copies) {
+  const Machine& machine = Machine::current();
+  std::map<std::string, std::string> args;
+  args["$size"] = toHexStr(machine.dataSize());
+  for (std::string name : { "next", "done", "literal_loop", "fill",
+                            "fill_loop", "copy", "copy_loop" }) {
+    args["$" + name] = parser->getUnusedLabel(label + "_" + name);
+  }
+  int insts = 0;
+  auto output = [&](const std::vector<std::string>& block) {
+    for (const std::string& inst : expand(block)) {
+      size_t space = inst.rfind(' ');
+      auto it = args.find(inst.substr(space + 1));
+      parser->writeInst(args.end() == it ? inst
+                                         : inst.substr(0, space + 1) +
+                                           it->second);
+      insts++;
+    }
+  };
+  parser->writeln(label + ":");
+  output(ENTRY);
+  parser->writeln(args["$next"] + ":");
+  output(HEAD);
+  if (copies) {
+    output(COPY_TEST);
+  }
+  output(FILL_TEST);
+  output(LITERAL_SETUP);
+  parser->writeln(args["$literal_loop"] + ":");
+  output(LITERAL_LOOP);
+  output(NEXT);
+  parser->writeln(args["$fill"] + ":");
+  output(FILL_SETUP);
+  parser->writeln(args["$fill_loop"] + ":");
+  output(FILL_LOOP);
+  output(NEXT);
+  if (copies) {
+    parser->writeln(args["$copy"] + ":");
+    output(COPY_SETUP);
+    parser->writeln(args["$copy_loop"] + ":");
+    output(COPY_LOOP);
+    output(COPY_END);
+    output(NEXT);
+  }
+  parser->writeln(args["$done"] + ":");
+  output(EXIT);
+  return insts * machine.instSize();
+}
@@ -0,0 +1,59 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_COMPRESSION_H
+#define CONSOLITE_COMPILER_COMPRESSION_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Parser;
+
+/**
+ * The elements of a global array declared "compressed" are written out as
+ * a stream of commands, which the routine output by outputDecompress()
+ * expands into a buffer at runtime. Each command starts with a header
+ * word:
+ *
+ *   0          - the end of the stream
+ *   1..0x3fff  - that many elements, which follow the header
+ *   0x4000 | n - n copies of the element that follows the header
+ *   0x8000 | n - n elements copied from the distance that follows the
+ *                header, in elements back from the end of the output,
+ *                which may overlap the elements being copied
+ *
+ * RLE streams only use the first three, and LZ streams use them all.
+ */
+enum Encoding { RLE_ENCODING, LZ_ENCODING };
+
+/**
+ * Returns the stream that the given elements are compressed to.
+ */
+std::vector<uint16_t> compressWords(const std::vector<uint16_t>& words,
+                                    Encoding encoding);
+
+/**
+ * Returns the name of the encoding, as it is written in the compression
+ * report.
+ */
+std::string encodingName(Encoding encoding);
+
+/**
+ * Returns the number of cycles the decompression routine takes to expand
+ * the given stream, including the call to it. The routine handles copies
+ * if copies is true.
+ */
+int decompressCycles(const std::vector<uint16_t>& stream, bool copies);
+
+/**
+ * Outputs the routine that expands the stream at the address in M into
+ * the buffer at the address in N, and returns the number of bytes it
+ * takes up. It only handles copies if copies is true, which is needed for
+ * LZ streams.
+ */
+int outputDecompress(Parser *parser, const std::string& label, bool copies);
+
+#endif
@@ -0,0 +1,306 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <algorithm>
+#include "effects.h"
+#include "util.h"
+
+/**
+ * An operand on the stack while walking a postfix expression. Variables
+ * and memory accesses are only counted as reads once it is known that
+ * they aren't being assigned to or having their address taken.
+ */
+struct EffectOperand {
+  enum Kind { VALUE, VARIABLE, MEMORY };
+  Kind kind;
+  const Variable *var;
+  MemoryAccess access;
+};
+
+/**
+ * Returns true if the builtin with the given name has side effects, or
+ * returns a value that depends on when it is called.
+ */
+static bool isIOBuiltin(const std::string& funcName) {
+  static const std::vector<std::string> pure = { "likely", "unlikely",
+                                                 "ABS", "MIN", "MAX",
+                                                 "ISQRT" };
+  return pure.end() == std::find(pure.begin(), pure.end(), funcName);
+}
+
+/**
+ * Returns true if the builtin with the given name calls a routine that
+ * reads and writes memory, so it is treated like a call to a function.
+ */
+static bool isRoutineBuiltin(const std::string& funcName) {
+  return "decompress" == funcName;
+}
+
+/**
+ * Adds the effects of other code to these.
+ */
+void Effects::merge(const Effects& other) {
+  reads.insert(other.reads.begin(), other.reads.end());
+  writes.insert(other.writes.begin(), other.writes.end());
+  memoryVars.insert(other.memoryVars.begin(), other.memoryVars.end());
+  memory.insert(memory.end(), other.memory.begin(), other.memory.end());
+  io = io || other.io;
+  calls = calls || other.calls;
+}
+
+/**
+ * Records that the operand's value is used.
+ */
+static void readOperand(const EffectOperand& operand, Effects& effects) {
+  if (EffectOperand::VARIABLE == operand.kind) {
+    effects.reads.insert(operand.var);
+  } else if (EffectOperand::MEMORY == operand.kind) {
+    effects.memory.push_back(operand.access);
+  }
+}
+
+/**
+ * Adds the effects of making the call to effects, besides those of
+ * evaluating its arguments.
+ */
+static void addCallEffects(const FunctionCallToken& fnCall,
+                           Effects& effects) {
+  if (!isBuiltin(fnCall.funcName()) || isRoutineBuiltin(fnCall.funcName())) {
+    effects.calls = true;
+  } else if (isIOBuiltin(fnCall.funcName())) {
+    effects.io = true;
+  }
+}
+
+/**
+ * Adds the effects of evaluating the expression to effects.
+ */
+static void addEffects(const std::shared_ptr<ExprToken>& expr,
+                       const Variable *induction,
+                       Effects& effects) {
+  const Postfix& postfix = expr->postfix();
+  auto leaf = [&](size_t i, EffectOperand& result) {
+    auto fnCall = postfix.call(i);
+    auto var = postfix.variable(i);
+    result = { EffectOperand::VALUE, nullptr, { nullptr, false, false } };
+    if (fnCall) {
+      std::vector<std::shared_ptr<ExprToken>> exprs;
+      fnCall->getExprs(exprs);
+      for (auto callExpr : exprs) {
+        addEffects(callExpr, induction, effects);
+      }
+      addCallEffects(*fnCall, effects);
+    } else if (var) {
+      result.kind = EffectOperand::VARIABLE;
+      result.var = var.get();
+      if (Postfix::GLOBAL == postfix.kind(i) || !var->canBeReg()) {
+        effects.memoryVars.insert(var.get());
+      }
+    }
+    return true;
+  };
+  auto apply = [&](size_t i, EffectOperand& lhs, EffectOperand& rhs,
+                   EffectOperand& result) {
+    const OperatorToken& op = postfix.op(i);
+    result = { EffectOperand::VALUE, nullptr, { nullptr, false, false } };
+    if (!op.isBinary()) {
+      if ("&" == op.str()) {
+        // Taking an address doesn't read anything.
+      } else if ("*" == op.str()) {
+        readOperand(rhs, effects);
+        result.kind = EffectOperand::MEMORY;
+      } else {
+        readOperand(rhs, effects);
+      }
+    } else if ("=" == op.str()) {
+      readOperand(rhs, effects);
+      if (EffectOperand::VARIABLE == lhs.kind) {
+        effects.writes.insert(lhs.var);
+      } else {
+        lhs.access.write = true;
+        effects.memory.push_back(lhs.access);
+      }
+      // The result of an assignment is the assigned value.
+    } else if ("[" == op.str()) {
+      readOperand(lhs, effects);
+      readOperand(rhs, effects);
+      result.kind = EffectOperand::MEMORY;
+      // Only an array variable's elements are known not to overlap with
+      // other memory, since a pointer could point anywhere.
+      if (EffectOperand::VARIABLE == lhs.kind &&
+          lhs.var->type().isArray()) {
+        result.access.array = lhs.var;
+        result.access.byInduction = induction &&
+          EffectOperand::VARIABLE == rhs.kind && induction == rhs.var;
+      }
+    } else {
+      readOperand(lhs, effects);
+      readOperand(rhs, effects);
+    }
+    return true;
+  };
+  EffectOperand result;
+  if (postfix.walk(leaf, apply, result)) {
+    readOperand(result, effects);
+  }
+}
+
+/**
+ * Returns the effects of evaluating the given expressions, including the
+ * arguments of the functions they call. Accesses to memory indexed by the
+ * induction variable, if there is one, are marked as such.
+ */
+Effects getEffects(const std::vector<std::shared_ptr<ExprToken>>& exprs,
+                   const Variable *induction) {
+  Effects effects;
+  for (auto expr : exprs) {
+    addEffects(expr, induction, effects);
+  }
+  return effects;
+}
+
+/**
+ * Returns the effects of running the given statement and all of the
+ * statements nested within it.
+ */
+Effects getEffects(const std::shared_ptr<StatementToken>& statement,
+                   const Variable *induction) {
+  std::vector<std::shared_ptr<ExprToken>> exprs;
+  collectExprs(statement, exprs);
+  Effects effects = getEffects(exprs, induction);
+  // Local variables are written by their initial values, and void
+  // statements are calls themselves, rather than expressions containing
+  // calls, so only their arguments are in exprs.
+  std::vector<std::shared_ptr<StatementToken>> statements;
+  collectStatements(statement, statements);
+  for (auto child : statements) {
+    auto local = std::dynamic_pointer_cast<LocalVarToken>(child);
+    auto voidStatement = std::dynamic_pointer_cast<VoidStatement>(child);
+    if (local) {
+      effects.writes.insert(local.get());
+    } else if (voidStatement) {
+      addCallEffects(*voidStatement->call(), effects);
+    }
+  }
+  return effects;
+}
+
+/**
+ * Returns true if the variable, which is used by code with the given
+ * effects, is stored where writes through a pointer could change it.
+ */
+static bool inMemory(const Variable *var, const Effects& effects) {
+  return 0 < effects.memoryVars.count(var);
+}
+
+/**
+ * Returns true if any of the memory accesses is a write that could be to
+ * anywhere.
+ */
+static bool writesAnywhere(const Effects& effects) {
+  for (auto access : effects.memory) {
+    if (access.write && !access.array) {
+      return true;
+    }
+  }
+  return effects.calls;
+}
+
+/**
+ * Returns true if the expression always has the same value while code
+ * with the given effects runs, because it has no side effects and reads
+ * nothing that the code could change. The induction variable, if given,
+ * is allowed to change, and may be assigned to by the expression.
+ */
+bool isInvariant(const std::shared_ptr<ExprToken>& expr,
+                 const Effects& effects,
+                 const Variable *induction) {
+  Effects exprEffects = getEffects({ expr });
+  exprEffects.writes.erase(induction);
+  if (exprEffects.io || exprEffects.calls || !exprEffects.writes.empty()) {
+    return false;
+  }
+  // Memory that is read must not be written by the code at all.
+  if (!exprEffects.memory.empty()) {
+    if (writesAnywhere(effects)) {
+      return false;
+    }
+    for (auto access : effects.memory) {
+      if (access.write) {
+        return false;
+      }
+    }
+  }
+  for (auto var : exprEffects.reads) {
+    if (var == induction) {
+      continue;
+    }
+    if (effects.writes.count(var) ||
+        (inMemory(var, exprEffects) && writesAnywhere(effects))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns true if the two memory accesses could touch the same memory in
+ * different iterations.
+ */
+static bool overlaps(const MemoryAccess& a, const MemoryAccess& b) {
+  if (!a.array || !b.array) {
+    return true;
+  }
+  return a.array == b.array && !(a.byInduction && b.byInduction);
+}
+
+/**
+ * Returns true if the writes of one piece of code could change what the
+ * other reads or writes, besides a write to a variable that neither
+ * reads.
+ */
+static bool writesConflict(const Effects& writer, const Effects& other) {
+  for (auto var : writer.writes) {
+    if (other.reads.count(var) ||
+        (inMemory(var, writer) && writesAnywhere(other))) {
+      return true;
+    }
+    if (inMemory(var, writer)) {
+      for (auto access : other.memory) {
+        if (!access.array) {
+          return true;
+        }
+      }
+    }
+  }
+  for (auto access : writer.memory) {
+    if (!access.write) {
+      continue;
+    }
+    for (auto otherAccess : other.memory) {
+      if (overlaps(access, otherAccess)) {
+        return true;
+      }
+    }
+    if (!access.array) {
+      if (!other.memoryVars.empty()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns true if code with the effects first and code with the effects
+ * second can't be interleaved one iteration at a time, like when fusing
+ * two loops, without changing what either of them computes.
+ */
+bool conflicts(const Effects& first, const Effects& second) {
+  if (first.calls || second.calls || (first.io && second.io)) {
+    return true;
+  }
+  return writesConflict(first, second) || writesConflict(second, first);
+}
@@ -0,0 +1,93 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_EFFECTS_H
+#define CONSOLITE_COMPILER_EFFECTS_H
+
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include "syntax.h"
+
+/**
+ * An access to memory through an index like "a[i]". The array is null if
+ * the memory could be anywhere, like for "*p" or "p[i]" where p is a
+ * pointer rather than an array.
+ */
+struct MemoryAccess {
+  const Variable *array;
+  /**
+   * True if the index is exactly the induction variable of the loop
+   * being analyzed, so the access touches a different element in each
+   * iteration.
+   */
+  bool byInduction;
+  bool write;
+};
+
+/**
+ * A summary of what some code reads and writes, which tells whether the
+ * code can be reordered with other code or moved out of a loop.
+ */
+struct Effects {
+  Effects() : io(false), calls(false) { }
+  /**
+   * Adds the effects of other code to these.
+   */
+  void merge(const Effects& other);
+  std::unordered_set<const Variable *> reads;
+  std::unordered_set<const Variable *> writes;
+  std::vector<MemoryAccess> memory;
+  /**
+   * The variables read or written that are stored in memory, like globals
+   * and variables whose address is taken, so that writes through a
+   * pointer could change them.
+   */
+  std::unordered_set<const Variable *> memoryVars;
+  /**
+   * True if the code uses a builtin with side effects or results that
+   * depend on when it runs, like PIXEL or RND.
+   */
+  bool io;
+  /**
+   * True if the code calls a function that isn't a builtin, which could
+   * do anything.
+   */
+  bool calls;
+};
+
+/**
+ * Returns the effects of evaluating the given expressions, including the
+ * arguments of the functions they call. Accesses to memory indexed by the
+ * induction variable, if there is one, are marked as such.
+ */
+Effects getEffects(const std::vector<std::shared_ptr<ExprToken>>& exprs,
+                   const Variable *induction = nullptr);
+
+/**
+ * Returns the effects of running the given statement and all of the
+ * statements nested within it.
+ */
+Effects getEffects(const std::shared_ptr<StatementToken>& statement,
+                   const Variable *induction = nullptr);
+
+/**
+ * Returns true if the expression always has the same value while code
+ * with the given effects runs, because it has no side effects and reads
+ * nothing that the code could change. The induction variable, if given,
+ * is allowed to change, and may be assigned to by the expression.
+ */
+bool isInvariant(const std::shared_ptr<ExprToken>& expr,
+                 const Effects& effects,
+                 const Variable *induction = nullptr);
+
+/**
+ * Returns true if code with the effects first and code with the effects
+ * second can't be interleaved one iteration at a time, like when fusing
+ * two loops, without changing what either of them computes.
+ */
+bool conflicts(const Effects& first, const Effects& second);
+
+#endif
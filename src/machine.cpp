@@ -0,0 +1,255 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include "machine.h"
+#include "util.h"
+
+/**
+ * The description of the reference Consolite core. The cycle counts are a
+ * rough model of it, in which memory accesses and control transfers take
+ * longer than register operations, and MUL and DIV are iterative.
+ */
+static const char *DEFAULT_DESCRIPTION =
+  "# Reference Consolite core\n"
+  "inst_size 4\n"
+  "data_size 2\n"
+  "address_size 2\n"
+  "registers A B C D E F G H I J K L M N SP FP\n"
+  "args A B C D\n"
+  "locals E F G H I J K\n"
+  "# inst NAME OPCODE CYCLES\n"
+  "inst NOP     0x00 1\n"
+  "inst INPUT   0x01 1\n"
+  "inst CALL    0x02 3\n"
+  "inst RET     0x03 3\n"
+  "inst LOAD    0x04 2\n"
+  "inst LOADI   0x05 1\n"
+  "inst MOV     0x06 1\n"
+  "inst MOVI    0x07 1\n"
+  "inst PUSH    0x08 2\n"
+  "inst POP     0x09 2\n"
+  "inst ADD     0x0a 1\n"
+  "inst SUB     0x0b 1\n"
+  "inst MUL     0x0c 4\n"
+  "inst DIV     0x0d 17\n"
+  "inst AND     0x0e 1\n"
+  "inst OR      0x0f 1\n"
+  "inst XOR     0x10 1\n"
+  "inst SHL     0x11 1\n"
+  "inst SHRA    0x12 1\n"
+  "inst SHRL    0x13 1\n"
+  "inst CMP     0x14 1\n"
+  "inst TST     0x15 1\n"
+  "inst COLOR   0x16 1\n"
+  "inst PIXEL   0x17 1\n"
+  "inst STOR    0x18 2\n"
+  "inst STORI   0x19 1\n"
+  "inst TIMERST 0x1a 1\n"
+  "inst TIME    0x1b 1\n"
+  "inst JMP     0x1c 2\n"
+  "inst JMPI    0x1d 2\n"
+  "inst JEQ     0x1e 1\n"
+  "inst JNE     0x1f 1\n"
+  "inst JG      0x20 1\n"
+  "inst JGE     0x21 1\n"
+  "inst JA      0x22 1\n"
+  "inst JAE     0x23 1\n"
+  "inst JL      0x24 1\n"
+  "inst JLE     0x25 1\n"
+  "inst JB      0x26 1\n"
+  "inst JBE     0x27 1\n"
+  "inst JO      0x28 1\n"
+  "inst JNO     0x29 1\n"
+  "inst JS      0x2a 1\n"
+  "inst JNS     0x2b 1\n"
+  "inst RND     0x2c 1\n";
+
+/**
+ * The registers that the code generator uses by name, as scratch registers
+ * and for the stack and frame pointers, which every machine must have.
+ * They are in the order of the REG_ constants.
+ */
+static const std::vector<std::string> FIXED_REGISTERS = {
+  "L", "M", "N", "SP", "FP"
+};
+
+Machine::Machine() : _instSize(0), _dataSize(0), _addressSize(0) {
+  if (!_parse(DEFAULT_DESCRIPTION, "default machine")) {
+    throw "Invalid default machine description.";
+  }
+}
+
+Machine& Machine::current() {
+  static Machine machine;
+  return machine;
+}
+
+const char *Machine::defaultDescription() {
+  return DEFAULT_DESCRIPTION;
+}
+
+bool Machine::load(const std::string& filename) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open machine description '" + filename + "'.");
+    return false;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  return _parse(text.str(), filename);
+}
+
+const Machine::Inst *Machine::getInst(const std::string& name) const {
+  auto it = _instIndex.find(name);
+  if (_instIndex.end() == it) {
+    return nullptr;
+  }
+  return &_insts[it->second];
+}
+
+int Machine::cycles(const std::string& name) const {
+  const Inst *inst = getInst(name);
+  return inst ? inst->cycles : 1;
+}
+
+Reg Machine::reg(const std::string& name) const {
+  auto it = std::find(_regNames.begin(), _regNames.end(), name);
+  if (_regNames.end() == it) {
+    return NO_REG;
+  }
+  return it - _regNames.begin();
+}
+
+/**
+ * Parses an integer in decimal or, with a "0x" prefix, hex. Returns false
+ * if the string isn't one or it isn't between min and max.
+ */
+static bool parseNumber(const std::string& str, long min, long max,
+                        int& value) {
+  if (str.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  long result = strtol(str.c_str(), &end, 0);
+  if ('\0' != *end || result < min || result > max) {
+    return false;
+  }
+  value = (int)result;
+  return true;
+}
+
+bool Machine::_parse(const std::string& text, const std::string& source) {
+  Machine machine(*this);
+  machine._insts.clear();
+  machine._instIndex.clear();
+  std::istringstream lines(text);
+  std::string line;
+  int lineNum = 0;
+  while (std::getline(lines, line)) {
+    lineNum++;
+    size_t comment = line.find('#');
+    if (std::string::npos != comment) {
+      line = line.substr(0, comment);
+    }
+    std::istringstream words(line);
+    std::string key;
+    if (!(words >> key)) {
+      continue;
+    }
+    std::vector<std::string> args;
+    std::string word;
+    while (words >> word) {
+      args.push_back(word);
+    }
+    std::string where = source + ":" + std::to_string(lineNum) + ": ";
+    if ("inst_size" == key || "data_size" == key || "address_size" == key) {
+      int value;
+      if (1 != args.size() || !parseNumber(args[0], 1, 0xffff, value)) {
+        _error(where + "Expected a positive size after '" + key + "'.");
+        return false;
+      }
+      if ("inst_size" == key) {
+        machine._instSize = value;
+      } else if ("data_size" == key) {
+        machine._dataSize = value;
+      } else {
+        machine._addressSize = value;
+      }
+    } else if ("registers" == key) {
+      if (Machine::MAX_REGISTERS < args.size()) {
+        _error(where + "A machine can have at most " +
+               std::to_string(Machine::MAX_REGISTERS) + " registers.");
+        return false;
+      }
+      machine._registers = args;
+      machine._regNames = FIXED_REGISTERS;
+      for (auto reg : args) {
+        if (FIXED_REGISTERS.end() == std::find(FIXED_REGISTERS.begin(),
+                                               FIXED_REGISTERS.end(),
+                                               reg)) {
+          machine._regNames.push_back(reg);
+        }
+      }
+    } else if ("args" == key || "locals" == key) {
+      std::vector<Reg> regs;
+      for (auto reg : args) {
+        if (machine._registers.end() == std::find(machine._registers.begin(),
+                                                  machine._registers.end(),
+                                                  reg) ||
+            FIXED_REGISTERS.end() != std::find(FIXED_REGISTERS.begin(),
+                                               FIXED_REGISTERS.end(),
+                                               reg)) {
+          _error(where + "'" + reg + "' is not a free register.");
+          return false;
+        }
+        regs.push_back(machine.reg(reg));
+      }
+      ("args" == key ? machine._args : machine._locals) = regs;
+    } else if ("inst" == key) {
+      int opcode;
+      int cycles;
+      if (3 != args.size() ||
+          !parseNumber(args[1], 0, 0xff, opcode) ||
+          !parseNumber(args[2], 1, 0xffff, cycles)) {
+        _error(where + "Expected 'inst NAME OPCODE CYCLES'.");
+        return false;
+      }
+      if (machine._instIndex.count(args[0])) {
+        _error(where + "Instruction '" + args[0] + "' is described twice.");
+        return false;
+      }
+      machine._instIndex[args[0]] = machine._insts.size();
+      machine._insts.push_back({ args[0], (uint8_t)opcode, cycles });
+    } else {
+      _error(where + "Unknown key '" + key + "'.");
+      return false;
+    }
+  }
+  for (auto reg : FIXED_REGISTERS) {
+    if (machine._registers.end() == std::find(machine._registers.begin(),
+                                              machine._registers.end(),
+                                              reg)) {
+      _error(source + ": The machine must have register '" + reg + "'.");
+      return false;
+    }
+  }
+  if (0 == machine._instSize || 0 == machine._dataSize ||
+      0 == machine._addressSize) {
+    _error(source + ": The machine must have an inst_size, data_size, and "
+           "address_size.");
+    return false;
+  }
+  if (0 != machine._instSize % machine._dataSize) {
+    _error(source + ": The instruction size must be a multiple of the "
+           "data size.");
+    return false;
+  }
+  *this = machine;
+  return true;
+}
@@ -0,0 +1,149 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_MACHINE_H
+#define CONSOLITE_COMPILER_MACHINE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * A register, as an index into the machine's register names. The
+ * registers the code generator uses by name come first, so they can be
+ * named as constants, and the rest follow in the order the machine
+ * describes them. Registers are only turned into their names when
+ * instruction text is written.
+ */
+typedef int8_t Reg;
+enum : Reg {
+  NO_REG = -1, REG_L, REG_M, REG_N, REG_SP, REG_FP, NUM_FIXED_REGS
+};
+
+/**
+ * A set of registers, stored as a bitmask of their indices.
+ */
+class RegSet {
+ public:
+  RegSet() : _bits(0) { }
+  void insert(Reg reg) { _bits |= (uint32_t)1 << reg; }
+  void erase(Reg reg) { _bits &= ~((uint32_t)1 << reg); }
+  bool contains(Reg reg) const { return _bits & ((uint32_t)1 << reg); }
+  bool empty() const { return 0 == _bits; }
+  void clear() { _bits = 0; }
+ private:
+  uint32_t _bits;
+};
+
+/**
+ * A description of the target machine: its sizes, registers, and the
+ * encoding and cycle cost of each instruction. The reference Consolite
+ * core is compiled in, and a description of a different core can be
+ * loaded from a file in the same format, which can be printed with
+ * defaultDescription().
+ */
+class Machine {
+ public:
+  /**
+   * An instruction of the target machine.
+   */
+  struct Inst {
+    std::string name;
+    uint8_t opcode;
+    int cycles;
+  };
+  /**
+   * Constructs the description of the reference Consolite core.
+   */
+  Machine();
+  /**
+   * Returns the description that code is generated for.
+   */
+  static Machine& current();
+  /**
+   * Returns the text of the description of the reference Consolite core.
+   */
+  static const char *defaultDescription();
+  /**
+   * Replaces this description with the one in the given file. Prints an
+   * error message and returns false if the file can't be read or isn't a
+   * valid description.
+   */
+  bool load(const std::string& filename);
+  /**
+   * Returns the size of an instruction in bytes.
+   */
+  int instSize() const { return _instSize; }
+  /**
+   * Returns the size of a data word in bytes.
+   */
+  int dataSize() const { return _dataSize; }
+  /**
+   * Returns the size of an address in bytes.
+   */
+  int addressSize() const { return _addressSize; }
+  /**
+   * The most registers a machine can have, so that a set of them fits in
+   * a RegSet.
+   */
+  static const size_t MAX_REGISTERS = 32;
+  /**
+   * Returns the names of all of the registers, in the order of their
+   * encoding.
+   */
+  const std::vector<std::string>& registers() const { return _registers; }
+  /**
+   * Returns the registers that the first arguments of a function are
+   * passed in, in order.
+   */
+  const std::vector<Reg>& argRegisters() const { return _args; }
+  /**
+   * Returns the registers that local variables can be stored in, which
+   * are saved by the function that uses them.
+   */
+  const std::vector<Reg>& localRegisters() const { return _locals; }
+  /**
+   * Returns the register with the given name, or NO_REG if the machine
+   * doesn't have it.
+   */
+  Reg reg(const std::string& name) const;
+  /**
+   * Returns the assembly code name of the register, like "A".
+   */
+  const std::string& regName(Reg reg) const { return _regNames[reg]; }
+  /**
+   * Returns all of the instructions, in order of opcode.
+   */
+  const std::vector<Inst>& insts() const { return _insts; }
+  /**
+   * Returns the instruction with the given mnemonic, or a null pointer if
+   * the machine doesn't have it.
+   */
+  const Inst *getInst(const std::string& name) const;
+  /**
+   * Returns the number of cycles the instruction with the given mnemonic
+   * takes, or 1 if the machine doesn't have it.
+   */
+  int cycles(const std::string& name) const;
+
+ private:
+  /**
+   * Parses the text of a description. Prints an error message and returns
+   * false if it isn't valid, in which case this description is unchanged.
+   */
+  bool _parse(const std::string& text, const std::string& source);
+  int _instSize;
+  int _dataSize;
+  int _addressSize;
+  std::vector<std::string> _registers;
+  std::vector<std::string> _regNames;
+  std::vector<Reg> _args;
+  std::vector<Reg> _locals;
+  std::vector<Inst> _insts;
+  std::unordered_map<std::string, size_t> _instIndex;
+};
+
+#endif
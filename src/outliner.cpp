@@ -0,0 +1,419 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include "outliner.h"
+#include "parser.h"
+#include "util.h"
+
+/**
+ * Splits an assembly line into its whitespace separated parts.
+ */
+static std::vector<std::string> splitLine(const std::string& line) {
+  std::vector<std::string> parts;
+  std::istringstream stream(line);
+  std::string part;
+  while (stream >> part) {
+    parts.push_back(part);
+  }
+  return parts;
+}
+
+/**
+ * Returns the suffix array of the given string of symbols, which is the
+ * list of starting positions of its suffixes in sorted order.
+ */
+static std::vector<int> suffixArray(const std::vector<int>& symbols) {
+  int n = symbols.size();
+  std::vector<int> sa(n), rank(symbols), next(n);
+  for (int i = 0; i < n; i++) {
+    sa[i] = i;
+  }
+  // Sort by the first k symbols, doubling k each time until all of the
+  // suffixes are distinguished.
+  for (int k = 1; ; k <<= 1) {
+    auto less = [&](int a, int b) {
+      if (rank[a] != rank[b]) {
+        return rank[a] < rank[b];
+      }
+      int rankA = a + k < n ? rank[a + k] : INT_MIN;
+      int rankB = b + k < n ? rank[b + k] : INT_MIN;
+      return rankA < rankB;
+    };
+    std::sort(sa.begin(), sa.end(), less);
+    next[sa[0]] = 0;
+    for (int i = 1; i < n; i++) {
+      next[sa[i]] = next[sa[i - 1]] + (less(sa[i - 1], sa[i]) ? 1 : 0);
+    }
+    rank = next;
+    if (n == 0 || rank[sa[n - 1]] == n - 1) {
+      break;
+    }
+  }
+  return sa;
+}
+
+/**
+ * Returns the length of the longest common prefix of each suffix in the
+ * suffix array and the one before it.
+ */
+static std::vector<int> lcpArray(const std::vector<int>& symbols,
+                                 const std::vector<int>& sa) {
+  int n = symbols.size();
+  std::vector<int> rank(n), lcp(n, 0);
+  for (int i = 0; i < n; i++) {
+    rank[sa[i]] = i;
+  }
+  int h = 0;
+  for (int i = 0; i < n; i++) {
+    if (0 == rank[i]) {
+      h = 0;
+      continue;
+    }
+    int j = sa[rank[i] - 1];
+    while (i + h < n && j + h < n && symbols[i + h] == symbols[j + h]) {
+      h++;
+    }
+    lcp[rank[i]] = h;
+    if (0 < h) {
+      h--;
+    }
+  }
+  return lcp;
+}
+
+Outliner::Outliner(Parser *parser,
+                   std::vector<std::string>& lines,
+                   std::vector<int>& sourceLines,
+                   size_t start)
+  : _parser(parser), _lines(lines), _sourceLines(sourceLines),
+    _start(start) { }
+
+int Outliner::run() {
+  // Read the lines into a list of items with the labels before them.
+  std::vector<std::string> labels;
+  for (size_t i = _start; i < _lines.size(); i++) {
+    std::vector<std::string> parts = splitLine(_lines[i]);
+    if (parts.empty()) {
+      continue;
+    } else if (' ' != _lines[i][0] && ':' == _lines[i].back()) {
+      labels.push_back(_lines[i].substr(0, _lines[i].size() - 1));
+      continue;
+    }
+    Item item;
+    item.labels = labels;
+    item.isData = 0 == parts[0].compare(0, 2, "0x");
+    item.sourceLine = _sourceLines[i];
+    for (auto part : parts) {
+      item.text += (item.text.empty() ? "" : " ") + part;
+    }
+    _items.push_back(item);
+    labels.clear();
+  }
+  _endLabels = labels;
+
+  // Outline the sequences until nothing is gained. Building the suffix
+  // array takes a pass over the whole program, so each pass outlines
+  // every candidate that doesn't overlap a better one, and only the
+  // sequences that changed are looked at again in the next pass.
+  int saved = 0;
+  while (true) {
+    this->_analyze();
+    std::vector<Candidate> candidates = this->_findCandidates();
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const Candidate& a, const Candidate& b) {
+                       return a.savings > b.savings;
+                     });
+    std::vector<bool> covered(_items.size(), false);
+    std::vector<Candidate> chosen;
+    for (const Candidate& candidate : candidates) {
+      bool overlaps = false;
+      for (int start : candidate.starts) {
+        for (int i = start; i < start + candidate.length; i++) {
+          overlaps = overlaps || covered[i];
+        }
+      }
+      if (overlaps) {
+        continue;
+      }
+      for (int start : candidate.starts) {
+        std::fill(covered.begin() + start,
+                  covered.begin() + start + candidate.length, true);
+      }
+      chosen.push_back(candidate);
+      saved += candidate.savings;
+    }
+    if (chosen.empty()) {
+      break;
+    }
+    this->_outline(chosen);
+  }
+
+  // Replace the lines with the result.
+  _lines.resize(_start);
+  _sourceLines.resize(_start);
+  for (auto item : _items) {
+    for (auto label : item.labels) {
+      _lines.push_back(label + ":");
+      _sourceLines.push_back(item.sourceLine);
+    }
+    _lines.push_back("        " + item.text);
+    _sourceLines.push_back(item.sourceLine);
+  }
+  for (auto label : _endLabels) {
+    _lines.push_back(label + ":");
+    _sourceLines.push_back(0);
+  }
+  return saved;
+}
+
+void Outliner::_analyze() {
+  int n = _items.size();
+  std::unordered_map<std::string, int> labelIndices;
+  for (int i = 0; i < n; i++) {
+    for (auto label : _items[i].labels) {
+      labelIndices[label] = i;
+    }
+  }
+  for (auto label : _endLabels) {
+    labelIndices[label] = n;
+  }
+  _symbols.assign(n, 0);
+  _targets.assign(n, -1);
+  _usesStack.assign(n, false);
+  _refMin.assign(n + 1, INT_MAX);
+  _refMax.assign(n + 1, -1);
+  std::unordered_map<std::string, int> symbolIds;
+  int uniqueId = -1;
+  for (int i = 0; i < n; i++) {
+    std::vector<std::string> parts = splitLine(_items[i].text);
+    std::string op = parts[0];
+    bool isJump = 'J' == op[0] && "JMP" != op;
+    _usesStack[i] = _items[i].isData || "PUSH" == op || "POP" == op ||
+      "CALL" == op || "RET" == op || "JMP" == op;
+    std::string symbol = _items[i].text;
+    for (size_t j = 1; j < parts.size(); j++) {
+      if ("SP" == parts[j]) {
+        _usesStack[i] = true;
+      }
+      auto label = labelIndices.find(parts[j]);
+      if (labelIndices.end() == label) {
+        continue;
+      } else if (isJump) {
+        // Number jumps relative to their own position, so that the same
+        // control flow matches wherever it is.
+        _targets[i] = label->second;
+        _refMin[label->second] = std::min(_refMin[label->second], i);
+        _refMax[label->second] = std::max(_refMax[label->second], i);
+        symbol = op + " @" + std::to_string(label->second - i);
+      } else {
+        _refMin[label->second] = -1;
+      }
+    }
+    if (_items[i].isData || (isJump && -1 == _targets[i])) {
+      _symbols[i] = uniqueId--;
+    } else if (0 == symbolIds.count(symbol)) {
+      int id = symbolIds.size();
+      symbolIds[symbol] = id;
+      _symbols[i] = id;
+    } else {
+      _symbols[i] = symbolIds[symbol];
+    }
+  }
+}
+
+std::vector<Outliner::Candidate> Outliner::_findCandidates() {
+  std::vector<Candidate> candidates;
+  std::vector<int> sa = suffixArray(_symbols);
+  std::vector<int> lcp = lcpArray(_symbols, sa);
+  // Visit each group of suffixes that share a prefix longer than the
+  // prefix shared with the suffixes around them. Each group is a range
+  // of the suffix array, which is found with a stack of open ranges.
+  struct Range {
+    int length;
+    int begin;
+  };
+  std::vector<Range> ranges = { { 0, 0 } };
+  int n = sa.size();
+  for (int i = 1; i <= n; i++) {
+    int length = i < n ? lcp[i] : 0;
+    int begin = i - 1;
+    while (length < ranges.back().length) {
+      Range range = ranges.back();
+      ranges.pop_back();
+      if (2 <= range.length) {
+        std::vector<int> starts(sa.begin() + range.begin, sa.begin() + i);
+        Candidate best;
+        this->_evaluate(range.length, starts, best);
+        if (0 < best.savings) {
+          candidates.push_back(best);
+        }
+      }
+      begin = range.begin;
+    }
+    if (length > ranges.back().length) {
+      ranges.push_back({ length, begin });
+    }
+  }
+  return candidates;
+}
+
+void Outliner::_evaluate(int length,
+                         std::vector<int> starts,
+                         Candidate& best) {
+  std::sort(starts.begin(), starts.end());
+  int first = starts[0];
+  // A sequence ending with RET can be shared by jumping to it, even if it
+  // uses the stack.
+  for (int i = first; i < first + length; i++) {
+    if (0 != _items[i].text.compare(0, 3, "RET")) {
+      continue;
+    }
+    int tailLength = i - first + 1;
+    if (2 <= tailLength && this->_isClosed(first, tailLength)) {
+      std::vector<int> usable = this->_usableStarts(starts, tailLength);
+      int n = usable.size();
+      int savings = (n - 1) * (tailLength - 1) *
+                    Machine::current().instSize();
+      if (savings > best.savings) {
+        best.length = tailLength;
+        best.savings = savings;
+        best.isTail = true;
+        best.starts = usable;
+      }
+    }
+    break;
+  }
+  // Otherwise find the longest prefix that can be put in a subroutine.
+  int callLength = 0;
+  int minTarget = INT_MAX;
+  int maxTarget = -1;
+  for (int i = first; i < first + length && !_usesStack[i]; i++) {
+    if (-1 != _targets[i]) {
+      minTarget = std::min(minTarget, _targets[i]);
+      maxTarget = std::max(maxTarget, _targets[i]);
+    }
+    if (first <= minTarget && maxTarget <= i + 1) {
+      callLength = i - first + 1;
+    }
+  }
+  if (2 <= callLength) {
+    std::vector<int> usable = this->_usableStarts(starts, callLength);
+    // Each copy becomes a CALL, and the subroutine needs a RET.
+    int n = usable.size();
+    int savings = ((n - 1) * callLength - n - 1) *
+                  Machine::current().instSize();
+    if (savings > best.savings) {
+      best.length = callLength;
+      best.savings = savings;
+      best.isTail = false;
+      best.starts = usable;
+    }
+  }
+}
+
+std::vector<int> Outliner::_usableStarts(const std::vector<int>& starts,
+                                         int length) const {
+  std::vector<int> usable;
+  for (auto start : starts) {
+    if (!usable.empty() && start < usable.back() + length) {
+      continue;
+    }
+    bool jumpedInto = false;
+    for (int i = start + 1; i < start + length; i++) {
+      if (!_items[i].labels.empty() &&
+          (_refMin[i] < start || _refMax[i] >= start + length)) {
+        jumpedInto = true;
+        break;
+      }
+    }
+    if (!jumpedInto) {
+      usable.push_back(start);
+    }
+  }
+  return usable;
+}
+
+bool Outliner::_isClosed(int start, int length) const {
+  for (int i = start; i < start + length; i++) {
+    if (-1 != _targets[i] &&
+        (_targets[i] < start || _targets[i] > start + length)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Outliner::_outline(const std::vector<Candidate>& candidates) {
+  // The candidate whose copy starts at each position that is replaced.
+  std::map<int, size_t> copies;
+  std::vector<std::string> names;
+  std::vector<Item> subroutines;
+  for (size_t k = 0; k < candidates.size(); k++) {
+    const Candidate& candidate = candidates[k];
+    int first = candidate.starts[0];
+    int length = candidate.length;
+    if (candidate.isTail) {
+      names.push_back(_parser->getUnusedLabel("shared_tail"));
+      _items[first].labels.push_back(names.back());
+      for (size_t i = 1; i < candidate.starts.size(); i++) {
+        copies[candidate.starts[i]] = k;
+      }
+      continue;
+    }
+    // Give the subroutine its own labels for the jumps inside it. A jump
+    // to the end of the sequence becomes a jump to the RET.
+    names.push_back(_parser->getUnusedLabel("outlined"));
+    std::map<int, std::string> targetLabels = { { 0, names.back() } };
+    for (int i = first; i < first + length; i++) {
+      int target = _targets[i] - first;
+      if (-1 != _targets[i] && 0 == targetLabels.count(target)) {
+        targetLabels[target] = _parser->getUnusedLabel("label");
+      }
+    }
+    for (int i = 0; i <= length; i++) {
+      Item item;
+      item.isData = false;
+      item.sourceLine = 0;
+      if (targetLabels.count(i)) {
+        item.labels.push_back(targetLabels[i]);
+      }
+      if (i == length) {
+        item.text = "RET";
+      } else if (-1 != _targets[first + i]) {
+        std::string op = splitLine(_items[first + i].text)[0];
+        item.text = op + " " + targetLabels[_targets[first + i] - first];
+      } else {
+        item.text = _items[first + i].text;
+      }
+      subroutines.push_back(item);
+    }
+    for (int start : candidate.starts) {
+      copies[start] = k;
+    }
+  }
+  // Replace each copy with a call or a jump, keeping the labels before
+  // it.
+  std::vector<Item> items;
+  for (int i = 0; i < (int)_items.size(); i++) {
+    auto copy = copies.find(i);
+    if (copies.end() == copy) {
+      items.push_back(_items[i]);
+      continue;
+    }
+    const Candidate& candidate = candidates[copy->second];
+    Item replacement = { _items[i].labels,
+                         (candidate.isTail ? "JMPI " : "CALL ") +
+                         names[copy->second], false, _items[i].sourceLine };
+    items.push_back(replacement);
+    i += candidate.length - 1;
+  }
+  items.insert(items.end(), subroutines.begin(), subroutines.end());
+  _items = items;
+}
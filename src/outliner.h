@@ -0,0 +1,125 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_OUTLINER_H
+#define CONSOLITE_COMPILER_OUTLINER_H
+
+#include <vector>
+#include <string>
+
+class Parser;
+
+/**
+ * Shrinks the output by finding instruction sequences that are repeated
+ * across the program and sharing a single copy of them. Sequences that
+ * don't touch the stack are moved into subroutines and replaced with a
+ * CALL. Sequences that end with RET are kept in one place, and the other
+ * copies are replaced with a jump to it.
+ */
+class Outliner {
+ public:
+  /**
+   * Takes the lines of assembly output starting at the given index, which
+   * must contain only functions, and the source line of each of them.
+   * Shared subroutines don't come from any one source line, so their
+   * lines get source line 0.
+   */
+  Outliner(Parser *parser, std::vector<std::string>& lines,
+           std::vector<int>& sourceLines, size_t start);
+  /**
+   * Outlines repeated sequences until doing so no longer saves space,
+   * and replaces the lines with the result. Returns the number of bytes
+   * saved.
+   */
+  int run();
+
+ private:
+  /**
+   * An instruction or data line, and the labels that come right before it.
+   */
+  struct Item {
+    std::vector<std::string> labels;
+    std::string text;
+    bool isData;
+    int sourceLine;
+  };
+  /**
+   * A repeated sequence that is worth outlining.
+   */
+  struct Candidate {
+    Candidate() : length(0), savings(0), isTail(false) { }
+    int length;
+    int savings;
+    bool isTail;
+    std::vector<int> starts;
+  };
+  /**
+   * Recomputes the symbols, jump targets and label references for the
+   * current list of items.
+   */
+  void _analyze();
+  /**
+   * Finds the repeated sequences that save space when outlined, with the
+   * best one for each group of sequences that are the same.
+   */
+  std::vector<Candidate> _findCandidates();
+  /**
+   * Fills in the candidate for the sequences of the given length starting
+   * at the given positions, trying both kinds of outlining.
+   */
+  void _evaluate(int length, std::vector<int> starts, Candidate& best);
+  /**
+   * Removes the occurrences that overlap an earlier one or have labels
+   * inside them that are jumped to from outside, and returns the rest.
+   */
+  std::vector<int> _usableStarts(const std::vector<int>& starts,
+                                 int length) const;
+  /**
+   * Returns true if all of the jumps in the sequence of the given length
+   * starting at the given position stay within the sequence.
+   */
+  bool _isClosed(int start, int length) const;
+  /**
+   * Outlines the candidates, none of which may overlap another. A call
+   * candidate is moved into a subroutine that is called from each of its
+   * original positions. A tail candidate keeps its first copy, and the
+   * others are replaced with jumps to it.
+   */
+  void _outline(const std::vector<Candidate>& candidates);
+  Parser *_parser;
+  std::vector<std::string>& _lines;
+  std::vector<int>& _sourceLines;
+  size_t _start;
+  std::vector<Item> _items;
+  /**
+   * Labels that come after the last item.
+   */
+  std::vector<std::string> _endLabels;
+  /**
+   * The symbol for each item, such that items with equal symbols behave
+   * the same wherever they are. Jumps are numbered relative to their own
+   * position, and items that can't be outlined get a unique symbol.
+   */
+  std::vector<int> _symbols;
+  /**
+   * For jumps, the index of the item that the jump goes to, or -1.
+   */
+  std::vector<int> _targets;
+  /**
+   * True for items that can't be put in a subroutine, because they use
+   * the stack or change control flow in a way that would break if they
+   * were.
+   */
+  std::vector<bool> _usesStack;
+  /**
+   * The lowest and highest index of a jump to the labels before each item.
+   * Labels used in some other way, like as a CALL target, have a lowest
+   * index of -1 so that they always count as jumped to from outside.
+   */
+  std::vector<int> _refMin;
+  std::vector<int> _refMax;
+};
+
+#endif
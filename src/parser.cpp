@@ -4,10 +4,19 @@
  */
 
 #include <iostream>
+#include <algorithm>
 #include "parser.h"
+#include "compression.h"
+#include "outliner.h"
+#include "peephole.h"
+#include "runtime.h"
+#include "specializer.h"
 #include "util.h"
 
-Parser::Parser(Tokenizer *t) : _tokenizer(t), _bytePos(0) {
+Parser::Parser(Tokenizer *t, const CompilerOptions& options)
+  : _tokenizer(t), _options(options), _sourceLine(0), _bytePos(0),
+    _bytesWritten(0), _measureDepth(0), _fixDivUsed(false),
+    _decompressUsed(false), _decompressBytes(0), _bssBytes(0) {
   // Add builtin "void COLOR(uint16 color)" function.
   _functions.push_back(
     std::make_shared<FunctionToken>(
@@ -83,6 +92,161 @@ Parser::Parser(Tokenizer *t) : _tokenizer(t), _bytePos(0) {
       )
     )
   );
+  // Add builtin "uint16 ABS(uint16 value)" function, which treats its
+  // argument as signed.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("uint16"),
+        "ABS",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "value")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "uint16 MIN(uint16 a, uint16 b)" and
+  // "uint16 MAX(uint16 a, uint16 b)" functions, which compare their
+  // arguments as unsigned.
+  for (std::string name : { "MIN", "MAX" }) {
+    _functions.push_back(
+      std::make_shared<FunctionToken>(
+        FunctionToken(
+          TypeToken("uint16"),
+          name,
+          {
+            std::make_shared<ParamToken>(
+              ParamToken(TypeToken("uint16"), "a")
+            ),
+            std::make_shared<ParamToken>(
+              ParamToken(TypeToken("uint16"), "b")
+            )
+          }
+        )
+      )
+    );
+  }
+  // Add builtin "void LINE(uint16 x0, uint16 y0, uint16 x1, uint16 y1)"
+  // function. It and the builtins after it up to ISQRT() are routines of
+  // the runtime library, which are only output if they are called.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("void"),
+        "LINE",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "x0")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "y0")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "x1")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "y1")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "void CIRCLE(uint16 cx, uint16 cy, uint16 r)" function.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("void"),
+        "CIRCLE",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "cx")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "cy")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "r")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "void RECT(uint16 x, uint16 y, uint16 w, uint16 h)"
+  // function.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("void"),
+        "RECT",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "x")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "y")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "w")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "h")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "uint16 ISQRT(uint16 n)" function.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("uint16"),
+        "ISQRT",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "n")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "void decompress(uint16 src, uint16 dest)" function,
+  // which expands a compressed array into a buffer.
+  _functions.push_back(
+    std::make_shared<FunctionToken>(
+      FunctionToken(
+        TypeToken("void"),
+        "decompress",
+        {
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "src")
+          ),
+          std::make_shared<ParamToken>(
+            ParamToken(TypeToken("uint16"), "dest")
+          )
+        }
+      )
+    )
+  );
+  // Add builtin "uint16 likely(uint16 cond)" and
+  // "uint16 unlikely(uint16 cond)" functions, which return their argument
+  // and hint at whether it is usually true.
+  for (std::string hint : { "likely", "unlikely" }) {
+    _functions.push_back(
+      std::make_shared<FunctionToken>(
+        FunctionToken(
+          TypeToken("uint16"),
+          hint,
+          {
+            std::make_shared<ParamToken>(
+              ParamToken(TypeToken("uint16"), "cond")
+            )
+          }
+        )
+      )
+    );
+  }
 }
 
 bool Parser::parse() {
@@ -92,6 +256,72 @@ bool Parser::parse() {
       // We have reached the end of the token stream without errors
       break;
     }
+    // Coroutines are declared like "coroutine[N] TYPE name(...)", where
+    // N is the number of instances and defaults to one.
+    size_t instances = 0;
+    if ("coroutine" == _tokenizer->peekNext().str()) {
+      int line = _tokenizer->getNext().line();
+      instances = 1;
+      if ("[" == _tokenizer->peekNext().str()) {
+        _tokenizer->getNext();
+        ExprToken expr;
+        if (!expr.parse(_tokenizer, _functions, _globals)) {
+          return false;
+        } else if (!expr.isConst() || 0 == expr.val()) {
+          _error("Number of coroutine instances must be a positive "
+                 "constant.", line);
+          return false;
+        }
+        instances = expr.val();
+        if ("]" != _tokenizer->getNext().str()) {
+          _error("Expected ']' after number of coroutine instances.", line);
+          return false;
+        }
+      }
+    }
+    // Sprites are declared like "sprite[W, T] uint16[N] name = ...", where
+    // W is the width of the bitmap and T is the color of its transparent
+    // pixels, if it has any. The bitmap is only used to output a function
+    // "void name(uint16 x, uint16 y)" that draws it.
+    size_t spriteWidth = 0;
+    int transparent = -1;
+    if (0 == instances && "sprite" == _tokenizer->peekNext().str()) {
+      int line = _tokenizer->getNext().line();
+      if (!_expect(_tokenizer, "[")) {
+        return false;
+      }
+      ExprToken width;
+      if (!width.parse(_tokenizer, _functions, _globals)) {
+        return false;
+      } else if (!width.isConst() || 0 == width.val()) {
+        _error("Sprite width must be a positive constant.", line);
+        return false;
+      }
+      spriteWidth = width.val();
+      if ("," == _tokenizer->peekNext().str()) {
+        _tokenizer->getNext();
+        ExprToken color;
+        if (!color.parse(_tokenizer, _functions, _globals)) {
+          return false;
+        } else if (!color.isConst()) {
+          _error("Transparent color of sprite must be a constant.", line);
+          return false;
+        }
+        transparent = color.val();
+      }
+      if (!_expect(_tokenizer, "]")) {
+        return false;
+      }
+    }
+    // Global arrays declared like "compressed TYPE[N] name = ..." are
+    // written out compressed, and expanded with decompress().
+    bool compressed = false;
+    int compressedLine = 0;
+    if (0 == instances && 0 == spriteWidth &&
+        "compressed" == _tokenizer->peekNext().str()) {
+      compressedLine = _tokenizer->getNext().line();
+      compressed = true;
+    }
     TypeToken type;
     if (!type.parse(_tokenizer, _functions, _globals)) {
       return false;
@@ -105,13 +335,49 @@ bool Parser::parse() {
     }
 
     // Differentiate between function and global variable
-    if ("(" == _tokenizer->peekNext().str()) {
+    if (compressed &&
+        (!type.isArray() || "(" == _tokenizer->peekNext().str())) {
+      _error("Expected a global array after 'compressed'.", compressedLine);
+      return false;
+    } else if (0 < spriteWidth && "(" == _tokenizer->peekNext().str()) {
+      _error("Expected a bitmap after 'sprite'.", name.line());
+      return false;
+    } else if (0 < spriteWidth) {
+      // The bitmap is parsed like the initial value of a global array, but
+      // only the function that draws it is kept.
+      GlobalVarToken bitmap(type, name.str());
+      if (!bitmap.parse(_tokenizer, _functions, _globals)) {
+        return false;
+      }
+      std::shared_ptr<FunctionToken> func(
+        new FunctionToken(
+          TypeToken("void"),
+          name.str(),
+          {
+            std::make_shared<ParamToken>(ParamToken(TypeToken("uint16"), "x")),
+            std::make_shared<ParamToken>(ParamToken(TypeToken("uint16"), "y"))
+          }
+        )
+      );
+      if (!func->makeSprite(bitmap, spriteWidth, transparent)) {
+        return false;
+      }
+      _functions.push_back(func);
+    } else if ("(" == _tokenizer->peekNext().str()) {
       std::shared_ptr<FunctionToken> func(new FunctionToken(type, name.str()));
-      if (!func->parse(_tokenizer, _functions, _globals)) {
+      func->setCoroutine(instances);
+      if (!func->parse(_tokenizer, _functions, _globals,
+                       !_options.lazyParse)) {
+        return false;
+      } else if (_options.lazyParse && !this->_skipBody(func)) {
         return false;
       }
+    } else if (0 < instances) {
+      _error("Expected a function after 'coroutine'.", name.line());
+      return false;
     } else {
       std::shared_ptr<GlobalVarToken> var(new GlobalVarToken(type, name.str()));
+      var->setCompressed(compressed);
       if (!var->parse(_tokenizer, _functions, _globals)) {
         return false;
       }
@@ -126,6 +392,97 @@ bool Parser::parse() {
     _error("No 'void main()' entry point found.");
     return false;
   }
+  if (_options.lazyParse) {
+    return this->_parseReachableBodies();
+  }
+  return true;
+}
+
+bool Parser::_skipBody(const std::shared_ptr<FunctionToken>& function) {
+  SkippedBody body;
+  body.function = function;
+  body.start = _tokenizer->position();
+  body.numFunctions = _functions.size();
+  body.numGlobals = _globals.size();
+  if (!_expect(_tokenizer, "{")) {
+    return false;
+  }
+  int depth = 1;
+  while (0 < depth) {
+    AtomToken t = _tokenizer->getNext();
+    if (t.empty()) {
+      _error("Unexpected EOF.", t.line());
+      return false;
+    } else if ("{" == t.str()) {
+      depth++;
+    } else if ("}" == t.str()) {
+      depth--;
+    } else {
+      body.names.insert(t.str());
+    }
+  }
+  _skippedBodies.push_back(body);
+  return true;
+}
+
+bool Parser::_parseReachableBodies() {
+  // Functions are reached from main(), and from the globals that start
+  // out holding their addresses. A name in a body that isn't a function,
+  // like a variable, reaches nothing.
+  std::unordered_map<std::string, size_t> bodyIndices;
+  for (size_t i = 0; i < _skippedBodies.size(); i++) {
+    bodyIndices[_skippedBodies[i].function->name()] = i;
+  }
+  std::vector<bool> reached(_skippedBodies.size(), false);
+  std::vector<size_t> work;
+  auto reach = [&](const std::string& name) {
+    auto it = bodyIndices.find(name);
+    if (bodyIndices.end() != it && !reached[it->second]) {
+      reached[it->second] = true;
+      work.push_back(it->second);
+    }
+  };
+  reach("main");
+  for (auto global : _globals) {
+    for (auto function : global->functions()) {
+      reach(function->name());
+    }
+  }
+  while (!work.empty()) {
+    size_t i = work.back();
+    work.pop_back();
+    for (auto name : _skippedBodies[i].names) {
+      reach(name);
+    }
+  }
+  // Parse the bodies in the order they were declared, so that errors are
+  // reported in the same order as when parsing everything up front. Each
+  // body can only use the functions and globals declared before it.
+  std::vector<std::shared_ptr<FunctionToken>> allFunctions = _functions;
+  _functions.clear();
+  for (auto function : allFunctions) {
+    if (0 == bodyIndices.count(function->name())) {
+      _functions.push_back(function);
+    }
+  }
+  for (size_t i = 0; i < _skippedBodies.size(); i++) {
+    const SkippedBody& body = _skippedBodies[i];
+    if (!reached[i] && !_options.checkUnreachable) {
+      continue;
+    }
+    std::vector<std::shared_ptr<FunctionToken>> functions(
+      allFunctions.begin(), allFunctions.begin() + body.numFunctions);
+    std::vector<std::shared_ptr<GlobalVarToken>> globals(
+      _globals.begin(), _globals.begin() + body.numGlobals);
+    _tokenizer->seek(body.start);
+    if (!body.function->parseBody(_tokenizer, functions, globals)) {
+      return false;
+    }
+    if (reached[i]) {
+      _functions.push_back(body.function);
+    }
+  }
+  _skippedBodies.clear();
   return true;
 }
 
@@ -136,6 +493,12 @@ bool Parser::output(char *filename) {
     _error("Unable to open output file.");
     return false;
   }
+  // Create copies of functions that are specialized for the constant
+  // arguments they are called with.
+  if (_options.specialize) {
+    Specializer specializer(this, _functions, _globals);
+    specializer.run();
+  }
   // Next assign labels for all globals and functions.
   for (auto global : _globals) {
     this->addLabel(global->name());
@@ -143,25 +506,126 @@ bool Parser::output(char *filename) {
   for (auto function : _functions) {
     this->addLabel(function->name());
   }
-  // Output the "bootloader". This sets the stack pointer, calls main,
-  // then goes into an infinite loop to prevent attempting to execute
-  // code that wasn't meant to be executed.
+  _fixDivLabel = this->getUnusedLabel("fix_div");
+  // Output the "bootloader". This sets the stack pointer, stores the
+  // addresses of functions in globals, calls main, then goes into an
+  // infinite loop to prevent attempting to execute code that wasn't
+  // meant to be executed.
   std::string stackLabel = this->getUnusedLabel("stack");
   this->writeInst("MOVI SP " + stackLabel);
+  this->_outputBss(stackLabel);
+  for (auto global : _globals) {
+    global->outputFunctions(this);
+  }
   this->writeInst("CALL main");
   std::string finishedLabel = this->getUnusedLabel("program_finished");
   this->writeln(finishedLabel + ":");
   this->writeInst("JMPI " + finishedLabel);
+  // A failed bounds check stops the program in a loop of its own, so
+  // that it can be told apart from the program finishing.
+  if (_options.boundsCheck) {
+    _boundsLabel = this->getUnusedLabel("bounds_error");
+    this->writeln(_boundsLabel + ":");
+    this->writeInst("JMPI " + _boundsLabel);
+  }
   // Output global variables.
   for (auto global : _globals) {
     global->output(this);
   }
+  // Output the frame records of coroutines, which hold their state
+  // between calls.
+  for (auto function : _functions) {
+    function->outputFrames(this);
+  }
   // Output functions.
+  size_t functionsStart = _lines.size();
   for (auto function: _functions) {
     function->output(this);
   }
+  this->setSourceLine(0);
+  if (_fixDivUsed) {
+    this->_outputFixDiv();
+  }
+  if (_decompressUsed) {
+    _decompressBytes = outputDecompress(this, "decompress",
+                                        this->_hasLzArray());
+  }
+  for (auto name : _runtimeUsed) {
+    outputRuntimeRoutine(this, name);
+  }
+  // Replace instruction sequences with cheaper ones that compute the same
+  // thing.
+  const Machine& machine = Machine::current();
+  int bytesSaved = 0;
+  if (_options.peephole) {
+    bytesSaved += machine.instSize() *
+      Peephole::current().run(_lines, _sourceLines, functionsStart);
+  }
+  // Share repeated instruction sequences between functions.
+  if (_options.optimizeSize) {
+    Outliner outliner(this, _lines, _sourceLines, functionsStart);
+    bytesSaved += outliner.run();
+  }
+  // The arrays moved after the program are addressed from its end, so
+  // they have to fit in the address space along with it.
+  int endAddress = _bytesWritten - bytesSaved + _bssBytes;
+  int64_t addressSpace = (int64_t)1 << (8 * machine.addressSize());
+  if (addressSpace < endAddress) {
+    _error("The program and its zeroed global arrays take " +
+           std::to_string(endAddress) + " bytes, more than the " +
+           std::to_string(addressSpace) + " bytes of the address space.");
+    return false;
+  }
   // Output the stack position.
   this->writeln(stackLabel + ":");
+  // Write the buffered lines to the outfile.
+  for (auto line : _lines) {
+    _outfile << line << std::endl;
+  }
+  return true;
+}
+
+bool Parser::writeLineMap(const std::string& filename,
+                          const std::string& source) const {
+  std::ofstream file(filename, std::ofstream::out | std::ofstream::trunc);
+  if (!file.good()) {
+    _error("Unable to open line map file.");
+    return false;
+  }
+  file << "source " << source << std::endl;
+  for (size_t i = 0; i < _sourceLines.size(); i++) {
+    if (0 < _sourceLines[i]) {
+      file << i + 1 << " " << _sourceLines[i] << std::endl;
+    }
+  }
+  return true;
+}
+
+bool Parser::writeCompressionReport(const std::string& filename) const {
+  std::ofstream file(filename, std::ofstream::out | std::ofstream::trunc);
+  if (!file.good()) {
+    _error("Unable to open compression report file.");
+    return false;
+  }
+  const Machine& machine = Machine::current();
+  bool copies = this->_hasLzArray();
+  file << "# array encoding elements raw_bytes compressed_bytes cycles"
+       << std::endl;
+  int saved = -_decompressBytes;
+  for (auto global : _globals) {
+    if (!global->isCompressed()) {
+      continue;
+    }
+    int rawBytes = global->arraySize() * machine.dataSize();
+    int bytes = global->stream().size() * machine.dataSize();
+    saved += rawBytes - bytes;
+    file << "array " << global->name() << " "
+         << encodingName(global->encoding()) << " " << global->arraySize()
+         << " " << rawBytes << " " << bytes << " "
+         << decompressCycles(global->stream(), copies) << std::endl;
+  }
+  file << "routine " << _decompressBytes << std::endl;
+  file << "saved " << saved << std::endl;
   return true;
 }
 
@@ -182,12 +646,14 @@ std::string Parser::getUnusedLabel(const std::string& label) {
     this->addLabel(label);
     return label;
   }
-  int i = 1;
+  int& i = _labelSuffixes[label];
+  i = std::max(i, 1);
   while (this->hasLabel(label + std::to_string(i))) {
     i++;
   }
-  this->addLabel(label + std::to_string(i));
-  return label + std::to_string(i);
+  std::string unused = label + std::to_string(i++);
+  this->addLabel(unused);
+  return unused;
 }
 
 void Parser::writeInst(const std::string& inst) {
@@ -213,25 +679,231 @@ void Parser::writeInst(const std::string& inst) {
     }
     return;
   }
+  const Machine& machine = Machine::current();
+  if (!machine.getInst(inst.substr(0, inst.find(' ')))) {
+    _error("Instruction '" + inst + "' is not supported by the target "
+           "machine.");
+    throw "Could not generate code for the target machine.";
+  }
   this->writeln("        " + inst);
-  _bytePos += INST_SIZE;
+  _bytePos += machine.instSize();
+  _bytesWritten += machine.instSize();
 }
 
 void Parser::writeData(const std::string& data, int dataLength) {
   this->writeln("        " + data);
-  _bytePos += dataLength * DATA_SIZE;
-  while (0 != _bytePos % INST_SIZE) {
+  uint16_t startPos = _bytePos;
+  const Machine& machine = Machine::current();
+  _bytePos += dataLength * machine.dataSize();
+  while (0 != _bytePos % machine.instSize()) {
     _bytePos++;
   }
+  _bytesWritten += (uint16_t)(_bytePos - startPos);
 }
 
 void Parser::writeln(const std::string& line) {
   // If there is a pending PUSH instruction, first write it
   // to the outfile.
   if (!_pendingPushReg.empty()) {
-    _outfile << "        PUSH " << _pendingPushReg << std::endl;
+    std::string pushReg = _pendingPushReg;
     _pendingPushReg = "";
+    this->writeln("        PUSH " + pushReg);
+    _bytePos += Machine::current().instSize();
+    _bytesWritten += Machine::current().instSize();
+  }
+  // Discard output while measuring.
+  if (0 < _measureDepth) {
+    return;
+  }
+  // Then buffer the new line.
+  _lines.push_back(line);
+  _sourceLines.push_back(_sourceLine);
+}
+
+int Parser::measure(const std::function<void()>& emit) {
+  // Save the state that emitting code changes, so that it can be
+  // restored afterward. A pending PUSH is set aside, since it belongs
+  // to the code before the measured code.
+  std::string pendingPushReg = _pendingPushReg;
+  std::unordered_set<std::string> assignedLabels = _assignedLabels;
+  std::unordered_map<std::string, int> labelSuffixes = _labelSuffixes;
+  uint16_t bytePos = _bytePos;
+  int bytesWritten = _bytesWritten;
+  int sourceLine = _sourceLine;
+  std::vector<std::function<void()>> coldCode;
+  coldCode.swap(_coldCode);
+  _pendingPushReg = "";
+  _measureDepth++;
+  emit();
+  // Rarely run code that was deferred still takes up space.
+  this->writeCold();
+  // A trailing PUSH would have been written eventually, so count it.
+  if (!_pendingPushReg.empty()) {
+    _bytesWritten += Machine::current().instSize();
+  }
+  _measureDepth--;
+  int size = _bytesWritten - bytesWritten;
+  _pendingPushReg = pendingPushReg;
+  _assignedLabels = assignedLabels;
+  _labelSuffixes = labelSuffixes;
+  _bytePos = bytePos;
+  _bytesWritten = bytesWritten;
+  _sourceLine = sourceLine;
+  _coldCode.swap(coldCode);
+  return size;
+}
+
+void Parser::deferCold(const std::function<void()>& emit) {
+  // Restore the bindings in effect now around the deferred code, which
+  // still comes from the current source line.
+  auto bindings = _bindings;
+  int sourceLine = _sourceLine;
+  _coldCode.push_back([=]() {
+      for (auto binding : bindings) {
+        binding.first();
+      }
+      this->setSourceLine(sourceLine);
+      emit();
+      for (auto it = bindings.rbegin(); it != bindings.rend(); it++) {
+        it->second();
+      }
+    });
+}
+
+void Parser::withBinding(const std::function<void()>& bind,
+                         const std::function<void()>& unbind,
+                         const std::function<void()>& emit) {
+  _bindings.push_back(std::make_pair(bind, unbind));
+  bind();
+  emit();
+  unbind();
+  _bindings.pop_back();
+}
+
+std::string Parser::fixDivLabel() {
+  if (0 == _measureDepth) {
+    _fixDivUsed = true;
+  }
+  return _fixDivLabel;
+}
+
+std::string Parser::decompressLabel() {
+  if (0 == _measureDepth) {
+    _decompressUsed = true;
+  }
+  return "decompress";
+}
+
+std::string Parser::runtimeLabel(const std::string& name) {
+  if (0 == _measureDepth) {
+    _runtimeUsed.insert(name);
+  }
+  return name;
+}
+
+bool Parser::_hasLzArray() const {
+  for (auto global : _globals) {
+    if (global->isCompressed() && LZ_ENCODING == global->encoding()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Parser::_outputFixDiv() {
+  // Divide the magnitudes and fix the sign of the result at the end. The
+  // integer part of the quotient comes from DIV, then each of the 8
+  // fraction bits is found by doubling the remainder and subtracting the
+  // divisor if it fits.
+  this->writeln(_fixDivLabel + ":");
+  this->writeInst("PUSH A");
+  this->writeInst("MOV L M");
+  this->writeInst("XOR L N");
+  this->writeInst("PUSH L");
+  for (std::string reg : { "M", "N" }) {
+    std::string positive = this->getUnusedLabel("fix_div_pos");
+    this->writeInst("TST " + reg + " " + reg);
+    this->writeInst("JNS " + positive);
+    this->writeInst("MOVI L 0x0");
+    this->writeInst("SUB L " + reg);
+    this->writeInst("MOV " + reg + " L");
+    this->writeln(positive + ":");
+  }
+  this->writeInst("MOV L M");
+  this->writeInst("DIV L N");
+  this->writeInst("MOV A L");
+  this->writeInst("MUL A N");
+  this->writeInst("SUB M A");
+  this->writeInst("MOVI A 0x1");
+  for (int i = 0; i < 8; i++) {
+    std::string skip = this->getUnusedLabel("fix_div_skip");
+    this->writeInst("ADD L L");
+    this->writeInst("ADD M M");
+    this->writeInst("CMP M N");
+    this->writeInst("JB " + skip);
+    this->writeInst("SUB M N");
+    this->writeInst("ADD L A");
+    this->writeln(skip + ":");
+  }
+  std::string done = this->getUnusedLabel("fix_div_done");
+  this->writeInst("POP A");
+  this->writeInst("TST A A");
+  this->writeInst("JNS " + done);
+  this->writeInst("MOVI M 0x0");
+  this->writeInst("SUB M L");
+  this->writeInst("MOV L M");
+  this->writeln(done + ":");
+  this->writeInst("MOV M L");
+  this->writeInst("POP A");
+  this->writeInst("RET");
+}
+
+void Parser::_outputBss(const std::string& startLabel) {
+  // Each array moved takes four instructions to store its address, and
+  // clearing them takes ten more.
+  const Machine& machine = Machine::current();
+  std::vector<std::shared_ptr<GlobalVarToken>> arrays;
+  int saved = -10 * machine.instSize();
+  for (auto global : _globals) {
+    int size = global->arraySize() * machine.dataSize();
+    if (global->isZeroArray() && 4 * machine.instSize() < size) {
+      arrays.push_back(global);
+      saved += size - 4 * machine.instSize();
+    }
+  }
+  if (saved <= 0) {
+    return;
+  }
+  this->writeInst("MOVI M " + startLabel);
+  for (auto array : arrays) {
+    array->setInBss(true);
+    this->writeInst("MOVI N " + array->name());
+    this->writeInst("STOR M N");
+    this->writeInst("MOVI L " + toHexStr(array->arraySize() *
+                                         machine.dataSize()));
+    this->writeInst("ADD M L");
+    _bssBytes += array->arraySize() * machine.dataSize();
+  }
+  // Memory isn't cleared when the program is loaded, so zero the arrays.
+  std::string loopLabel = this->getUnusedLabel("bss_clear");
+  this->writeInst("MOV N M");
+  this->writeInst("MOVI M " + startLabel);
+  this->writeInst("MOVI L " + toHexStr(0));
+  this->writeInst("MOVI A " + toHexStr(machine.dataSize()));
+  this->writeln(loopLabel + ":");
+  this->writeInst("STOR L M");
+  this->writeInst("ADD M A");
+  this->writeInst("CMP M N");
+  this->writeInst("JB " + loopLabel);
+  this->writeInst("MOV SP N");
+}
+
+void Parser::writeCold() {
+  // Deferred code can defer more code, so the queue can grow while it is
+  // being output.
+  for (size_t i = 0; i < _coldCode.size(); i++) {
+    std::function<void()> emit = _coldCode[i];
+    emit();
   }
-  // Then write the new line.
-  _outfile << line << std::endl;
+  _coldCode.clear();
 }
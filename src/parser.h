@@ -8,12 +8,77 @@
 
 #include <vector>
 #include <fstream>
+#include <functional>
+#include <set>
 #include <unordered_set>
+#include <unordered_map>
 #include "tokenizer.h"
 
+/**
+ * Options that control code generation, set from the command line.
+ */
+struct CompilerOptions {
+  CompilerOptions() : specialize(true), specializeBudget(512),
+                      unrollBudget(256), unswitchBudget(256), fuseBudget(0),
+                      optimizeSize(false), boundsCheck(false),
+                      peephole(true), lazyParse(false),
+                      checkUnreachable(false) { }
+  /**
+   * Whether to create copies of functions specialized for constant
+   * arguments.
+   */
+  bool specialize;
+  /**
+   * The maximum number of bytes that specialized functions may add to
+   * the output.
+   */
+  int specializeBudget;
+  /**
+   * The maximum number of bytes a single fully unrolled loop may take up.
+   */
+  int unrollBudget;
+  /**
+   * The maximum number of bytes that splitting a loop into a copy for
+   * each value of an unchanging condition inside of it may add.
+   */
+  int unswitchBudget;
+  /**
+   * The maximum number of bytes that merging adjacent loops with the same
+   * bounds into one may add.
+   */
+  int fuseBudget;
+  /**
+   * Whether to make the output smaller by sharing repeated instruction
+   * sequences, at the cost of extra jumps and calls.
+   */
+  bool optimizeSize;
+  /**
+   * Whether to check that array indices are in bounds at runtime, where
+   * they can't be proven to be in bounds at compile time.
+   */
+  bool boundsCheck;
+  /**
+   * Whether to replace instruction sequences with cheaper ones from the
+   * peephole table.
+   */
+  bool peephole;
+  /**
+   * Whether to skip over function bodies at first, and only parse those
+   * of the functions that main() can reach. The others are left out of
+   * the output.
+   */
+  bool lazyParse;
+  /**
+   * Whether to still parse and check the bodies of the functions that
+   * main() can't reach when parsing lazily, so that errors in them are
+   * reported, without putting them in the output.
+   */
+  bool checkUnreachable;
+};
+
 class Parser {
  public:
-  Parser(Tokenizer *t);
+  Parser(Tokenizer *t, const CompilerOptions& options = CompilerOptions());
   /**
    * Parses the tokens from the Tokenizer into an abstract syntax tree.
    * Returns false if there were errors found in the source code.
@@ -24,6 +89,27 @@ class Parser {
    * the given file. Returns false if it encounters an error.
    */
   bool output(char *filename);
+  /**
+   * Writes the source line that each line of the output came from to the
+   * given file, after output() has been called. The first line of the
+   * file is "source SRC", and each line after it is "OUTPUT_LINE
+   * SOURCE_LINE" for a line of output that came from a line of source
+   * code, with both counted from 1. Returns false if the file can't be
+   * written.
+   */
+  bool writeLineMap(const std::string& filename,
+                    const std::string& source) const;
+  /**
+   * Writes how much the compressed arrays save to the given file, after
+   * output() has been called. The first line is a comment naming the
+   * columns, then each compressed array has a line "array NAME ENCODING
+   * ELEMENTS RAW_BYTES COMPRESSED_BYTES CYCLES", where CYCLES is how long
+   * decompress() takes to expand it. The last lines are "routine BYTES"
+   * for the size of the decompression routine, and "saved BYTES" for the
+   * total saved after paying for it. Returns false if the file can't be
+   * written.
+   */
+  bool writeCompressionReport(const std::string& filename) const;
   /**
    * Tests if an assembly-level label has already been used.
    */
@@ -48,19 +134,145 @@ class Parser {
    */
   void writeData(const std::string& data, int dataLength);
   /**
-   * Writes a line of output to the outfile.
+   * Writes a line of output. Lines are buffered until the whole program
+   * has been output, so that they can be optimized as a whole.
    */
   void writeln(const std::string& line);
   /**
    * Gets the current byte position of the output.
    */
   uint16_t getBytePos() const { return _bytePos; }
+  /**
+   * Sets the line of source code that the lines written after this come
+   * from, or 0 for code that doesn't come from one line.
+   */
+  void setSourceLine(int line) { _sourceLine = line; }
+  /**
+   * Returns the line of source code that the lines being written come
+   * from, or 0 if they don't come from one line.
+   */
+  int sourceLine() const { return _sourceLine; }
+  /**
+   * Calls emit() without writing anything to the outfile, and returns the
+   * number of bytes that it would have written. Labels requested while
+   * measuring are released afterward, so measuring doesn't affect the
+   * labels assigned to code that is actually output.
+   */
+  int measure(const std::function<void()>& emit);
+  /**
+   * Queues code that is rarely run to be output after the end of the
+   * current function, so that the code that usually runs falls through
+   * without jumping over it.
+   */
+  void deferCold(const std::function<void()>& emit);
+  /**
+   * Outputs the code queued with deferCold(), including any code that it
+   * queues itself.
+   */
+  void writeCold();
+  /**
+   * Calls bind(), then emit(), then unbind(). Use this for state that the
+   * emitted code depends on, like a variable bound to a value, so that
+   * code deferred with deferCold() is output with the same state.
+   */
+  void withBinding(const std::function<void()>& bind,
+                   const std::function<void()>& unbind,
+                   const std::function<void()>& emit);
+  /**
+   * Returns the options that control code generation.
+   */
+  const CompilerOptions& options() const { return _options; }
+  /**
+   * Returns the label that a failed bounds check jumps to.
+   */
+  std::string boundsLabel() const { return _boundsLabel; }
+  /**
+   * Returns the label of the routine that divides one fix8_8 value in M
+   * by another in N, leaving the result in M. The routine is only output
+   * if this is called for code that is output.
+   */
+  std::string fixDivLabel();
+  /**
+   * Returns the label of the routine that expands the compressed array
+   * at the address in M into the buffer at the address in N. The routine
+   * is only output if this is called for code that is output.
+   */
+  std::string decompressLabel();
+  /**
+   * Returns the label of the runtime routine with the given name, see
+   * runtime.h. The routine is only output if this is called for code that
+   * is output.
+   */
+  std::string runtimeLabel(const std::string& name);
 
  private:
+  /**
+   * A function body that was skipped over by a lazy parse.
+   */
+  struct SkippedBody {
+    std::shared_ptr<FunctionToken> function;
+    /**
+     * Where the body starts, at its '{'.
+     */
+    Tokenizer::Position start;
+    /**
+     * The number of functions and globals declared before the body, which
+     * are the ones it can use.
+     */
+    size_t numFunctions;
+    size_t numGlobals;
+    /**
+     * The tokens in the body other than braces, which include the names
+     * of all of the functions it calls or takes the address of.
+     */
+    std::unordered_set<std::string> names;
+  };
+  /**
+   * Skips over the body of the given function by matching braces, and
+   * saves where it is so it can be parsed later. Returns false if the
+   * body doesn't start with '{' or its braces aren't closed.
+   */
+  bool _skipBody(const std::shared_ptr<FunctionToken>& function);
+  /**
+   * Parses the skipped bodies of the functions that main() can reach,
+   * and removes the other functions. Their bodies are also parsed and
+   * checked first if the options say so. Returns false if there are
+   * errors in a body that is parsed.
+   */
+  bool _parseReachableBodies();
+  /**
+   * Outputs the routine that divides fix8_8 values.
+   */
+  void _outputFixDiv();
+  /**
+   * Returns true if a compressed array is LZ encoded, so that the
+   * decompression routine has to handle copies.
+   */
+  bool _hasLzArray() const;
+  /**
+   * Moves the elements of big zeroed global arrays after the program,
+   * starting at the given label, so that they aren't written out as data.
+   * Outputs the code that stores their addresses and clears them, then
+   * points the stack pointer after them. Does nothing if that wouldn't
+   * make the output smaller.
+   */
+  void _outputBss(const std::string& startLabel);
   Tokenizer *_tokenizer;
+  CompilerOptions _options;
   std::vector<std::shared_ptr<GlobalVarToken>> _globals;
   std::vector<std::shared_ptr<FunctionToken>> _functions;
+  std::vector<SkippedBody> _skippedBodies;
   std::ofstream _outfile;
+  /**
+   * The lines of output that haven't been written to the outfile yet.
+   */
+  std::vector<std::string> _lines;
+  /**
+   * The source line of each of the lines of output, and the one that new
+   * lines come from.
+   */
+  std::vector<int> _sourceLines;
+  int _sourceLine;
   /**
    * The register that was most recently requested to be PUSHed onto
    * the stack. Used for optimizing the PUSH followed by POP pattern.
@@ -71,11 +283,62 @@ class Parser {
    * These are saved so that we don't have conflicting label names.
    */
   std::unordered_set<std::string> _assignedLabels;
+  /**
+   * The next numeric suffix to try for each base label passed to
+   * getUnusedLabel(). Every smaller suffix is already used, so generating
+   * many labels from the same base doesn't have to try them all again.
+   */
+  std::unordered_map<std::string, int> _labelSuffixes;
   /**
    * The current byte count of the output. Used to know the current
    * address.
    */
   uint16_t _bytePos;
+  /**
+   * The total number of bytes written, including those written while
+   * measuring.
+   */
+  int _bytesWritten;
+  /**
+   * The number of nested calls to measure() in progress. Nothing is
+   * written to the outfile while this is nonzero.
+   */
+  int _measureDepth;
+  /**
+   * The rarely run code queued to be output at the end of the function.
+   */
+  std::vector<std::function<void()>> _coldCode;
+  /**
+   * The bind and unbind functions of the calls to withBinding() in
+   * progress, from outermost to innermost.
+   */
+  std::vector<std::pair<std::function<void()>,
+                        std::function<void()>>> _bindings;
+  /**
+   * The label of the loop that the program is stopped in when an array
+   * index is out of bounds.
+   */
+  std::string _boundsLabel;
+  /**
+   * The label of the fix8_8 division routine, and whether any code that
+   * was output calls it.
+   */
+  std::string _fixDivLabel;
+  bool _fixDivUsed;
+  /**
+   * Whether any code that was output calls the decompression routine,
+   * and the number of bytes the routine takes up.
+   */
+  bool _decompressUsed;
+  int _decompressBytes;
+  /**
+   * The number of bytes of the arrays moved after the program.
+   */
+  int _bssBytes;
+  /**
+   * The names of the runtime routines that code that was output calls.
+   */
+  std::set<std::string> _runtimeUsed;
 };
 
 #endif
@@ -0,0 +1,394 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include "peephole.h"
+#include "machine.h"
+#include "util.h"
+
+/**
+ * The table for the reference Consolite core, found by running
+ * tools/superopt.cpp on the output for the example programs.
+ */
+static const char *DEFAULT_TABLE =
+  "# Peephole table for the reference Consolite core\n"
+  "# rule PATTERN => REPLACEMENT; dead REGS\n"
+  "rule MOV %a %b; MOVI %c $a => MOVI %c $a; dead %a\n"
+  "rule MOVI %a 0x1; SHL %b %a => ADD %b %b; dead %a FLAGS\n"
+  "rule MOVI %a $a; ADD %b %a; MOV %c %b => MOVI %c $a; ADD %c %b; dead %a %b\n"
+  "rule ADD %a %b; MOV %b %a => ADD %b %a; dead %a\n"
+  "rule MOV %a %b; MOV %c %a => MOV %c %b; dead %a\n"
+  "rule ADD %a %b; MOVI %b $a => MOVI %b $a; dead %a FLAGS\n"
+  "rule MOVI %a $a; MOV %b %a => MOVI %b $a; dead %a\n"
+  "rule MOV %a %b; MOV %b %c => MOV %b %c; dead %a\n"
+  "rule MUL %a %b; MOV %b %a => MUL %b %a; dead %a\n"
+  "rule MOVI %a $a; MOVI %b $b => MOVI %b $b; dead %a\n"
+  "rule MOVI %a 0x1; SUB %b %a; MOV %a %b"
+  " => MOVI %a 0xffff; ADD %a %b; dead %b FLAGS\n"
+  "rule MOVI %a $a; AND %b %a; MOV %c %b => MOVI %c $a; AND %c %b; dead %a %b\n"
+  "rule MOV %a %b; MOV %c %b => MOV %c %b; dead %a\n"
+  "rule MOVI %a 0x10; SUB %b %a; MOV %c %b"
+  " => MOVI %c 0xfff0; ADD %c %b; dead %a %b FLAGS\n"
+  "rule MOV %a %a =>\n"
+  "rule ADD %a %b; MOVI %c $a => MOVI %c $a; dead %a FLAGS\n"
+  "rule MOV %a %b; MOVI %b $a => MOVI %b $a; dead %a\n"
+  "rule MOVI %a $a; MUL %a %b; MOV %c %a => MOVI %c $a; MUL %c %b; dead %a\n"
+  "rule MOVI %a 0x1; SUB %b %a; MOV %c %b"
+  " => MOVI %c 0xffff; ADD %c %b; dead %a %b FLAGS\n"
+  "rule MOVI %a $a; MOVI %b $a => MOVI %b $a; dead %a\n"
+  "rule OR %a %b; MOV %b %a => OR %b %a; dead %a\n"
+  "rule MOV %a %b; ADD %b %b => ADD %b %b; dead %a\n"
+  "rule MOV %a %b; MOV %b %a => MOV %a %b\n"
+  "rule MOV %a %b; MOV %b %a =>; dead %a\n"
+  "rule MOV %a %b; MUL %a %b; MOV %c %a => MOV %c %b; MUL %c %b; dead %a\n";
+
+/**
+ * The instructions that write their first argument without reading it.
+ */
+static const std::vector<std::string> WRITE_ONLY = {
+  "MOV", "MOVI", "LOAD", "LOADI", "POP", "TIME", "RND"
+};
+
+/**
+ * Parses a number in decimal or, with a "0x" prefix, hex. Returns false
+ * if the string isn't one or doesn't fit in 16 bits.
+ */
+static bool parseValue(const std::string& str, uint16_t& value) {
+  if (str.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  long result = strtol(str.c_str(), &end, 0);
+  if ('\0' != *end || result < 0 || result > 0xffff) {
+    return false;
+  }
+  value = (uint16_t)result;
+  return true;
+}
+
+/**
+ * Returns the index in the list of variables of a rule for an argument
+ * that stands for a register, like "%a", or a number or label, like "$a".
+ * Returns -1 if the argument isn't a variable.
+ */
+static int varIndex(const std::string& arg) {
+  if (2 != arg.size() || ('%' != arg[0] && '$' != arg[0]) ||
+      !islower(arg[1])) {
+    return -1;
+  }
+  return ('%' == arg[0] ? 0 : 26) + arg[1] - 'a';
+}
+
+/**
+ * Splits a line of assembly into words. Returns false if it isn't an
+ * instruction of the current machine, like a label or data.
+ */
+static bool parseInst(const std::string& line, Peephole::Inst& inst) {
+  std::istringstream words(line);
+  if (line.empty() || !isspace(line[0]) || !(words >> inst.name) ||
+      !Machine::current().getInst(inst.name)) {
+    return false;
+  }
+  inst.args.clear();
+  std::string arg;
+  while (words >> arg) {
+    inst.args.push_back(arg);
+  }
+  return true;
+}
+
+/**
+ * Returns true if the register, or the flags if it is "FLAGS", is written
+ * before it is read by the code starting at the given line. The flags are
+ * written by CMP and TST and read by conditional jumps. Code after a jump
+ * or call could read anything, so a register that isn't written before
+ * then is assumed to be read.
+ */
+static bool isDead(const std::vector<std::string>& lines, size_t pos,
+                   const std::string& reg) {
+  for (; pos < lines.size(); pos++) {
+    if (!lines[pos].empty() && ':' == lines[pos].back()) {
+      continue;
+    }
+    Peephole::Inst inst;
+    if (!parseInst(lines[pos], inst)) {
+      return false;
+    }
+    bool writeOnly = WRITE_ONLY.end() != std::find(WRITE_ONLY.begin(),
+                                                   WRITE_ONLY.end(),
+                                                   inst.name);
+    auto firstRead = inst.args.begin() + (writeOnly ? 1 : 0);
+    if (inst.args.end() != std::find(std::min(firstRead, inst.args.end()),
+                                     inst.args.end(), reg)) {
+      return false;
+    } else if (writeOnly && !inst.args.empty() && reg == inst.args[0]) {
+      return true;
+    } else if ("FLAGS" == reg &&
+               ("CMP" == inst.name || "TST" == inst.name)) {
+      return true;
+    } else if ('J' == inst.name[0] || "CALL" == inst.name ||
+               "RET" == inst.name) {
+      return false;
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns the number of cycles that the instructions take on the current
+ * machine, or -1 if it doesn't have one of them.
+ */
+static int cycles(const std::vector<Peephole::Inst>& insts) {
+  int total = 0;
+  for (auto inst : insts) {
+    const Machine::Inst *machineInst = Machine::current().getInst(inst.name);
+    if (!machineInst) {
+      return -1;
+    }
+    total += machineInst->cycles;
+  }
+  return total;
+}
+
+Peephole::Peephole() {
+  if (!_parse(DEFAULT_TABLE, "default peephole table")) {
+    throw "Invalid default peephole table.";
+  }
+}
+
+Peephole& Peephole::current() {
+  static Peephole peephole;
+  return peephole;
+}
+
+const char *Peephole::defaultTable() {
+  return DEFAULT_TABLE;
+}
+
+bool Peephole::load(const std::string& filename) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open peephole table '" + filename + "'.");
+    return false;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  return _parse(text.str(), filename);
+}
+
+int Peephole::run(std::vector<std::string>& lines,
+                  std::vector<int>& sourceLines, size_t start) const {
+  size_t longest = 0;
+  for (const Rule& rule : _rules) {
+    longest = std::max(longest, rule.pattern.size());
+  }
+  int removed = 0;
+  std::vector<std::string> vars;
+  size_t pos = start;
+  while (pos < lines.size()) {
+    bool matched = false;
+    Inst first;
+    bool isInst = parseInst(lines[pos], first);
+    for (const Rule& rule : _rules) {
+      if (!isInst || first.name != rule.pattern[0].name ||
+          !this->_match(rule, lines, pos, vars)) {
+        continue;
+      }
+      std::vector<std::string> replacement;
+      std::vector<int> replacementLines(
+          sourceLines.begin() + pos + rule.pattern.size() -
+          rule.replacement.size(),
+          sourceLines.begin() + pos + rule.pattern.size());
+      for (auto inst : rule.replacement) {
+        std::string text = "        " + inst.name;
+        for (auto arg : inst.args) {
+          uint16_t value = 0;
+          if (-1 != varIndex(arg)) {
+            text += " " + vars[varIndex(arg)];
+          } else if (parseValue(arg, value)) {
+            text += " " + toHexStr(value);
+          }
+        }
+        replacement.push_back(text);
+      }
+      lines.erase(lines.begin() + pos,
+                  lines.begin() + pos + rule.pattern.size());
+      lines.insert(lines.begin() + pos, replacement.begin(),
+                   replacement.end());
+      sourceLines.erase(sourceLines.begin() + pos,
+                        sourceLines.begin() + pos + rule.pattern.size());
+      sourceLines.insert(sourceLines.begin() + pos, replacementLines.begin(),
+                         replacementLines.end());
+      removed += rule.pattern.size() - rule.replacement.size();
+      matched = true;
+      break;
+    }
+    // The replacement can complete a sequence that starts before it, so
+    // look at those again.
+    if (matched) {
+      pos -= std::min(pos - start, longest - 1);
+    } else {
+      pos++;
+    }
+  }
+  return removed;
+}
+
+bool Peephole::_match(const Rule& rule, const std::vector<std::string>& lines,
+                      size_t pos, std::vector<std::string>& vars) const {
+  if (lines.size() - pos < rule.pattern.size()) {
+    return false;
+  }
+  const std::vector<std::string>& registers = Machine::current().registers();
+  vars.assign(2 * 26, "");
+  for (size_t i = 0; i < rule.pattern.size(); i++) {
+    const Inst& pattern = rule.pattern[i];
+    Inst inst;
+    if (!parseInst(lines[pos + i], inst) || pattern.name != inst.name ||
+        pattern.args.size() != inst.args.size()) {
+      return false;
+    }
+    for (size_t j = 0; j < inst.args.size(); j++) {
+      const std::string& arg = inst.args[j];
+      bool isReg = registers.end() != std::find(registers.begin(),
+                                                registers.end(), arg);
+      int index = varIndex(pattern.args[j]);
+      uint16_t value;
+      uint16_t expected;
+      if (-1 == index) {
+        if (!parseValue(arg, value) ||
+            !parseValue(pattern.args[j], expected) || value != expected) {
+          return false;
+        }
+        continue;
+      }
+      // Registers stand for distinct general purpose registers, since the
+      // stack and frame pointers are used implicitly.
+      std::string& var = vars[index];
+      if (var.empty()) {
+        if ('%' == pattern.args[j][0] ?
+            (!isReg || "SP" == arg || "FP" == arg ||
+             vars.begin() + 26 != std::find(vars.begin(), vars.begin() + 26,
+                                            arg)) :
+            isReg) {
+          return false;
+        }
+        var = arg;
+      } else if (var != arg) {
+        return false;
+      }
+    }
+  }
+  // The table could have been found for a different machine, so make
+  // sure the replacement is no slower on this one.
+  int before = cycles(rule.pattern);
+  int after = cycles(rule.replacement);
+  if (-1 == after || after > before ||
+      rule.replacement.size() > rule.pattern.size() ||
+      (after == before && rule.replacement.size() == rule.pattern.size())) {
+    return false;
+  }
+  for (auto dead : rule.dead) {
+    if (!isDead(lines, pos + rule.pattern.size(),
+                "FLAGS" == dead ? dead : vars[varIndex(dead)])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Peephole::_parse(const std::string& text, const std::string& source) {
+  std::vector<Rule> rules;
+  std::istringstream lines(text);
+  std::string line;
+  int lineNum = 0;
+  while (std::getline(lines, line)) {
+    lineNum++;
+    size_t comment = line.find('#');
+    if (std::string::npos != comment) {
+      line = line.substr(0, comment);
+    }
+    std::istringstream words(line);
+    std::string key;
+    if (!(words >> key)) {
+      continue;
+    }
+    std::string where = source + ":" + std::to_string(lineNum) + ": ";
+    if ("rule" != key) {
+      _error(where + "Unknown key '" + key + "'.");
+      return false;
+    }
+    // Split the rest of the line into the pattern and the replacement,
+    // and those into instructions.
+    std::string rest;
+    std::getline(words, rest);
+    size_t arrow = rest.find("=>");
+    bool valid = std::string::npos != arrow &&
+      std::string::npos == rest.find("=>", arrow + 2);
+    Rule rule;
+    for (auto side : { &rule.pattern, &rule.replacement }) {
+      std::istringstream insts(side == &rule.pattern ?
+                               rest.substr(0, arrow) :
+                               rest.substr(std::min(arrow + 2, rest.size())));
+      std::string instText;
+      while (valid && std::getline(insts, instText, ';')) {
+        std::istringstream instWords(instText);
+        Inst inst;
+        if (!(instWords >> inst.name)) {
+          continue;
+        }
+        std::string arg;
+        while (instWords >> arg) {
+          inst.args.push_back(arg);
+        }
+        if ("dead" != inst.name) {
+          valid = rule.dead.empty();
+          side->push_back(inst);
+        } else {
+          valid = side == &rule.replacement && rule.dead.empty() &&
+            !inst.args.empty();
+          rule.dead = inst.args;
+        }
+      }
+    }
+    valid = valid && !rule.pattern.empty();
+    // Every variable has to be bound by the pattern, and every number has
+    // to fit in 16 bits.
+    std::vector<bool> bound(2 * 26, false);
+    for (auto group : { &rule.pattern, &rule.replacement }) {
+      for (auto patternInst : *group) {
+        for (auto arg : patternInst.args) {
+          uint16_t value;
+          int index = varIndex(arg);
+          if (-1 != index) {
+            if (group == &rule.pattern) {
+              bound[index] = true;
+            }
+            valid = valid && bound[index];
+          } else {
+            valid = valid && parseValue(arg, value);
+          }
+        }
+      }
+    }
+    for (auto reg : rule.dead) {
+      valid = valid && ("FLAGS" == reg ||
+                        ('%' == reg[0] && -1 != varIndex(reg) &&
+                         bound[varIndex(reg)]));
+    }
+    if (!valid) {
+      _error(where + "Expected 'rule PATTERN => REPLACEMENT', with "
+             "instructions separated by ';' and optionally followed by "
+             "'; dead REGS'.");
+      return false;
+    }
+    rules.push_back(rule);
+  }
+  _rules = rules;
+  return true;
+}
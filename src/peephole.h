@@ -0,0 +1,86 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_PEEPHOLE_H
+#define CONSOLITE_COMPILER_PEEPHOLE_H
+
+#include <string>
+#include <vector>
+
+/**
+ * A table of rules that replace short straight-line instruction sequences
+ * with cheaper ones that compute the same thing. The table is found
+ * offline by tools/superopt.cpp, which checks each replacement against
+ * the sequence it replaces for every input. A table for the reference
+ * Consolite core is compiled in, and another one can be loaded from a file
+ * in the same format, which can be printed with defaultTable().
+ */
+class Peephole {
+ public:
+  /**
+   * An instruction in a rule. Arguments starting with '%' stand for any
+   * register, those starting with '$' stand for any number or label, and
+   * the others are numbers.
+   */
+  struct Inst {
+    std::string name;
+    std::vector<std::string> args;
+  };
+  /**
+   * Replaces the pattern with the replacement. The registers in dead, and
+   * the flags if it has "FLAGS", may be left with a different value than
+   * the pattern leaves them with, so the rule only applies where they
+   * aren't read afterward.
+   */
+  struct Rule {
+    std::vector<Inst> pattern;
+    std::vector<Inst> replacement;
+    std::vector<std::string> dead;
+  };
+  /**
+   * Constructs the table for the reference Consolite core.
+   */
+  Peephole();
+  /**
+   * Returns the table that the output is optimized with.
+   */
+  static Peephole& current();
+  /**
+   * Returns the text of the table for the reference Consolite core.
+   */
+  static const char *defaultTable();
+  /**
+   * Replaces this table with the one in the given file. Prints an error
+   * message and returns false if the file can't be read or isn't a valid
+   * table.
+   */
+  bool load(const std::string& filename);
+  /**
+   * Applies the rules to the lines of assembly output starting at the
+   * given index until none of them match, and returns the number of
+   * instructions removed. The source line of each line of output is kept
+   * in sourceLines, and each instruction in a replacement takes the
+   * source line of the instruction it lines up with at the end of the
+   * pattern.
+   */
+  int run(std::vector<std::string>& lines, std::vector<int>& sourceLines,
+          size_t start) const;
+
+ private:
+  /**
+   * Parses the text of a table. Prints an error message and returns false
+   * if it isn't valid, in which case this table is unchanged.
+   */
+  bool _parse(const std::string& text, const std::string& source);
+  /**
+   * Returns true if the rule matches the instructions starting at the given
+   * line, and sets vars to what each '%' and '$' argument stands for.
+   */
+  bool _match(const Rule& rule, const std::vector<std::string>& lines,
+              size_t pos, std::vector<std::string>& vars) const;
+  std::vector<Rule> _rules;
+};
+
+#endif
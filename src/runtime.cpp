@@ -0,0 +1,169 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <map>
+#include <sstream>
+#include <vector>
+#include "runtime.h"
+#include "machine.h"
+#include "parser.h"
+
+/**
+ * A routine of the runtime library. Its code is written for the reference
+ * Consolite core, where A through D are the argument registers, E through
+ * H are local registers, and L, M, and N are the scratch registers, and it
+ * is translated to the registers of the target machine when it is output.
+ * Arguments starting with '$' are labels local to the routine, and lines
+ * ending in ':' declare them.
+ */
+struct Routine {
+  std::string name;
+  std::vector<std::string> code;
+};
+
+static const std::vector<Routine> ROUTINES = {
+  // Bresenham's line algorithm. A and B are the current point, C and D
+  // the distances to the end along each axis, E and F the steps along
+  // each axis, G the error term, and H the number of steps left, which is
+  // the longer distance. Each step takes about 18 cycles.
+  { "LINE", {
+    "PUSH E", "PUSH F", "PUSH G", "PUSH H",
+    "MOVI N 0x1",
+    "MOV E N", "SUB C A", "TST C C", "JNS $dx",
+    "MOVI L 0x0", "SUB L C", "MOV C L", "MOVI E 0xffff",
+    "$dx:",
+    "MOV F N", "SUB D B", "TST D D", "JNS $dy",
+    "MOVI L 0x0", "SUB L D", "MOV D L", "MOVI F 0xffff",
+    "$dy:",
+    "MOV G C", "SUB G D",
+    "MOV H C", "CMP C D", "JAE $loop", "MOV H D",
+    "$loop:",
+    "PIXEL A B", "TST H H", "JEQ $done", "SUB H N",
+    "MOV L G", "ADD L L", "MOV M L", "ADD M D", "TST M M", "JS $skip_x",
+    "SUB G D", "ADD A E",
+    "$skip_x:",
+    "CMP L C", "JG $loop",
+    "ADD G C", "ADD B F", "JMPI $loop",
+    "$done:",
+    "POP H", "POP G", "POP F", "POP E", "RET"
+  } },
+  // The midpoint circle algorithm, which draws the outline of the circle
+  // one point in each octant at a time. C is the x offset, starting at
+  // the radius, D the y offset, starting at 0, and E the decision term.
+  // The loop ends when the offsets cross, with signed comparisons so that
+  // a radius of 0 draws one point.
+  { "CIRCLE", {
+    "PUSH D", "PUSH E",
+    "MOVI D 0x0", "MOVI E 0x1", "SUB E C",
+    "$loop:",
+    "CMP C D", "JL $done",
+    "MOV M A", "ADD M C", "MOV N B", "ADD N D", "PIXEL M N",
+    "MOV M A", "SUB M C", "PIXEL M N",
+    "MOV N B", "SUB N D", "PIXEL M N",
+    "MOV M A", "ADD M C", "PIXEL M N",
+    "MOV M A", "ADD M D", "MOV N B", "ADD N C", "PIXEL M N",
+    "MOV M A", "SUB M D", "PIXEL M N",
+    "MOV N B", "SUB N C", "PIXEL M N",
+    "MOV M A", "ADD M D", "PIXEL M N",
+    "MOVI N 0x1", "ADD D N", "TST E E", "JNS $outer",
+    "MOV L D", "ADD L L", "ADD L N", "ADD E L", "JMPI $loop",
+    "$outer:",
+    "SUB C N", "MOV L D", "SUB L C", "ADD L L", "ADD L N", "ADD E L",
+    "JMPI $loop",
+    "$done:",
+    "POP E", "POP D", "RET"
+  } },
+  // Fills the rectangle row by row, with C and D moved to its right and
+  // bottom edges. The tests for the edges are for equality, so that a
+  // rectangle can wrap around the edge of the screen. Each pixel takes 4
+  // cycles.
+  { "RECT", {
+    "TST C C", "JEQ $done", "TST D D", "JEQ $done",
+    "ADD C A", "ADD D B", "MOVI N 0x1",
+    "$row:",
+    "MOV M A",
+    "$pixel:",
+    "PIXEL M B", "ADD M N", "CMP M C", "JNE $pixel",
+    "ADD B N", "CMP B D", "JNE $row",
+    "$done:",
+    "RET"
+  } },
+  // Finds the square root one bit at a time, from the highest. L is the
+  // root found so far, M the bit being tried, squared, and A what is left
+  // of the argument. The loop runs 8 times.
+  { "ISQRT", {
+    "PUSH B",
+    "MOVI B 0x1", "MOVI L 0x0", "MOVI M 0x4000",
+    "$loop:",
+    "MOV N L", "ADD N M", "CMP A N", "JB $less",
+    "SUB A N", "SHRL L B", "ADD L M", "JMPI $next",
+    "$less:",
+    "SHRL L B",
+    "$next:",
+    "SHRL M B", "SHRL M B", "TST M M", "JNE $loop",
+    "POP B", "RET"
+  } }
+};
+
+/**
+ * Returns true if funcName is a routine of the runtime library.
+ */
+bool isRuntimeRoutine(const std::string& funcName) {
+  for (const Routine& routine : ROUTINES) {
+    if (routine.name == funcName) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Outputs the runtime routine with the given name, translating its
+ * registers and giving its labels unused names.
+ */
+void outputRuntimeRoutine(Parser *parser, const std::string& name) {
+  const Machine& machine = Machine::current();
+  const std::vector<Reg>& argRegs = machine.argRegisters();
+  const std::vector<Reg>& localRegs = machine.localRegisters();
+  if (argRegs.size() < 4 || localRegs.size() < 4) {
+    throw "The runtime library needs at least four argument registers "
+          "and four local registers.";
+  }
+  std::map<std::string, std::string> args;
+  for (int i = 0; i < 4; i++) {
+    args[std::string(1, 'A' + i)] = machine.regName(argRegs[i]);
+    args[std::string(1, 'E' + i)] = machine.regName(localRegs[i]);
+  }
+  args["L"] = machine.regName(REG_L);
+  args["M"] = machine.regName(REG_M);
+  args["N"] = machine.regName(REG_N);
+  for (const Routine& routine : ROUTINES) {
+    if (routine.name != name) {
+      continue;
+    }
+    for (const std::string& line : routine.code) {
+      if ('$' == line[0]) {
+        std::string label = line.substr(0, line.size() - 1);
+        args[label] = parser->getUnusedLabel(name + "_" + label.substr(1));
+      }
+    }
+    parser->writeln(name + ":");
+    for (const std::string& line : routine.code) {
+      if ('$' == line[0]) {
+        parser->writeln(args[line.substr(0, line.size() - 1)] + ":");
+        continue;
+      }
+      std::istringstream words(line);
+      std::string inst;
+      words >> inst;
+      std::string word;
+      while (words >> word) {
+        auto it = args.find(word);
+        inst += " " + (args.end() == it ? word : it->second);
+      }
+      parser->writeInst(inst);
+    }
+  }
+}
@@ -0,0 +1,41 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_RUNTIME_H
+#define CONSOLITE_COMPILER_RUNTIME_H
+
+#include <string>
+
+class Parser;
+
+/**
+ * The runtime library is a set of hand written routines for drawing and
+ * math, which are declared as builtin functions and only output if the
+ * program calls them:
+ *
+ *   void LINE(uint16 x0, uint16 y0, uint16 x1, uint16 y1)
+ *   void CIRCLE(uint16 cx, uint16 cy, uint16 r)
+ *   void RECT(uint16 x, uint16 y, uint16 w, uint16 h)
+ *   uint16 ISQRT(uint16 n)
+ *
+ * They are called like other functions, with the arguments in the
+ * argument registers and the result in L. The register contract is the
+ * same for each of them: a routine may change its own argument registers,
+ * which the caller saves, and L, M, and N, and it saves any other register
+ * it uses. No routine touches memory other than the stack.
+ */
+
+/**
+ * Returns true if funcName is a routine of the runtime library.
+ */
+bool isRuntimeRoutine(const std::string& funcName);
+
+/**
+ * Outputs the runtime routine with the given name, which is also its
+ * label.
+ */
+void outputRuntimeRoutine(Parser *parser, const std::string& name);
+
+#endif
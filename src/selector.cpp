@@ -0,0 +1,918 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <unordered_map>
+#include "selector.h"
+#include "parser.h"
+#include "util.h"
+
+/**
+ * The rules for covering expression trees. Each rule reduces a tree
+ * pattern to a nonterminal with a template of instructions.
+ *
+ * Patterns are made of operators like ADD(x, y), operator classes that
+ * match several operators, and leaves. The operator classes are BINOP
+ * for operators with a matching instruction, CMPOP for comparisons and
+ * LOGOP for && and ||. The leaves are:
+ *   stk, adr     the child reduced to that nonterminal
+ *   any          the child in whichever form is cheapest to load
+ *   var          a register variable
+ *   con          a constant, or zero/pow2 for constants of that kind,
+ *                or spow2 for powers of two that are positive as signed
+ *                values
+ *   sameN        a side effect free copy of leaf N, which costs nothing
+ * Leaves are numbered from 0 in the order they appear in the pattern.
+ *
+ * Templates can use these in place of instructions:
+ *   @R=$N        load leaf N into register R
+ *   #mul $N      multiply M by constant leaf N with shifts and adds
+ * and these in place of operands:
+ *   $I, $J       the instruction or conditional jump for the operator
+ *                that matched an operator class
+ *   $rN          the register of leaf N
+ *   $cN, $kN     the value of constant leaf N, or its base 2 logarithm
+ *   $hN, $lN     the high byte of constant leaf N shifted down with its
+ *                sign, or its low byte
+ *   $mN, $sN     the value of constant leaf N minus one, or times
+ *                the data size
+ *   $scale       the base 2 logarithm of the data size
+ *   $fail        the label that a failed bounds check jumps to
+ *   $fixdiv      the routine that divides fix8_8 value M by N into M
+ *   $T           the branch target of a jmp rule. The jump on a line that
+ *                uses it is inverted when branching on a false condition
+ *   $L1, $L2...  new labels
+ *
+ * When rules cost the same, the first one is chosen. Rules that load a
+ * constant or register variable into N come before the ones that load any
+ * value there, since they load the other leaf first, and the parser
+ * merges the PUSH of its value with the POP that loads it.
+ *
+ * A new instruction only needs rules that use it here, and a cost in the
+ * machine description. Rules that use instructions the target machine
+ * doesn't have are never chosen.
+ */
+static const std::vector<std::pair<std::string, std::vector<std::string>>>
+RULES = {
+  // Arithmetic
+  { "stk: BINOP(any, con)", { "@M=$0", "MOVI N $c1", "$I M N", "PUSH M" } },
+  { "stk: BINOP(any, any)", { "@N=$1", "@M=$0", "$I M N", "PUSH M" } },
+  { "stk: BINOP(any, var)", { "@M=$0", "$I M $r1", "PUSH M" } },
+  { "stk: MUL(any, pow2)", { "@M=$0", "MOVI N $k1", "SHL M N", "PUSH M" } },
+  { "stk: MUL(pow2, any)", { "@M=$1", "MOVI N $k0", "SHL M N", "PUSH M" } },
+  { "stk: MUL(any, con)", { "@M=$0", "#mul $1", "PUSH M" } },
+  { "stk: MUL(con, any)", { "@M=$1", "#mul $0", "PUSH M" } },
+  { "stk: DIV(any, pow2)", { "@M=$0", "MOVI N $k1", "SHRL M N", "PUSH M" } },
+  { "stk: MOD(any, any)", { "@N=$1", "@M=$0", "MOV L M", "DIV M N",
+                            "MUL M N", "SUB L M", "PUSH L" } },
+  { "stk: MOD(any, pow2)", { "@M=$0", "MOVI N $m1", "AND M N", "PUSH M" } },
+  { "stk: NEG(any)", { "@M=$0", "MOVI N 0xffff", "XOR M N", "MOVI N 0x1",
+                       "ADD M N", "PUSH M" } },
+  { "stk: NEG(any)", { "@N=$0", "MOVI M 0x0", "SUB M N", "PUSH M" } },
+  { "stk: NOT(any)", { "@M=$0", "MOVI N 0xffff", "XOR M N", "PUSH M" } },
+  { "stk: POS(any)", { "@M=$0", "PUSH M" } },
+  // Signed and fix8_8 arithmetic. Signed division divides the magnitudes
+  // and fixes the sign of the result afterward, and division by a power
+  // of two rounds toward zero by adding the divisor minus one to negative
+  // values before shifting.
+  { "stk: TOFIX(any)", { "@M=$0", "MOVI N 0x8", "SHL M N", "PUSH M" } },
+  { "stk: TOINT(any)", { "@M=$0", "MOVI N 0x8", "SHRA M N", "PUSH M" } },
+  { "stk: SDIV(any, any)", { "@N=$1", "@M=$0", "MOV L M", "XOR L N",
+                             "PUSH L", "TST M M", "JNS $L1", "MOVI L 0x0",
+                             "SUB L M", "MOV M L", "$L1:", "TST N N",
+                             "JNS $L2", "MOVI L 0x0", "SUB L N", "MOV N L",
+                             "$L2:", "DIV M N", "POP L", "TST L L",
+                             "JNS $L3", "MOVI L 0x0", "SUB L M", "MOV M L",
+                             "$L3:", "PUSH M" } },
+  { "stk: SDIV(any, spow2)", { "@M=$0", "MOV L M", "MOVI N 0xf",
+                               "SHRA L N", "MOVI N $m1", "AND L N",
+                               "ADD M L", "MOVI N $k1", "SHRA M N",
+                               "PUSH M" } },
+  // A fix8_8 product is (a * b) >> 8, which needs the high bits of the
+  // product. Splitting a into its signed high byte ah and low byte al,
+  // and b the same way, it is ah * b + al * bh + ((al * bl) >> 8).
+  { "stk: FMUL(any, any)", { "@N=$1", "@M=$0", "PUSH M", "MOVI L 0x8",
+                             "SHRA M L", "MUL M N", "POP L", "PUSH M",
+                             "MOVI M 0xff", "AND L M", "AND M N",
+                             "MUL M L", "PUSH L", "MOVI L 0x8", "SHRL M L",
+                             "SHRA N L", "POP L", "MUL N L", "ADD M N",
+                             "POP N", "ADD M N", "PUSH M" } },
+  // By a constant c, it is a * ch + ah * cl + ((al * cl) >> 8).
+  { "stk: FMUL(any, con)", { "@M=$0", "MOV N M", "MOVI L 0x8", "SHRA N L",
+                             "MOVI L $l1", "MUL N L", "PUSH N", "MOV N M",
+                             "MOVI L 0xff", "AND N L", "MOVI L $l1",
+                             "MUL N L", "MOVI L 0x8", "SHRL N L",
+                             "MOVI L $h1", "MUL M L", "ADD M N", "POP N",
+                             "ADD M N", "PUSH M" } },
+  { "stk: FMUL(con, any)", { "@M=$1", "MOV N M", "MOVI L 0x8", "SHRA N L",
+                             "MOVI L $l0", "MUL N L", "PUSH N", "MOV N M",
+                             "MOVI L 0xff", "AND N L", "MOVI L $l0",
+                             "MUL N L", "MOVI L 0x8", "SHRL N L",
+                             "MOVI L $h0", "MUL M L", "ADD M N", "POP N",
+                             "ADD M N", "PUSH M" } },
+  { "stk: FDIV(any, any)", { "@N=$1", "@M=$0", "CALL $fixdiv", "PUSH M" } },
+  // Comparisons and logical operators
+  { "stk: CMPOP(any, con)", { "@M=$0", "MOVI N $c1", "CMP M N", "$J $L1",
+                              "MOVI M 0x0", "JMPI $L2", "$L1:",
+                              "MOVI M 0x1", "$L2:", "PUSH M" } },
+  { "stk: CMPOP(any, any)", { "@N=$1", "@M=$0", "CMP M N", "$J $L1",
+                              "MOVI M 0x0", "JMPI $L2", "$L1:",
+                              "MOVI M 0x1", "$L2:", "PUSH M" } },
+  { "stk: CMPOP(any, var)", { "@M=$0", "CMP M $r1", "$J $L1",
+                              "MOVI M 0x0", "JMPI $L2", "$L1:",
+                              "MOVI M 0x1", "$L2:", "PUSH M" } },
+  { "stk: EQ(any, zero)", { "@M=$0", "TST M M", "JEQ $L1", "MOVI M 0x0",
+                            "JMPI $L2", "$L1:", "MOVI M 0x1", "$L2:",
+                            "PUSH M" } },
+  { "stk: NE(any, zero)", { "@M=$0", "TST M M", "JNE $L1", "MOVI M 0x0",
+                            "JMPI $L2", "$L1:", "MOVI M 0x1", "$L2:",
+                            "PUSH M" } },
+  { "stk: LNOT(any)", { "@M=$0", "TST M M", "JNE $L1", "MOVI M 0x1",
+                        "JMPI $L2", "$L1:", "MOVI M 0x0", "$L2:",
+                        "PUSH M" } },
+  { "stk: LOGOP(any, any)", { "@N=$1", "TST N N", "JEQ $L1", "MOVI N 0x1",
+                              "JMPI $L2", "$L1:", "MOVI N 0x0", "$L2:",
+                              "@M=$0", "TST M M", "JEQ $L3", "MOVI M 0x1",
+                              "JMPI $L4", "$L3:", "MOVI M 0x0", "$L4:",
+                              "$I M N", "PUSH M" } },
+  { "stk: LOR(any, any)", { "@N=$1", "@M=$0", "OR M N", "TST M M",
+                            "JEQ $L1", "MOVI M 0x1", "$L1:", "PUSH M" } },
+  // Conditions of if statements and loops, which jump on the flags of
+  // the comparison instead of turning it into 0 or 1 first. TST of a
+  // value with itself sets the flags like a comparison with zero.
+  { "jmp: CMPOP(any, con)", { "@M=$0", "MOVI N $c1", "CMP M N", "$J $T" } },
+  { "jmp: CMPOP(any, any)", { "@N=$1", "@M=$0", "CMP M N", "$J $T" } },
+  { "jmp: CMPOP(any, var)", { "@M=$0", "CMP M $r1", "$J $T" } },
+  { "jmp: CMPOP(var, var)", { "CMP $r0 $r1", "$J $T" } },
+  { "jmp: CMPOP(any, zero)", { "@M=$0", "TST M M", "$J $T" } },
+  { "jmp: CMPOP(var, zero)", { "TST $r0 $r0", "$J $T" } },
+  { "jmp: LNOT(any)", { "@M=$0", "TST M M", "JEQ $T" } },
+  { "jmp: LNOT(var)", { "TST $r0 $r0", "JEQ $T" } },
+  // Assignment
+  { "stk: ASSIGN(adr, con)", { "POP M", "MOVI N $c1", "STOR N M",
+                               "PUSH N" } },
+  { "stk: ASSIGN(adr, any)", { "@N=$1", "POP M", "STOR N M", "PUSH N" } },
+  { "stk: ASSIGN(var, any)", { "@$r0=$1", "PUSH $r0" } },
+  { "stk: ASSIGN(var, BINOP(same0, any))", { "@N=$2", "$I $r0 N",
+                                             "PUSH $r0" } },
+  { "stk: ASSIGN(var, BINOP(same0, var))", { "$I $r0 $r2", "PUSH $r0" } },
+  { "stk: ASSIGN(adr, BINOP(same0, con))", { "POP L", "LOAD M L",
+                                             "MOVI N $c2", "$I M N",
+                                             "STOR M L", "PUSH M" } },
+  { "stk: ASSIGN(adr, BINOP(same0, any))", { "@N=$2", "POP L", "LOAD M L",
+                                             "$I M N", "STOR M L",
+                                             "PUSH M" } },
+  // Memory
+  { "adr: INDEX(any, var)", { "@M=$0", "MOV N $r1", "MOVI L $scale",
+                              "SHL N L", "ADD M N", "PUSH M" } },
+  { "adr: INDEX(any, CHECK(var, con))", { "@M=$0", "MOV N $r1",
+                                         "MOVI L $c2", "CMP N L",
+                                         "JAE $fail", "MOVI L $scale",
+                                         "SHL N L", "ADD M N", "PUSH M" } },
+  { "adr: INDEX(any, any)", { "@N=$1", "@M=$0", "MOVI L $scale", "SHL N L",
+                              "ADD M N", "PUSH M" } },
+  { "adr: INDEX(any, con)", { "@M=$0", "MOVI N $s1", "ADD M N", "PUSH M" } },
+  { "adr: INDEX(any, zero)", { "@M=$0", "PUSH M" } },
+  { "stk: CHECK(any, con)", { "@M=$0", "MOVI N $c1", "CMP M N", "JAE $fail",
+                              "PUSH M" } },
+  { "adr: DEREF(stk)", { } },
+  { "adr: DEREF(any)", { "@M=$0", "PUSH M" } },
+  { "stk: ADDR(adr)", { } }
+};
+
+/**
+ * The operators matched by each operator class, and the instruction that
+ * $I or $J stands for.
+ */
+static const std::unordered_map<std::string, std::string> BINOPS = {
+  { "ADD", "ADD" }, { "SUB", "SUB" }, { "MUL", "MUL" }, { "DIV", "DIV" },
+  { "AND", "AND" }, { "OR", "OR" }, { "XOR", "XOR" }, { "SHL", "SHL" },
+  { "SHR", "SHRL" }, { "SAR", "SHRA" }
+};
+static const std::unordered_map<std::string, std::string> CMPOPS = {
+  { "EQ", "JEQ" }, { "NE", "JNE" }, { "LT", "JB" }, { "LE", "JBE" },
+  { "GT", "JA" }, { "GE", "JAE" }, { "SLT", "JL" }, { "SLE", "JLE" },
+  { "SGT", "JG" }, { "SGE", "JGE" }
+};
+static const std::unordered_map<std::string, std::string> LOGOPS = {
+  { "LAND", "AND" }, { "LOR", "OR" }
+};
+
+/**
+ * The conditional jump that is taken exactly when each one isn't.
+ */
+static const std::unordered_map<std::string, std::string> INVERSE_JUMPS = {
+  { "JEQ", "JNE" }, { "JNE", "JEQ" }, { "JA", "JBE" }, { "JBE", "JA" },
+  { "JAE", "JB" }, { "JB", "JAE" }, { "JG", "JLE" }, { "JLE", "JG" },
+  { "JGE", "JL" }, { "JL", "JGE" }, { "JS", "JNS" }, { "JNS", "JS" }
+};
+
+/**
+ * A parsed rule pattern.
+ */
+struct Pattern {
+  std::string name;
+  std::vector<Pattern> kids;
+};
+
+/**
+ * A parsed rule.
+ */
+struct Rule {
+  Nonterm result;
+  Pattern pattern;
+  std::vector<std::string> code;
+};
+
+/**
+ * Parses a pattern like "ADD(any, con)" starting at pos.
+ */
+static Pattern parsePattern(const std::string& str, size_t& pos) {
+  Pattern pattern;
+  while (pos < str.size() && ' ' == str[pos]) {
+    pos++;
+  }
+  while (pos < str.size() && (isalnum(str[pos]) || '_' == str[pos])) {
+    pattern.name += str[pos++];
+  }
+  if (pos < str.size() && '(' == str[pos]) {
+    do {
+      pos++;
+      pattern.kids.push_back(parsePattern(str, pos));
+    } while (pos < str.size() && ',' == str[pos]);
+    pos++;
+  }
+  return pattern;
+}
+
+/**
+ * Returns the parsed rule table.
+ */
+static const std::vector<Rule>& getRules() {
+  static std::vector<Rule> rules;
+  if (rules.empty()) {
+    for (auto spec : RULES) {
+      size_t colon = spec.first.find(':');
+      std::string result = spec.first.substr(0, colon);
+      size_t pos = colon + 1;
+      Rule rule;
+      rule.result = "adr" == result ? ADR : ("jmp" == result ? JMP : STK);
+      rule.pattern = parsePattern(spec.first, pos);
+      rule.code = spec.second;
+      rules.push_back(rule);
+    }
+  }
+  return rules;
+}
+
+/**
+ * Returns the name that the rule patterns use for the operator.
+ */
+static std::string getOpName(const OperatorToken& op) {
+  static const std::unordered_map<std::string, std::string> binaryNames = {
+    { "+", "ADD" }, { "-", "SUB" }, { "*", "MUL" }, { "/", "DIV" },
+    { "%", "MOD" }, { "&", "AND" }, { "|", "OR" }, { "^", "XOR" },
+    { "<<", "SHL" }, { ">>", "SHR" }, { "==", "EQ" }, { "!=", "NE" },
+    { "<", "LT" }, { "<=", "LE" }, { ">", "GT" }, { ">=", "GE" },
+    { "&&", "LAND" }, { "||", "LOR" }, { "=", "ASSIGN" }, { "[", "INDEX" }
+  };
+  static const std::unordered_map<std::string, std::string> unaryNames = {
+    { "-", "NEG" }, { "*", "DEREF" }, { "&", "ADDR" }, { "~", "NOT" },
+    { "!", "LNOT" }, { "+", "POS" }, { "(fix8_8)", "TOFIX" },
+    { "(uint16)", "TOINT" }
+  };
+  static const std::unordered_map<std::string, std::string> signedNames = {
+    { "/", "SDIV" }, { "<", "SLT" }, { "<=", "SLE" }, { ">", "SGT" },
+    { ">=", "SGE" }, { ">>", "SAR" }
+  };
+  static const std::unordered_map<std::string, std::string> fixedNames = {
+    { "*", "FMUL" }, { "/", "FDIV" }
+  };
+  if (op.isUnary()) {
+    return unaryNames.at(op.str());
+  } else if (FIXED_ARITHMETIC == op.arithmetic() &&
+             fixedNames.count(op.str())) {
+    return fixedNames.at(op.str());
+  } else if (UNSIGNED_ARITHMETIC != op.arithmetic() &&
+             signedNames.count(op.str())) {
+    return signedNames.at(op.str());
+  }
+  return binaryNames.at(op.str());
+}
+
+/**
+ * Returns true if the two trees compute the same value without side
+ * effects.
+ */
+static bool isSameTree(const std::shared_ptr<ExprNode>& a,
+                       const std::shared_ptr<ExprNode>& b) {
+  if (!a->pure || !b->pure || a->kind != b->kind ||
+      a->value != b->value || a->reg != b->reg ||
+      a->name != b->name || a->offset != b->offset || a->op != b->op ||
+      a->kids.size() != b->kids.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a->kids.size(); i++) {
+    if (!isSameTree(a->kids[i], b->kids[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Sets the range of values that the operator node can have, given the
+ * ranges of its children. Results that could wrap around are assumed to
+ * have any value.
+ */
+static void setRange(ExprNode& node) {
+  const ExprNode& lhs = *node.kids.front();
+  const ExprNode& rhs = *node.kids.back();
+  uint32_t min = 0;
+  uint32_t max = 0xffff;
+  const std::string& op = node.op;
+  if ("AND" == op) {
+    max = std::min(lhs.max, rhs.max);
+  } else if ("OR" == op || "XOR" == op) {
+    // The result has no bits set above the highest bit of either side.
+    max = std::max(lhs.max, rhs.max);
+    while (max & (max + 1)) {
+      max |= max >> 1;
+    }
+  } else if ("ADD" == op && (uint32_t)lhs.max + rhs.max <= 0xffff) {
+    min = lhs.min + rhs.min;
+    max = lhs.max + rhs.max;
+  } else if ("SUB" == op && rhs.max <= lhs.min) {
+    min = lhs.min - rhs.max;
+    max = lhs.max - rhs.min;
+  } else if ("MUL" == op && (uint32_t)lhs.max * rhs.max <= 0xffff) {
+    min = lhs.min * rhs.min;
+    max = lhs.max * rhs.max;
+  } else if ("DIV" == op && 0 < rhs.min) {
+    min = lhs.min / rhs.max;
+    max = lhs.max / rhs.min;
+  } else if ("MOD" == op && 0 < rhs.min) {
+    if (lhs.max < rhs.min) {
+      min = lhs.min;
+      max = lhs.max;
+    } else {
+      max = std::min<uint32_t>(lhs.max, rhs.max - 1);
+    }
+  } else if ("SHR" == op && rhs.max < 16) {
+    min = lhs.min >> rhs.max;
+    max = lhs.max >> rhs.min;
+  } else if ("SHL" == op && rhs.max < 16 &&
+             ((uint32_t)lhs.max << rhs.max) <= 0xffff) {
+    min = lhs.min << rhs.min;
+    max = lhs.max << rhs.max;
+  } else if (CMPOPS.count(op) || LOGOPS.count(op) || "LNOT" == op) {
+    max = 1;
+  } else if ("ASSIGN" == op || "POS" == op) {
+    min = rhs.min;
+    max = rhs.max;
+  } else if ("CHECK" == op) {
+    min = lhs.min;
+    max = std::min<uint32_t>(lhs.max, rhs.value - 1);
+  }
+  node.min = min;
+  node.max = max;
+}
+
+/**
+ * Turns a fix8_8 multiply or divide by a constant into integer arithmetic
+ * where the constant makes that possible, like multiplying by 2.0, which
+ * is an integer multiply by 2, or by 0.25, which is a shift right by 2.
+ */
+static void foldScale(ExprNode& node) {
+  if ("FMUL" == node.op && ExprNode::LITERAL == node.kids.front()->kind) {
+    std::swap(node.kids.front(), node.kids.back());
+  }
+  auto& rhs = node.kids.back();
+  if (("FMUL" != node.op && "FDIV" != node.op) ||
+      ExprNode::LITERAL != rhs->kind || 0 == rhs->value) {
+    return;
+  }
+  uint16_t value = rhs->value;
+  bool pow2 = 0 == (value & (value - 1)) && value < 0x8000;
+  int log = pow2 ? (int)log2(value) : 0;
+  auto literal = std::make_shared<ExprNode>(ExprNode::LITERAL);
+  if ("FMUL" == node.op && 0 == (value & 0xff)) {
+    node.op = "MUL";
+    literal->value = (uint16_t)((int16_t)value >> 8);
+  } else if ("FMUL" == node.op && pow2) {
+    node.op = "SAR";
+    literal->value = 8 - log;
+  } else if ("FDIV" == node.op && pow2 && log < 8) {
+    node.op = "SHL";
+    literal->value = 8 - log;
+  } else if ("FDIV" == node.op && 0 == (value & 0xff)) {
+    node.op = "SDIV";
+    literal->value = (uint16_t)((int16_t)value >> 8);
+  } else {
+    return;
+  }
+  literal->min = literal->max = literal->value;
+  rhs = literal;
+}
+
+Selector::Selector(Parser *parser) : _parser(parser), _jumpIf(true) { }
+
+std::shared_ptr<ExprNode> Selector::build(const Postfix& postfix) const {
+  auto leaf = [&](size_t i, std::shared_ptr<ExprNode>& node) {
+    auto global = postfix.global(i);
+    auto var = postfix.variable(i);
+    auto fnCall = postfix.call(i);
+    auto labelAddress = postfix.labelAddress(i);
+    auto address = postfix.functionAddress(i);
+    if (nullptr != global) {
+      node = std::make_shared<ExprNode>(ExprNode::GLOBAL);
+      node->name = global->name();
+      if (global->isArray()) {
+        node->arraySize = global->type().arraySize();
+      }
+    } else if (nullptr != var) {
+      // Variables bound to a known value are treated as literals, and
+      // those bound to a function as its address.
+      if (var->isBound()) {
+        node = std::make_shared<ExprNode>(ExprNode::LITERAL);
+        node->value = node->min = node->max = var->boundVal();
+      } else if (var->boundFunction()) {
+        node = std::make_shared<ExprNode>(ExprNode::LABEL);
+        node->name = var->boundFunction()->name();
+      } else {
+        if (var->isReg()) {
+          node = std::make_shared<ExprNode>(ExprNode::REGISTER);
+          node->reg = var->getReg();
+        } else {
+          node = std::make_shared<ExprNode>(ExprNode::LOCAL);
+          node->offset = var->getOffset();
+        }
+        node->min = var->rangeMin();
+        node->max = var->rangeMax();
+        if (var->type().isArray()) {
+          node->arraySize = var->type().arraySize();
+        }
+      }
+    } else if (postfix.isLiteral(i)) {
+      node = std::make_shared<ExprNode>(ExprNode::LITERAL);
+      node->value = node->min = node->max = postfix.literal(i);
+    } else if (nullptr != labelAddress) {
+      node = std::make_shared<ExprNode>(ExprNode::LABEL);
+      node->name = labelAddress->label()->getAsmLabel();
+    } else if (nullptr != address) {
+      node = std::make_shared<ExprNode>(ExprNode::LABEL);
+      node->name = address->function()->name();
+    } else if (nullptr != fnCall) {
+      node = std::make_shared<ExprNode>(ExprNode::CALL);
+      node->call = fnCall;
+      node->pure = false;
+    }
+    return true;
+  };
+  auto apply = [&](size_t i, const std::shared_ptr<ExprNode>& left,
+                   const std::shared_ptr<ExprNode>& right,
+                   std::shared_ptr<ExprNode>& node) {
+    const OperatorToken& op = postfix.op(i);
+    node = std::make_shared<ExprNode>(ExprNode::OPERATOR);
+    node->op = getOpName(op);
+    node->symbol = op.str();
+    if (op.isBinary()) {
+      node->kids = { left, right };
+    } else {
+      node->kids = { right };
+    }
+    // If the operands are literals, compute the result now instead of
+    // outputting code for it.
+    auto lhs = node->kids.front();
+    auto rhs = node->kids.back();
+    if (ExprNode::LITERAL == lhs->kind &&
+        ExprNode::LITERAL == rhs->kind && op.isFoldable(rhs->value)) {
+      uint16_t value = op.operate(lhs->value, rhs->value);
+      node = std::make_shared<ExprNode>(ExprNode::LITERAL);
+      node->value = value;
+      node->min = node->max = value;
+    } else {
+      foldScale(*node);
+      node->pure = "ASSIGN" != node->op && lhs->pure && rhs->pure;
+      // Check the index into an array unless it is known to be in
+      // bounds.
+      if ("INDEX" == node->op && _parser->options().boundsCheck &&
+          0 < lhs->arraySize && lhs->arraySize <= rhs->max) {
+        auto size = std::make_shared<ExprNode>(ExprNode::LITERAL);
+        size->value = size->min = size->max = lhs->arraySize;
+        auto check = std::make_shared<ExprNode>(ExprNode::OPERATOR);
+        check->op = "CHECK";
+        check->symbol = op.str();
+        check->kids = { rhs, size };
+        check->pure = rhs->pure;
+        setRange(*check);
+        node->kids.back() = check;
+      }
+      setRange(*node);
+    }
+    return true;
+  };
+  std::shared_ptr<ExprNode> root;
+  postfix.walk(leaf, apply, root);
+  return root;
+}
+
+Operand Selector::output(const std::shared_ptr<ExprNode>& root) {
+  this->_label(root);
+  Nonterm nonterm = this->_anyNonterm(root);
+  this->_reduce(root, nonterm);
+  if (STK == nonterm) {
+    return Operand(OperandType::VALUE);
+  } else if (ADR == nonterm) {
+    return Operand(OperandType::ADDRESS);
+  } else if (CON == nonterm) {
+    return Operand(OperandType::LITERAL, root->value);
+  }
+  return Operand(OperandType::REGISTER, root->reg);
+}
+
+void Selector::outputBranch(const std::shared_ptr<ExprNode>& root,
+                            bool jumpIf, const std::string& target) {
+  _jumpIf = jumpIf;
+  _target = target;
+  this->_label(root);
+  if (-1 != root->cost[JMP]) {
+    this->_reduce(root, JMP);
+    return;
+  }
+  // Otherwise test the value of the condition.
+  Leaf leaf = { root, this->_anyNonterm(root), false };
+  this->_reduce(root, leaf.nonterm);
+  std::string reg = "M";
+  if (VAR == leaf.nonterm) {
+    reg = Machine::current().regName(root->reg);
+  } else {
+    for (auto line : this->_fetch(leaf, reg)) {
+      _parser->writeInst(line);
+    }
+  }
+  _parser->writeInst("TST " + reg + " " + reg);
+  _parser->writeInst((jumpIf ? "JNE " : "JEQ ") + target);
+}
+
+void Selector::_label(const std::shared_ptr<ExprNode>& node) {
+  for (int i = 0; i < NUM_NONTERMS; i++) {
+    node->cost[i] = -1;
+    node->rule[i] = -1;
+  }
+  for (auto kid : node->kids) {
+    this->_label(kid);
+  }
+  if (ExprNode::LITERAL == node->kind) {
+    node->cost[CON] = 0;
+  } else if (ExprNode::REGISTER == node->kind) {
+    node->cost[VAR] = 0;
+  } else if (ExprNode::LOCAL == node->kind ||
+             ExprNode::GLOBAL == node->kind) {
+    node->cost[ADR] = this->_cost(this->_leafCode(node));
+  } else if (ExprNode::CALL == node->kind ||
+             ExprNode::LABEL == node->kind) {
+    node->cost[STK] = this->_cost(this->_leafCode(node));
+  } else {
+    // Try every rule, keeping the cheapest one for each nonterminal.
+    const std::vector<Rule>& rules = getRules();
+    for (size_t i = 0; i < rules.size(); i++) {
+      Match match;
+      if (!this->_match(rules[i].pattern, node, match)) {
+        continue;
+      }
+      int cost = this->_cost(this->_expand(i, match, false));
+      if (cost < 0) {
+        continue;
+      }
+      for (auto leaf : match.leaves) {
+        if (!leaf.same) {
+          cost += leaf.node->cost[leaf.nonterm];
+        }
+      }
+      Nonterm result = rules[i].result;
+      if (-1 == node->cost[result] || cost < node->cost[result]) {
+        node->cost[result] = cost;
+        node->rule[result] = i;
+      }
+    }
+    if (-1 == node->cost[STK] && -1 == node->cost[ADR]) {
+      this->_noRuleError(node);
+      throw "Could not generate code for the target machine.";
+    }
+  }
+}
+
+void Selector::_noRuleError(const std::shared_ptr<ExprNode>& node) const {
+  const Machine& machine = Machine::current();
+  const std::vector<Rule>& rules = getRules();
+  std::vector<std::string> missing;
+  for (size_t i = 0; i < rules.size(); i++) {
+    Match match;
+    if (JMP == rules[i].result ||
+        !this->_match(rules[i].pattern, node, match)) {
+      continue;
+    }
+    for (auto line : this->_expand(i, match, false)) {
+      std::string name = line.substr(0, line.find(' '));
+      if (':' != line.back() && !machine.getInst(name) &&
+          missing.end() == std::find(missing.begin(), missing.end(),
+                                     name)) {
+        missing.push_back(name);
+      }
+    }
+  }
+  std::string msg = "No instruction pattern matches operator '" +
+                    node->symbol + "'";
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (0 == i) {
+      msg += ", since the target machine has no ";
+    } else {
+      msg += i + 1 == missing.size() ? " or " : ", ";
+    }
+    msg += missing[i];
+  }
+  _error(msg + (missing.empty() ? "." : " instruction."),
+         _parser->sourceLine());
+}
+
+bool Selector::_match(const Pattern& pattern,
+                      const std::shared_ptr<ExprNode>& node,
+                      Match& match) const {
+  const std::string& name = pattern.name;
+  if (pattern.kids.empty()) {
+    Leaf leaf = { node, STK, false };
+    if ("any" == name) {
+      leaf.nonterm = this->_anyNonterm(node);
+    } else if ("stk" == name || "adr" == name) {
+      leaf.nonterm = "stk" == name ? STK : ADR;
+      if (-1 == node->cost[leaf.nonterm]) {
+        return false;
+      }
+    } else if ("con" == name || "zero" == name || "pow2" == name ||
+               "spow2" == name) {
+      leaf.nonterm = CON;
+      if (ExprNode::LITERAL != node->kind ||
+          ("zero" == name && 0 != node->value) ||
+          (("pow2" == name || "spow2" == name) &&
+           (0 == node->value || 0 != (node->value & (node->value - 1)))) ||
+          ("spow2" == name && 0x8000 == node->value)) {
+        return false;
+      }
+    } else if ("var" == name) {
+      leaf.nonterm = VAR;
+      if (ExprNode::REGISTER != node->kind) {
+        return false;
+      }
+    } else if (0 == name.compare(0, 4, "same")) {
+      size_t other = std::stoi(name.substr(4));
+      if (other >= match.leaves.size() ||
+          !isSameTree(match.leaves[other].node, node)) {
+        return false;
+      }
+      leaf.nonterm = match.leaves[other].nonterm;
+      leaf.same = true;
+    }
+    match.leaves.push_back(leaf);
+    return true;
+  }
+  // Match the operator or operator class, then the children.
+  if (ExprNode::OPERATOR != node->kind ||
+      pattern.kids.size() != node->kids.size()) {
+    return false;
+  }
+  if ("BINOP" == name || "CMPOP" == name || "LOGOP" == name) {
+    const auto& ops = "BINOP" == name ? BINOPS :
+      ("CMPOP" == name ? CMPOPS : LOGOPS);
+    if (0 == ops.count(node->op)) {
+      return false;
+    }
+    match.op = node->op;
+  } else if (name != node->op) {
+    return false;
+  }
+  for (size_t i = 0; i < pattern.kids.size(); i++) {
+    if (!this->_match(pattern.kids[i], node->kids[i], match)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Nonterm Selector::_anyNonterm(const std::shared_ptr<ExprNode>& node) const {
+  Nonterm best = STK;
+  int bestCost = -1;
+  for (int i = 0; i < NUM_NONTERMS; i++) {
+    if (-1 == node->cost[i] || JMP == i) {
+      continue;
+    }
+    Leaf leaf = { node, (Nonterm)i, false };
+    int fetchCost = this->_cost(this->_fetch(leaf, "M"));
+    if (-1 == fetchCost) {
+      continue;
+    }
+    int cost = node->cost[i] + fetchCost;
+    if (-1 == bestCost || cost < bestCost) {
+      best = (Nonterm)i;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+std::vector<std::string> Selector::_expand(int rule,
+                                           const Match& match,
+                                           bool output) const {
+  const std::vector<Leaf>& leaves = match.leaves;
+  std::unordered_map<std::string, std::string> labels;
+  std::vector<std::string> lines;
+  for (auto line : getRules()[rule].code) {
+    // Expand the loads and multiplications.
+    if ('@' == line[0]) {
+      size_t equals = line.find('=');
+      std::string reg = line.substr(1, equals - 1);
+      if ('$' == reg[0]) {
+        reg = Machine::current().regName(
+              leaves[std::stoi(reg.substr(2))].node->reg);
+      }
+      const Leaf& leaf = leaves[std::stoi(line.substr(equals + 2))];
+      for (auto fetchLine : this->_fetch(leaf, reg)) {
+        lines.push_back(fetchLine);
+      }
+      continue;
+    } else if ('#' == line[0]) {
+      // Multiply by a constant one bit at a time, starting with the
+      // highest bit that is set.
+      uint16_t value = leaves[std::stoi(line.substr(6))].node->value;
+      if (0 == value) {
+        lines.push_back("MOVI M 0x0");
+        continue;
+      }
+      int bit = 15;
+      while (0 == (value & (1 << bit))) {
+        bit--;
+      }
+      if (0 < bit) {
+        lines.push_back("MOV N M");
+      }
+      for (bit--; 0 <= bit; bit--) {
+        lines.push_back("ADD M M");
+        if (value & (1 << bit)) {
+          lines.push_back("ADD M N");
+        }
+      }
+      continue;
+    }
+    // Substitute the operands.
+    std::istringstream stream(line);
+    std::string part;
+    std::string text;
+    bool branch = false;
+    while (stream >> part) {
+      std::string suffix = ':' == part.back() ? ":" : "";
+      part = part.substr(0, part.size() - suffix.size());
+      if ("$I" == part || "$J" == part) {
+        if (BINOPS.count(match.op)) {
+          part = BINOPS.at(match.op);
+        } else if (CMPOPS.count(match.op)) {
+          part = CMPOPS.at(match.op);
+        } else {
+          part = LOGOPS.at(match.op);
+        }
+      } else if ("$T" == part) {
+        part = _target;
+        branch = true;
+      } else if ("$fail" == part) {
+        part = _parser->boundsLabel();
+      } else if ("$fixdiv" == part) {
+        part = output ? _parser->fixDivLabel() : "fix_div";
+      } else if ("$scale" == part) {
+        part = toHexStr((uint16_t)log2(Machine::current().dataSize()));
+      } else if ('$' == part[0] && 'L' == part[1]) {
+        if (0 == labels.count(part)) {
+          labels[part] = output ? _parser->getUnusedLabel("label") : "label";
+        }
+        part = labels[part];
+      } else if ('$' == part[0]) {
+        const Leaf& leaf = leaves[std::stoi(part.substr(2))];
+        uint16_t value = leaf.node->value;
+        if ('r' == part[1]) {
+          part = Machine::current().regName(leaf.node->reg);
+        } else if ('c' == part[1]) {
+          part = toHexStr(value);
+        } else if ('k' == part[1]) {
+          part = toHexStr((uint16_t)log2(value));
+        } else if ('m' == part[1]) {
+          part = toHexStr(value - 1);
+        } else if ('s' == part[1]) {
+          part = toHexStr(value * Machine::current().dataSize());
+        } else if ('h' == part[1]) {
+          part = toHexStr((uint16_t)((int16_t)value >> 8));
+        } else if ('l' == part[1]) {
+          part = toHexStr(value & 0xff);
+        }
+      }
+      text += (text.empty() ? "" : " ") + part + suffix;
+    }
+    if (branch && !_jumpIf) {
+      size_t space = text.find(' ');
+      text = INVERSE_JUMPS.at(text.substr(0, space)) + text.substr(space);
+    }
+    lines.push_back(text);
+  }
+  return lines;
+}
+
+std::vector<std::string> Selector::_fetch(const Leaf& leaf,
+                                          const std::string& reg) const {
+  if (STK == leaf.nonterm) {
+    return { "POP " + reg };
+  } else if (ADR == leaf.nonterm) {
+    return { "POP " + reg, "LOAD " + reg + " " + reg };
+  } else if (CON == leaf.nonterm) {
+    return { "MOVI " + reg + " " + toHexStr(leaf.node->value) };
+  } else if (Machine::current().regName(leaf.node->reg) == reg) {
+    return { };
+  }
+  return { "MOV " + reg + " " + Machine::current().regName(leaf.node->reg) };
+}
+
+std::vector<std::string> Selector::_leafCode(
+      const std::shared_ptr<ExprNode>& node) const {
+  if (ExprNode::GLOBAL == node->kind || ExprNode::LABEL == node->kind) {
+    // Push the address onto the stack.
+    return { "MOVI L " + node->name, "PUSH L" };
+  } else if (ExprNode::CALL == node->kind) {
+    // Get the result of the function call and push it onto the stack.
+    return { "CALL " + node->call->funcName(), "PUSH L" };
+  }
+  // Get the variable's location into register M, and push the address
+  // onto the stack.
+  std::vector<std::string> lines = { "MOV M FP" };
+  int offset = node->offset;
+  if (0 != offset) {
+    lines.push_back("MOVI L " + toHexStr(0 < offset ? offset : -offset));
+    lines.push_back(0 < offset ? "ADD M L" : "SUB M L");
+  }
+  lines.push_back("PUSH M");
+  return lines;
+}
+
+int Selector::_cost(const std::vector<std::string>& lines) const {
+  const Machine& machine = Machine::current();
+  int cycles = 0;
+  int bytes = 0;
+  for (auto line : lines) {
+    if (':' == line.back()) {
+      continue;
+    }
+    const Machine::Inst *inst =
+      machine.getInst(line.substr(0, line.find(' ')));
+    if (!inst) {
+      return -1;
+    }
+    cycles += inst->cycles;
+    bytes += machine.instSize();
+  }
+  // Ties are broken by the other measure.
+  if (_parser->options().optimizeSize) {
+    return bytes * 256 + cycles;
+  }
+  return cycles * 256 + bytes;
+}
+
+void Selector::_reduce(const std::shared_ptr<ExprNode>& node,
+                       Nonterm nonterm) {
+  if (CON == nonterm || VAR == nonterm) {
+    return;
+  } else if (ExprNode::CALL == node->kind) {
+    node->call->output(_parser);
+    _parser->writeInst("PUSH L");
+    return;
+  } else if (ExprNode::OPERATOR != node->kind) {
+    for (auto line : this->_leafCode(node)) {
+      _parser->writeInst(line);
+    }
+    return;
+  }
+  // Output the leaves of the rule in order, then the rule's template.
+  int rule = node->rule[nonterm];
+  Match match;
+  this->_match(getRules()[rule].pattern, node, match);
+  for (auto leaf : match.leaves) {
+    if (!leaf.same) {
+      this->_reduce(leaf.node, leaf.nonterm);
+    }
+  }
+  for (auto line : this->_expand(rule, match, true)) {
+    if (':' == line.back()) {
+      _parser->writeln(line);
+    } else {
+      _parser->writeInst(line);
+    }
+  }
+}
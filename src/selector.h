@@ -0,0 +1,198 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_SELECTOR_H
+#define CONSOLITE_COMPILER_SELECTOR_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include "syntax.h"
+
+/**
+ * The forms that the result of an expression tree node can take. STK is a
+ * value pushed onto the stack, ADR is an address pushed onto the stack,
+ * CON is a value known at compile time, and VAR is a value in a register
+ * variable. CON and VAR don't require any code. JMP is a jump to the
+ * branch target that is taken if the value is nonzero, which only the
+ * root of a condition is reduced to.
+ */
+enum Nonterm { STK, ADR, CON, VAR, JMP, NUM_NONTERMS };
+
+/**
+ * A node in the tree form of an expression, which is built from the
+ * postfix form so that the instruction selector can match patterns that
+ * span several operators.
+ */
+struct ExprNode {
+  enum Kind { LITERAL, REGISTER, LOCAL, GLOBAL, LABEL, CALL, OPERATOR };
+  ExprNode(Kind k) : kind(k), value(0), reg(NO_REG), offset(0), pure(true),
+                     min(0), max(0xffff), arraySize(0) { }
+  Kind kind;
+  /**
+   * The value of a literal.
+   */
+  uint16_t value;
+  /**
+   * The register of a register variable.
+   */
+  Reg reg;
+  /**
+   * The name of a global, or the assembly-level label whose address is
+   * taken.
+   */
+  std::string name;
+  /**
+   * The frame pointer offset of a variable on the stack.
+   */
+  int offset;
+  std::shared_ptr<FunctionCallToken> call;
+  /**
+   * The name of the operator, like "ADD" or "NEG", which is what the
+   * patterns in the rule table use.
+   */
+  std::string op;
+  /**
+   * The operator as it is written in the source, like "+", for error
+   * messages.
+   */
+  std::string symbol;
+  std::vector<std::shared_ptr<ExprNode>> kids;
+  /**
+   * True if evaluating the node has no side effects.
+   */
+  bool pure;
+  /**
+   * The smallest and largest values the node can have, as far as is known
+   * at compile time.
+   */
+  uint16_t min;
+  uint16_t max;
+  /**
+   * The number of elements if the node is an array variable, or 0.
+   */
+  uint16_t arraySize;
+  /**
+   * The cheapest cost and rule found for each nonterminal, or -1 if the
+   * node can't be reduced to the nonterminal.
+   */
+  int cost[NUM_NONTERMS];
+  int rule[NUM_NONTERMS];
+};
+
+struct Pattern;
+
+/**
+ * A BURS-style instruction selector. Expression trees are covered with
+ * patterns from a table of rules, each of which has a template of
+ * Consolite instructions. A bottom-up pass finds the cheapest cover of
+ * each tree according to the cycle cost of the instructions, or their
+ * size when optimizing for size, and a top-down pass outputs it.
+ *
+ * When checking array bounds, indices into arrays that can't be proven to
+ * be in bounds from the range of values they can have are wrapped in a
+ * CHECK operator, which stops the program if the index is too big.
+ */
+class Selector {
+ public:
+  Selector(Parser *parser);
+  /**
+   * Builds the tree for the given postfix expression.
+   */
+  std::shared_ptr<ExprNode> build(const Postfix& postfix) const;
+  /**
+   * Outputs the cheapest code for the tree, and returns an operand that
+   * represents its result.
+   */
+  Operand output(const std::shared_ptr<ExprNode>& root);
+  /**
+   * Outputs the cheapest code that jumps to target if the value of the
+   * tree is nonzero, or if it is zero when jumpIf is false, using the
+   * flags of a comparison directly where possible.
+   */
+  void outputBranch(const std::shared_ptr<ExprNode>& root, bool jumpIf,
+                    const std::string& target);
+
+ private:
+  struct Leaf {
+    std::shared_ptr<ExprNode> node;
+    Nonterm nonterm;
+    /**
+     * True if the leaf matched a "sameN" pattern, which means it is the
+     * same as another leaf and no code is needed for it.
+     */
+    bool same;
+  };
+  /**
+   * The result of matching a pattern against a tree. The leaves are in
+   * the order they appear in the pattern, and op is the operator that
+   * matched an operator class like BINOP, if there was one.
+   */
+  struct Match {
+    std::vector<Leaf> leaves;
+    std::string op;
+  };
+  /**
+   * Finds the cheapest rule for each nonterminal of the node and its
+   * children.
+   */
+  void _label(const std::shared_ptr<ExprNode>& node);
+  /**
+   * Prints an error for an operator node that no rule can reduce, naming
+   * the instructions that the rules matching it need and the target
+   * machine doesn't have.
+   */
+  void _noRuleError(const std::shared_ptr<ExprNode>& node) const;
+  /**
+   * Returns true if the pattern matches the node, and fills in the
+   * leaves of the match.
+   */
+  bool _match(const Pattern& pattern,
+              const std::shared_ptr<ExprNode>& node,
+              Match& match) const;
+  /**
+   * Returns the nonterminal that the node should be reduced to when any
+   * value is accepted, taking the cost of loading it into a register into
+   * account.
+   */
+  Nonterm _anyNonterm(const std::shared_ptr<ExprNode>& node) const;
+  /**
+   * Expands the template of the rule into lines of assembly. New labels
+   * are only requested from the parser if output is true.
+   */
+  std::vector<std::string> _expand(int rule,
+                                   const Match& match,
+                                   bool output) const;
+  /**
+   * Returns the lines of assembly that load the value of the leaf into
+   * the given register.
+   */
+  std::vector<std::string> _fetch(const Leaf& leaf,
+                                  const std::string& reg) const;
+  /**
+   * Returns the lines of assembly for a node that doesn't have any
+   * children, like a variable on the stack.
+   */
+  std::vector<std::string> _leafCode(
+        const std::shared_ptr<ExprNode>& node) const;
+  /**
+   * Returns the cost of the given lines of assembly, or -1 if they use an
+   * instruction that the target machine doesn't have.
+   */
+  int _cost(const std::vector<std::string>& lines) const;
+  /**
+   * Outputs the code that reduces the node to the given nonterminal.
+   */
+  void _reduce(const std::shared_ptr<ExprNode>& node, Nonterm nonterm);
+  Parser *_parser;
+  /**
+   * The branch target of outputBranch(), and whether the jump to it is
+   * taken when the condition is true.
+   */
+  std::string _target;
+  bool _jumpIf;
+};
+
+#endif
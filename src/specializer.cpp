@@ -0,0 +1,208 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#include <algorithm>
+#include <map>
+#include "specializer.h"
+#include "parser.h"
+#include "util.h"
+
+Specializer::Specializer(
+      Parser *parser,
+      std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals)
+  : _parser(parser), _functions(functions), _globals(globals) { }
+
+void Specializer::run() {
+  // Group the calls that have constant arguments by the function they
+  // call and the constant values, in the order they appear in the source.
+  // The addresses of functions passed to function pointer parameters are
+  // constants too, and calls through those parameters become direct.
+  struct Candidate {
+    std::shared_ptr<FunctionToken> function;
+    std::vector<std::pair<size_t, uint16_t>> constParams;
+    std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>
+      functionParams;
+    std::vector<std::shared_ptr<FunctionCallToken>> calls;
+  };
+  std::vector<Candidate> candidates;
+  std::map<std::string, size_t> candidateIndices;
+  for (auto call : _getCalls()) {
+    auto function = getFunction(call->funcName(), _functions);
+    // Coroutines keep their state in frame records shared by every call,
+    // so they can't be copied, and sprites have no body to specialize.
+    if (!function || isBuiltin(function->name()) ||
+        function->isCoroutine() || function->isSprite()) {
+      continue;
+    }
+    std::vector<std::pair<size_t, uint16_t>> constParams;
+    std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>
+      functionParams;
+    for (size_t i = 0; i < call->numArgs(); i++) {
+      uint16_t value;
+      if (!function->isParamConstant(i)) {
+        continue;
+      } else if (call->getArg(i)->evaluateBound(value)) {
+        constParams.push_back(std::make_pair(i, value));
+      } else if (call->getArg(i)->evaluateFunction()) {
+        functionParams.push_back(
+          std::make_pair(i, call->getArg(i)->evaluateFunction()));
+      }
+    }
+    if (constParams.empty() && functionParams.empty()) {
+      continue;
+    }
+    std::string name = _specializedName(function, constParams,
+                                        functionParams);
+    if (0 == candidateIndices.count(name)) {
+      candidateIndices[name] = candidates.size();
+      candidates.push_back({ function, constParams, functionParams, { } });
+    }
+    candidates[candidateIndices[name]].calls.push_back(call);
+  }
+
+  // Keep the specializations that are cheaper than the original, as
+  // long as they fit in the budget. A specialization is cheaper if
+  // folding the constants made it smaller, or if it let loops be
+  // unrolled without making the rest of it bigger.
+  std::map<std::string, int> originalSizes;
+  std::vector<std::string> specializedNames;
+  int budget = _parser->options().specializeBudget;
+  for (auto candidate : candidates) {
+    auto function = candidate.function;
+    if (0 == originalSizes.count(function->name())) {
+      originalSizes[function->name()] = _measure(function);
+    }
+    int originalSize = originalSizes[function->name()];
+    std::string name = _specializedName(function, candidate.constParams,
+                                        candidate.functionParams);
+    auto specialized = function->specialize(name, candidate.constParams,
+                                            candidate.functionParams);
+    specialized->setUnrollsLoops(false);
+    int foldedSize = _measure(specialized);
+    specialized->setUnrollsLoops(true);
+    int unrolledSize = _measure(specialized);
+    int size = unrolledSize;
+    if (originalSize < foldedSize) {
+      continue;
+    } else if (budget < unrolledSize || foldedSize == unrolledSize) {
+      specialized->setUnrollsLoops(false);
+      size = foldedSize;
+      if (originalSize == foldedSize) {
+        continue;
+      }
+    }
+    if (budget < size) {
+      continue;
+    }
+    budget -= size;
+    // Point the calls at the specialized function, without the arguments
+    // that have been folded into it.
+    std::vector<size_t> removed;
+    for (auto constParam : candidate.constParams) {
+      removed.push_back(constParam.first);
+    }
+    for (auto functionParam : candidate.functionParams) {
+      removed.push_back(functionParam.first);
+    }
+    for (auto call : candidate.calls) {
+      call->redirect(name, removed);
+    }
+    _functions.push_back(specialized);
+    specializedNames.push_back(function->name());
+  }
+
+  // Remove the original functions that are no longer called, unless
+  // their addresses are taken.
+  auto calls = _getCalls();
+  auto addressed = _getFunctionAddresses();
+  for (auto name : specializedNames) {
+    bool called = "main" == name;
+    for (auto function : addressed) {
+      if (name == function->name()) {
+        called = true;
+      }
+    }
+    for (auto call : calls) {
+      if (name == call->funcName()) {
+        called = true;
+        break;
+      }
+    }
+    auto function = getFunction(name, _functions);
+    if (!called && function) {
+      _functions.erase(std::find(_functions.begin(), _functions.end(),
+                                 function));
+    }
+  }
+}
+
+std::string Specializer::_specializedName(
+      const std::shared_ptr<FunctionToken>& function,
+      const std::vector<std::pair<size_t, uint16_t>>& constParams,
+      const std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>&
+        functionParams) const {
+  std::string name = function->name();
+  for (auto constParam : constParams) {
+    name += "_" + function->getParam(constParam.first)->name() + "_" +
+      toHexStr(constParam.second).substr(2);
+  }
+  for (auto functionParam : functionParams) {
+    name += "_" + function->getParam(functionParam.first)->name() + "_" +
+      functionParam.second->name();
+  }
+  // Avoid conflicts with names from the source code.
+  while (getFunction(name, _functions) || getGlobal(name, _globals)) {
+    name += "_";
+  }
+  return name;
+}
+
+int Specializer::_measure(const std::shared_ptr<FunctionToken>& function) {
+  return _parser->measure([&]() { function->output(_parser); });
+}
+
+std::vector<std::shared_ptr<FunctionCallToken>> Specializer::_getCalls() const {
+  std::vector<std::shared_ptr<FunctionCallToken>> calls;
+  for (auto function : _functions) {
+    // Specialized copies share their bodies with the original, so their
+    // calls have already been found.
+    if (function->isSpecialization()) {
+      continue;
+    }
+    for (auto local : function->localVars()) {
+      collectCalls(local, calls);
+    }
+    for (auto statement : function->statements()) {
+      collectCalls(statement, calls);
+    }
+  }
+  return calls;
+}
+
+std::vector<std::shared_ptr<FunctionToken>>
+Specializer::_getFunctionAddresses() const {
+  std::vector<std::shared_ptr<FunctionToken>> addressed;
+  for (auto global : _globals) {
+    auto functions = global->functions();
+    addressed.insert(addressed.end(), functions.begin(), functions.end());
+  }
+  for (auto function : _functions) {
+    if (function->isSpecialization()) {
+      continue;
+    }
+    std::vector<std::shared_ptr<ExprToken>> exprs;
+    for (auto local : function->localVars()) {
+      collectExprs(local, exprs);
+    }
+    for (auto statement : function->statements()) {
+      collectExprs(statement, exprs);
+    }
+    for (auto expr : exprs) {
+      expr->getFunctionAddresses(addressed);
+    }
+  }
+  return addressed;
+}
@@ -0,0 +1,63 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+#ifndef CONSOLITE_COMPILER_SPECIALIZER_H
+#define CONSOLITE_COMPILER_SPECIALIZER_H
+
+#include <vector>
+#include <memory>
+#include "syntax.h"
+
+/**
+ * Creates copies of functions that are specialized for the constant
+ * arguments they are called with, like "draw_cell(x, y, color, 8)". In a
+ * specialized copy the constant parameters are folded into the body and
+ * loops with a known trip count are unrolled. A copy is only kept if that
+ * makes it cheaper than the original, and the copies together must fit
+ * in the specialization budget.
+ */
+class Specializer {
+ public:
+  Specializer(Parser *parser,
+              std::vector<std::shared_ptr<FunctionToken>>& functions,
+              const std::vector<std::shared_ptr<GlobalVarToken>>& globals);
+  /**
+   * Creates the specialized copies, adds them to the list of functions,
+   * and points call sites at them. Functions that are no longer called
+   * after this are removed from the list.
+   */
+  void run();
+
+ private:
+  /**
+   * Returns a name for the copy of the function specialized for the given
+   * constant parameters. The name only depends on the function and the
+   * constants, so that the output is stable between compilations.
+   */
+  std::string _specializedName(
+        const std::shared_ptr<FunctionToken>& function,
+        const std::vector<std::pair<size_t, uint16_t>>& constParams,
+        const std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>&
+          functionParams) const;
+  /**
+   * Returns the number of bytes of code output for the given function.
+   */
+  int _measure(const std::shared_ptr<FunctionToken>& function);
+  /**
+   * Returns all of the calls made from within the list of functions.
+   */
+  std::vector<std::shared_ptr<FunctionCallToken>> _getCalls() const;
+  /**
+   * Returns the functions whose addresses are taken within the list of
+   * functions or in the initial values of globals, which must be kept
+   * even if they are no longer called by name.
+   */
+  std::vector<std::shared_ptr<FunctionToken>> _getFunctionAddresses() const;
+  Parser *_parser;
+  std::vector<std::shared_ptr<FunctionToken>>& _functions;
+  const std::vector<std::shared_ptr<GlobalVarToken>>& _globals;
+};
+
+#endif
@@ -3,10 +3,14 @@
  * Copyright (c) 2015 Robert Fotino, All Rights Reserved
  */
 
-#include <iostream>
-#include <regex>
+#include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <iostream>
 #include "parser.h"
+#include "selector.h"
+#include "effects.h"
+#include "runtime.h"
 #include "tokenizer.h"
 #include "syntax.h"
 #include "util.h"
@@ -15,34 +19,60 @@
  * Parses a literal value in the code, such as "0x00ff" or "1234".
  * Only hex and decimal formats supported currently, no string
  * literals. Only stores up to the maximum value of a signed int.
- * Returns false if the literal is not in a valid format.
+ * Returns false if the literal is not in a valid format. The format is
+ * checked by hand rather than with regular expressions, since big data
+ * tables have many thousands of literals.
  */
 bool LiteralToken::parse(const AtomToken& token) {
   _lineNum = token.line();
-  if (std::regex_match(token.str(), std::regex("^0[xX][0-9a-fA-F]+$"))) {
+  const std::string& str = token.str();
+  // Returns true if the characters from start to end are all digits in
+  // the given base, and there is at least one.
+  auto digits = [&](size_t start, size_t end, int base) {
+    if (end <= start) {
+      return false;
+    }
+    for (size_t i = start; i < end; i++) {
+      unsigned char c = str[i];
+      if ((16 == base && !isxdigit(c)) || (10 == base && !isdigit(c)) ||
+          (2 == base && '0' != c && '1' != c)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  bool prefixed = 2 < str.size() && '0' == str[0];
+  size_t point = str.find('.');
+  if (prefixed && ('x' == str[1] || 'X' == str[1]) &&
+      digits(2, str.size(), 16)) {
     // Matched hex
     _value = 0;
-    for (size_t i = 2; i < token.str().size(); i++) {
-      char c = token.str().at(i);
+    for (size_t i = 2; i < str.size(); i++) {
+      char c = str[i];
       uint8_t hexVal =
         ('0' <= c && c <= '9') ? (c - '0') :
         ('a' <= c && c <= 'f') ? (c - 'a' + 10) : (c - 'A' + 10);
       _value = (_value * 16) + hexVal;
     }
-  } else if (std::regex_match(token.str(), std::regex("^0[bB][01]+$"))) {
+  } else if (prefixed && ('b' == str[1] || 'B' == str[1]) &&
+             digits(2, str.size(), 2)) {
     // Matched binary
     _value = 0;
-    for (size_t i = 2; i < token.str().size(); i++) {
-      _value = (_value * 2) + (token.str().at(i) - '0');
+    for (size_t i = 2; i < str.size(); i++) {
+      _value = (_value * 2) + (str[i] - '0');
     }
-  } else if (std::regex_match(token.str(), std::regex("^[0-9]+$"))) {
+  } else if (digits(0, str.size(), 10)) {
     // Matched decimal
     _value = 0;
-    for (size_t i = 0; i < token.str().size(); i++) {
-      char c = token.str().at(i);
-      uint8_t decVal = c - '0';
+    for (size_t i = 0; i < str.size(); i++) {
+      uint8_t decVal = str[i] - '0';
       _value = (_value * 10) + decVal;
     }
+  } else if (std::string::npos != point && digits(0, point, 10) &&
+             digits(point + 1, str.size(), 10)) {
+    // Matched fix8_8, which is rounded to the nearest 1/256
+    _fixed = true;
+    _value = (uint16_t)std::lround(std::stod(str) * 256);
   } else {
     return false;
   }
@@ -69,6 +99,16 @@ bool OperatorToken::parse(const AtomToken& token) {
   return false;
 }
 
+/**
+ * Constructs a unary operator like "(fix8_8)" that converts its operand to
+ * the given type. Converting a fix8_8 value to uint16 rounds it down.
+ */
+OperatorToken::OperatorToken(const TypeToken& type, int lineNum)
+  : _op("(" + type.name() + ")"), _binary(false),
+    _arithmetic(SIGNED_ARITHMETIC) {
+  _lineNum = lineNum;
+}
+
 bool OperatorToken::maybeBinary() {
   static std::vector<std::string> validOps = { "+", "-", "*", "/", "%", "=",
                                                "&", "|", "^", "||", "&&", "<",
@@ -128,8 +168,14 @@ bool OperatorToken::leftToRight() const {
 }
 
 uint16_t OperatorToken::operate(uint16_t lhs, uint16_t rhs) const {
+  int16_t signedLhs = (int16_t)lhs;
+  int16_t signedRhs = (int16_t)rhs;
   if (isUnary()) {
-    if ("-" == _op) {
+    if ("(fix8_8)" == _op) {
+      return rhs << 8;
+    } else if ("(uint16)" == _op) {
+      return signedRhs >> 8;
+    } else if ("-" == _op) {
       return -rhs;
     } else if ("*" == _op) {
       throw "Dereferencing not allowed in constant expression.";
@@ -142,6 +188,37 @@ uint16_t OperatorToken::operate(uint16_t lhs, uint16_t rhs) const {
     } else if ("+" == _op) {
       return +rhs;
     }
+  } else if (isBinary() && FIXED_ARITHMETIC == _arithmetic &&
+             ("*" == _op || "/" == _op)) {
+    // Both sides are scaled by 256, so the product has to be scaled down
+    // and the dividend scaled up. Products round down and quotients round
+    // toward zero.
+    if ("*" == _op) {
+      return (int32_t)signedLhs * signedRhs >> 8;
+    } else if (0 == rhs) {
+      _warn("Division by zero in expression.", _lineNum);
+      return 0xffff;
+    }
+    return (int32_t)signedLhs * 256 / signedRhs;
+  } else if (isBinary() && UNSIGNED_ARITHMETIC != _arithmetic &&
+             ("/" == _op || "<" == _op || "<=" == _op || ">" == _op ||
+              ">=" == _op || ">>" == _op)) {
+    if ("/" == _op) {
+      if (0 == rhs) {
+        _warn("Division by zero in expression.", _lineNum);
+        return 0xffff;
+      }
+      return signedLhs / signedRhs;
+    } else if ("<" == _op) {
+      return signedLhs < signedRhs ? 1 : 0;
+    } else if ("<=" == _op) {
+      return signedLhs <= signedRhs ? 1 : 0;
+    } else if (">" == _op) {
+      return signedLhs > signedRhs ? 1 : 0;
+    } else if (">=" == _op) {
+      return signedLhs >= signedRhs ? 1 : 0;
+    }
+    return signedLhs >> std::min<uint16_t>(rhs, 15);
   } else if (isBinary()) {
     if ("+" == _op) {
       return lhs + rhs;
@@ -197,198 +274,36 @@ uint16_t OperatorToken::operate(uint16_t lhs, uint16_t rhs) const {
 }
 
 /**
- * Outputs assembly code for this operation on the given left hand and
- * right hand sides. Returns an operand representing the result, which
- * will be an address or a value depending on the operation.
+ * Returns true if operate() can compute the result of this operation at
+ * compile time, given the value of the right hand side.
  */
-Operand OperatorToken::output(Parser *parser,
-                              const Operand& lhs, const Operand& rhs) {
+bool OperatorToken::isFoldable(uint16_t rhs) const {
   if (isUnary()) {
-    if ("-" == _op) {
-      // The negative of a 2's complement number x is ~x + 1.
-      operandValueToReg(parser, rhs, "M");
-      parser->writeInst("MOVI N 0xffff");
-      parser->writeInst("XOR M N");
-      parser->writeInst("MOVI N 0x1");
-      parser->writeInst("ADD M N");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    } else if ("*" == _op) {
-      // Dereference operator. Do nothing for value operands, because
-      // we would just be popping them off and pushing them back onto
-      // the stack.
-      if (OperandType::VALUE != rhs.type()) {
-        operandValueToReg(parser, rhs, "M");
-        parser->writeInst("PUSH M");
-      }
-      return Operand(OperandType::ADDRESS);
-    } else if ("&" == _op) {
-      // Do nothing, the value should already be on the stack.
-      if (OperandType::ADDRESS != rhs.type()) {
-        throw "Right hand side must be an address for the address-of operator.";
-      }
-      return Operand(OperandType::VALUE);
-    } else if ("~" == _op) {
-      // x ^ 0xffff == ~x
-      operandValueToReg(parser, rhs, "M");
-      parser->writeInst("MOVI N 0xffff");
-      parser->writeInst("XOR M N");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    } else if ("!" == _op) {
-      // x = x != 0 ? 1 : 0
-      std::string label1 = parser->getUnusedLabel("label");
-      std::string label2 = parser->getUnusedLabel("label");
-      operandValueToReg(parser, rhs, "M");
-      parser->writeInst("TST M M");
-      parser->writeInst("JNE " + label1);
-      parser->writeInst("MOVI M 0x1");
-      parser->writeInst("JMPI " + label2);
-      parser->writeln(label1 + ":");
-      parser->writeInst("MOVI M 0x0");
-      parser->writeln(label2 + ":");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    } else if ("+" == _op) {
-      // Get the value and push it onto the stack.
-      operandValueToReg(parser, rhs, "M");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    }
-  } else if (isBinary()) {
-    if ("%" == _op) {
-      // a % b == a - (b * (a / b))
-      operandValueToReg(parser, rhs, "N");
-      operandValueToReg(parser, lhs, "M");
-      parser->writeInst("MOV L M");
-      parser->writeInst("DIV M N");
-      parser->writeInst("MUL M N");
-      parser->writeInst("SUB L M");
-      parser->writeInst("PUSH L");
-      return Operand(OperandType::VALUE);
-    } else if ("=" == _op) {
-      // Load RHS value into a register.
-      operandValueToReg(parser, rhs, "N");
-      if (OperandType::ADDRESS == lhs.type()) {
-        parser->writeInst("POP M");
-        parser->writeInst("STOR N M");
-      } else if (OperandType::REGISTER == lhs.type()) {
-        parser->writeInst("MOV " + lhs.reg() + " N");
-      } else {
-        throw "Left hand side of assignment cannot be an rvalue.";
-      }
-      parser->writeInst("PUSH N");
-      return Operand(OperandType::VALUE);
-    } else if ("+" == _op || "-" == _op || "*" == _op || "/" == _op ||
-               "&" == _op || "|" == _op || "^" == _op ||
-               "<<" == _op || ">>" == _op) {
-      operandValueToReg(parser, rhs, "N");
-      operandValueToReg(parser, lhs, "M");
-      std::string inst;
-      if ("+" == _op) {
-        inst = "ADD";
-      } else if ("-" == _op) {
-        inst = "SUB";
-      } else if ("*" == _op) {
-        inst = "MUL";
-      } else if ("/" == _op) {
-        inst = "DIV";
-      } else if ("&" == _op) {
-        inst = "AND";
-      } else if ("|" == _op) {
-        inst = "OR";
-      } else if ("^" == _op) {
-        inst = "XOR";
-      } else if ("<<" == _op) {
-        inst = "SHL";
-      } else if (">>" == _op) {
-        inst = "SHRL";
-      }
-      parser->writeInst(inst + " M N");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    } else if ("[" == _op) {
-      // For x[a], push &x + (a * DATA_SIZE) onto the stack.
-      operandValueToReg(parser, rhs, "N");
-      operandValueToReg(parser, lhs, "M");
-      // Assume DATA_SIZE is a power of 2, and do a fast
-      // multiply by shifting left
-      parser->writeInst("MOVI L " + toHexStr(ceil(log2(DATA_SIZE))));
-      parser->writeInst("SHL N L");
-      parser->writeInst("ADD M N");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::ADDRESS);
-    } else if ("||" == _op || "&&" == _op) {
-      // Make N either 0 or 1.
-      std::string label1 = parser->getUnusedLabel("label");
-      std::string label2 = parser->getUnusedLabel("label");
-      operandValueToReg(parser, rhs, "N");
-      parser->writeInst("TST N N");
-      parser->writeInst("JEQ " + label1);
-      parser->writeInst("MOVI N 0x1");
-      parser->writeInst("JMPI " + label2);
-      parser->writeln(label1 + ":");
-      parser->writeInst("MOVI N 0x0");
-      parser->writeln(label2 + ":");
-      // Make M either 0 or 1.
-      std::string label3 = parser->getUnusedLabel("label");
-      std::string label4 = parser->getUnusedLabel("label");
-      operandValueToReg(parser, lhs, "M");
-      parser->writeInst("TST M M");
-      parser->writeInst("JEQ " + label3);
-      parser->writeInst("MOVI M 0x1");
-      parser->writeInst("JMPI " + label4);
-      parser->writeln(label3 + ":");
-      parser->writeInst("MOVI M 0x0");
-      parser->writeln(label4 + ":");
-      // Do the operation.
-      if ("||" == _op) {
-        parser->writeInst("OR M N");
-      } else if ("&&" == _op) {
-        parser->writeInst("AND M N");
-      }
-      // Push the result.
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    } else if ("<" == _op || "<=" == _op || ">" == _op || ">=" == _op ||
-               "==" == _op || "!=" == _op) {
-      std::string label1 = parser->getUnusedLabel("label");
-      std::string label2 = parser->getUnusedLabel("label");
-      operandValueToReg(parser, rhs, "N");
-      operandValueToReg(parser, lhs, "M");
-      parser->writeInst("CMP M N");
-      std::string inst;
-      if ("<" == _op) {
-        inst = "JB";
-      } else if ("<=" == _op) {
-        inst = "JBE";
-      } else if (">" == _op) {
-        inst = "JA";
-      } else if (">=" == _op) {
-        inst = "JAE";
-      } else if ("==" == _op) {
-        inst = "JEQ";
-      } else if ("!=" == _op) {
-        inst = "JNE";
-      }
-      parser->writeInst(inst + " " + label1);
-      parser->writeInst("MOVI M 0x0");
-      parser->writeInst("JMPI " + label2);
-      parser->writeln(label1 + ":");
-      parser->writeInst("MOVI M 0x1");
-      parser->writeln(label2 + ":");
-      parser->writeInst("PUSH M");
-      return Operand(OperandType::VALUE);
-    }
+    return "*" != _op && "&" != _op;
+  }
+  if ("/" == _op || "%" == _op) {
+    return 0 != rhs;
   }
-  // By default return a value type, control should never reach here.
-  return Operand(OperandType::VALUE);
+  return "=" != _op && "[" != _op;
+}
+
+/**
+ * Constructs the type of a pointer to a function with the given return
+ * type and parameter types.
+ */
+TypeToken::TypeToken(const TypeToken& returnType,
+                     const std::vector<TypeToken>& paramTypes)
+  : _name("uint16"), _isArray(false), _arraySize(0), _isFunction(true),
+    _returnType(std::make_shared<TypeToken>(returnType)),
+    _paramTypes(paramTypes) {
+  _lineNum = returnType.line();
 }
 
 /**
  * Parses either a single type or an array type, like "uint16"
  * or "uint16[32]". The expression within square brackets must
- * be known at compile time.
+ * be known at compile time. A type followed by a parenthesized list of
+ * parameter types, like "void(uint16)", is a pointer to a function.
  */
 bool TypeToken::parse(
       Tokenizer *tokenizer,
@@ -403,6 +318,11 @@ bool TypeToken::parse(
   }
   _lineNum = typeName.line();
   _name = typeName.str();
+  while ("(" == tokenizer->peekNext().str()) {
+    if (!_parseFunction(tokenizer, functions, globals)) {
+      return false;
+    }
+  }
   if ("[" == tokenizer->peekNext().str()) {
     tokenizer->getNext();
     _isArray = true;
@@ -422,11 +342,287 @@ bool TypeToken::parse(
   return true;
 }
 
+/**
+ * Parses the parameter types of a function pointer type like
+ * "uint16(uint16, uint16)", where the return type has already been
+ * parsed into this token.
+ */
+bool TypeToken::_parseFunction(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals) {
+  if (!_expect(tokenizer, "(")) {
+    return false;
+  }
+  std::vector<TypeToken> paramTypes;
+  while (")" != tokenizer->peekNext().str()) {
+    TypeToken paramType;
+    if (!paramType.parse(tokenizer, functions, globals)) {
+      return false;
+    } else if (paramType.isArray()) {
+      _error("Array parameter types not supported.", paramType.line());
+      return false;
+    } else if ("void" == paramType.name()) {
+      _error("Parameter cannot be of type void.", paramType.line());
+      return false;
+    }
+    paramTypes.push_back(paramType);
+    AtomToken t = tokenizer->peekNext();
+    if (t.str().empty()) {
+      _error("Unexpected EOF.", t.line());
+      return false;
+    } else if ("," == t.str()) {
+      tokenizer->getNext();
+    } else if (")" != t.str()) {
+      _error("Unexpected token '" + t.str() + "'.", t.line());
+      return false;
+    }
+  }
+  // Consume the closing parenthesis.
+  tokenizer->getNext();
+  *this = TypeToken(*this, paramTypes);
+  return true;
+}
+
+/**
+ * Returns the type of the elements of an array of this type, or the type
+ * itself if it is not an array.
+ */
+TypeToken TypeToken::elementType() const {
+  TypeToken type(*this);
+  type._isArray = false;
+  type._arraySize = 0;
+  return type;
+}
+
+/**
+ * Returns a string like "void(uint16,uint16)" for function pointer types,
+ * or the type's name for other types.
+ */
+std::string TypeToken::signature() const {
+  if (!_isFunction) {
+    return _name;
+  }
+  std::string signature = _returnType->signature() + "(";
+  for (size_t i = 0; i < _paramTypes.size(); i++) {
+    signature += _paramTypes[i].signature();
+    if (i + 1 < _paramTypes.size()) {
+      signature += ",";
+    }
+  }
+  return signature + ")";
+}
+
+/**
+ * Returns true if a value of the other type can be stored in a variable of
+ * this type. Plain addresses can be stored in function pointers and the
+ * other way around, but function pointers of different signatures can't
+ * be mixed.
+ */
+bool TypeToken::canHold(const TypeToken& other) const {
+  return !_isFunction || !other._isFunction ||
+    signature() == other.signature();
+}
+
+/**
+ * Returns the variable, call, or address at the given index, or a null
+ * pointer for a literal or operator.
+ */
+std::shared_ptr<Token> Postfix::symbol(size_t i) const {
+  if (isLiteral(i) || isOperator(i)) {
+    return nullptr;
+  }
+  return _symbols[_nodes[i].index];
+}
+
+/**
+ * Returns the variable at the given index, or a null pointer if it is not
+ * a variable.
+ */
+std::shared_ptr<Variable> Postfix::variable(size_t i) const {
+  switch (_nodes[i].kind) {
+  case GLOBAL:
+    return std::static_pointer_cast<GlobalVarToken>(_symbols[_nodes[i].index]);
+  case PARAM:
+    return std::static_pointer_cast<ParamToken>(_symbols[_nodes[i].index]);
+  case LOCAL:
+    return std::static_pointer_cast<LocalVarToken>(_symbols[_nodes[i].index]);
+  default:
+    return nullptr;
+  }
+}
+
+/**
+ * Returns the global variable at the given index, or a null pointer if it
+ * is not one.
+ */
+std::shared_ptr<GlobalVarToken> Postfix::global(size_t i) const {
+  if (GLOBAL != _nodes[i].kind) {
+    return nullptr;
+  }
+  return std::static_pointer_cast<GlobalVarToken>(_symbols[_nodes[i].index]);
+}
+
+/**
+ * Returns the function call at the given index, or a null pointer if it is
+ * not one.
+ */
+std::shared_ptr<FunctionCallToken> Postfix::call(size_t i) const {
+  if (CALL != _nodes[i].kind) {
+    return nullptr;
+  }
+  return std::static_pointer_cast<FunctionCallToken>(
+           _symbols[_nodes[i].index]);
+}
+
+/**
+ * Returns the address of a function at the given index, or a null pointer
+ * if it is not one.
+ */
+std::shared_ptr<FunctionAddressToken> Postfix::functionAddress(
+      size_t i) const {
+  if (FUNCTION_ADDRESS != _nodes[i].kind) {
+    return nullptr;
+  }
+  return std::static_pointer_cast<FunctionAddressToken>(
+           _symbols[_nodes[i].index]);
+}
+
+/**
+ * Returns the address of a label at the given index, or a null pointer if
+ * it is not one.
+ */
+std::shared_ptr<LabelAddressToken> Postfix::labelAddress(size_t i) const {
+  if (LABEL_ADDRESS != _nodes[i].kind) {
+    return nullptr;
+  }
+  return std::static_pointer_cast<LabelAddressToken>(
+           _symbols[_nodes[i].index]);
+}
+
+/**
+ * Returns the line number of the token at the given index. Literals only
+ * keep their value, so they have no line number.
+ */
+int Postfix::line(size_t i) const {
+  if (isLiteral(i)) {
+    return -1;
+  } else if (isOperator(i)) {
+    return op(i).line();
+  }
+  return _symbols[_nodes[i].index]->line();
+}
+
+void Postfix::pushLiteral(uint16_t value, bool fixed) {
+  _push(fixed ? FIXED_LITERAL : LITERAL, value);
+}
+
+void Postfix::push(const OperatorToken& op) {
+  _push(OPERATOR, _operators.size());
+  _operators.push_back(op);
+}
+
+void Postfix::push(const std::shared_ptr<GlobalVarToken>& global) {
+  _pushSymbol(GLOBAL, global);
+}
+
+void Postfix::push(const std::shared_ptr<ParamToken>& param) {
+  _pushSymbol(PARAM, param);
+}
+
+void Postfix::push(const std::shared_ptr<LocalVarToken>& local) {
+  _pushSymbol(LOCAL, local);
+}
+
+void Postfix::push(const std::shared_ptr<FunctionCallToken>& call) {
+  _pushSymbol(CALL, call);
+}
+
+void Postfix::push(const std::shared_ptr<FunctionAddressToken>& address) {
+  _pushSymbol(FUNCTION_ADDRESS, address);
+}
+
+void Postfix::push(const std::shared_ptr<LabelAddressToken>& address) {
+  _pushSymbol(LABEL_ADDRESS, address);
+}
+
+/**
+ * Appends the token at the given index of another expression, copying the
+ * operator or symbol into this expression's tables.
+ */
+void Postfix::push(const Postfix& other, size_t i) {
+  if (other.isLiteral(i)) {
+    _nodes.push_back(other._nodes[i]);
+  } else if (other.isOperator(i)) {
+    this->push(other.op(i));
+  } else {
+    _pushSymbol(other.kind(i), other._symbols[other._nodes[i].index]);
+  }
+}
+
+/**
+ * Appends all of the tokens of another expression.
+ */
+void Postfix::append(const Postfix& other) {
+  for (size_t i = 0; i < other.size(); i++) {
+    this->push(other, i);
+  }
+}
+
+/**
+ * Inserts an operator before the token at the given index.
+ */
+void Postfix::insert(size_t pos, const OperatorToken& op) {
+  this->push(op);
+  Node node = _nodes.back();
+  _nodes.pop_back();
+  _nodes.insert(_nodes.begin() + pos, node);
+}
+
+/**
+ * Appends a node. The index of a node is 16 bits, which is the size of a
+ * literal's value and more tokens than an expression can reasonably have.
+ */
+void Postfix::_push(Kind kind, size_t index) {
+  if (0xffff < index) {
+    throw "Expression has too many tokens.";
+  }
+  _nodes.push_back({ kind, (uint16_t)index });
+}
+
+void Postfix::_pushSymbol(Kind kind, const std::shared_ptr<Token>& symbol) {
+  _push(kind, _symbols.size());
+  _symbols.push_back(symbol);
+}
+
 /**
  * Constructs an expression token that represents a constant value.
  */
-ExprToken::ExprToken(uint16_t value) : _const(true), _value(value) {
-  _postfix.push_back(std::shared_ptr<Token>(new LiteralToken(value)));
+ExprToken::ExprToken(uint16_t value)
+  : _const(true), _value(value), _assumed(false), _assumedValue(0),
+    _type("uint16") {
+  _postfix.pushLiteral(value);
+}
+
+/**
+ * Constructs an expression token for a literal, with the type and line of
+ * the literal.
+ */
+ExprToken::ExprToken(const LiteralToken& literal)
+  : _const(true), _value(literal.val()), _assumed(false), _assumedValue(0),
+    _type(literal.isFixed() ? "fix8_8" : "uint16") {
+  _lineNum = literal.line();
+  _postfix.pushLiteral(literal.val(), literal.isFixed());
+}
+
+/**
+ * Constructs an expression token from tokens that are already in postfix
+ * order and have been validated.
+ */
+ExprToken::ExprToken(const Postfix& postfix, const TypeToken& type)
+  : _const(false), _value(0), _postfix(postfix), _assumed(false),
+    _assumedValue(0), _type(type) {
+  _lineNum = postfix.line(0);
 }
 
 /**
@@ -440,7 +636,8 @@ bool ExprToken::parse(
       const std::vector<std::shared_ptr<FunctionToken>>& functions,
       const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
       const std::vector<std::shared_ptr<ParamToken>>& parameters,
-      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+      bool isStatement) {
   std::string prev;
   std::stack<std::string> parens;
   std::stack<std::shared_ptr<Token>> opStack;
@@ -449,7 +646,7 @@ bool ExprToken::parse(
     if (-1 == _lineNum) {
       _lineNum = t.line();
     }
-    std::shared_ptr<LiteralToken> literal(new LiteralToken());
+    LiteralToken literal;
     std::shared_ptr<OperatorToken> op(new OperatorToken());
     if ("(" == t.str()) {
       if (!prev.empty() && "(" != prev && "op" != prev) {
@@ -470,20 +667,35 @@ bool ExprToken::parse(
       // Pop operators off the stack until we reach a corresponding "("
       while (!opStack.empty() &&
              std::dynamic_pointer_cast<OperatorToken>(opStack.top())) {
-        _postfix.push_back(opStack.top());
+        _postfix.push(*std::static_pointer_cast<OperatorToken>(opStack.top()));
         opStack.pop();
       }
       // Pop off the "("
       opStack.pop();
       parens.pop();
       prev = ")";
-    } else if (literal->parse(t)) {
+    } else if ("&&" == t.str() &&
+               (prev.empty() || "(" == prev || "op" == prev)) {
+      // Where a value is expected, "&&label" is the address of a label.
+      // The label may be declared later in the function, so it is looked
+      // up once the function has been parsed.
+      tokenizer->getNext();
+      AtomToken name = tokenizer->peekNext();
+      if (!isValidName(name.str())) {
+        _error("Expected a label name after '&&' in expression.",
+               name.line());
+        return false;
+      }
+      _postfix.push(
+        std::make_shared<LabelAddressToken>(name.str(), name.line()));
+      prev = "val";
+    } else if (literal.parse(t)) {
       if (!prev.empty() && "(" != prev && "op" != prev) {
         _error("Unexpected token '" + t.str() + "' in expression.", t.line());
         return false;
       }
       prev = "val";
-      _postfix.push_back(literal);
+      _postfix.pushLiteral(literal.val(), literal.isFixed());
     } else if (op->parse(t)) {
       // Determine if the operator is binary or unary.
       if (op->maybeBinary() && (")" == prev || "val" == prev)) {
@@ -503,12 +715,12 @@ bool ExprToken::parse(
           break;
         } else if (op->precedence() == topOp->precedence()) {
           if (op->leftToRight()) {
-            _postfix.push_back(opStack.top());
+            _postfix.push(*topOp);
             opStack.pop();
           }
           break;
         } else {
-          _postfix.push_back(opStack.top());
+          _postfix.push(*topOp);
           opStack.pop();
         }
       }
@@ -526,17 +738,50 @@ bool ExprToken::parse(
       auto function = getFunction(t.str(), functions);
       auto param = getParameter(t.str(), parameters);
       auto localVar = getLocal(t.str(), localVars);
+      Postfix var;
+      TypeToken varType;
       if (nullptr != globalVar) {
-        // If the name represents a global variable, push it onto the stack
-        _postfix.push_back(globalVar);
-        prev = "val";
+        var.push(globalVar);
+        varType = globalVar->type();
       } else if (nullptr != param) {
-        // If the name represents a parameter, push it onto the stack
-        _postfix.push_back(param);
-        prev = "val";
+        var.push(param);
+        varType = param->type();
       } else if (nullptr != localVar) {
-        // If the name represents a parameter, push it onto the stack
-        _postfix.push_back(localVar);
+        var.push(localVar);
+        varType = localVar->type();
+      }
+      std::shared_ptr<OperatorToken> topOp;
+      if (!opStack.empty()) {
+        topOp = std::dynamic_pointer_cast<OperatorToken>(opStack.top());
+      }
+      if (!var.empty() && varType.isFunction()) {
+        // A function pointer is either called or used as a value.
+        tokenizer->getNext();
+        if (!_parseFunctionPointer(tokenizer, var, varType, functions,
+                                   globals, parameters, localVars)) {
+          return false;
+        }
+        prev = "val";
+        continue;
+      } else if (!var.empty()) {
+        // If the name represents a variable, push it onto the stack
+        _postfix.append(var);
+        prev = "val";
+      } else if (nullptr != function && "op" == prev && nullptr != topOp &&
+                 "&" == topOp->str() && topOp->isUnary()) {
+        // The address of a function, which replaces the address operator.
+        if (isBuiltin(function->name())) {
+          _error("Can't get address of builtin function '" +
+                 function->name() + "()'.", t.line());
+          return false;
+        } else if (function->isCoroutine()) {
+          _error("Can't get address of coroutine '" + function->name() +
+                 "()'.", t.line());
+          return false;
+        }
+        opStack.pop();
+        _postfix.push(
+          std::make_shared<FunctionAddressToken>(function, t.line()));
         prev = "val";
       } else if (nullptr != function) {
         // If the function returns void, this is an error. We can't have
@@ -553,7 +798,7 @@ bool ExprToken::parse(
                            parameters, localVars)) {
           return false;
         }
-        _postfix.push_back(fnCall);
+        _postfix.push(fnCall);
         prev = "val";
         // Continue so we don't consume an extra token at the end, all
         // tokens have been consumed already for the function call.
@@ -580,9 +825,20 @@ bool ExprToken::parse(
   }
   // Pop any remaining operators off the stack.
   while (!opStack.empty()) {
-    _postfix.push_back(opStack.top());
+    _postfix.push(*std::static_pointer_cast<OperatorToken>(opStack.top()));
     opStack.pop();
   }
+  // A call through a pointer to a void function has no value, so it can
+  // only be a statement by itself.
+  for (size_t i = 0; i < _postfix.size(); i++) {
+    auto fnCall = _postfix.call(i);
+    if (nullptr != fnCall && "void" == fnCall->type().name() &&
+        (!isStatement || 1 != _postfix.size())) {
+      _error("Call through pointer to void function not allowed in "
+             "expression.", fnCall->line());
+      return false;
+    }
+  }
   // Validate the expression for further errors.
   if (!_validate()) {
     return false;
@@ -596,218 +852,568 @@ bool ExprToken::parse(
 }
 
 /**
- * Validate the assignments in the expression, make sure that we only
- * assign to types that can be assigned to.
+ * Parses the rest of a use of a function pointer variable. If the
+ * variable is an array, it may be indexed first. If a parenthesized
+ * argument list follows, this is a call through the pointer.
  */
-bool ExprToken::_validate() {
-  std::stack<std::string> operands;
-  for (auto token : _postfix) {
-    auto op = std::dynamic_pointer_cast<OperatorToken>(token);
-    if (std::dynamic_pointer_cast<LiteralToken>(token) ||
-        std::dynamic_pointer_cast<FunctionCallToken>(token)) {
-      operands.push("rvalue");
-    } else if (std::dynamic_pointer_cast<GlobalVarToken>(token) ||
-               std::dynamic_pointer_cast<ParamToken>(token) ||
-               std::dynamic_pointer_cast<LocalVarToken>(token)) {
-      operands.push("lvalue");
-    } else if (nullptr != op) {
-      std::string rhs = operands.top();
-      operands.pop();
-      std::string lhs;
-      if (op->isBinary()) {
-        lhs = operands.top();
-        operands.pop();
-      }
-      std::string result;
-      if ("=" == op->str()) {
-        if ("rvalue" == lhs) {
-          _error("Can't assign to an rvalue in expression.", op->line());
-          return false;
-        }
-        result = "rvalue";
-      } else if ("*" == op->str() && op->isUnary()) {
-        result = "lvalue";
-      } else if ("&" == op->str() && op->isUnary()) {
-        if ("lvalue" != rhs) {
-          _error("Can't get address of an rvalue in expression.",
-                 op->line());
-          return false;
-        }
-        result = "rvalue";
-      } else if ("[" == op->str()) {
-        result = "lvalue";
-      } else {
-        result = "rvalue";
-      }
-      operands.push(result);
+bool ExprToken::_parseFunctionPointer(
+      Tokenizer *tokenizer,
+      const Postfix& var,
+      const TypeToken& varType,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
+  Postfix target = var;
+  TypeToken type = varType;
+  if (type.isArray() && "[" == tokenizer->peekNext().str()) {
+    OperatorToken op;
+    op.parse(tokenizer->getNext());
+    op.setBinary();
+    ExprToken index;
+    if (!index.parse(tokenizer, functions, globals, parameters, localVars) ||
+        !_expect(tokenizer, "]")) {
+      return false;
     }
+    target.append(index.postfix());
+    target.push(op);
+    type = type.elementType();
+  }
+  if (type.isArray() || "(" != tokenizer->peekNext().str()) {
+    _postfix.append(target);
+    return true;
   }
+  std::shared_ptr<FunctionCallToken> fnCall(new FunctionCallToken());
+  if (!fnCall->parseIndirect(tokenizer,
+                             std::make_shared<ExprToken>(target, type), type,
+                             functions, globals, parameters, localVars)) {
+    return false;
+  }
+  _postfix.push(fnCall);
   return true;
 }
 
 /**
- * Tries to evaluate the expression as if it were constant, setting
- * _const appropriately and _value if succesful. Warns of certain errors
- * like divide by zero.
+ * Validate the assignments in the expression, make sure that we only
+ * assign to types that can be assigned to. Function pointers can only be
+ * assigned addresses of functions with the same signature. Where uint16
+ * and fix8_8 values meet, the uint16 value is converted to fix8_8, except
+ * that a fix8_8 value can be multiplied or divided by a uint16 one
+ * directly.
  */
-void ExprToken::_evaluate() {
-  // Evaluate the postfix expression
-  std::stack<std::shared_ptr<Token>> operands;
-  for (auto token : _postfix) {
-    auto op = std::dynamic_pointer_cast<OperatorToken>(token);
-    if (std::dynamic_pointer_cast<LiteralToken>(token) ||
-        std::dynamic_pointer_cast<GlobalVarToken>(token)) {
-      operands.push(token);
-    } else if (std::dynamic_pointer_cast<ParamToken>(token) ||
-               std::dynamic_pointer_cast<LocalVarToken>(token) ||
-               std::dynamic_pointer_cast<FunctionCallToken>(token)) {
-      // We don't know parameter or local variable values at
-      // compile time, nor do we know the output of functions,
-      // so this expression can't be constant.
-      _const = false;
-      return;
-    } else if (nullptr != op) {
-      std::shared_ptr<Token> rhs = operands.top();
-      operands.pop();
-      std::shared_ptr<Token> lhs;
-      if (op->isBinary()) {
-        lhs = operands.top();
-        operands.pop();
-      } else {
-        lhs = nullptr;
+bool ExprToken::_validate() {
+  // Each operand is an lvalue or an rvalue of some type, and starts at
+  // some position in the copy of the tokens.
+  struct Value {
+    bool lvalue;
+    TypeToken type;
+    size_t start;
+    /**
+     * The compressed global array this is, which can't be indexed, or
+     * null.
+     */
+    std::shared_ptr<GlobalVarToken> compressed;
+  };
+  // The postfix tokens are copied so that conversions can be inserted
+  // after operands.
+  Postfix postfix;
+  TypeToken fixedType("fix8_8");
+  TypeToken intType("uint16");
+  auto leaf = [&](size_t i, Value& value) {
+    auto var = _postfix.variable(i);
+    auto fnCall = _postfix.call(i);
+    auto address = _postfix.functionAddress(i);
+    value.start = postfix.size();
+    value.lvalue = nullptr != var;
+    value.compressed = nullptr;
+    auto global = _postfix.global(i);
+    if (nullptr != global && global->isCompressed()) {
+      // The elements of a compressed array are only in memory once they
+      // have been expanded into a buffer.
+      value.lvalue = false;
+      value.compressed = global;
+    }
+    if (nullptr != fnCall) {
+      value.type = fnCall->type();
+    } else if (nullptr != address) {
+      value.type = address->function()->pointerType();
+    } else if (nullptr != var) {
+      value.type = var->type();
+    } else {
+      value.type = Postfix::FIXED_LITERAL == _postfix.kind(i) ? fixedType
+                                                              : intType;
+    }
+    postfix.push(_postfix, i);
+    return true;
+  };
+  auto apply = [&](size_t i, Value& lhs, Value& rhs, Value& result) {
+    OperatorToken op = _postfix.op(i);
+    TypeToken& lhsType = lhs.type;
+    TypeToken& rhsType = rhs.type;
+    size_t rhsStart = rhs.start;
+    size_t lhsStart = op.isBinary() ? lhs.start : rhsStart;
+    // Converts the right hand side, or the left hand side, which ends
+    // where the right hand side starts.
+    auto convertRhs = [&](const TypeToken& type) {
+      postfix.push(OperatorToken(type, op.line()));
+      rhsType = type;
+    };
+    auto convertLhs = [&](const TypeToken& type) {
+      postfix.insert(rhsStart, OperatorToken(type, op.line()));
+      lhsType = type;
+    };
+    bool lhsFixed = lhsType.isFixed();
+    bool rhsFixed = rhsType.isFixed();
+    bool lvalue = false;
+    TypeToken resultType("uint16");
+    if ("=" == op.str()) {
+      if (!lhs.lvalue) {
+        _error("Can't assign to an rvalue in expression.", op.line());
+        return false;
+      } else if (!lhsType.canHold(rhsType)) {
+        _error("Can't assign '" + rhsType.signature() + "' to '" +
+               lhsType.signature() + "' in expression.", op.line());
+        return false;
+      } else if (lhsFixed != rhsFixed && !lhsType.isFunction()) {
+        convertRhs(lhsFixed ? fixedType : intType);
+      }
+      resultType = lhsType;
+    } else if ("*" == op.str() && op.isUnary()) {
+      lvalue = true;
+    } else if ("&" == op.str() && op.isUnary()) {
+      if (!rhs.lvalue) {
+        _error("Can't get address of an rvalue in expression.",
+               op.line());
+        return false;
+      }
+    } else if ("[" == op.str()) {
+      if (nullptr != lhs.compressed) {
+        _error("Compressed array '" + lhs.compressed->name() + "' must be "
+               "expanded with decompress() before it is indexed.",
+               op.line());
+        return false;
       }
-      uint16_t result;
-      // If using assignment, dereferencing, or address-of, this
-      // expression is not considered constant.
-      if (("=" == op->str() && op->isBinary()) ||
-          (("&" == op->str() || "*" == op->str()) && op->isUnary())) {
-        _const = false;
-        return;
-      } else if ("[" == op->str() && op->isBinary()) {
-        auto global = std::dynamic_pointer_cast<GlobalVarToken>(lhs);
-        if (nullptr == global) {
-          _const = false;
-          return;
+      lvalue = true;
+      if (lhsType.isArray()) {
+        resultType = lhsType.elementType();
+      }
+      if (rhsFixed) {
+        convertRhs(intType);
+      }
+    } else if ("(fix8_8)" == op.str() || "(uint16)" == op.str()) {
+      // Conversions inserted by an earlier pass over the tokens.
+      resultType = "(fix8_8)" == op.str() ? fixedType : intType;
+    } else if (op.isUnary()) {
+      if ("!" != op.str() && rhsFixed) {
+        resultType = rhsType;
+      }
+    } else if ((lhsFixed || rhsFixed) &&
+               "&&" != op.str() && "||" != op.str()) {
+      resultType = fixedType;
+      op.setArithmetic(SIGNED_ARITHMETIC);
+      if ("%" == op.str()) {
+        _error("Operator '%' can't be used with fix8_8 values.",
+               op.line());
+        return false;
+      } else if ("*" == op.str()) {
+        // Multiplying by a uint16 value only scales the fix8_8 value.
+        if (lhsFixed && rhsFixed) {
+          op.setArithmetic(FIXED_ARITHMETIC);
         }
-        if (!global->isArray()) {
-          _const = false;
-          return;
-        } else if (global->arraySize() <= rhs->val()) {
-          _warn("Array index out of bounds in expression.", _lineNum);
-          _const = false;
-          return;
+      } else if ("/" == op.str()) {
+        if (!lhsFixed) {
+          convertLhs(fixedType);
+        }
+        if (rhsFixed) {
+          op.setArithmetic(FIXED_ARITHMETIC);
+        }
+      } else if ("<<" == op.str() || ">>" == op.str()) {
+        // The shift amount is a uint16 value.
+        if (rhsFixed) {
+          convertRhs(intType);
+        }
+        if (!lhsFixed) {
+          op.setArithmetic(UNSIGNED_ARITHMETIC);
+          resultType = intType;
         }
-        result = global->arrayVal(rhs->val());
       } else {
-        result = op->operate(lhs ? lhs->val() : 0, rhs->val());
+        if (!lhsFixed) {
+          convertLhs(fixedType);
+        } else if (!rhsFixed) {
+          convertRhs(fixedType);
+        }
+        if ("<" == op.str() || "<=" == op.str() || ">" == op.str() ||
+            ">=" == op.str() || "==" == op.str() || "!=" == op.str()) {
+          resultType = intType;
+        }
       }
-      operands.push(std::shared_ptr<Token>(new LiteralToken(result)));
-    } else {
-      _const = false;
-      return;
     }
+    result.lvalue = lvalue;
+    result.type = resultType;
+    result.start = lhsStart;
+    result.compressed = nullptr;
+    postfix.push(op);
+    return true;
+  };
+  Value value;
+  if (!_postfix.walk(leaf, apply, value)) {
+    return false;
   }
-  _value = operands.top()->val();
+  _postfix = postfix;
+  _type = value.type;
+  return true;
 }
 
 /**
- * Flags variables used in this expression that are not able to be stored
- * in registers due to address-of operations.
+ * Converts the value of the expression to the given type by adding a
+ * conversion to the end of it, if the type is a fix8_8 value and the
+ * expression isn't or the other way around.
  */
-void ExprToken::_flagNonRegs() {
-  std::stack<std::shared_ptr<Token>> operands;
-  for (auto token : _postfix) {
-    auto op = std::dynamic_pointer_cast<OperatorToken>(token);
-    if (nullptr != op) {
-      std::shared_ptr<Token> rhs = operands.top();
-      operands.pop();
-      if (op->isBinary()) {
-        operands.pop();
+void ExprToken::convertTo(const TypeToken& type) {
+  TypeToken valueType = type.elementType();
+  if (valueType.isFixed() == _type.isFixed() || valueType.isFunction() ||
+      _type.isFunction()) {
+    return;
+  }
+  _postfix.push(OperatorToken(valueType, _lineNum));
+  _type = valueType;
+  _const = true;
+  _evaluate();
+}
+
+/**
+ * Tries to evaluate the expression as if it were constant, setting
+ * _const appropriately and _value if succesful. Warns of certain errors
+ * like divide by zero.
+ */
+void ExprToken::_evaluate() {
+  // Operands are literal values or global variables, which are constant
+  // as far as indexing into them at compile time goes.
+  struct Value {
+    uint16_t value;
+    std::shared_ptr<GlobalVarToken> global;
+  };
+  auto leaf = [&](size_t i, Value& value) {
+    auto global = _postfix.global(i);
+    if (nullptr != global && global->type().isFunction()) {
+      // The addresses of functions aren't known until the program has
+      // been assembled.
+      return false;
+    } else if (nullptr != global) {
+      value.value = global->val();
+      value.global = global;
+      return true;
+    } else if (_postfix.isLiteral(i)) {
+      value.value = _postfix.literal(i);
+      return true;
+    }
+    // We don't know parameter or local variable values at compile time,
+    // nor do we know the output of functions, so this expression can't be
+    // constant.
+    return false;
+  };
+  auto apply = [&](size_t i, Value& lhs, Value& rhs, Value& result) {
+    const OperatorToken& op = _postfix.op(i);
+    // If using assignment, dereferencing, or address-of, this
+    // expression is not considered constant.
+    if (("=" == op.str() && op.isBinary()) ||
+        (("&" == op.str() || "*" == op.str()) && op.isUnary())) {
+      return false;
+    } else if ("[" == op.str() && op.isBinary()) {
+      if (nullptr == lhs.global || !lhs.global->isArray()) {
+        return false;
+      } else if (lhs.global->arraySize() <= rhs.value) {
+        _warn("Array index out of bounds in expression.", _lineNum);
+        return false;
       }
-      // Check if it is an address-of operation
-      if (op->isUnary() && "&" == op->str()) {
-        auto var = std::dynamic_pointer_cast<Variable>(rhs);
-        if (nullptr != var) {
-          var->flagNonReg();
+      result.value = lhs.global->arrayVal(rhs.value);
+    } else {
+      result.value = op.operate(lhs.value, rhs.value);
+    }
+    return true;
+  };
+  Value value;
+  if (!_postfix.walk(leaf, apply, value)) {
+    _const = false;
+    return;
+  }
+  _value = value.value;
+}
+
+/**
+ * Flags variables used in this expression that are not able to be stored
+ * in registers due to address-of operations.
+ */
+void ExprToken::_flagNonRegs() {
+  auto leaf = [&](size_t i, std::shared_ptr<Variable>& var) {
+    var = _postfix.variable(i);
+    return true;
+  };
+  auto apply = [&](size_t i, std::shared_ptr<Variable>&,
+                   std::shared_ptr<Variable>& rhs,
+                   std::shared_ptr<Variable>&) {
+    // Check if it is an address-of operation
+    const OperatorToken& op = _postfix.op(i);
+    if (op.isUnary() && "&" == op.str() && nullptr != rhs) {
+      rhs->flagNonReg();
+    }
+    return true;
+  };
+  std::shared_ptr<Variable> var;
+  _postfix.walk(leaf, apply, var);
+}
+
+/**
+ * Tries to evaluate the expression using only literals and variables
+ * that are currently bound to values. Returns true and sets value if
+ * successful.
+ */
+bool ExprToken::evaluateBound(uint16_t& value) const {
+  if (_assumed) {
+    value = _assumedValue;
+    return true;
+  }
+  return _evaluateBound(0, _postfix.size(), value);
+}
+
+/**
+ * Evaluates the tokens of the postfix expression in [begin, end), treating
+ * literals and bound variables as known values. Returns false if anything
+ * else is encountered, or if the tokens don't form a single expression.
+ */
+bool ExprToken::_evaluateBound(size_t begin, size_t end,
+                               uint16_t& value) const {
+  auto leaf = [&](size_t i, uint16_t& operand) {
+    auto var = _postfix.variable(i);
+    if (_postfix.isLiteral(i)) {
+      operand = _postfix.literal(i);
+    } else if (nullptr != var && var->isBound()) {
+      operand = var->boundVal();
+    } else {
+      return false;
+    }
+    return true;
+  };
+  auto apply = [&](size_t i, uint16_t lhs, uint16_t rhs, uint16_t& result) {
+    const OperatorToken& op = _postfix.op(i);
+    if (!op.isFoldable(rhs)) {
+      return false;
+    }
+    result = op.operate(lhs, rhs);
+    return true;
+  };
+  return _postfix.walk(begin, end, leaf, apply, value);
+}
+
+/**
+ * Returns the function that the expression is the address of, either
+ * directly like "&func" or through a variable bound to it.
+ */
+std::shared_ptr<FunctionToken> ExprToken::evaluateFunction() const {
+  if (1 != _postfix.size()) {
+    return nullptr;
+  }
+  auto address = _postfix.functionAddress(0);
+  auto var = _postfix.variable(0);
+  if (nullptr != address) {
+    return address->function();
+  } else if (nullptr != var) {
+    return var->boundFunction();
+  }
+  return nullptr;
+}
+
+/**
+ * Returns true if the expression or one of its function call arguments
+ * assigns directly to the given variable.
+ */
+bool ExprToken::assigns(const Variable *var) const {
+  bool found = false;
+  auto leaf = [&](size_t i, const Variable *& operand) {
+    auto fnCall = _postfix.call(i);
+    if (nullptr != fnCall) {
+      std::vector<std::shared_ptr<ExprToken>> exprs;
+      fnCall->getExprs(exprs);
+      for (auto expr : exprs) {
+        if (expr->assigns(var)) {
+          found = true;
+          return false;
         }
       }
-      // Push something back onto the stack.
-      operands.push(nullptr);
-    } else {
-      operands.push(token);
     }
+    operand = _postfix.variable(i).get();
+    return true;
+  };
+  auto apply = [&](size_t i, const Variable *lhs, const Variable *,
+                   const Variable *&) {
+    const OperatorToken& op = _postfix.op(i);
+    if (op.isBinary() && "=" == op.str() && lhs == var) {
+      found = true;
+      return false;
+    }
+    return true;
+  };
+  const Variable *result = nullptr;
+  _postfix.walk(leaf, apply, result);
+  return found;
+}
+
+/**
+ * If the whole expression is a call like "likely(EXPR)" or
+ * "unlikely(EXPR)", returns LIKELY or UNLIKELY and sets hinted to EXPR.
+ * Otherwise returns UNPREDICTED and leaves hinted alone.
+ */
+Likelihood ExprToken::hint(std::shared_ptr<ExprToken>& hinted) const {
+  if (1 != _postfix.size()) {
+    return UNPREDICTED;
+  }
+  auto fnCall = _postfix.call(0);
+  if (!fnCall ||
+      ("likely" != fnCall->funcName() && "unlikely" != fnCall->funcName())) {
+    return UNPREDICTED;
   }
+  hinted = fnCall->getArg(0);
+  return "likely" == fnCall->funcName() ? LIKELY : UNLIKELY;
 }
 
 /**
- * Outputs assembly code to evaluate the given expression and store the
- * result in the given register, reg.
+ * Returns true if the expression has the same tokens as the other one,
+ * so that they compute the same value. Expressions with function calls
+ * are never the same.
  */
-void ExprToken::output(Parser *parser, const VarLocation& varLoc) {
-  // Evaluate the postfix expression using the stack, pushing nullptr
-  // as an operand where a temporary value would go (one that is
-  // not already represented by a Token).
-  std::stack<Operand> operands;
-  for (auto token : _postfix) {
-    auto op = std::dynamic_pointer_cast<OperatorToken>(token);
-    auto global = std::dynamic_pointer_cast<GlobalVarToken>(token);
-    auto var = std::dynamic_pointer_cast<Variable>(token);
-    auto literal = std::dynamic_pointer_cast<LiteralToken>(token);
-    auto fnCall = std::dynamic_pointer_cast<FunctionCallToken>(token);
-    if (nullptr != op) {
-      // Pop one or two operands off the stack, depending on if the
-      // operator is unary or binary. Then output the operation in
-      // assembly.
-      Operand rhs = operands.top();
-      operands.pop();
-      Operand lhs;
-      if (op->isBinary()) {
-        lhs = operands.top();
-        operands.pop();
+bool ExprToken::sameAs(const ExprToken& other) const {
+  const Postfix& otherPostfix = other._postfix;
+  if (_postfix.size() != otherPostfix.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < _postfix.size(); i++) {
+    bool literal = _postfix.isLiteral(i);
+    bool otherLiteral = otherPostfix.isLiteral(i);
+    bool op = _postfix.isOperator(i);
+    bool otherOp = otherPostfix.isOperator(i);
+    if (literal || otherLiteral) {
+      if (!literal || !otherLiteral ||
+          _postfix.literal(i) != otherPostfix.literal(i)) {
+        return false;
       }
-      Operand result = op->output(parser, lhs, rhs);
-      operands.push(result);
-    } else if (nullptr != global) {
-      // Push the address onto the stack.
-      parser->writeInst("MOVI L " + global->name());
-      parser->writeInst("PUSH L");
-      operands.push(Operand(OperandType::ADDRESS));
-    } else if (nullptr != var) {
-      // Push nothing onto the stack for a register, or the address onto the
-      // stack for a variable on the stack.
-      if (var->isReg()) {
-        operands.push(Operand(OperandType::REGISTER, var->getReg()));
-      } else {
-        // Get the variable's location into register M
-        parser->writeInst("MOV M FP");
-        int offset = var->getOffset();
-        if (0 != offset) {
-          parser->writeInst("MOVI L " + toHexStr(0 < offset ? offset : -offset));
-          if (0 < offset) {
-            parser->writeInst("ADD M L");
-          } else {
-            parser->writeInst("SUB M L");
-          }
-        }
-        // Push the address onto the stack.
-        parser->writeInst("PUSH M");
-        operands.push(Operand(OperandType::ADDRESS));
+    } else if (op || otherOp) {
+      if (!op || !otherOp ||
+          _postfix.op(i).str() != otherPostfix.op(i).str() ||
+          _postfix.op(i).isBinary() != otherPostfix.op(i).isBinary() ||
+          _postfix.op(i).arithmetic() != otherPostfix.op(i).arithmetic()) {
+        return false;
       }
-    } else if (nullptr != literal) {
-      // Don't do anything with the stack, we can save this literal for
-      // later use.
-      operands.push(Operand(OperandType::LITERAL, literal->val()));
-    } else if (nullptr != fnCall) {
-      // Get the result of the function call and push it onto the stack.
-      fnCall->output(parser);
-      parser->writeInst("PUSH L");
-      // The result of a function call is a value token.
-      operands.push(Operand(OperandType::VALUE));
+    } else if (!_postfix.isVariable(i) ||
+               _postfix.symbol(i) != otherPostfix.symbol(i)) {
+      return false;
     }
   }
+  return true;
+}
+
+/**
+ * If the expression is a plain assignment like "x = EXPR" and x is a
+ * local variable or parameter, returns x.
+ * Otherwise returns a null pointer.
+ */
+std::shared_ptr<Variable> ExprToken::assignedVar() const {
+  if (_postfix.size() < 3) {
+    return nullptr;
+  }
+  size_t last = _postfix.size() - 1;
+  if (!_postfix.isOperator(last) || "=" != _postfix.op(last).str() ||
+      !_postfix.op(last).isBinary()) {
+    return nullptr;
+  }
+  // The tokens between the first and last must form the right hand side
+  // on their own, otherwise the first token is only part of a larger
+  // left hand side like "x[i]".
+  int depth = 0;
+  for (size_t i = 1; i < last; i++) {
+    if (!_postfix.isOperator(i)) {
+      depth++;
+    } else if (_postfix.op(i).isBinary()) {
+      depth--;
+    }
+    if (depth < 1) {
+      return nullptr;
+    }
+  }
+  if (1 != depth || _postfix.global(0)) {
+    return nullptr;
+  }
+  return _postfix.variable(0);
+}
+
+/**
+ * For a plain assignment like "x = EXPR", tries to evaluate EXPR in the
+ * same way as evaluateBound().
+ */
+bool ExprToken::evaluateAssignedBound(uint16_t& value) const {
+  if (!assignedVar()) {
+    return false;
+  }
+  return _evaluateBound(1, _postfix.size() - 1, value);
+}
+
+/**
+ * Appends the function calls made by this expression, including calls
+ * nested in the arguments of other calls, to calls.
+ */
+void ExprToken::getCalls(
+      std::vector<std::shared_ptr<FunctionCallToken>>& calls) const {
+  for (size_t i = 0; i < _postfix.size(); i++) {
+    auto fnCall = _postfix.call(i);
+    if (nullptr != fnCall) {
+      calls.push_back(fnCall);
+      std::vector<std::shared_ptr<ExprToken>> exprs;
+      fnCall->getExprs(exprs);
+      for (auto expr : exprs) {
+        expr->getCalls(calls);
+      }
+    }
+  }
+}
+
+/**
+ * Appends the functions whose addresses are taken by this expression,
+ * including in the arguments of the calls it makes, to functions.
+ */
+void ExprToken::getFunctionAddresses(
+      std::vector<std::shared_ptr<FunctionToken>>& functions) const {
+  std::vector<std::shared_ptr<FunctionCallToken>> calls;
+  this->getCalls(calls);
+  std::vector<std::shared_ptr<ExprToken>> callExprs;
+  for (auto call : calls) {
+    call->getExprs(callExprs);
+  }
+  std::vector<const ExprToken *> exprs = { this };
+  for (auto expr : callExprs) {
+    exprs.push_back(expr.get());
+  }
+  for (auto expr : exprs) {
+    for (size_t i = 0; i < expr->_postfix.size(); i++) {
+      auto address = expr->_postfix.functionAddress(i);
+      if (nullptr != address) {
+        functions.push_back(address->function());
+      }
+    }
+  }
+}
+
+/**
+ * Outputs assembly code to evaluate the given expression and store the
+ * result in the given register, reg.
+ */
+void ExprToken::output(Parser *parser, const VarLocation& varLoc) {
+  parser->setSourceLine(_lineNum);
+  // Choose the instructions for the expression tree. The result is left
+  // on the stack or somewhere that doesn't need code, like a literal.
+  Selector selector(parser);
+  Operand result = selector.output(selector.build(_postfix));
   // Move the evaluated expression output to the given variable location.
   if (varLoc.isReg()) {
-    operandValueToReg(parser, operands.top(), varLoc.getReg());
+    operandValueToReg(parser, result, varLoc.getReg());
   } else {
     // Get the variable's address in a register so that we can store to
     // that address.
@@ -824,14 +1430,41 @@ void ExprToken::output(Parser *parser, const VarLocation& varLoc) {
     }
     // Pop the result from the expression and store it in the calculated
     // address.
-    operandValueToReg(parser, operands.top(), "L");
+    operandValueToReg(parser, result, REG_L);
     parser->writeInst("STOR L M");
   }
 }
 
+/**
+ * Outputs assembly code to evaluate the expression as a condition and
+ * jump to label if it is true, or if it is false when jumpIf is false.
+ * Comparisons jump on the flags they set instead of producing 0 or 1.
+ */
+void ExprToken::outputBranch(Parser *parser, bool jumpIf,
+                             const std::string& label) {
+  parser->setSourceLine(_lineNum);
+  Selector selector(parser);
+  selector.outputBranch(selector.build(_postfix), jumpIf, label);
+}
+
+/**
+ * Returns true if the expression is constant or a lone variable that has
+ * been assigned a register.
+ */
+bool ExprToken::isSimple() const {
+  if (_const) {
+    return true;
+  } else if (1 != _postfix.size() || !_postfix.isVariable(0)) {
+    return false;
+  }
+  return _postfix.variable(0)->isReg();
+}
+
 /**
  * Parses an array expression like "{1,2,3}" where 1, 2, and 3 could
- * be an arbitrary non-array expression.
+ * be an arbitrary non-array expression. An element that is a lone literal,
+ * as in the data tables that take up most of the source of some programs,
+ * is kept as a literal instead of being parsed as an expression.
  */
 bool ArrayExprToken::parse(
       Tokenizer *tokenizer,
@@ -852,11 +1485,24 @@ bool ArrayExprToken::parse(
   }
   // Get any expressions we find, separated by commas
   while (true) {
-    std::shared_ptr<ExprToken> expr(new ExprToken());
-    if (!expr->parse(tokenizer, functions, globals, parameters, localVars)) {
-      return false;
+    Tokenizer::Position start = tokenizer->position();
+    LiteralToken literal;
+    if (literal.parse(tokenizer->getNext()) &&
+        ("," == tokenizer->peekNext().str() ||
+         "}" == tokenizer->peekNext().str())) {
+      _exprs.push_back(nullptr);
+      _literals.push_back(literal);
+    } else {
+      // Go back to the start of the element and parse all of it.
+      tokenizer->seek(start);
+      std::shared_ptr<ExprToken> expr(new ExprToken());
+      if (!expr->parse(tokenizer, functions, globals, parameters,
+                       localVars)) {
+        return false;
+      }
+      _exprs.push_back(expr);
+      _literals.push_back(LiteralToken());
     }
-    _exprs.push_back(expr);
     AtomToken next = tokenizer->getNext();
     if ("}" == next.str()) {
       break;
@@ -871,6 +1517,13 @@ bool ArrayExprToken::parse(
   return true;
 }
 
+std::shared_ptr<ExprToken> ArrayExprToken::get(int i) const {
+  if (this->isLiteral(i)) {
+    return std::make_shared<ExprToken>(_literals[i]);
+  }
+  return _exprs[i];
+}
+
 /**
  * Parses a function call within an expression. A function call is of the
  * form "FUNC_NAME ( [ARG_LIST] )", where ARG_LIST is an optional
@@ -900,6 +1553,67 @@ bool FunctionCallToken::parse(
     _error("Function '" + _funcName + "' does not exist.", _lineNum);
     return false;
   }
+  _type = function->type();
+  // A coroutine with more than one instance is resumed like "f[i](x)",
+  // where i is the index of the instance.
+  if (function->isCoroutine() && 1 < function->instances()) {
+    if (!_expect(tokenizer, "[")) {
+      return false;
+    }
+    _instance = std::shared_ptr<ExprToken>(new ExprToken());
+    if (!_instance->parse(tokenizer, functions, globals, parameters,
+                          localVars)) {
+      return false;
+    } else if (!_expect(tokenizer, "]")) {
+      return false;
+    }
+  }
+  if (!_parseArgs(tokenizer, function->pointerType(), functions, globals,
+                  parameters, localVars)) {
+    return false;
+  }
+  // Make sure this is not a call to "void main()", which is illegal.
+  if ("main" == function->name() && "void" == function->type().name() &&
+      0 == function->numParams()) {
+    _error("Illegal call to 'void main()', the entry point cannot be called "
+	   "from within the program.",
+	   _lineNum);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Parses a call through a function pointer, like "f(x)" or "table[i](x)",
+ * where the tokens before the argument list have already been parsed into
+ * the target expression.
+ */
+bool FunctionCallToken::parseIndirect(
+      Tokenizer *tokenizer,
+      const std::shared_ptr<ExprToken>& target,
+      const TypeToken& targetType,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
+  _lineNum = target->line();
+  _target = target;
+  _type = targetType.returnType();
+  return _parseArgs(tokenizer, targetType, functions, globals, parameters,
+                    localVars);
+}
+
+/**
+ * Parses a parenthesized, comma-separated list of argument expressions and
+ * checks that they match the parameters of the given function type.
+ */
+bool FunctionCallToken::_parseArgs(
+      Tokenizer *tokenizer,
+      const TypeToken& functionType,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
   // The next token should be an open parenthesis.
   if (!_expect(tokenizer, "(")) {
     return false;
@@ -925,20 +1639,23 @@ bool FunctionCallToken::parse(
     return false;
   }
   // Check that the number of parameters is correct.
-  if (this->numArgs() != function->numParams()) {
+  if (this->numArgs() != functionType.numParams()) {
     _error("Invalid function call, expected " +
-           std::to_string(function->numParams()) + " arguments but got " +
+           std::to_string(functionType.numParams()) + " arguments but got " +
            std::to_string(this->numArgs()) + ".",
            _lineNum);
     return false;
   }
-  // Make sure this is not a call to "void main()", which is illegal.
-  if ("main" == function->name() && "void" == function->type().name() &&
-      0 == function->numParams()) {
-    _error("Illegal call to 'void main()', the entry point cannot be called "
-	   "from within the program.",
-	   _lineNum);
-    return false;
+  // Check that function pointer arguments have the right signatures.
+  for (size_t i = 0; i < _arguments.size(); i++) {
+    TypeToken paramType = functionType.paramType(i);
+    if (!paramType.canHold(_arguments[i]->type())) {
+      _error("Invalid function call, can't pass '" +
+             _arguments[i]->type().signature() + "' as '" +
+             paramType.signature() + "'.", _arguments[i]->line());
+      return false;
+    }
+    _arguments[i]->convertTo(paramType);
   }
   return true;
 }
@@ -951,12 +1668,11 @@ void FunctionCallToken::output(Parser *parser) {
   // output will look different (with no CALL instruction).
   if ("COLOR" == _funcName) {
     // Signature is "void COLOR(uint16 color)"
-    _arguments[0]->output(parser, VarLocation("M"));
+    _arguments[0]->output(parser, VarLocation(REG_M));
     parser->writeInst("COLOR M");
   } else if ("PIXEL" == _funcName) {
     // Signature is "void PIXEL(uint16 x, uint16 y)"
-    _arguments[0]->output(parser, VarLocation("M"));
-    _arguments[1]->output(parser, VarLocation("N"));
+    this->_outputArgsToMN(parser);
     parser->writeInst("PIXEL M N");
   } else if ("TIMERST" == _funcName) {
     // Signatue is "void TIMERST()"
@@ -966,41 +1682,155 @@ void FunctionCallToken::output(Parser *parser) {
     parser->writeInst("TIME L");
   } else if ("INPUT" == _funcName) {
     // Signature is "uint16 INPUT(uint16 input_id)"
-    _arguments[0]->output(parser, VarLocation("M"));
+    _arguments[0]->output(parser, VarLocation(REG_M));
     parser->writeInst("INPUT L M");
   } else if ("RND" == _funcName) {
     // Signature is "uint16 RND()"
     parser->writeInst("RND L");
+  } else if ("decompress" == _funcName) {
+    // Signature is "void decompress(uint16 src, uint16 dest)", and the
+    // routine is output after the functions.
+    this->_outputArgsToMN(parser);
+    parser->writeInst("CALL " + parser->decompressLabel());
+  } else if ("ABS" == _funcName) {
+    // Signature is "uint16 ABS(uint16 value)"
+    std::string done = parser->getUnusedLabel("abs_done");
+    _arguments[0]->output(parser, VarLocation(REG_M));
+    parser->writeInst("MOV L M");
+    parser->writeInst("TST L L");
+    parser->writeInst("JNS " + done);
+    parser->writeInst("MOVI L 0x0");
+    parser->writeInst("SUB L M");
+    parser->writeln(done + ":");
+  } else if ("MIN" == _funcName || "MAX" == _funcName) {
+    // Signature is "uint16 MIN(uint16 a, uint16 b)"
+    std::string done = parser->getUnusedLabel("min_max_done");
+    this->_outputArgsToMN(parser);
+    parser->writeInst("MOV L M");
+    parser->writeInst("CMP M N");
+    parser->writeInst(("MIN" == _funcName ? "JB " : "JAE ") + done);
+    parser->writeInst("MOV L N");
+    parser->writeln(done + ":");
+  } else if ("likely" == _funcName || "unlikely" == _funcName) {
+    // Signature is "uint16 likely(uint16 cond)". The hint only matters
+    // to branches that test it directly.
+    _arguments[0]->output(parser, VarLocation(REG_L));
   } else {
-    // Save registers A through D if we are using them as arguments.
-    std::stack<std::string> savedRegisters;
-    std::string reg = "A";
-    for (size_t i = 0; i < 4 && i < _arguments.size(); i++, reg[0]++) {
-      parser->writeInst("PUSH " + reg);
-      savedRegisters.push(reg);
-    }
-    // Evaluate up to the first four arguments and store them in registers
-    // A through D.
-    reg = "A";
-    for (size_t i = 0; i < 4 && i < _arguments.size(); i++, reg[0]++) {
-      _arguments[i]->output(parser, VarLocation(reg));
-    }
-    // Push any overflow arguments onto the stack. In reverse order so that
-    // it matches the callee's expectations of the order.
-    for (int i = _arguments.size() - 1; 4 <= i; i--) {
-      _arguments[i]->output(parser, VarLocation("L"));
+    // A call through a pointer that is known to hold the address of a
+    // function is made directly.
+    std::string funcName = _funcName;
+    if (_target && _target->evaluateFunction()) {
+      funcName = _target->evaluateFunction()->name();
+    }
+    // Save the argument registers, A through D by default, if we are
+    // using them as arguments.
+    const Machine& machine = Machine::current();
+    const std::vector<Reg>& argRegs = machine.argRegisters();
+    int numArgRegs = std::min(argRegs.size(), _arguments.size());
+    for (int i = 0; i < numArgRegs; i++) {
+      parser->writeInst("PUSH " + machine.regName(argRegs[i]));
+    }
+    // Calls through a pointer pass the address of the function in M, and
+    // calls to a coroutine pass the index of the instance to resume.
+    std::shared_ptr<ExprToken> mValue = funcName.empty() ? _target
+                                                         : _instance;
+    if (mValue) {
+      // Push any overflow arguments onto the stack, then the value for M.
+      // It is evaluated before the argument registers are overwritten,
+      // since it may depend on them.
+      for (int i = _arguments.size() - 1; numArgRegs <= i; i--) {
+        _arguments[i]->output(parser, VarLocation(REG_L));
+        parser->writeInst("PUSH L");
+      }
+      mValue->output(parser, VarLocation(REG_L));
       parser->writeInst("PUSH L");
+      for (int i = 0; i < numArgRegs; i++) {
+        _arguments[i]->output(parser, VarLocation(argRegs[i]));
+      }
+      parser->writeInst("POP M");
+    }
+    if (funcName.empty()) {
+      // There is no indirect CALL instruction, so push the return address
+      // and jump to the function.
+      std::string returnLabel = parser->getUnusedLabel("indirect_return");
+      parser->writeInst("MOVI L " + returnLabel);
+      parser->writeInst("PUSH L");
+      parser->writeInst("JMP M");
+      parser->writeln(returnLabel + ":");
+    } else {
+      if (!mValue) {
+        // Evaluate the first arguments and store them in the argument
+        // registers.
+        for (int i = 0; i < numArgRegs; i++) {
+          _arguments[i]->output(parser, VarLocation(argRegs[i]));
+        }
+        // Push any overflow arguments onto the stack. In reverse order so
+        // that it matches the callee's expectations of the order.
+        for (int i = _arguments.size() - 1; numArgRegs <= i; i--) {
+          _arguments[i]->output(parser, VarLocation(REG_L));
+          parser->writeInst("PUSH L");
+        }
+      }
+      // Call the function, noting the runtime routines that are used.
+      if (isRuntimeRoutine(funcName)) {
+        funcName = parser->runtimeLabel(funcName);
+      }
+      parser->writeInst("CALL " + funcName);
     }
-    // Call the function
-    parser->writeInst("CALL " + _funcName);
     // Restore registers A through D if they were used as arguments.
-    while (!savedRegisters.empty()) {
-      parser->writeInst("POP " + savedRegisters.top());
-      savedRegisters.pop();
+    for (int i = numArgRegs - 1; 0 <= i; i--) {
+      parser->writeInst("POP " + machine.regName(argRegs[i]));
     }
   }
 }
 
+/**
+ * Outputs the first argument into M and the second into N. Evaluating the
+ * second one can use M, so unless it is simple the first one waits on the
+ * stack.
+ */
+void FunctionCallToken::_outputArgsToMN(Parser *parser) {
+  if (_arguments[1]->isSimple()) {
+    _arguments[0]->output(parser, VarLocation(REG_M));
+    _arguments[1]->output(parser, VarLocation(REG_N));
+  } else {
+    _arguments[0]->output(parser, VarLocation(REG_L));
+    parser->writeInst("PUSH L");
+    _arguments[1]->output(parser, VarLocation(REG_N));
+    parser->writeInst("POP M");
+  }
+}
+
+/**
+ * Appends the expressions evaluated to make this call to exprs.
+ */
+void FunctionCallToken::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.insert(exprs.end(), _arguments.begin(), _arguments.end());
+  if (_target) {
+    exprs.push_back(_target);
+  }
+  if (_instance) {
+    exprs.push_back(_instance);
+  }
+}
+
+/**
+ * Makes this call target the function with the given name instead,
+ * removing the arguments at the given indices.
+ */
+void FunctionCallToken::redirect(const std::string& funcName,
+                                 const std::vector<size_t>& removed) {
+  _funcName = funcName;
+  std::vector<std::shared_ptr<ExprToken>> arguments;
+  for (size_t i = 0; i < _arguments.size(); i++) {
+    if (removed.end() == std::find(removed.begin(), removed.end(), i)) {
+      arguments.push_back(_arguments[i]);
+    }
+  }
+  _arguments = arguments;
+}
+
 /**
  * Parses a global variable declaration and possibly assignment.
  * Assigns a value to the global variable, either zero if not
@@ -1035,7 +1865,11 @@ bool GlobalVarToken::parse(
   AtomToken next = tokenizer->getNext();
   AtomToken last = next;
   if ("=" == next.str()) {
-    if (_type.isArray()) {
+    if (_type.isArray() && "embed" == tokenizer->peekNext().str()) {
+      if (!this->_parseEmbed(tokenizer)) {
+        return false;
+      }
+    } else if (_type.isArray()) {
       // Make sure array expression has as many values as the type
       // requires, and make sure they are all constant.
       ArrayExprToken arrayExpr;
@@ -1045,24 +1879,55 @@ bool GlobalVarToken::parse(
         _error("Array size mismatch.", _type.line());
         return false;
       }
+      bool fixed = _type.elementType().isFixed();
+      _arrayValues.reserve(arrayExpr.size());
+      _functions.reserve(arrayExpr.size());
       for (size_t i = 0; i < arrayExpr.size(); i++) {
+        // A literal of the element type is stored as it is, without
+        // building an expression for it.
+        if (arrayExpr.isLiteral(i) && fixed == arrayExpr.literal(i).isFixed()) {
+          _functions.push_back(nullptr);
+          _arrayValues.push_back(arrayExpr.literal(i).val());
+          continue;
+        }
         auto expr = arrayExpr.get(i);
-        if (!expr->isConst()) {
+        if (!_type.canHold(expr->type())) {
+          _error("Can't initialize '" + _type.signature() + "' with '" +
+                 expr->type().signature() + "'.", expr->line());
+          return false;
+        }
+        expr->convertTo(_type);
+        // The address of a function is stored before main() is called.
+        _functions.push_back(expr->evaluateFunction());
+        if (_functions.back()) {
+          _arrayValues.push_back(0);
+        } else if (!expr->isConst()) {
           _error("Global value must be known at compile time.", expr->line());
           return false;
+        } else {
+          _arrayValues.push_back(expr->val());
         }
-        _arrayValues.push_back(expr->val());
       }
     } else {
       // Not an array value, get the singleton initialization expression
       ExprToken expr;
       if (!expr.parse(tokenizer, functions, globals)) {
         return false;
+      } else if (!_type.canHold(expr.type())) {
+        _error("Can't initialize '" + _type.signature() + "' with '" +
+               expr.type().signature() + "'.", expr.line());
+        return false;
+      }
+      expr.convertTo(_type);
+      _functions.push_back(expr.evaluateFunction());
+      if (_functions.back()) {
+        _value = 0;
       } else if (!expr.isConst()) {
         _error("Global value must be known at compile time.", expr.line());
         return false;
+      } else {
+        _value = expr.val();
       }
-      _value = expr.val();
     }
     // This should be a semicolon
     last = tokenizer->getNext();
@@ -1082,6 +1947,89 @@ bool GlobalVarToken::parse(
   } else if (";" != last.str()) {
     _error("Unexpected token '" + last.str() + "', expected ';'.", last.line());
     return false;
+  } else if (_compressed && !this->_compress()) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reads the file named in an embed() initializer into the elements of
+ * this array.
+ */
+bool GlobalVarToken::_parseEmbed(Tokenizer *tokenizer) {
+  int line = tokenizer->getNext().line();
+  if (!_expect(tokenizer, "(")) {
+    return false;
+  }
+  AtomToken file = tokenizer->getNext();
+  const std::string& quoted = file.str();
+  if (quoted.size() < 2 || '"' != quoted.front() || '"' != quoted.back()) {
+    _error("Expected a file name in quotes after 'embed('.", file.line());
+    return false;
+  }
+  std::string filename = quoted.substr(1, quoted.size() - 2);
+  // Relative paths start from the directory of the source file.
+  const std::string& source = tokenizer->filename();
+  size_t slash = source.rfind('/');
+  if ('/' != filename.front() && std::string::npos != slash) {
+    filename = source.substr(0, slash + 1) + filename;
+  }
+  bool bigEndian = true;
+  bool packBytes = true;
+  while ("," == tokenizer->peekNext().str()) {
+    tokenizer->getNext();
+    AtomToken option = tokenizer->getNext();
+    if ("big" == option.str() || "little" == option.str()) {
+      bigEndian = "big" == option.str();
+    } else if ("words" == option.str() || "bytes" == option.str()) {
+      packBytes = "words" == option.str();
+    } else {
+      _error("Unknown embed() option '" + option.str() + "', expected "
+             "'big', 'little', 'words', or 'bytes'.", option.line());
+      return false;
+    }
+  }
+  if (!_expect(tokenizer, ")")) {
+    return false;
+  }
+  if (!readWords(filename, bigEndian, packBytes, _arrayValues)) {
+    _error("Unable to read embedded file '" + filename + "'.", line);
+    return false;
+  } else if (_arrayValues.size() > _type.arraySize()) {
+    _error("Embedded file '" + filename + "' has " +
+           std::to_string(_arrayValues.size()) + " elements, more than "
+           "the " + std::to_string(_type.arraySize()) + " of '" + _name +
+           "'.", line);
+    return false;
+  }
+  _arrayValues.resize(_type.arraySize(), 0);
+  return true;
+}
+
+/**
+ * Compresses the elements of this array with both encodings. An LZ stream
+ * is only kept if it is smaller, since an RLE stream is quicker to expand
+ * and doesn't need the copy part of the decompression routine.
+ */
+bool GlobalVarToken::_compress() {
+  if (!this->functions().empty()) {
+    _error("Compressed array '" + _name + "' can't hold function "
+           "addresses.", _lineNum);
+    return false;
+  }
+  _encoding = RLE_ENCODING;
+  _stream = compressWords(_arrayValues, RLE_ENCODING);
+  std::vector<uint16_t> lz = compressWords(_arrayValues, LZ_ENCODING);
+  if (lz.size() < _stream.size()) {
+    _encoding = LZ_ENCODING;
+    _stream.swap(lz);
+  }
+  if (_stream.size() >= _arrayValues.size()) {
+    _warn("Compressed array '" + _name + "' takes up " +
+          std::to_string(_stream.size()) + " words compressed, and " +
+          std::to_string(_arrayValues.size()) + " words uncompressed.",
+          _lineNum);
   }
   return true;
 }
@@ -1092,25 +2040,85 @@ bool GlobalVarToken::parse(
 void GlobalVarToken::output(Parser *parser) {
   // Write out a label for the global variable.
   parser->writeln(_name + ":");
-  if (_type.isArray()) {
+  if (_inBss) {
+    // The address of the elements is stored before main() is called.
+    parser->writeData(toHexStr(0), 1);
+  } else if (_type.isArray()) {
     // The address for the array's elements will be the current byte
     // position plus the instruction size.
-    parser->writeData(toHexStr(parser->getBytePos() + INST_SIZE), 1);
-    // Write out the array's elements as hex values.
+    parser->writeData(toHexStr(parser->getBytePos() +
+                               Machine::current().instSize()), 1);
+    // Write out the array's elements as hex values, or the stream they
+    // are compressed to.
+    const std::vector<uint16_t>& values = _compressed ? _stream
+                                                      : _arrayValues;
     std::string dataOutput;
-    for (size_t i = 0; i < _arrayValues.size(); i++) {
-      dataOutput += toHexStr(_arrayValues[i]);
-      if (i + 1 < _arrayValues.size()) {
-        dataOutput += " ";
+    dataOutput.reserve(7 * values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+      appendHexStr(dataOutput, values[i]);
+      if (i + 1 < values.size()) {
+        dataOutput += ' ';
       }
     }
-    parser->writeData(dataOutput, _arrayValues.size());
+    parser->writeData(dataOutput, values.size());
   } else {
     // Not an array, just write out the single hex value.
     parser->writeData(toHexStr(_value), 1);
   }
 }
 
+/**
+ * Outputs code that stores the addresses of the functions in the initial
+ * value of this global variable. Data can only be written as hex values,
+ * so the addresses are stored by the bootloader instead.
+ */
+void GlobalVarToken::outputFunctions(Parser *parser) {
+  const Machine& machine = Machine::current();
+  for (size_t i = 0; i < _functions.size(); i++) {
+    if (!_functions[i]) {
+      continue;
+    }
+    parser->writeInst("MOVI M " + _name);
+    if (_type.isArray()) {
+      // The elements start after the address of the array.
+      parser->writeInst("MOVI L " + toHexStr(machine.instSize() +
+                                             i * machine.dataSize()));
+      parser->writeInst("ADD M L");
+    }
+    parser->writeInst("MOVI L " + _functions[i]->name());
+    parser->writeInst("STOR L M");
+  }
+}
+
+/**
+ * Returns true if this is an array whose elements all start out as zero,
+ * including those that aren't initialized.
+ */
+bool GlobalVarToken::isZeroArray() const {
+  if (!_type.isArray() || !this->functions().empty() || _compressed) {
+    return false;
+  }
+  for (auto value : _arrayValues) {
+    if (0 != value) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns the functions whose addresses are in the initial value.
+ */
+std::vector<std::shared_ptr<FunctionToken>> GlobalVarToken::functions() const {
+  std::vector<std::shared_ptr<FunctionToken>> functions;
+  for (auto function : _functions) {
+    if (function) {
+      functions.push_back(function);
+    }
+  }
+  return functions;
+}
+
 /**
  * Parses out a type and a name for the parameter, making sure
  * the type is appropriate for a parameter and the name doesn't
@@ -1153,14 +2161,16 @@ bool ParamToken::parse(
 }
 
 /**
- * Parses a function's parameter signature and the function body.
+ * Parses a function's parameter signature and, unless parseBody is false,
+ * the function body.
  *
  * TODO: Allow function definitions.
  */
 bool FunctionToken::parse(
       Tokenizer *tokenizer,
       std::vector<std::shared_ptr<FunctionToken>>& functions,
-      std::vector<std::shared_ptr<GlobalVarToken>>& globals) {
+      std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      bool parseBody) {
   _lineNum = _type.line();
   // Validate the type
   if (_type.isArray()) {
@@ -1209,8 +2219,37 @@ bool FunctionToken::parse(
   }
   // Consume the closing parenthesis
   tokenizer->getNext();
+  // Coroutines receive all of their arguments in registers, so that they
+  // don't have to be found on the stack when resuming.
+  if (this->isCoroutine()) {
+    size_t numArgRegs = Machine::current().argRegisters().size();
+    if ("main" == _name) {
+      _error("The entry point 'main()' cannot be a coroutine.",
+             _type.line());
+      return false;
+    } else if (numArgRegs < _parameters.size()) {
+      _error("Coroutine '" + _name + "()' has more than " +
+             std::to_string(numArgRegs) + " parameters.", _type.line());
+      return false;
+    }
+  }
   // Add self to the functions list
   functions.push_back(shared_from_this());
+  if (!parseBody) {
+    return true;
+  }
+  return this->parseBody(tokenizer, functions, globals);
+}
+
+/**
+ * Parses the statements within the braces of the function body, then
+ * checks that the labels used by goto statements and label addresses
+ * exist.
+ */
+bool FunctionToken::parseBody(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals) {
   // Get the function body. Make sure it starts with a '{'.
   if (!_expect(tokenizer, "{")) {
     return false;
@@ -1251,137 +2290,522 @@ bool FunctionToken::parse(
   // Make sure all of the goto statements match up with a label.
   bool ret = true;
   for (auto gotoStatement : _gotos) {
-    if (!getLabel(gotoStatement->label(), _labels)) {
+    if (!gotoStatement->label().empty() &&
+        !getLabel(gotoStatement->label(), _labels)) {
       _error("Label '" + gotoStatement->label() + "' does not exist in "
              "function '" + _name + "' for goto statement.",
              gotoStatement->line());
       ret = false;
     }
   }
-  return ret;
+  // Look up the labels whose addresses are taken.
+  std::vector<std::shared_ptr<ExprToken>> exprs;
+  for (auto statement : _statements) {
+    collectExprs(statement, exprs);
+  }
+  for (auto expr : exprs) {
+    const Postfix& postfix = expr->postfix();
+    for (size_t i = 0; i < postfix.size(); i++) {
+      auto labelAddress = postfix.labelAddress(i);
+      if (!labelAddress) {
+        continue;
+      }
+      auto label = getLabel(labelAddress->name(), _labels);
+      if (!label) {
+        _error("Label '" + labelAddress->name() + "' does not exist in "
+               "function '" + _name + "' for label address.",
+               labelAddress->line());
+        ret = false;
+      }
+      labelAddress->setLabel(label);
+    }
+  }
+  return ret;
+}
+
+/**
+ * Outputs assembly code for this function.
+ */
+void FunctionToken::output(Parser *parser) {
+  // Check if this is a builtin function, in which case we should
+  // do nothing.
+  if (isBuiltin(_name)) {
+    return;
+  } else if (this->isSprite()) {
+    this->_outputSprite(parser);
+    return;
+  }
+  // Bind the parameters this function is specialized for to their
+  // values while it is output.
+  for (auto boundParam : _boundParams) {
+    boundParam.first->bind(boundParam.second);
+  }
+  for (auto boundParam : _boundFunctionParams) {
+    boundParam.first->bindFunction(boundParam.second);
+  }
+  if (this->isCoroutine()) {
+    _outputCoroutine(parser);
+    return;
+  }
+  // Create an end label for the function, so if we return we can jump
+  // to it without having to unwind the stack each time.
+  std::string endLabel = parser->getUnusedLabel(_name + "_end");
+  // Create a label for the function so that we can CALL it. The code
+  // that sets up and tears down the frame comes from the line that
+  // declares the function.
+  parser->setSourceLine(_lineNum);
+  parser->writeln(_name + ":");
+  // Assign registers or stack positions to parameters. Parameters can
+  // be stored in the machine's argument registers, "A" through "D" by
+  // default, and if there are more parameters they will be stored on the
+  // stack before the return address. The return address is stored at
+  // FP, so the first overflow parameter will be stored at -2, the next
+  // at -4, etc.
+  const Machine& machine = Machine::current();
+  const std::vector<Reg>& argRegs = machine.argRegisters();
+  size_t numArgRegs = 0;
+  int offset = -machine.addressSize();
+  int numOverflowParams = 0;
+  for (auto param : _parameters) {
+    if (numArgRegs < argRegs.size()) {
+      param->setReg(argRegs[numArgRegs++]);
+    } else {
+      // Parameters are shared with specialized copies of this function,
+      // where they may have been assigned a register.
+      param->setReg(NO_REG);
+      param->setOffset(offset);
+      offset -= machine.dataSize();
+      numOverflowParams++;
+    }
+  }
+  // Assign registers or stack positions to local variables. Local
+  // variables can be stored in the machine's local registers, "E"
+  // through "K" by default, and if there are more local variables than
+  // can fit in registers we store them as frame pointer offsets. The
+  // offset counts the bytes in use above the frame pointer, which points
+  // at the saved frame pointer, so each variable is stored DATA_SIZE
+  // bytes above the current offset.
+  const std::vector<Reg>& localRegs = machine.localRegisters();
+  size_t numLocalRegs = 0;
+  offset = 0;
+  int extraParamOffset = 0;
+  _savedRegisters.clear();
+  for (auto local : _localVars) {
+    if (numLocalRegs < localRegs.size() && local->canBeReg()) {
+      Reg reg = localRegs[numLocalRegs++];
+      local->setReg(reg);
+      // This is a callee-saved register, push it onto the stack and
+      // make a note that we need to pop it later.
+      parser->writeInst("PUSH " + machine.regName(reg));
+      _savedRegisters.insert(reg);
+      extraParamOffset -= machine.dataSize();
+    } else {
+      local->setReg(NO_REG);
+      local->setOffset(offset + machine.dataSize());
+      offset += machine.dataSize();
+    }
+    // If this is an array, reserve space for the array's data.
+    if (local->type().isArray()) {
+      // The data offset is at the current stack offset + DATA_SIZE.
+      // We must add DATA_SIZE because the stack pointer points at an
+      // address that's in use, and we want the next unused address.
+      local->setDataOffset(offset + machine.dataSize());
+      offset += local->type().arraySize() * machine.dataSize();
+    }
+  }
+  // Save the previous value of the frame pointer.
+  parser->writeInst("PUSH FP");
+  _savedRegisters.insert(REG_FP);
+  extraParamOffset -= machine.dataSize();
+  // Set the frame pointer to the stack's current location.
+  parser->writeInst("MOV FP SP");
+  // Reserve space for the local variable storage on the stack.
+  if (0 < offset) {
+    parser->writeInst("MOVI L " + toHexStr(offset));
+    parser->writeInst("ADD SP L");
+  }
+  // Store parameters on the stack if they are currently stored in
+  // registers but are flagged as needing their own address. Also fix
+  // offset for parameters on the stack based on the number of saved
+  // registers.
+  for (auto param : _parameters) {
+    if (param->isReg() && !param->canBeReg()) {
+      parser->writeInst("PUSH " + machine.regName(param->getReg()));
+      param->setOffset(offset + machine.dataSize());
+      offset += machine.dataSize();
+    } else if (!param->isReg()) {
+      param->setOffset(param->getOffset() + extraParamOffset);
+    }
+  }
+
+  // Outputs initial values of local variables.
+  for (auto local : _localVars) {
+    local->output(parser);
+  }
+
+  // Assign assembly-level labels to all label declarations.
+  for (auto label : _labels) {
+    std::string asmLabel = parser->getUnusedLabel(_name + "_" + label->name());
+    label->setAsmLabel(asmLabel);
+  }
+
+  // Output assembly code for the rest of the statement types.
+  outputStatements(parser, _statements, shared_from_this(), endLabel);
+
+  // Unwind the stack, popping the saved registers, then return.
+  // We have a label here so that when we have return statements
+  // they can jump here without having to unwind the stack in
+  // multiple places.
+  parser->setSourceLine(_lineNum);
+  parser->writeln(endLabel + ":");
+  parser->writeInst("MOV SP FP");
+  // The frame pointer was pushed last, after the local registers in the
+  // order they were assigned.
+  if (_savedRegisters.contains(REG_FP)) {
+    parser->writeInst("POP FP");
+  }
+  for (auto reg = localRegs.rbegin(); localRegs.rend() != reg; ++reg) {
+    if (_savedRegisters.contains(*reg)) {
+      parser->writeInst("POP " + machine.regName(*reg));
+    }
+  }
+  // If there are overflow parameters, pop them off the stack in
+  // addition to jumping to the return address.
+  if (0 < numOverflowParams) {
+    parser->writeInst("RET " + toHexStr(numOverflowParams *
+                                        machine.dataSize(), 2));
+  } else {
+    parser->writeInst("RET");
+  }
+  // Output the rarely run code that was moved out of the way, while the
+  // bound parameters still have their values.
+  parser->writeCold();
+  for (auto boundParam : _boundParams) {
+    boundParam.first->unbind();
+  }
+  for (auto boundParam : _boundFunctionParams) {
+    boundParam.first->unbind();
+  }
+}
+
+/**
+ * Returns the number of bytes in the frame record of one instance of this
+ * coroutine. The first word is the address to resume at, or zero if the
+ * coroutine should start from the beginning, followed by the local
+ * variables and the parameters whose addresses are taken.
+ */
+int FunctionToken::frameSize() const {
+  int words = 1;
+  for (auto local : _localVars) {
+    words++;
+    if (local->type().isArray()) {
+      words += local->type().arraySize();
+    }
+  }
+  for (auto param : _parameters) {
+    if (!param->canBeReg()) {
+      words++;
+    }
+  }
+  return words * Machine::current().dataSize();
+}
+
+/**
+ * Outputs the frame records of the instances of this coroutine, which
+ * start out zeroed so that each instance starts from the beginning.
+ */
+void FunctionToken::outputFrames(Parser *parser) {
+  if (!this->isCoroutine()) {
+    return;
+  }
+  _frameLabel = parser->getUnusedLabel(_name + "_frames");
+  parser->writeln(_frameLabel + ":");
+  int words = _instances * frameSize() / Machine::current().dataSize();
+  for (int i = 0; i < words; i++) {
+    parser->writeData(toHexStr(0), 1);
+  }
+}
+
+/**
+ * Outputs assembly code for this coroutine. The frame pointer points at
+ * the frame record of the instance being resumed, rather than at the
+ * stack, so that local variables keep their values between calls. The
+ * first word of the record holds the address of the code after the yield
+ * statement that last returned, which the coroutine jumps to.
+ */
+void FunctionToken::_outputCoroutine(Parser *parser) {
+  const Machine& machine = Machine::current();
+  std::string startLabel = parser->getUnusedLabel(_name + "_start");
+  std::string endLabel = parser->getUnusedLabel(_name + "_end");
+  parser->setSourceLine(_lineNum);
+  parser->writeln(_name + ":");
+  // Parameters are passed again each time the coroutine is resumed, so
+  // they are all in the argument registers.
+  const std::vector<Reg>& argRegs = machine.argRegisters();
+  for (size_t i = 0; i < _parameters.size(); i++) {
+    _parameters[i]->setReg(argRegs[i]);
+  }
+  // Point the frame pointer at the frame record of the instance, whose
+  // index is passed in M.
+  parser->writeInst("PUSH FP");
+  parser->writeInst("MOVI FP " + _frameLabel);
+  if (1 < _instances) {
+    // Scale the index by the size of a record with whatever the machine
+    // does best, like a shift for a power of two.
+    auto index = std::make_shared<ExprNode>(ExprNode::REGISTER);
+    index->reg = REG_M;
+    index->max = _instances - 1;
+    auto size = std::make_shared<ExprNode>(ExprNode::LITERAL);
+    size->value = size->min = size->max = frameSize();
+    auto offset = std::make_shared<ExprNode>(ExprNode::OPERATOR);
+    offset->op = "MUL";
+    offset->symbol = "*";
+    offset->kids = { index, size };
+    Selector selector(parser);
+    operandValueToReg(parser, selector.output(offset), REG_M);
+    parser->writeInst("ADD FP M");
+  }
+  // Local variables are stored after the resume address, with the data
+  // of arrays right after the variables themselves.
+  int offset = machine.dataSize();
+  for (auto local : _localVars) {
+    local->setReg(NO_REG);
+    local->setOffset(offset);
+    offset += machine.dataSize();
+    if (local->type().isArray()) {
+      local->setDataOffset(offset);
+      offset += local->type().arraySize() * machine.dataSize();
+    }
+  }
+  // Parameters that need their own address are copied into the frame
+  // record each time.
+  for (size_t i = 0; i < _parameters.size(); i++) {
+    if (!_parameters[i]->canBeReg()) {
+      _parameters[i]->setReg(NO_REG);
+      _parameters[i]->setOffset(offset);
+      parser->writeInst("MOVI L " + toHexStr(offset));
+      parser->writeInst("ADD L FP");
+      parser->writeInst("STOR " + machine.regName(argRegs[i]) + " L");
+      offset += machine.dataSize();
+    }
+  }
+  // Jump to where the instance last yielded, unless it is starting over.
+  parser->writeInst("LOAD M FP");
+  parser->writeInst("TST M M");
+  parser->writeInst("JEQ " + startLabel);
+  parser->writeInst("JMP M");
+  parser->writeln(startLabel + ":");
+  for (auto local : _localVars) {
+    local->output(parser);
+  }
+  for (auto label : _labels) {
+    std::string asmLabel = parser->getUnusedLabel(_name + "_" + label->name());
+    label->setAsmLabel(asmLabel);
+  }
+  outputStatements(parser, _statements, shared_from_this(), endLabel);
+  // Running off the end or returning makes the instance start over the
+  // next time it is called.
+  parser->writeln(endLabel + ":");
+  parser->writeInst("MOVI M " + toHexStr(0));
+  parser->writeInst("STOR M FP");
+  parser->writeInst("POP FP");
+  parser->writeInst("RET");
+  parser->writeCold();
+}
+
+/**
+ * Takes the pixels of the bitmap of a sprite, after checking that it is
+ * made of whole rows.
+ */
+bool FunctionToken::makeSprite(const GlobalVarToken& bitmap, size_t width,
+                               int transparent) {
+  _lineNum = bitmap.line();
+  if (!bitmap.isArray() || "uint16" != bitmap.type().elementType().name()) {
+    _error("Sprite '" + _name + "' must be a uint16 array.", _lineNum);
+    return false;
+  } else if (!bitmap.functions().empty()) {
+    _error("Sprite '" + _name + "' can't hold function addresses.",
+           _lineNum);
+    return false;
+  } else if (0 != bitmap.arraySize() % width) {
+    _error("Sprite '" + _name + "' has " +
+           std::to_string(bitmap.arraySize()) + " pixels, which aren't "
+           "whole rows of " + std::to_string(width) + ".", _lineNum);
+    return false;
+  }
+  _spriteWidth = width;
+  _transparent = transparent;
+  _spritePixels.reserve(bitmap.arraySize());
+  for (size_t i = 0; i < bitmap.arraySize(); i++) {
+    _spritePixels.push_back(bitmap.arrayVal(i));
+  }
+  return true;
+}
+
+/**
+ * Outputs the code for a sprite, which moves x and y from one pixel to
+ * the next instead of computing where each pixel is. The pixels are
+ * visited row by row, going back and forth so that moving to the next row
+ * is cheap. Visiting the pixels of each color in turn only changes the
+ * color once for each of them, which is worth the longer moves when the
+ * colors are mixed together, so whichever order takes fewer instructions
+ * is used.
+ */
+void FunctionToken::_outputSprite(Parser *parser) {
+  size_t height = _spritePixels.size() / _spriteWidth;
+  auto color = [&](size_t i) { return _spritePixels[i] & 0xff; };
+  auto visit = [&](int onlyColor, std::vector<size_t>& pixels) {
+    for (size_t row = 0; row < height; row++) {
+      for (size_t j = 0; j < _spriteWidth; j++) {
+        size_t col = 0 == row % 2 ? j : _spriteWidth - 1 - j;
+        size_t i = row * _spriteWidth + col;
+        if (_transparent != _spritePixels[i] &&
+            (-1 == onlyColor || onlyColor == color(i))) {
+          pixels.push_back(i);
+        }
+      }
+    }
+  };
+  std::vector<size_t> byRow;
+  visit(-1, byRow);
+  std::vector<size_t> byColor;
+  std::vector<bool> visited(0x100, false);
+  for (size_t i : byRow) {
+    if (!visited[color(i)]) {
+      visited[color(i)] = true;
+      visit(color(i), byColor);
+    }
+  }
+  std::vector<std::string> insts = this->_spriteInsts(byRow);
+  std::vector<std::string> colorInsts = this->_spriteInsts(byColor);
+  if (colorInsts.size() < insts.size()) {
+    insts.swap(colorInsts);
+  }
+  parser->setSourceLine(_lineNum);
+  parser->writeln(_name + ":");
+  for (const std::string& inst : insts) {
+    parser->writeInst(inst);
+  }
+  parser->writeInst("RET");
 }
 
 /**
- * Outputs assembly code for this function.
+ * Moves the x and y parameters to each pixel in turn, and draws it. M
+ * holds 1 for the moves to the next pixel over, and L holds the color and
+ * the length of the other moves.
  */
-void FunctionToken::output(Parser *parser) {
-  // Check if this is a builtin function, in which case we should
-  // do nothing.
-  if (isBuiltin(_name)) {
-    return;
+std::vector<std::string> FunctionToken::_spriteInsts(
+      const std::vector<size_t>& pixels) const {
+  const Machine& machine = Machine::current();
+  const std::vector<Reg>& argRegs = machine.argRegisters();
+  if (argRegs.size() < 2) {
+    throw "Sprites need at least two argument registers.";
   }
-  // Create an end label for the function, so if we return we can jump
-  // to it without having to unwind the stack each time.
-  std::string endLabel = parser->getUnusedLabel(_name + "_end");
-  // Create a label for the function so that we can CALL it.
-  parser->writeln(_name + ":");
-  // Assign registers or stack positions to parameters. Parameters can
-  // be stored in registers "A" through "D", and if there are more than
-  // 4 parameters they will be stored on the stack before the return
-  // address. The return address is stored at FP, so the first
-  // overflow parameter will be stored at -2, the next at -4, etc.
-  std::string reg = "A";
-  int offset = -ADDRESS_SIZE;
-  int numOverflowParams = 0;
-  for (auto param : _parameters) {
-    if (reg[0] <= 'D') {
-      param->setReg(reg);
-      reg[0]++;
-    } else {
-      param->setOffset(offset);
-      offset -= DATA_SIZE;
-      numOverflowParams++;
+  std::string x = machine.regName(argRegs[0]);
+  std::string y = machine.regName(argRegs[1]);
+  std::vector<std::string> insts;
+  bool usesOne = false;
+  auto move = [&](const std::string& reg, int distance) {
+    std::string inst = 0 < distance ? "ADD " : "SUB ";
+    if (1 == std::abs(distance)) {
+      insts.push_back(inst + reg + " M");
+      usesOne = true;
+    } else if (0 != distance) {
+      insts.push_back("MOVI L " + toHexStr(std::abs(distance)));
+      insts.push_back(inst + reg + " L");
     }
+  };
+  int col = 0;
+  int row = 0;
+  int color = -1;
+  for (size_t i : pixels) {
+    if (color != (_spritePixels[i] & 0xff)) {
+      color = _spritePixels[i] & 0xff;
+      insts.push_back("MOVI L " + toHexStr(color));
+      insts.push_back("COLOR L");
+    }
+    move(x, (int)(i % _spriteWidth) - col);
+    move(y, (int)(i / _spriteWidth) - row);
+    col = i % _spriteWidth;
+    row = i / _spriteWidth;
+    insts.push_back("PIXEL " + x + " " + y);
   }
-  // Assign registers or stack positions to local variables. Local
-  // variables can be stored in registers "E" through "K", and if there
-  // are more local variables than can fit in registers we store them
-  // as frame pointer offsets. The offset starts at 0 and increases from
-  // there.
-  reg = "E";
-  offset = 0;
-  int extraParamOffset = 0;
-  for (auto local : _localVars) {
-    if (reg[0] <= 'K' && local->canBeReg()) {
-      local->setReg(reg);
-      // This is a callee-saved register, push it onto the stack and
-      // make a note that we need to pop it later.
-      parser->writeInst("PUSH " + reg);
-      _savedRegisters.push(reg);
-      extraParamOffset -= DATA_SIZE;
-      // Increment the register
-      reg[0]++;
+  if (usesOne) {
+    insts.insert(insts.begin(), "MOVI M " + toHexStr(1));
+  }
+  return insts;
+}
+
+/**
+ * Creates a copy of this function with the given name where the
+ * parameters at the given indices are bound to constant values, or to
+ * functions for function pointer parameters.
+ */
+std::shared_ptr<FunctionToken> FunctionToken::specialize(
+      const std::string& name,
+      const std::vector<std::pair<size_t, uint16_t>>& constParams,
+      const std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>&
+        functionParams) const {
+  std::shared_ptr<FunctionToken> func(new FunctionToken(*this));
+  func->_name = name;
+  func->_parameters.clear();
+  func->_unrollLoops = true;
+  for (size_t i = 0; i < _parameters.size(); i++) {
+    auto constParam = std::find_if(
+          constParams.begin(), constParams.end(),
+          [i](const std::pair<size_t, uint16_t>& p) { return i == p.first; });
+    auto functionParam = std::find_if(
+          functionParams.begin(), functionParams.end(),
+          [i](const std::pair<size_t, std::shared_ptr<FunctionToken>>& p) {
+            return i == p.first;
+          });
+    if (constParams.end() != constParam) {
+      func->_boundParams.push_back(
+            std::make_pair(_parameters[i], constParam->second));
+    } else if (functionParams.end() != functionParam) {
+      func->_boundFunctionParams.push_back(
+            std::make_pair(_parameters[i], functionParam->second));
     } else {
-      local->setOffset(offset);
-      offset += DATA_SIZE;
-    }
-    // If this is an array, reserve space for the array's data.
-    if (local->type().isArray()) {
-      // The data offset is at the current stack offset + DATA_SIZE.
-      // We must add DATA_SIZE because the stack pointer points at an
-      // address that's in use, and we want the next unused address.
-      local->setDataOffset(offset + DATA_SIZE);
-      offset += local->type().arraySize() * DATA_SIZE;
+      func->_parameters.push_back(_parameters[i]);
     }
   }
-  // Save the previous value of the frame pointer.
-  parser->writeInst("PUSH FP");
-  _savedRegisters.push("FP");
-  extraParamOffset -= DATA_SIZE;
-  // Set the frame pointer to the stack's current location.
-  parser->writeInst("MOV FP SP");
-  // Store parameters on the stack if they are currently stored in
-  // registers but are flagged as needing their own address. Also fix
-  // offset for parameters on the stack based on the number of saved
-  // registers.
+  return func;
+}
+
+/**
+ * Returns the type of a pointer to this function, made from its return
+ * type and the types of its parameters.
+ */
+TypeToken FunctionToken::pointerType() const {
+  std::vector<TypeToken> paramTypes;
   for (auto param : _parameters) {
-    if (param->isReg() && !param->canBeReg()) {
-      parser->writeInst("PUSH " + param->getReg());
-      param->setOffset(offset);
-      offset += DATA_SIZE;
-    } else if (!param->isReg()) {
-      param->setOffset(param->getOffset() + extraParamOffset);
-    }
-  }
-  // Reserve space for the local variable storage on the stack.
-  if (0 < offset) {
-    parser->writeInst("MOVI L " + toHexStr(offset));
-    parser->writeInst("ADD SP L");
+    paramTypes.push_back(param->type());
   }
+  return TypeToken(_type, paramTypes);
+}
 
-  // Outputs initial values of local variables.
-  for (auto local : _localVars) {
-    local->output(parser);
+/**
+ * Returns true if the parameter at the given index is never assigned
+ * to and never has its address taken.
+ */
+bool FunctionToken::isParamConstant(size_t i) const {
+  auto param = _parameters.at(i);
+  if (!param->canBeReg()) {
+    return false;
   }
-
-  // Assign assembly-level labels to all label declarations.
-  for (auto label : _labels) {
-    std::string asmLabel = parser->getUnusedLabel(_name + "_" + label->name());
-    label->setAsmLabel(asmLabel);
+  std::vector<std::shared_ptr<ExprToken>> exprs;
+  for (auto local : _localVars) {
+    local->getExprs(exprs);
   }
-
-  // Output assembly code for the rest of the statement types.
   for (auto statement : _statements) {
-    statement->output(parser, shared_from_this(), endLabel);
-  }
-
-  // Unwind the stack, popping the saved registers, then return.
-  // We have a label here so that when we have return statements
-  // they can jump here without having to unwind the stack in
-  // multiple places.
-  parser->writeln(endLabel + ":");
-  parser->writeInst("MOV SP FP");
-  while (!_savedRegisters.empty()) {
-    parser->writeInst("POP " + _savedRegisters.top());
-    _savedRegisters.pop();
+    collectExprs(statement, exprs);
   }
-  // If there are overflow parameters, pop them off the stack in
-  // addition to jumping to the return address.
-  if (0 < numOverflowParams) {
-    parser->writeInst("RET " + toHexStr(numOverflowParams * DATA_SIZE, 2));
-  } else {
-    parser->writeInst("RET");
+  for (auto expr : exprs) {
+    if (expr->assigns(param.get())) {
+      return false;
+    }
   }
+  return true;
 }
 
 /**
@@ -1398,9 +2822,12 @@ std::string FunctionToken::toAsmLabel(const std::string& srcLabel) {
   return "";
 }
 
+int StatementToken::_nesting = 0;
+
 /**
  * Gets the next statement and returns a pointer to it. Returns
- * a null pointer if there is no valid next statement.
+ * a null pointer if there is no valid next statement, or if it is nested
+ * too deeply.
  */
 std::shared_ptr<StatementToken> StatementToken::parse(
       Tokenizer *tokenizer,
@@ -1412,6 +2839,30 @@ std::shared_ptr<StatementToken> StatementToken::parse(
       std::vector<std::shared_ptr<GotoStatement>>& gotos,
       const std::shared_ptr<FunctionToken>& currentFunc,
       bool inLoop) {
+  if (_nesting >= MAX_NESTING) {
+    _error("Statements are nested more than " +
+           std::to_string(MAX_NESTING) + " levels deep.",
+           tokenizer->peekNext().line());
+    return nullptr;
+  }
+  _nesting++;
+  auto statement = _parseNested(tokenizer, functions, globals, parameters,
+                                localVars, labels, gotos, currentFunc,
+                                inLoop);
+  _nesting--;
+  return statement;
+}
+
+std::shared_ptr<StatementToken> StatementToken::_parseNested(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+      std::vector<std::shared_ptr<LabelStatement>>& labels,
+      std::vector<std::shared_ptr<GotoStatement>>& gotos,
+      const std::shared_ptr<FunctionToken>& currentFunc,
+      bool inLoop) {
   AtomToken t = tokenizer->peekNext();
   auto function = getFunction(t.str(), functions);
   if (t.str().empty()) {
@@ -1463,9 +2914,16 @@ std::shared_ptr<StatementToken> StatementToken::parse(
                                localVars, currentFunc)) {
       return returnStatement;
     }
+  } else if ("yield" == t.str()) {
+    std::shared_ptr<YieldStatement> yieldStatement(new YieldStatement());
+    if (yieldStatement->parse(tokenizer, functions, globals, parameters,
+                              localVars, currentFunc)) {
+      return yieldStatement;
+    }
   } else if ("goto" == t.str()) {
     std::shared_ptr<GotoStatement> gotoStatement(new GotoStatement());
-    if (gotoStatement->parse(tokenizer)) {
+    if (gotoStatement->parse(tokenizer, functions, globals, parameters,
+                             localVars)) {
       gotos.push_back(gotoStatement);
       return gotoStatement;
     }
@@ -1512,6 +2970,19 @@ void StatementToken::output(Parser *,
                             const std::string&) {
 }
 
+/**
+ * By default a statement evaluates no expressions.
+ */
+void StatementToken::getExprs(std::vector<std::shared_ptr<ExprToken>>&) const {
+}
+
+/**
+ * By default a statement has no nested statements.
+ */
+void StatementToken::getChildren(
+      std::vector<std::shared_ptr<StatementToken>>&) const {
+}
+
 /**
  * Parses a compound statement, which consists of zero or more
  * statements within curly braces.
@@ -1558,9 +3029,16 @@ void CompoundStatement::output(Parser *parser,
                                const std::string& returnLabel,
                                const std::string& breakLabel,
                                const std::string& continueLabel) {
-  for (auto statement : _statements) {
-    statement->output(parser, function, returnLabel, breakLabel, continueLabel);
-  }
+  outputStatements(parser, _statements, function, returnLabel, breakLabel,
+                   continueLabel);
+}
+
+/**
+ * Appends the statements within the braces to children.
+ */
+void CompoundStatement::getChildren(
+      std::vector<std::shared_ptr<StatementToken>>& children) const {
+  children.insert(children.end(), _statements.begin(), _statements.end());
 }
 
 bool LocalVarToken::parse(
@@ -1633,6 +3111,14 @@ bool LocalVarToken::parse(
       }
       _initExprs.push_back(expr);
     }
+    for (auto expr : _initExprs) {
+      if (!_type.canHold(expr->type())) {
+        _error("Can't initialize '" + _type.signature() + "' with '" +
+               expr->type().signature() + "'.", expr->line());
+        return false;
+      }
+      expr->convertTo(_type);
+    }
     // This should be a semicolon
     last = tokenizer->getNext();
   }
@@ -1661,10 +3147,11 @@ void LocalVarToken::output(Parser *parser,
     // Store the location of the array at the variable's location.
     if (this->isReg()) {
       // Store FP + _dataOffset in the variable's register.
-      parser->writeInst("MOV " + this->getReg() + " FP");
+      const std::string& reg = Machine::current().regName(this->getReg());
+      parser->writeInst("MOV " + reg + " FP");
       if (0 != _dataOffset) {
         parser->writeInst("MOVI L " + toHexStr(_dataOffset));
-        parser->writeInst("ADD " + this->getReg() + " L");
+        parser->writeInst("ADD " + reg + " L");
       }
     } else {
       // Store FP + _offset in M
@@ -1692,7 +3179,8 @@ void LocalVarToken::output(Parser *parser,
   if (_type.isArray()) {
     for (size_t i = 0; i < _initExprs.size(); i++) {
       // Output initial expressions for each element.
-      _initExprs[i]->output(parser, VarLocation(_dataOffset + (DATA_SIZE * i)));
+      int offset = _dataOffset + Machine::current().dataSize() * (int)i;
+      _initExprs[i]->output(parser, VarLocation(offset));
     }
   } else {
     // Output initial expression for the scalar, to either the register
@@ -1701,6 +3189,14 @@ void LocalVarToken::output(Parser *parser,
   }
 }
 
+/**
+ * Appends the initialization expressions to exprs.
+ */
+void LocalVarToken::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.insert(exprs.end(), _initExprs.begin(), _initExprs.end());
+}
+
 /**
  * An expression statement has an expression followed by a semicolon.
  * This could include assignment, function calls, etc. Does not include
@@ -1714,9 +3210,60 @@ bool ExprStatement::parse(
       const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
   _lineNum = tokenizer->peekNext().line();
   // An expression statement is just an expression followed by a semicolon.
-  if (!_expr.parse(tokenizer, functions, globals, parameters, localVars)) {
+  _expr = std::shared_ptr<ExprToken>(new ExprToken());
+  if (!_expr->parse(tokenizer, functions, globals, parameters, localVars,
+                    true)) {
+    return false;
+  }
+  if (!_expect(tokenizer, ";")) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Outputs assembly code for this expression statement. This just
+ * evaluates the expression and then discards the result.
+ */
+void ExprStatement::output(Parser *parser,
+                           const std::shared_ptr<FunctionToken>&,
+                           const std::string&,
+                           const std::string&,
+                           const std::string&) {
+  _expr->output(parser, VarLocation(REG_L));
+}
+
+/**
+ * Appends the expression evaluated by this statement to exprs.
+ */
+void ExprStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.push_back(_expr);
+}
+
+/**
+ * A void statement is a function call that returns void, followed by
+ * a semicolon.
+ */
+bool VoidStatement::parse(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
+  _lineNum = tokenizer->peekNext().line();
+  // Parse the function call.
+  _fnCall = std::shared_ptr<FunctionCallToken>(new FunctionCallToken());
+  if (!_fnCall->parse(tokenizer, functions, globals, parameters, localVars)) {
+    return false;
+  }
+  // Make sure the function call is void.
+  auto function = getFunction(_fnCall->funcName(), functions);
+  if (!function || "void" != function->type().name()) {
+    _error("Expected function call to be of type 'void'.", _lineNum);
     return false;
   }
+  // Make sure the next symbol is a semicolon.
   if (!_expect(tokenizer, ";")) {
     return false;
   }
@@ -1724,140 +3271,413 @@ bool ExprStatement::parse(
 }
 
 /**
- * Outputs assembly code for this expression statement. This just
- * evaluates the expression and then discards the result.
+ * Outputs the assembly code for this void statement.
+ */
+void VoidStatement::output(Parser *parser,
+                           const std::shared_ptr<FunctionToken>&,
+                           const std::string&,
+                           const std::string&,
+                           const std::string&) {
+  _fnCall->output(parser);
+}
+
+/**
+ * Appends the argument expressions of the function call to exprs.
+ */
+void VoidStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  _fnCall->getExprs(exprs);
+}
+
+/**
+ * An if statement looks like "if (COND_EXPR) TRUE_STMT [else FALSE_STMT]",
+ * where the else part is optional. COND_EXPR is an arbitrary expression,
+ * and TRUE_STMT and FALSE_STMT are both arbitrary statements. A chain of
+ * "else if" parts is parsed in a loop rather than recursively, since
+ * generated code can have thousands of them.
+ */
+bool IfStatement::parse(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+      std::vector<std::shared_ptr<LabelStatement>>& labels,
+      std::vector<std::shared_ptr<GotoStatement>>& gotos,
+      const std::shared_ptr<FunctionToken>& currentFunc,
+      bool inLoop) {
+  IfStatement *current = this;
+  while (true) {
+    current->_lineNum = tokenizer->peekNext().line();
+    // Make sure it starts with "if"
+    if (!_expect(tokenizer, "if")) {
+      return false;
+    }
+    // Followed by an open parenthesis
+    if (!_expect(tokenizer, "(")) {
+      return false;
+    }
+    // Followed by a valid expression
+    current->_condExpr = std::shared_ptr<ExprToken>(new ExprToken());
+    if (!current->_condExpr->parse(tokenizer, functions, globals, parameters,
+                                   localVars)) {
+      return false;
+    }
+    // Followed by a closing parenthesis
+    if (!_expect(tokenizer, ")")) {
+      return false;
+    }
+    // Followed by a valid statement
+    current->_trueStatement = StatementToken::parse(tokenizer, functions,
+                                                    globals, parameters,
+                                                    localVars, labels, gotos,
+                                                    currentFunc, inLoop);
+    if (!current->_trueStatement) {
+      return false;
+    }
+    // If the next token is "else", check for the else statement.
+    if ("else" != tokenizer->peekNext().str()) {
+      current->_hasElse = false;
+      return true;
+    }
+    current->_hasElse = true;
+    // Consume the "else" token.
+    tokenizer->getNext();
+    // An "else if" continues the chain with the nested if statement.
+    if ("if" == tokenizer->peekNext().str()) {
+      std::shared_ptr<IfStatement> next(new IfStatement());
+      current->_falseStatement = next;
+      current = next.get();
+      continue;
+    }
+    // Make sure it is followed by a valid statement.
+    current->_falseStatement = StatementToken::parse(tokenizer, functions,
+                                                     globals, parameters,
+                                                     localVars, labels, gotos,
+                                                     currentFunc, inLoop);
+    return nullptr != current->_falseStatement;
+  }
+}
+
+/**
+ * Unlinks a chain of "else if" parts one at a time, so that destroying a
+ * long chain doesn't recurse once per part.
+ */
+IfStatement::~IfStatement() {
+  std::shared_ptr<StatementToken> next = std::move(_falseStatement);
+  while (1 == next.use_count()) {
+    auto nextIf = dynamic_cast<IfStatement*>(next.get());
+    if (nullptr == nextIf) {
+      break;
+    }
+    next = std::move(nextIf->_falseStatement);
+  }
+}
+
+/**
+ * Outputs the assembly code for this if statement. A chain of "else if"
+ * parts is output in a loop rather than recursively, with the code that
+ * closes each part saved until the parts nested in it have been output.
+ */
+void IfStatement::output(Parser *parser,
+                         const std::shared_ptr<FunctionToken>& function,
+                         const std::string& returnLabel,
+                         const std::string& breakLabel,
+                         const std::string& continueLabel) {
+  std::vector<std::function<void()>> finish;
+  IfStatement *current = this;
+  while (nullptr != current) {
+    auto last = current->_outputTest(parser, function, returnLabel,
+                                     breakLabel, continueLabel, finish);
+    current = dynamic_cast<IfStatement*>(last.get());
+    if (nullptr == current && nullptr != last) {
+      last->output(parser, function, returnLabel, breakLabel,
+                   continueLabel);
+    }
+  }
+  for (auto it = finish.rbegin(); it != finish.rend(); ++it) {
+    (*it)();
+  }
+}
+
+/**
+ * Outputs this if statement up to the statement that goes last before its
+ * end label, and returns that statement without outputting it. The code
+ * that goes after it is appended to finish.
+ */
+std::shared_ptr<StatementToken> IfStatement::_outputTest(
+      Parser *parser,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel,
+      const std::string& breakLabel,
+      const std::string& continueLabel,
+      std::vector<std::function<void()>>& finish) {
+  // A hint like "if (likely(x))" is only used for the layout, so test the
+  // hinted expression directly.
+  std::shared_ptr<ExprToken> condExpr = this->testedExpr();
+  Likelihood likelihood = _condExpr->hint(condExpr);
+  // If the condition is known at compile time, only output the branch
+  // that is taken, as long as the other branch has no labels that could
+  // be jumped to with goto.
+  uint16_t condValue;
+  if (condExpr->evaluateBound(condValue)) {
+    auto taken = condValue ? _trueStatement : _falseStatement;
+    auto skipped = condValue ? _falseStatement : _trueStatement;
+    if (!skipped || !containsLabel(skipped)) {
+      return taken;
+    }
+  }
+  if (UNPREDICTED == likelihood) {
+    likelihood = predictBranch(_trueStatement, _falseStatement);
+  }
+  // The branch that is unlikely to run is moved to the end of the
+  // function, so that the likely one falls through without any jumps.
+  // Moving it costs a jump back unless it ends by jumping anyway, which
+  // isn't worth it when optimizing for size. There is nothing to move if
+  // the false statement is missing and likely.
+  std::shared_ptr<StatementToken> coldStatement;
+  if (LIKELY == likelihood) {
+    coldStatement = _falseStatement;
+  } else if (UNLIKELY == likelihood) {
+    coldStatement = _trueStatement;
+  }
+  if (coldStatement &&
+      (!parser->options().optimizeSize || _falseStatement ||
+       endsWithJump(coldStatement))) {
+    std::string coldLabel =
+      parser->getUnusedLabel(function->name() + "_if_cold");
+    std::string endLabel =
+      parser->getUnusedLabel(function->name() + "_if_end");
+    condExpr->outputBranch(parser, LIKELY != likelihood, coldLabel);
+    // The cold statement jumps back to the end of the if statement when it
+    // is done, unless it has jumped elsewhere already.
+    finish.push_back([=]() {
+        parser->writeln(endLabel + ":");
+        parser->deferCold([=]() {
+            parser->writeln(coldLabel + ":");
+            coldStatement->output(parser, function, returnLabel, breakLabel,
+                                  continueLabel);
+            if (!endsWithJump(coldStatement)) {
+              parser->writeInst("JMPI " + endLabel);
+            }
+          });
+      });
+    return LIKELY == likelihood ? _trueStatement : _falseStatement;
+  }
+  std::string falseLabel = parser->getUnusedLabel(function->name() + "_if_false");
+  std::string endLabel = parser->getUnusedLabel(function->name() + "_if_end");
+  // Test the condition and jump to the false label if it is false.
+  condExpr->outputBranch(parser, false, falseLabel);
+  // Output the true statement and jump to the end.
+  _trueStatement->output(parser, function, returnLabel, breakLabel,
+                         continueLabel);
+  parser->writeInst("JMPI " + endLabel);
+  // Output the false statement label, and leave the false statement for
+  // the caller.
+  parser->writeln(falseLabel + ":");
+  // The end label is where the true statement jumps over the false one.
+  finish.push_back([=]() {
+      parser->writeln(endLabel + ":");
+    });
+  return _falseStatement;
+}
+
+/**
+ * Returns the condition that is tested, without a likely() or unlikely()
+ * hint around it.
+ */
+std::shared_ptr<ExprToken> IfStatement::testedExpr() const {
+  std::shared_ptr<ExprToken> condExpr = _condExpr;
+  _condExpr->hint(condExpr);
+  return condExpr;
+}
+
+/**
+ * Appends the condition expression to exprs.
  */
-void ExprStatement::output(Parser *parser,
-                           const std::shared_ptr<FunctionToken>&,
-                           const std::string&,
-                           const std::string&,
-                           const std::string&) {
-  _expr.output(parser, VarLocation("L"));
+void IfStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.push_back(_condExpr);
 }
 
 /**
- * A void statement is a function call that returns void, followed by
- * a semicolon.
+ * Appends the true and false statements to children.
  */
-bool VoidStatement::parse(
-      Tokenizer *tokenizer,
-      const std::vector<std::shared_ptr<FunctionToken>>& functions,
-      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
-      const std::vector<std::shared_ptr<ParamToken>>& parameters,
-      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
-  _lineNum = tokenizer->peekNext().line();
-  // Parse the function call.
-  if (!_fnCall.parse(tokenizer, functions, globals, parameters, localVars)) {
-    return false;
-  }
-  // Make sure the function call is void.
-  auto function = getFunction(_fnCall.funcName(), functions);
-  if (!function || "void" != function->type().name()) {
-    _error("Expected function call to be of type 'void'.", _lineNum);
-    return false;
-  }
-  // Make sure the next symbol is a semicolon.
-  if (!_expect(tokenizer, ";")) {
-    return false;
+void IfStatement::getChildren(
+      std::vector<std::shared_ptr<StatementToken>>& children) const {
+  children.push_back(_trueStatement);
+  if (nullptr != _falseStatement) {
+    children.push_back(_falseStatement);
   }
-  return true;
 }
 
 /**
- * Outputs the assembly code for this void statement.
+ * Appends the condition expression to exprs.
  */
-void VoidStatement::output(Parser *parser,
-                           const std::shared_ptr<FunctionToken>&,
-                           const std::string&,
-                           const std::string&,
-                           const std::string&) {
-  _fnCall.output(parser);
+void LoopStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.push_back(_condExpr);
 }
 
 /**
- * An if statement looks like "if (COND_EXPR) TRUE_STMT [else FALSE_STMT]",
- * where the else part is optional. COND_EXPR is an arbitrary expression,
- * and TRUE_STMT and FALSE_STMT are both arbitrary statements.
+ * Appends the body of the loop to children.
  */
-bool IfStatement::parse(
-      Tokenizer *tokenizer,
-      const std::vector<std::shared_ptr<FunctionToken>>& functions,
-      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
-      const std::vector<std::shared_ptr<ParamToken>>& parameters,
-      const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
-      std::vector<std::shared_ptr<LabelStatement>>& labels,
-      std::vector<std::shared_ptr<GotoStatement>>& gotos,
-      const std::shared_ptr<FunctionToken>& currentFunc,
-      bool inLoop) {
-  _lineNum = tokenizer->peekNext().line();
-  // Make sure it starts with "if"
-  if (!_expect(tokenizer, "if")) {
+void LoopStatement::getChildren(
+      std::vector<std::shared_ptr<StatementToken>>& children) const {
+  children.push_back(_body);
+}
+
+/**
+ * Tries to output the loop twice, once for each value of the condition
+ * of an if statement in the body that doesn't change while the loop
+ * runs, with a test of the condition up front that picks one. Each copy
+ * only has the branch of the if statement that it takes. Returns false
+ * and outputs nothing if there is no such condition, if the loop calls a
+ * function, or if the copies don't fit in the unswitching budget.
+ */
+bool LoopStatement::_outputUnswitched(
+      Parser *parser,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel) {
+  if (_unswitching || parser->options().unswitchBudget <= 0 ||
+      containsLabel(_body)) {
     return false;
   }
-  // Followed by an open parenthesis
-  if (!_expect(tokenizer, "(")) {
+  // Find the first if statement whose condition doesn't change, and that
+  // isn't already known because of an outer loop that was unswitched.
+  std::vector<std::shared_ptr<ExprToken>> headerExprs;
+  this->getExprs(headerExprs);
+  Effects effects = getEffects(_body);
+  effects.merge(getEffects(headerExprs));
+  // A called function could change anything the condition depends on.
+  if (effects.calls) {
     return false;
   }
-  // Followed by a valid expression
-  if (!_condExpr.parse(tokenizer, functions, globals, parameters, localVars)) {
-    return false;
+  std::vector<std::shared_ptr<StatementToken>> statements;
+  collectStatements(_body, statements);
+  std::shared_ptr<ExprToken> condExpr;
+  for (auto statement : statements) {
+    auto ifStatement = std::dynamic_pointer_cast<IfStatement>(statement);
+    uint16_t value;
+    if (ifStatement && !ifStatement->testedExpr()->evaluateBound(value) &&
+        isInvariant(ifStatement->testedExpr(), effects)) {
+      condExpr = ifStatement->testedExpr();
+      break;
+    }
   }
-  // Followed by a closing parenthesis
-  if (!_expect(tokenizer, ")")) {
+  if (!condExpr) {
     return false;
   }
-  // Followed by a valid statement
-  _trueStatement = StatementToken::parse(tokenizer, functions, globals,
-                                         parameters, localVars, labels,
-                                         gotos, currentFunc, inLoop);
-  if (!_trueStatement) {
+  // Output a copy of the loop with the condition assumed to have each
+  // value. Code deferred to the end of the function needs the same
+  // assumption.
+  auto emitCopy = [=](uint16_t value) {
+    parser->withBinding([=]() { condExpr->assume(value); },
+                        [=]() { condExpr->unassume(); },
+                        [=]() {
+                          this->output(parser, function, returnLabel, "", "");
+                        });
+  };
+  auto emitUnswitched = [&]() {
+    std::string falseLabel =
+      parser->getUnusedLabel(function->name() + "_unswitch_false");
+    std::string endLabel =
+      parser->getUnusedLabel(function->name() + "_unswitch_end");
+    condExpr->outputBranch(parser, false, falseLabel);
+    emitCopy(1);
+    parser->writeInst("JMPI " + endLabel);
+    parser->writeln(falseLabel + ":");
+    emitCopy(0);
+    parser->writeln(endLabel + ":");
+  };
+  // Make sure the copies fit in the budget.
+  _unswitching = true;
+  int size = parser->measure([&]() {
+      this->output(parser, function, returnLabel, "", "");
+    });
+  _unswitching = false;
+  if (parser->options().unswitchBudget < parser->measure(emitUnswitched) - size) {
     return false;
   }
-  // If the next token is "else", check for the else statement.
-  if ("else" == tokenizer->peekNext().str()) {
-    _hasElse = true;
-    // Consume the "else" token.
-    tokenizer->getNext();
-    // Make sure it is followed by a valid statement.
-    _falseStatement = StatementToken::parse(tokenizer, functions, globals,
-                                            parameters, localVars, labels,
-                                            gotos, currentFunc, inLoop);
-    if (!_falseStatement) {
-      return false;
-    }
-  } else {
-    _hasElse = false;
-  }
+  emitUnswitched();
   return true;
 }
 
 /**
- * Outputs the assembly code for this if statement.
+ * Outputs the body of the loop. When checking array bounds, the loop
+ * variable is limited to the range it can have in the body, if known.
  */
-void IfStatement::output(Parser *parser,
-                         const std::shared_ptr<FunctionToken>& function,
-                         const std::string& returnLabel,
-                         const std::string& breakLabel,
-                         const std::string& continueLabel) {
-  std::string falseLabel = parser->getUnusedLabel(function->name() + "_if_false");
-  std::string endLabel = parser->getUnusedLabel(function->name() + "_if_end");
-  // Test the condition and jump to the false label if it is false.
-  _condExpr.output(parser, VarLocation("L"));
-  parser->writeInst("TST L L");
-  parser->writeInst("JEQ " + falseLabel);
-  // Output the true statement and jump to the end.
-  _trueStatement->output(parser, function, returnLabel, breakLabel,
-                         continueLabel);
-  parser->writeInst("JMPI " + endLabel);
-  // Output the false statement label and the false statement.
-  parser->writeln(falseLabel + ":");
-  if (nullptr != _falseStatement) {
-    _falseStatement->output(parser, function, returnLabel, breakLabel,
-                            continueLabel);
+void LoopStatement::_outputBody(
+      Parser *parser,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel,
+      const std::string& breakLabel,
+      const std::string& continueLabel) {
+  uint16_t min, max;
+  auto var = this->_bodyRange(parser, min, max);
+  if (!var) {
+    _body->output(parser, function, returnLabel, breakLabel, continueLabel);
+    return;
   }
-  // Output the end label that the true statement uses to jump over the
-  // false statement.
-  parser->writeln(endLabel + ":");
+  uint16_t oldMin = var->rangeMin();
+  uint16_t oldMax = var->rangeMax();
+  parser->withBinding([=]() { var->setRange(min, max); },
+                      [=]() { var->setRange(oldMin, oldMax); },
+                      [&]() {
+                        _body->output(parser, function, returnLabel,
+                                      breakLabel, continueLabel);
+                      });
+}
+
+/**
+ * Finds the range of values that a variable has whenever the body of the
+ * loop starts. Returns null since nothing is known in general.
+ */
+std::shared_ptr<Variable> LoopStatement::_bodyRange(Parser *,
+                                                    uint16_t&,
+                                                    uint16_t&) const {
+  return nullptr;
+}
+
+/**
+ * Outputs the loop with its condition tested at the bottom, so that the
+ * jump back to the start is taken and exiting falls through. The first
+ * test is reached by jumping over the body, or skipped if the condition
+ * is known to be true.
+ */
+void LoopStatement::_outputRotated(
+      Parser *parser,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel,
+      const std::shared_ptr<ExprToken>& condExpr,
+      const std::vector<std::shared_ptr<ExprToken>>& loopExprs,
+      const std::string& startLabel,
+      const std::string& condLabel,
+      const std::string& breakLabel,
+      const std::string& continueLabel) {
+  uint16_t condValue;
+  bool alwaysTrue = condExpr->evaluateBound(condValue) && condValue;
+  if (!alwaysTrue) {
+    parser->writeInst("JMPI " + condLabel);
+  }
+  // Output the body followed by the continue label and loop expressions.
+  parser->writeln(startLabel + ":");
+  this->_outputBody(parser, function, returnLabel, breakLabel, continueLabel);
+  if (continueLabel != condLabel) {
+    parser->writeln(continueLabel + ":");
+  }
+  for (auto expr : loopExprs) {
+    expr->output(parser, VarLocation(REG_L));
+  }
+  // Test the condition and jump back to the start if it is true.
+  parser->writeln(condLabel + ":");
+  if (alwaysTrue) {
+    parser->writeInst("JMPI " + startLabel);
+  } else {
+    condExpr->outputBranch(parser, true, startLabel);
+  }
+  // Output the break label.
+  parser->writeln(breakLabel + ":");
 }
 
 /**
@@ -1968,9 +3788,19 @@ void ForStatement::output(Parser *parser,
                           const std::string& returnLabel,
                           const std::string&,
                           const std::string&) {
+  // Loops with a trip count known at compile time may be unrolled.
+  if (function->unrollsLoops() &&
+      _outputUnrolled(parser, function, returnLabel)) {
+    return;
+  }
+  // Loops with an if statement that always goes the same way may be
+  // split into a copy for each way.
+  if (_outputUnswitched(parser, function, returnLabel)) {
+    return;
+  }
   // Evaluate the initial expressions and discard the result.
   for (auto expr : _initExprs) {
-    expr->output(parser, VarLocation("L"));
+    expr->output(parser, VarLocation(REG_L));
   }
   // Create the start, break, and continue labels.
   std::string startLabel =
@@ -1979,21 +3809,267 @@ void ForStatement::output(Parser *parser,
     parser->getUnusedLabel(function->name() + "_for_break");
   std::string continueLabel =
     parser->getUnusedLabel(function->name() + "_for_continue");
-  // Output the start label and test the condition.
-  parser->writeln(startLabel + ":");
-  _condExpr->output(parser, VarLocation("L"));
-  parser->writeInst("TST L L");
-  parser->writeInst("JEQ " + breakLabel);
-  // Output the function body followed by the continue label.
-  _body->output(parser, function, returnLabel, breakLabel, continueLabel);
-  parser->writeln(continueLabel + ":");
-  // Output the loop expressions and jump to the start of the loop.
-  for (auto expr : _loopExprs) {
-    expr->output(parser, VarLocation("L"));
+  std::shared_ptr<ExprToken> condExpr = _condExpr;
+  if (UNLIKELY == _condExpr->hint(condExpr)) {
+    // The loop usually doesn't run at all, so test the condition at the
+    // top where exiting takes a single jump. Output the start label and
+    // test the condition.
+    parser->writeln(startLabel + ":");
+    condExpr->outputBranch(parser, false, breakLabel);
+    // Output the function body followed by the continue label.
+    this->_outputBody(parser, function, returnLabel, breakLabel,
+                      continueLabel);
+    parser->writeln(continueLabel + ":");
+    // Output the loop expressions and jump to the start of the loop.
+    for (auto expr : _loopExprs) {
+      expr->output(parser, VarLocation(REG_L));
+    }
+    parser->writeInst("JMPI " + startLabel);
+    // Output the break label.
+    parser->writeln(breakLabel + ":");
+    return;
   }
-  parser->writeInst("JMPI " + startLabel);
-  // Output the break label.
-  parser->writeln(breakLabel + ":");
+  // The loop usually runs again, so test the condition at the bottom.
+  std::string condLabel =
+    parser->getUnusedLabel(function->name() + "_for_cond");
+  _outputRotated(parser, function, returnLabel, condExpr, _loopExprs,
+                 startLabel, condLabel, breakLabel, continueLabel);
+}
+
+/**
+ * Appends the initial, condition, and loop expressions to exprs.
+ */
+void ForStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  exprs.insert(exprs.end(), _initExprs.begin(), _initExprs.end());
+  exprs.push_back(_condExpr);
+  exprs.insert(exprs.end(), _loopExprs.begin(), _loopExprs.end());
+}
+
+/**
+ * Returns a single loop that runs the bodies of first and second one
+ * after the other in each iteration, or null if the loops don't have
+ * the same header or if running them together could change what they
+ * compute. Both loops must look like "for (i = A; COND; i = STEP)" with
+ * identical expressions, where neither body assigns to i, leaves the
+ * loop early, or calls a function, and where the header doesn't depend on
+ * anything the bodies change besides i.
+ */
+std::shared_ptr<ForStatement> ForStatement::fuse(
+      const std::shared_ptr<ForStatement>& first,
+      const std::shared_ptr<ForStatement>& second) {
+  if (1 != first->_initExprs.size() || 1 != first->_loopExprs.size() ||
+      1 != second->_initExprs.size() || 1 != second->_loopExprs.size() ||
+      !first->_initExprs[0]->sameAs(*second->_initExprs[0]) ||
+      !first->_condExpr->sameAs(*second->_condExpr) ||
+      !first->_loopExprs[0]->sameAs(*second->_loopExprs[0])) {
+    return nullptr;
+  }
+  auto var = first->_initExprs[0]->assignedVar();
+  if (!var || !var->canBeReg() || var->isBound() ||
+      var != first->_loopExprs[0]->assignedVar()) {
+    return nullptr;
+  }
+  // Both bodies have to run every iteration, in order, without changing
+  // the loop variable.
+  for (auto body : { first->_body, second->_body }) {
+    std::vector<std::shared_ptr<ExprToken>> bodyExprs;
+    collectExprs(body, bodyExprs);
+    for (auto expr : bodyExprs) {
+      if (expr->assigns(var.get())) {
+        return nullptr;
+      }
+    }
+    if (containsLabel(body) || containsLoopExit(body)) {
+      return nullptr;
+    }
+    std::vector<std::shared_ptr<StatementToken>> statements;
+    collectStatements(body, statements);
+    for (auto statement : statements) {
+      if (std::dynamic_pointer_cast<ReturnStatement>(statement) ||
+          std::dynamic_pointer_cast<GotoStatement>(statement)) {
+        return nullptr;
+      }
+    }
+  }
+  // The second loop must run the same iterations after the first loop
+  // has run, and an iteration of either body can't depend on a later
+  // iteration of the other. Nothing is known about what a called function
+  // does, so bodies that call one are never fused.
+  Effects firstEffects = getEffects(first->_body, var.get());
+  Effects secondEffects = getEffects(second->_body, var.get());
+  if (firstEffects.calls || secondEffects.calls ||
+      conflicts(firstEffects, secondEffects)) {
+    return nullptr;
+  }
+  Effects bodyEffects = firstEffects;
+  bodyEffects.merge(secondEffects);
+  std::vector<std::shared_ptr<ExprToken>> headerExprs;
+  first->getExprs(headerExprs);
+  for (auto expr : headerExprs) {
+    if (!isInvariant(expr, bodyEffects, var.get())) {
+      return nullptr;
+    }
+  }
+  std::shared_ptr<ForStatement> fused(new ForStatement(*first));
+  fused->_body = std::make_shared<CompoundStatement>(
+    std::vector<std::shared_ptr<StatementToken>>{ first->_body,
+                                                  second->_body });
+  return fused;
+}
+
+/**
+ * Finds the range of the loop variable in the body, for loops like
+ * "for (i = A; i < N; i = i + C)" where C is a positive constant and the
+ * body doesn't assign to i. Then i is at least the smallest value A can
+ * have, and less than the largest value N can have. Only done when
+ * checking array bounds, since nothing else uses it.
+ */
+std::shared_ptr<Variable> ForStatement::_bodyRange(Parser *parser,
+                                                   uint16_t& min,
+                                                   uint16_t& max) const {
+  if (!parser->options().boundsCheck ||
+      1 != _initExprs.size() || 1 != _loopExprs.size()) {
+    return nullptr;
+  }
+  auto var = _initExprs[0]->assignedVar();
+  if (!var || !var->canBeReg() || var->isBound() ||
+      var != _loopExprs[0]->assignedVar()) {
+    return nullptr;
+  }
+  // The loop expression must add a positive constant to i.
+  const Postfix& step = _loopExprs[0]->postfix();
+  if (5 != step.size() || !step.isLiteral(2) || 0 == step.literal(2) ||
+      !step.isOperator(3) || "+" != step.op(3).str() ||
+      var != step.variable(1)) {
+    return nullptr;
+  }
+  uint16_t stepSize = step.literal(2);
+  // The condition must compare i to an upper bound.
+  std::shared_ptr<ExprToken> condExpr = _condExpr;
+  _condExpr->hint(condExpr);
+  const Postfix& cond = condExpr->postfix();
+  size_t last = cond.size() - 1;
+  if (!cond.isOperator(last)) {
+    return nullptr;
+  }
+  const OperatorToken& compare = cond.op(last);
+  if (!compare.isBinary() ||
+      ("<" != compare.str() && "<=" != compare.str()) ||
+      UNSIGNED_ARITHMETIC != compare.arithmetic() ||
+      var != cond.variable(0) ||
+      condExpr->assigns(var.get())) {
+    return nullptr;
+  }
+  std::vector<std::shared_ptr<ExprToken>> bodyExprs;
+  collectExprs(_body, bodyExprs);
+  for (auto expr : bodyExprs) {
+    if (expr->assigns(var.get())) {
+      return nullptr;
+    }
+  }
+  Selector selector(parser);
+  auto init = selector.build(_initExprs[0]->postfix());
+  auto test = selector.build(cond);
+  if (ExprNode::OPERATOR != test->kind) {
+    return nullptr;
+  }
+  uint32_t limit = test->kids[1]->max;
+  if ("<" == compare.str()) {
+    if (0 == limit) {
+      return nullptr;
+    }
+    limit--;
+  }
+  // Adding the step to the last value must not wrap around to a value
+  // that passes the test again.
+  if (0xffff < limit + stepSize || limit < init->min) {
+    return nullptr;
+  }
+  min = init->min;
+  max = limit;
+  return var;
+}
+
+/**
+ * Tries to output the loop fully unrolled. This is possible for loops
+ * like "for (i = A; COND; i = STEP)" where A is known, COND and STEP can
+ * be computed from i and other known values, and the body doesn't assign
+ * to i, declare labels, or break or continue. Each copy of the body is
+ * output with i bound to its value in that iteration, and i is left with
+ * its final value.
+ */
+bool ForStatement::_outputUnrolled(
+      Parser *parser,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel) {
+  // Unrolling a very long loop is never worth it, regardless of the
+  // size of its body.
+  static const size_t MAX_TRIP_COUNT = 64;
+  if (1 != _initExprs.size() || 1 != _loopExprs.size()) {
+    return false;
+  }
+  auto var = _initExprs[0]->assignedVar();
+  if (!var || !var->canBeReg() || var->isBound() ||
+      var != _loopExprs[0]->assignedVar()) {
+    return false;
+  }
+  // Make sure the body leaves the loop variable alone and can be copied.
+  std::vector<std::shared_ptr<ExprToken>> bodyExprs;
+  collectExprs(_body, bodyExprs);
+  bodyExprs.push_back(_condExpr);
+  for (auto expr : bodyExprs) {
+    if (expr->assigns(var.get())) {
+      return false;
+    }
+  }
+  if (containsLabel(_body) || containsLoopExit(_body)) {
+    return false;
+  }
+  // Find the value of the loop variable in each iteration.
+  std::vector<uint16_t> values;
+  uint16_t value;
+  if (!_initExprs[0]->evaluateAssignedBound(value)) {
+    return false;
+  }
+  while (true) {
+    uint16_t cond = 0;
+    var->bind(value);
+    bool known = _condExpr->evaluateBound(cond);
+    if (known && cond) {
+      values.push_back(value);
+      known = _loopExprs[0]->evaluateAssignedBound(value);
+    }
+    var->unbind();
+    if (!known || MAX_TRIP_COUNT < values.size()) {
+      return false;
+    } else if (!cond) {
+      break;
+    }
+  }
+  // Make sure the unrolled loop fits in the budget.
+  int size = 0;
+  for (auto iterValue : values) {
+    var->bind(iterValue);
+    size += parser->measure([&]() {
+        _body->output(parser, function, returnLabel);
+      });
+    var->unbind();
+    if (parser->options().unrollBudget < size) {
+      return false;
+    }
+  }
+  // Output a copy of the body for each iteration, then store the final
+  // value of the loop variable in case it is used after the loop. Code in
+  // the body that is deferred to the end of the function needs the loop
+  // variable bound as well.
+  for (auto iterValue : values) {
+    parser->withBinding([=]() { var->bind(iterValue); },
+                        [=]() { var->unbind(); },
+                        [&]() { _body->output(parser, function, returnLabel); });
+  }
+  ExprToken(value).output(parser, *var);
+  return true;
 }
 
 /**
@@ -2056,21 +4132,34 @@ void WhileStatement::output(Parser *parser,
                             const std::string& returnLabel,
                             const std::string&,
                             const std::string&) {
+  // Loops with an if statement that always goes the same way may be
+  // split into a copy for each way.
+  if (_outputUnswitched(parser, function, returnLabel)) {
+    return;
+  }
   // Create the break and continue labels.
   std::string breakLabel =
     parser->getUnusedLabel(function->name() + "_while_break");
   std::string continueLabel =
     parser->getUnusedLabel(function->name() + "_while_continue");
-  // Output the continue label and test the condition.
-  parser->writeln(continueLabel + ":");
-  _condExpr->output(parser, VarLocation("L"));
-  parser->writeInst("TST L L");
-  parser->writeInst("JEQ " + breakLabel);
-  // Output the loop body and then jump to the start again.
-  _body->output(parser, function, returnLabel, breakLabel, continueLabel);
-  parser->writeInst("JMPI " + continueLabel);
-  // Output the break label.
-  parser->writeln(breakLabel + ":");
+  std::shared_ptr<ExprToken> condExpr = _condExpr;
+  if (UNLIKELY == _condExpr->hint(condExpr)) {
+    // The loop usually doesn't run at all, so test the condition at the
+    // top. Output the continue label and test the condition.
+    parser->writeln(continueLabel + ":");
+    condExpr->outputBranch(parser, false, breakLabel);
+    // Output the loop body and then jump to the start again.
+    _body->output(parser, function, returnLabel, breakLabel, continueLabel);
+    parser->writeInst("JMPI " + continueLabel);
+    // Output the break label.
+    parser->writeln(breakLabel + ":");
+    return;
+  }
+  // Otherwise test the condition at the bottom, like a for loop.
+  std::string startLabel =
+    parser->getUnusedLabel(function->name() + "_while_start");
+  _outputRotated(parser, function, returnLabel, condExpr, { },
+                 startLabel, continueLabel, breakLabel, continueLabel);
 }
 
 /**
@@ -2150,9 +4239,7 @@ void DoWhileStatement::output(Parser *parser,
   // Output the loop body.
   _body->output(parser, function, returnLabel, breakLabel, continueLabel);
   // Test the condition.
-  _condExpr->output(parser, VarLocation("L"));
-  parser->writeInst("TST L L");
-  parser->writeInst("JNE " + continueLabel);
+  _condExpr->outputBranch(parser, true, continueLabel);
   // Output the break label.
   parser->writeln(breakLabel + ":");
 }
@@ -2182,6 +4269,7 @@ void BreakStatement::output(Parser *parser,
                             const std::string&,
                             const std::string& breakLabel,
                             const std::string&) {
+  parser->setSourceLine(_lineNum);
   parser->writeInst("JMPI " + breakLabel);
 }
 
@@ -2210,6 +4298,7 @@ void ContinueStatement::output(Parser *parser,
                                const std::string&,
                                const std::string&,
                                const std::string& continueLabel) {
+  parser->setSourceLine(_lineNum);
   parser->writeInst("JMPI " + continueLabel);
 }
 
@@ -2235,7 +4324,8 @@ bool ReturnStatement::parse(
   // If the next token is not a semicolon, parse the expression.
   if (";" != tokenizer->peekNext().str()) {
     _hasExpr = true;
-    if (!_returnExpr.parse(tokenizer, functions, globals,
+    _returnExpr = std::shared_ptr<ExprToken>(new ExprToken());
+    if (!_returnExpr->parse(tokenizer, functions, globals,
                            parameters, localVars)) {
       return false;
     }
@@ -2255,6 +4345,13 @@ bool ReturnStatement::parse(
     _error("Return statement must include a value in a non-void function.",
            _lineNum);
     return false;
+  } else if (_hasExpr && !currentFunc->type().canHold(_returnExpr->type())) {
+    _error("Can't return '" + _returnExpr->type().signature() + "' from "
+           "function returning '" + currentFunc->type().signature() + "'.",
+           _lineNum);
+    return false;
+  } else if (_hasExpr) {
+    _returnExpr->convertTo(currentFunc->type());
   }
   return true;
 }
@@ -2269,12 +4366,103 @@ void ReturnStatement::output(Parser *parser,
                              const std::string& returnLabel,
                              const std::string&,
                              const std::string&) {
+  parser->setSourceLine(_lineNum);
   if (_hasExpr) {
-    _returnExpr.output(parser, VarLocation("L"));
+    _returnExpr->output(parser, VarLocation(REG_L));
   }
   parser->writeInst("JMPI " + returnLabel);
 }
 
+/**
+ * Appends the return value expression, if there is one, to exprs.
+ */
+void ReturnStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  if (_hasExpr) {
+    exprs.push_back(_returnExpr);
+  }
+}
+
+/**
+ * Parses a yield statement like "yield EXPR;" or "yield;", which may only
+ * appear in a coroutine. Like a return statement, it must have a value if
+ * and only if the coroutine is not void.
+ */
+bool YieldStatement::parse(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+      const std::shared_ptr<FunctionToken>& currentFunc) {
+  _lineNum = tokenizer->peekNext().line();
+  if (!_expect(tokenizer, "yield")) {
+    return false;
+  } else if (!currentFunc->isCoroutine()) {
+    _error("Yield statement outside of a coroutine.", _lineNum);
+    return false;
+  }
+  if (";" != tokenizer->peekNext().str()) {
+    _yieldExpr = std::shared_ptr<ExprToken>(new ExprToken());
+    if (!_yieldExpr->parse(tokenizer, functions, globals,
+                           parameters, localVars)) {
+      return false;
+    }
+  }
+  if (!_expect(tokenizer, ";")) {
+    return false;
+  }
+  if (_yieldExpr && "void" == currentFunc->type().name()) {
+    _error("Cannot yield a value from a void coroutine.", _lineNum);
+    return false;
+  } else if (!_yieldExpr && "void" != currentFunc->type().name()) {
+    _error("Yield statement must include a value in a non-void coroutine.",
+           _lineNum);
+    return false;
+  } else if (_yieldExpr && !currentFunc->type().canHold(_yieldExpr->type())) {
+    _error("Can't yield '" + _yieldExpr->type().signature() + "' from "
+           "coroutine returning '" + currentFunc->type().signature() + "'.",
+           _lineNum);
+    return false;
+  } else if (_yieldExpr) {
+    _yieldExpr->convertTo(currentFunc->type());
+  }
+  return true;
+}
+
+/**
+ * Stores the address of the code after this statement in the frame record
+ * of the coroutine's instance, then returns the value of the expression in
+ * register L. Local variables are already in the frame record, so only the
+ * caller's frame pointer needs to be restored.
+ */
+void YieldStatement::output(Parser *parser,
+                            const std::shared_ptr<FunctionToken>& function,
+                            const std::string&,
+                            const std::string&,
+                            const std::string&) {
+  if (_yieldExpr) {
+    _yieldExpr->output(parser, VarLocation(REG_L));
+  }
+  std::string resumeLabel = parser->getUnusedLabel(function->name() +
+                                                   "_resume");
+  parser->writeInst("MOVI M " + resumeLabel);
+  parser->writeInst("STOR M FP");
+  parser->writeInst("POP FP");
+  parser->writeInst("RET");
+  parser->writeln(resumeLabel + ":");
+}
+
+/**
+ * Appends the yielded expression, if there is one, to exprs.
+ */
+void YieldStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  if (_yieldExpr) {
+    exprs.push_back(_yieldExpr);
+  }
+}
+
 /**
  * Parses a label declaration like "label:". Must start with a name and
  * end with a colon, without whitespace.
@@ -2307,14 +4495,30 @@ void LabelStatement::output(Parser *parser,
 }
 
 /**
- * A goto statement is of the form "goto LABEL;".
+ * A goto statement is of the form "goto LABEL;", or "goto *EXPR;" to jump
+ * to an address computed from label addresses like "&&LABEL".
  */
-bool GotoStatement::parse(Tokenizer *tokenizer) {
+bool GotoStatement::parse(
+      Tokenizer *tokenizer,
+      const std::vector<std::shared_ptr<FunctionToken>>& functions,
+      const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+      const std::vector<std::shared_ptr<ParamToken>>& parameters,
+      const std::vector<std::shared_ptr<LocalVarToken>>& localVars) {
   _lineNum = tokenizer->peekNext().line();
   // Make sure the first token is the "goto" keyword.
   if (!_expect(tokenizer, "goto")) {
     return false;
   }
+  // Get the target expression of a computed goto.
+  if ("*" == tokenizer->peekNext().str()) {
+    tokenizer->getNext();
+    _target = std::shared_ptr<ExprToken>(new ExprToken());
+    if (!_target->parse(tokenizer, functions, globals, parameters,
+                        localVars)) {
+      return false;
+    }
+    return _expect(tokenizer, ";");
+  }
   // Get the label.
   AtomToken labelToken = tokenizer->getNext();
   if (labelToken.str().empty()) {
@@ -2340,6 +4544,21 @@ void GotoStatement::output(Parser *parser,
                            const std::string&,
                            const std::string&,
                            const std::string&) {
+  if (_target) {
+    _target->output(parser, VarLocation(REG_L));
+    parser->writeInst("JMP L");
+    return;
+  }
   std::string asmLabel = function->toAsmLabel(_label);
   parser->writeInst("JMPI " + asmLabel);
 }
+
+/**
+ * Appends the target expression of a computed goto to exprs.
+ */
+void GotoStatement::getExprs(
+      std::vector<std::shared_ptr<ExprToken>>& exprs) const {
+  if (_target) {
+    exprs.push_back(_target);
+  }
+}
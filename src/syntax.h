@@ -6,10 +6,14 @@
 #ifndef CONSOLITE_COMPILER_SYNTAX_H
 #define CONSOLITE_COMPILER_SYNTAX_H
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
 #include <stack>
+#include <utility>
+#include "compression.h"
+#include "machine.h"
 
 // Forward declaration, some tokens take a pointer to a tokenizer or
 // parser as an argument.
@@ -23,16 +27,16 @@ enum OperandType { ADDRESS, REGISTER, VALUE, LITERAL };
 class Operand {
  public:
   Operand() { }
-  Operand(OperandType type, const std::string& reg = "")
+  Operand(OperandType type, Reg reg = NO_REG)
     : _type(type), _reg(reg) { }
   Operand(OperandType type, uint16_t literal)
-    : _type(type), _literal(literal) { }
+    : _type(type), _reg(NO_REG), _literal(literal) { }
   OperandType type() const { return _type; }
-  std::string reg() const { return _reg; }
+  Reg reg() const { return _reg; }
   uint16_t literal() const { return _literal; }
  private:
   OperandType _type;
-  std::string _reg;
+  Reg _reg;
   uint16_t _literal;
 };
 
@@ -64,6 +68,7 @@ class AtomToken : public Token {
   std::string _str;
 };
 
+class TypeToken;
 class GlobalVarToken;
 class FunctionToken;
 class ParamToken;
@@ -71,25 +76,91 @@ class LocalVarToken;
 class StatementToken;
 class LabelStatement;
 class GotoStatement;
+class FunctionCallToken;
 
 /**
  * A token representing a literal value from the code like "0x1234" or "4321".
+ * Literals with a decimal point like "1.5" are fix8_8 values, which are
+ * stored scaled by 256.
  */
 class LiteralToken : public Token {
  public:
-  LiteralToken(uint16_t value = 0) : _value(value) { }
+  LiteralToken(uint16_t value = 0) : _value(value), _fixed(false) { }
   bool parse(const AtomToken& token);
   uint16_t val() const { return _value; }
+  /**
+   * Returns true if this is a fix8_8 literal like "1.5".
+   */
+  bool isFixed() const { return _fixed; }
  private:
   uint16_t _value;
+  bool _fixed;
+};
+
+/**
+ * A token representing the address of a label in the current function,
+ * like "&&label", which can be jumped to with "goto *EXPR;".
+ */
+class LabelAddressToken : public Token {
+ public:
+  LabelAddressToken(const std::string& name, int lineNum) : _name(name) {
+    _lineNum = lineNum;
+  }
+  /**
+   * Returns the source-level label.
+   */
+  std::string name() const { return _name; }
+  /**
+   * Sets the label statement this refers to, once the whole function has
+   * been parsed.
+   */
+  void setLabel(const std::shared_ptr<LabelStatement>& label) {
+    _label = label;
+  }
+  /**
+   * Returns the label statement this refers to.
+   */
+  std::shared_ptr<LabelStatement> label() const { return _label; }
+ private:
+  std::string _name;
+  std::shared_ptr<LabelStatement> _label;
 };
 
+/**
+ * A token representing the address of a function, like "&func", which can
+ * be stored in a function pointer and called through it.
+ */
+class FunctionAddressToken : public Token {
+ public:
+  FunctionAddressToken(const std::shared_ptr<FunctionToken>& function,
+                       int lineNum)
+    : _function(function) {
+    _lineNum = lineNum;
+  }
+  std::shared_ptr<FunctionToken> function() const { return _function; }
+ private:
+  std::shared_ptr<FunctionToken> _function;
+};
+
+/**
+ * How an operator treats its operands. Operators on fix8_8 values compare
+ * and shift them as signed numbers, and FIXED_ARITHMETIC is for "*" and "/"
+ * when both sides are fix8_8, which rescale the result.
+ */
+enum Arithmetic { UNSIGNED_ARITHMETIC, SIGNED_ARITHMETIC, FIXED_ARITHMETIC };
+
 /**
  * A token representing a binary or unary operator in an expression, like
  * "+", "==", or "!".
  */
 class OperatorToken : public Token {
  public:
+  OperatorToken() : _binary(false), _arithmetic(UNSIGNED_ARITHMETIC) { }
+  /**
+   * Constructs a unary operator that converts its operand to the given
+   * type, which the compiler inserts where uint16 and fix8_8 values meet.
+   */
+  OperatorToken(const TypeToken& type, int lineNum);
   /**
    * Returns true if the token is a valid operator.
    */
@@ -136,30 +207,45 @@ class OperatorToken : public Token {
    */
   uint16_t operate(uint16_t lhs, uint16_t rhs) const;
   /**
-   * Outputs assembly code for this operation on the given left hand and
-   * right hand sides. Returns an operand representing the result, which
-   * will be an address or a value depending on the operation.
+   * Returns true if operate() can compute the result of this operation at
+   * compile time, given the value of the right hand side. Assignment,
+   * address operations, and division by zero can't be computed.
    */
-  Operand output(Parser *parser, const Operand& lhs, const Operand& rhs);
+  bool isFoldable(uint16_t rhs) const;
   /**
    * Returns a string representation of the operator.
    */
   std::string str() const { return _op; }
+  /**
+   * Sets how the operator treats its operands, which depends on their
+   * types.
+   */
+  void setArithmetic(Arithmetic arithmetic) { _arithmetic = arithmetic; }
+  Arithmetic arithmetic() const { return _arithmetic; }
  private:
   std::string _op;
   bool _binary;
+  Arithmetic _arithmetic;
 };
 
 /**
  * A token representing a type. This could have been constructed from
  * a single token like "uint16" or from several like "uint16", "[", "3", "]"
- * if it is an array type,
+ * if it is an array type, or "uint16", "(", "uint16", ")" if it is a
+ * pointer to a function.
  */
 class TypeToken : public Token {
  public:
-  TypeToken() : _isArray(false), _arraySize(-1) { }
+  TypeToken() : _isArray(false), _arraySize(-1), _isFunction(false) { }
   TypeToken(const std::string& name, bool isArray = false, size_t arraySize = 0)
-    : _name(name), _isArray(isArray), _arraySize(arraySize) { }
+    : _name(name), _isArray(isArray), _arraySize(arraySize),
+      _isFunction(false) { }
+  /**
+   * Constructs the type of a pointer to a function with the given return
+   * type and parameter types.
+   */
+  TypeToken(const TypeToken& returnType,
+            const std::vector<TypeToken>& paramTypes);
   bool parse(Tokenizer *tokenizer,
              const std::vector<std::shared_ptr<FunctionToken>>& functions,
              const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
@@ -168,31 +254,79 @@ class TypeToken : public Token {
   std::string name() const { return _name; }
   bool isArray() const { return _isArray; }
   size_t arraySize() const { return _arraySize; }
+  /**
+   * Returns the type of the elements of an array of this type, or the
+   * type itself if it is not an array.
+   */
+  TypeToken elementType() const;
+  /**
+   * Returns true if values of this type are fix8_8 numbers, which have 8
+   * integer bits and 8 fraction bits.
+   */
+  bool isFixed() const {
+    return !_isArray && !_isFunction && "fix8_8" == _name;
+  }
+  /**
+   * Returns true if this is a pointer to a function, like
+   * "uint16(uint16, uint16)". Its name is "uint16", since the value is an
+   * address.
+   */
+  bool isFunction() const { return _isFunction; }
+  /**
+   * Returns the return type of the function this points to.
+   */
+  TypeToken returnType() const { return *_returnType; }
+  size_t numParams() const { return _paramTypes.size(); }
+  TypeToken paramType(size_t i) const { return _paramTypes.at(i); }
+  /**
+   * Returns a string that is the same for two function pointer types if
+   * and only if they point to the same kind of function, like
+   * "void(uint16,uint16)". For other types this is the type's name.
+   */
+  std::string signature() const;
+  /**
+   * Returns true if a value of the other type can be stored in a variable
+   * of this type. A function pointer can only hold the address of a
+   * function with the same signature.
+   */
+  bool canHold(const TypeToken& other) const;
  private:
+  /**
+   * Parses the parenthesized parameter types of a function pointer type
+   * that returns this type, and makes this the function pointer type.
+   */
+  bool _parseFunction(
+        Tokenizer *tokenizer,
+        const std::vector<std::shared_ptr<FunctionToken>>& functions,
+        const std::vector<std::shared_ptr<GlobalVarToken>>& globals);
   std::string _name;
   bool _isArray;
   uint16_t _arraySize;
+  bool _isFunction;
+  std::shared_ptr<TypeToken> _returnType;
+  std::vector<TypeToken> _paramTypes;
 };
 
 class VarLocation {
  public:
-  VarLocation() { }
-  VarLocation(const std::string& reg) : _reg(reg) { }
-  VarLocation(int offset) : _offset(offset) { }
-  VarLocation(const std::string& reg, int offset)
+  VarLocation() : _reg(NO_REG) { }
+  VarLocation(Reg reg) : _reg(reg) { }
+  VarLocation(int offset) : _reg(NO_REG), _offset(offset) { }
+  VarLocation(Reg reg, int offset)
     : _reg(reg), _offset(offset) { }
   /**
    * Returns true if the variable's location is stored in a register.
    */
-  bool isReg() const { return !_reg.empty(); }
+  bool isReg() const { return NO_REG != _reg; }
   /**
-   * Returns the assembly code representation of this register, like "A".
+   * Returns the register the variable is stored in.
    */
-  std::string getReg() const { return _reg; }
+  Reg getReg() const { return _reg; }
   /**
-   * Sets the assembly code representation of this register, like "A".
+   * Sets the register the variable is stored in, or NO_REG if it is not
+   * stored in a register.
    */
-  void setReg(const std::string& reg) { _reg = reg; }
+  void setReg(Reg reg) { _reg = reg; }
   /**
    * Returns the offset from the frame pointer in bytes at which this
    * variable is stored.
@@ -205,10 +339,10 @@ class VarLocation {
   void setOffset(int offset) { _offset = offset; }
  protected:
   /**
-   * The assembly code representation of this register, or the empty
-   * string if it is not stored in a register.
+   * The register the variable is stored in, or NO_REG if it is not
+   * stored in a register.
    */
-  std::string _reg;
+  Reg _reg;
   /**
    * The offset from the frame pointer in bytes at which this variable
    * is stored, if it is not in a register.
@@ -222,9 +356,11 @@ class VarLocation {
  */
 class Variable : public VarLocation {
  public:
-  Variable() : _canBeReg(true) { }
+  Variable() : _canBeReg(true), _bound(false), _boundValue(0),
+               _rangeMin(0), _rangeMax(0xffff) { }
   Variable(const TypeToken& type, const std::string& name)
-    : _type(type), _name(name), _canBeReg(true) { }
+    : _type(type), _name(name), _canBeReg(true),
+      _bound(false), _boundValue(0), _rangeMin(0), _rangeMax(0xffff) { }
   TypeToken type() const { return _type; }
   std::string name() const { return _name; }
   /**
@@ -236,10 +372,65 @@ class Variable : public VarLocation {
    * could be because it was used with an address operator.
    */
   void flagNonReg() { _canBeReg = false; }
+  /**
+   * Binds this variable to a value that is known while code is being
+   * generated, like a specialized parameter or an unrolled loop counter.
+   * Expressions treat a bound variable as a literal until it is unbound.
+   */
+  void bind(uint16_t value) { _bound = true; _boundValue = value; }
+  /**
+   * Binds this variable to the address of a function, like a function
+   * pointer parameter of a specialized function. Calls through a bound
+   * variable call the function directly.
+   */
+  void bindFunction(const std::shared_ptr<FunctionToken>& function) {
+    _boundFunction = function;
+  }
+  /**
+   * Removes the binding set with bind() or bindFunction().
+   */
+  void unbind() { _bound = false; _boundFunction = nullptr; }
+  /**
+   * Returns true if this variable is currently bound to a known value.
+   */
+  bool isBound() const { return _bound; }
+  /**
+   * Returns the value this variable is bound to.
+   */
+  uint16_t boundVal() const { return _boundValue; }
+  /**
+   * Returns the function this variable is bound to, or a null pointer if
+   * it isn't bound to one.
+   */
+  std::shared_ptr<FunctionToken> boundFunction() const {
+    return _boundFunction;
+  }
+  /**
+   * Limits the values this variable is known to have while code is being
+   * generated, like the counter of a loop within the loop body. Used to
+   * prove that array indices are in bounds.
+   */
+  void setRange(uint16_t min, uint16_t max) {
+    _rangeMin = min;
+    _rangeMax = max;
+  }
+  /**
+   * Returns the smallest value this variable is known to have.
+   */
+  uint16_t rangeMin() const { return _rangeMin; }
+  /**
+   * Returns the largest value this variable is known to have.
+   */
+  uint16_t rangeMax() const { return _rangeMax; }
  protected:
   TypeToken _type;
   std::string _name;
   bool _canBeReg;
+  bool _bound;
+  uint16_t _boundValue;
+  std::shared_ptr<FunctionToken> _boundFunction;
+  uint16_t _rangeMin;
+  uint16_t _rangeMax;
 };
 
 /**
@@ -251,7 +442,8 @@ class Variable : public VarLocation {
 class GlobalVarToken : public Token, public Variable {
  public:
   GlobalVarToken(const TypeToken& type, const std::string& name)
-    : Variable(type, name) { }
+    : Variable(type, name), _inBss(false), _compressed(false),
+      _encoding(RLE_ENCODING) { }
   /**
    * Parses out a global variable declaration from source code
    * and validates it.
@@ -263,13 +455,77 @@ class GlobalVarToken : public Token, public Variable {
    * Outputs assembly code for this global variable declaration.
    */
   void output(Parser *parser);
+  /**
+   * Outputs code that stores the addresses of the functions in the
+   * initial value of this global, which is run before main() since
+   * addresses can't be written as data.
+   */
+  void outputFunctions(Parser *parser);
   uint16_t val() const { return _value; }
   bool isArray() const { return _type.isArray(); }
   uint16_t arraySize() const { return _arrayValues.size(); }
   uint16_t arrayVal(int i) const { return _arrayValues.at(i); }
+  /**
+   * Returns the functions whose addresses are in the initial value.
+   */
+  std::vector<std::shared_ptr<FunctionToken>> functions() const;
+  /**
+   * Returns true if this is an array whose elements all start out as
+   * zero, and that isn't compressed.
+   */
+  bool isZeroArray() const;
+  /**
+   * Sets whether the elements of this array are kept after the program
+   * instead of being written out as data. Their address is then stored
+   * before main() is called, and they are cleared.
+   */
+  void setInBss(bool inBss) { _inBss = inBss; }
+  /**
+   * Sets whether this array is declared "compressed", which has to be
+   * done before it is parsed. Its elements are then written out as a
+   * compressed stream, which decompress() expands into a buffer.
+   */
+  void setCompressed(bool compressed) { _compressed = compressed; }
+  bool isCompressed() const { return _compressed; }
+  /**
+   * Returns the encoding of a compressed array, whichever of them gave
+   * the smaller stream.
+   */
+  Encoding encoding() const { return _encoding; }
+  /**
+   * Returns the compressed stream that is written out for a compressed
+   * array.
+   */
+  const std::vector<uint16_t>& stream() const { return _stream; }
  private:
+  /**
+   * Parses an initializer like 'embed("file.bin", little, bytes)', which
+   * sets the elements of the array to the contents of the file. The path
+   * is relative to the source file. Two bytes are packed into each
+   * element in big endian order, unless "little" or "bytes" say to use
+   * little endian order or one byte per element. Elements past the end of
+   * the file are zero. Returns false if the file can't be read or doesn't
+   * fit in the array.
+   */
+  bool _parseEmbed(Tokenizer *tokenizer);
+  /**
+   * Compresses the elements of the array with each encoding, and keeps
+   * the smaller stream. Returns false if some of the elements are
+   * function addresses, which aren't known until the program is output.
+   */
+  bool _compress();
   uint16_t _value;
   std::vector<uint16_t> _arrayValues;
+  bool _inBss;
+  bool _compressed;
+  Encoding _encoding;
+  std::vector<uint16_t> _stream;
+  /**
+   * The functions whose addresses are the initial values of the elements
+   * of the array, or of the variable itself if it isn't an array. Null
+   * for values that aren't function addresses.
+   */
+  std::vector<std::shared_ptr<FunctionToken>> _functions;
 };
 
 /**
@@ -295,16 +551,40 @@ class FunctionToken : public Token,
  public:
   FunctionToken(const TypeToken& type, const std::string& name,
                 const std::vector<std::shared_ptr<ParamToken>>& params)
-    : _type(type), _name(name), _parameters(params) { }
+    : _type(type), _name(name), _parameters(params), _unrollLoops(false),
+      _instances(0), _spriteWidth(0), _transparent(-1) { }
   FunctionToken(const TypeToken& type, const std::string& name)
-    : _type(type), _name(name) { }
+    : _type(type), _name(name), _unrollLoops(false), _instances(0),
+      _spriteWidth(0), _transparent(-1) { }
+  /**
+   * Creates a copy of this function with the given name where the
+   * parameters at the given indices are bound to constant values. The
+   * copy shares its body with this function, and its remaining
+   * parameters keep their relative order.
+   */
+  std::shared_ptr<FunctionToken> specialize(
+        const std::string& name,
+        const std::vector<std::pair<size_t, uint16_t>>& constParams,
+        const std::vector<std::pair<size_t, std::shared_ptr<FunctionToken>>>&
+          functionParams = {}) const;
   /**
    * Parses source code for a function and validates it. Returns false
-   * if there are errors in parsing the function.
+   * if there are errors in parsing the function. If parseBody is false,
+   * only the parameters are parsed and the tokenizer is left at the '{'
+   * that starts the body, which can be parsed later with parseBody().
    */
   bool parse(Tokenizer *tokenizer,
              std::vector<std::shared_ptr<FunctionToken>>& functions,
-             std::vector<std::shared_ptr<GlobalVarToken>>& globals);
+             std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+             bool parseBody = true);
+  /**
+   * Parses the body of the function starting at the '{' and validates it,
+   * given the functions and globals declared before it. Returns false if
+   * there are errors in parsing the body.
+   */
+  bool parseBody(Tokenizer *tokenizer,
+                 const std::vector<std::shared_ptr<FunctionToken>>& functions,
+                 const std::vector<std::shared_ptr<GlobalVarToken>>& globals);
   /**
    * Outputs assembly code for this function.
    */
@@ -315,10 +595,70 @@ class FunctionToken : public Token,
    * string if the source-level label does not exist.
    */
   std::string toAsmLabel(const std::string& srcLabel);
+  /**
+   * Returns true if the parameter at the given index is never assigned
+   * to and never has its address taken, so a constant argument for it
+   * can be substituted into the function body.
+   */
+  bool isParamConstant(size_t i) const;
+  /**
+   * Returns true if this function was created by specialize().
+   */
+  bool isSpecialization() const {
+    return !_boundParams.empty() || !_boundFunctionParams.empty();
+  }
+  /**
+   * Returns true if loops with a trip count known at compile time should
+   * be fully unrolled when outputting this function.
+   */
+  bool unrollsLoops() const { return _unrollLoops; }
+  void setUnrollsLoops(bool unroll) { _unrollLoops = unroll; }
+  /**
+   * Makes this function a coroutine with the given number of instances.
+   * Each call resumes an instance where it last yielded, and its local
+   * variables are kept in a frame record for the instance between calls.
+   */
+  void setCoroutine(size_t instances) { _instances = instances; }
+  bool isCoroutine() const { return 0 < _instances; }
+  /**
+   * Returns the number of instances of a coroutine, which are resumed
+   * like "f[i]()" if there is more than one.
+   */
+  size_t instances() const { return _instances; }
+  /**
+   * Returns the number of bytes in the frame record of one instance of a
+   * coroutine, which holds the address to resume at and the variables
+   * that are kept between calls.
+   */
+  int frameSize() const;
+  /**
+   * Outputs the zeroed frame records of the instances of a coroutine.
+   */
+  void outputFrames(Parser *parser);
+  /**
+   * Makes this function, which takes the parameters "uint16 x, uint16 y",
+   * a sprite that draws the bitmap with its top left corner at (x, y).
+   * The bitmap holds the colors of the pixels row by row, and pixels with
+   * the transparent color are skipped, unless it is -1. Returns false if
+   * the bitmap isn't a uint16 array of whole rows of the given width.
+   */
+  bool makeSprite(const GlobalVarToken& bitmap, size_t width,
+                  int transparent);
+  bool isSprite() const { return 0 < _spriteWidth; }
   TypeToken type() const { return _type; }
+  /**
+   * Returns the type of a pointer to this function.
+   */
+  TypeToken pointerType() const;
   std::string name() const { return _name; }
   size_t numParams() const { return _parameters.size(); }
   std::shared_ptr<ParamToken> getParam(int i) const { return _parameters.at(i); }
+  const std::vector<std::shared_ptr<LocalVarToken>>& localVars() const {
+    return _localVars;
+  }
+  const std::vector<std::shared_ptr<StatementToken>>& statements() const {
+    return _statements;
+  }
  private:
   TypeToken _type;
   std::string _name;
@@ -327,9 +667,197 @@ class FunctionToken : public Token,
   std::vector<std::shared_ptr<LabelStatement>> _labels;
   std::vector<std::shared_ptr<GotoStatement>> _gotos;
   std::vector<std::shared_ptr<StatementToken>> _statements;
-  std::stack<std::string> _savedRegisters;
+  RegSet _savedRegisters;
+  /**
+   * Parameters of the original function that are bound to constant
+   * values in this specialization, and the values they are bound to.
+   */
+  std::vector<std::pair<std::shared_ptr<ParamToken>, uint16_t>> _boundParams;
+  /**
+   * Function pointer parameters of the original function that are bound
+   * to known functions in this specialization.
+   */
+  std::vector<std::pair<std::shared_ptr<ParamToken>,
+                        std::shared_ptr<FunctionToken>>> _boundFunctionParams;
+  bool _unrollLoops;
+  /**
+   * Outputs assembly code for a coroutine, which finds the frame record of
+   * the instance being resumed and jumps to where it last yielded.
+   */
+  void _outputCoroutine(Parser *parser);
+  /**
+   * The number of instances if this is a coroutine, or zero otherwise.
+   */
+  size_t _instances;
+  /**
+   * The assembly-level label of the frame records of a coroutine.
+   */
+  std::string _frameLabel;
+  /**
+   * Outputs assembly code for a sprite, which draws each pixel that isn't
+   * transparent with its own PIXEL instruction.
+   */
+  void _outputSprite(Parser *parser);
+  /**
+   * Returns the instructions that draw the given pixels of a sprite in
+   * order, given as indices into its bitmap.
+   */
+  std::vector<std::string> _spriteInsts(
+        const std::vector<size_t>& pixels) const;
+  /**
+   * The width of the bitmap if this is a sprite, or zero otherwise, and
+   * the bitmap and transparent color of a sprite.
+   */
+  size_t _spriteWidth;
+  std::vector<uint16_t> _spritePixels;
+  int _transparent;
+};
+
+/**
+ * The tokens of an expression in postfix order, stored as a flat array of
+ * small nodes. A literal's value is kept in its node, operators are kept
+ * by value in a table of their own, and variables, calls, and addresses
+ * are kept in a table of symbols, so that walking an expression only
+ * follows a pointer for the tokens that are shared with the rest of the
+ * program.
+ */
+class Postfix {
+ public:
+  enum Kind : uint8_t {
+    LITERAL, FIXED_LITERAL, OPERATOR, GLOBAL, PARAM, LOCAL, CALL,
+    FUNCTION_ADDRESS, LABEL_ADDRESS
+  };
+  size_t size() const { return _nodes.size(); }
+  bool empty() const { return _nodes.empty(); }
+  Kind kind(size_t i) const { return _nodes[i].kind; }
+  bool isOperator(size_t i) const { return OPERATOR == _nodes[i].kind; }
+  bool isLiteral(size_t i) const {
+    return LITERAL == _nodes[i].kind || FIXED_LITERAL == _nodes[i].kind;
+  }
+  bool isVariable(size_t i) const {
+    return GLOBAL == _nodes[i].kind || PARAM == _nodes[i].kind ||
+      LOCAL == _nodes[i].kind;
+  }
+  /**
+   * Returns the value of the literal at the given index.
+   */
+  uint16_t literal(size_t i) const { return _nodes[i].index; }
+  /**
+   * Returns the operator at the given index.
+   */
+  const OperatorToken& op(size_t i) const {
+    return _operators[_nodes[i].index];
+  }
+  OperatorToken& op(size_t i) { return _operators[_nodes[i].index]; }
+  /**
+   * Returns the variable, call, or address at the given index, or a null
+   * pointer for a literal or operator.
+   */
+  std::shared_ptr<Token> symbol(size_t i) const;
+  /**
+   * Return the token at the given index if it is of the type asked for,
+   * or a null pointer otherwise.
+   */
+  std::shared_ptr<Variable> variable(size_t i) const;
+  std::shared_ptr<GlobalVarToken> global(size_t i) const;
+  std::shared_ptr<FunctionCallToken> call(size_t i) const;
+  std::shared_ptr<FunctionAddressToken> functionAddress(size_t i) const;
+  std::shared_ptr<LabelAddressToken> labelAddress(size_t i) const;
+  /**
+   * Returns the line number of the token at the given index, or -1 for a
+   * literal.
+   */
+  int line(size_t i) const;
+  /**
+   * Appends a token.
+   */
+  void pushLiteral(uint16_t value, bool fixed = false);
+  void push(const OperatorToken& op);
+  void push(const std::shared_ptr<GlobalVarToken>& global);
+  void push(const std::shared_ptr<ParamToken>& param);
+  void push(const std::shared_ptr<LocalVarToken>& local);
+  void push(const std::shared_ptr<FunctionCallToken>& call);
+  void push(const std::shared_ptr<FunctionAddressToken>& address);
+  void push(const std::shared_ptr<LabelAddressToken>& address);
+  /**
+   * Appends the token at the given index of another expression, or all of
+   * its tokens.
+   */
+  void push(const Postfix& other, size_t i);
+  void append(const Postfix& other);
+  /**
+   * Inserts an operator before the token at the given index.
+   */
+  void insert(size_t pos, const OperatorToken& op);
+  /**
+   * Evaluates the tokens in [begin, end) with a stack of values of type T,
+   * which is how every pass over an expression walks it. Each operand is
+   * pushed as the value that leaf(i, value) sets, and each operator pops
+   * its operands and pushes the value that apply(i, lhs, rhs, value) sets,
+   * where lhs is T() for a unary operator. Either one can return false to
+   * stop. Returns true and sets result if the tokens form one expression.
+   */
+  template <typename T, typename Leaf, typename Apply>
+  bool walk(size_t begin, size_t end, Leaf leaf, Apply apply,
+            T& result) const {
+    std::vector<T> stack;
+    stack.reserve(end - begin);
+    for (size_t i = begin; i < end; i++) {
+      T value = T();
+      if (OPERATOR != _nodes[i].kind) {
+        if (!leaf(i, value)) {
+          return false;
+        }
+      } else {
+        size_t arity = op(i).isBinary() ? 2 : 1;
+        if (stack.size() < arity) {
+          return false;
+        }
+        T rhs = std::move(stack.back());
+        stack.pop_back();
+        T lhs = T();
+        if (2 == arity) {
+          lhs = std::move(stack.back());
+          stack.pop_back();
+        }
+        if (!apply(i, lhs, rhs, value)) {
+          return false;
+        }
+      }
+      stack.push_back(std::move(value));
+    }
+    if (1 != stack.size()) {
+      return false;
+    }
+    result = std::move(stack.back());
+    return true;
+  }
+  template <typename T, typename Leaf, typename Apply>
+  bool walk(Leaf leaf, Apply apply, T& result) const {
+    return walk(0, _nodes.size(), leaf, apply, result);
+  }
+ private:
+  /**
+   * Appends a node, where index is a literal's value or the index of an
+   * operator or symbol in its table.
+   */
+  void _push(Kind kind, size_t index);
+  void _pushSymbol(Kind kind, const std::shared_ptr<Token>& symbol);
+  struct Node {
+    Kind kind;
+    uint16_t index;
+  };
+  std::vector<Node> _nodes;
+  std::vector<OperatorToken> _operators;
+  std::vector<std::shared_ptr<Token>> _symbols;
 };
 
+/**
+ * How likely a branch is to be taken, from a hint in the code or from
+ * static heuristics.
+ */
+enum Likelihood { LIKELY, UNLIKELY, UNPREDICTED };
+
 /**
  * A token representing an expression like "(a+b)*(c-d)". It parses out an
  * expression tree of operators, literals, variables, and function calls
@@ -337,25 +865,149 @@ class FunctionToken : public Token,
  */
 class ExprToken : public Token {
  public:
-  ExprToken() : _const(true), _value(0) { }
+  ExprToken() : _const(true), _value(0), _assumed(false), _assumedValue(0),
+                _type("uint16") { }
   ExprToken(uint16_t value);
+  /**
+   * Constructs an expression for a lone literal, the same as parsing it.
+   */
+  ExprToken(const LiteralToken& literal);
+  /**
+   * Constructs an expression from tokens that are already in postfix
+   * order, like the function pointer of a call through one.
+   */
+  ExprToken(const Postfix& postfix, const TypeToken& type);
+  /**
+   * Parses an expression. If isStatement is true, the expression may be a
+   * call through a pointer to a function that returns void, since its
+   * value is discarded.
+   */
   bool parse(Tokenizer *tokenizer,
              const std::vector<std::shared_ptr<FunctionToken>>& functions,
              const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
              const std::vector<std::shared_ptr<ParamToken>>& parameters = {},
-             const std::vector<std::shared_ptr<LocalVarToken>>& localVars = {});
+             const std::vector<std::shared_ptr<LocalVarToken>>& localVars = {},
+             bool isStatement = false);
   bool isConst() const { return _const; }
   uint16_t val() const { return _value; }
+  /**
+   * Returns true if the expression is constant or a variable kept in a
+   * register, so that it can be output into a register without using any
+   * of the others.
+   */
+  bool isSimple() const;
+  /**
+   * Returns the type of the expression's value, which is a function
+   * pointer type for things like "&func" or "table[i]" where table is an
+   * array of function pointers.
+   */
+  TypeToken type() const { return _type; }
+  /**
+   * Converts the value of the expression to the given type, like when it
+   * is assigned to a variable or passed as an argument. Only conversions
+   * between uint16 and fix8_8 values need any code.
+   */
+  void convertTo(const TypeToken& type);
+  /**
+   * If the expression is the address of a function, like "&func", or a
+   * variable that is bound to one, returns the function. Otherwise returns
+   * a null pointer.
+   */
+  std::shared_ptr<FunctionToken> evaluateFunction() const;
+  /**
+   * Tries to evaluate the expression using only literals and variables
+   * that are currently bound to values. Unlike isConst(), global variables
+   * are not treated as constants since they may change at runtime. Returns
+   * true and sets value if successful.
+   */
+  bool evaluateBound(uint16_t& value) const;
+  /**
+   * Returns true if the expression or one of its function call arguments
+   * assigns directly to the given variable.
+   */
+  bool assigns(const Variable *var) const;
+  /**
+   * If the expression is a plain assignment like "x = EXPR" and x is a
+   * local variable or parameter, returns x.
+   * Otherwise returns a null pointer.
+   */
+  std::shared_ptr<Variable> assignedVar() const;
+  /**
+   * For a plain assignment like "x = EXPR", tries to evaluate EXPR in the
+   * same way as evaluateBound().
+   */
+  bool evaluateAssignedBound(uint16_t& value) const;
+  /**
+   * Appends the function calls made by this expression, including calls
+   * nested in the arguments of other calls, to calls.
+   */
+  void getCalls(std::vector<std::shared_ptr<FunctionCallToken>>& calls) const;
+  /**
+   * Appends the functions whose addresses are taken by this expression,
+   * including in the arguments of the calls it makes, to functions.
+   */
+  void getFunctionAddresses(
+        std::vector<std::shared_ptr<FunctionToken>>& functions) const;
+  /**
+   * If the whole expression is a call like "likely(EXPR)" or
+   * "unlikely(EXPR)", returns LIKELY or UNLIKELY and sets hinted to EXPR.
+   * Otherwise returns UNPREDICTED and leaves hinted alone.
+   */
+  Likelihood hint(std::shared_ptr<ExprToken>& hinted) const;
+  /**
+   * Returns true if the expression has the same tokens as the other one,
+   * so that they compute the same value. Expressions with function calls
+   * are never the same.
+   */
+  bool sameAs(const ExprToken& other) const;
+  /**
+   * Makes evaluateBound() treat the expression as having the given value
+   * until unassume() is called, like when outputting a copy of a loop for
+   * one value of a condition that doesn't change inside of it.
+   */
+  void assume(uint16_t value) { _assumed = true; _assumedValue = value; }
+  /**
+   * Removes the value set with assume().
+   */
+  void unassume() { _assumed = false; }
+  /**
+   * Returns the tokens of the expression in postfix order.
+   */
+  const Postfix& postfix() const { return _postfix; }
   /**
    * Outputs assembly code to evaluate the given expression and store the
    * result in the given register, reg.
    */
   void output(Parser *parser, const VarLocation& varLoc);
+  /**
+   * Outputs assembly code to evaluate the expression as a condition and
+   * jump to label if it is true, or if it is false when jumpIf is false.
+   */
+  void outputBranch(Parser *parser, bool jumpIf, const std::string& label);
  private:
+  /**
+   * Evaluates the tokens of the postfix expression in [begin, end) like
+   * evaluateBound().
+   */
+  bool _evaluateBound(size_t begin, size_t end, uint16_t& value) const;
+  /**
+   * Parses the rest of a use of a function pointer variable whose name has
+   * just been consumed, which is either a call through it like "f(x)" or
+   * "table[i](x)", or its value.
+   */
+  bool _parseFunctionPointer(
+        Tokenizer *tokenizer,
+        const Postfix& var,
+        const TypeToken& varType,
+        const std::vector<std::shared_ptr<FunctionToken>>& functions,
+        const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+        const std::vector<std::shared_ptr<ParamToken>>& parameters,
+        const std::vector<std::shared_ptr<LocalVarToken>>& localVars);
   /**
    * Validates the expression to see if it will compile. Prints errors if
    * using an rvalue on the left side of an assignment, etc. Returns true
-   * if the expression is valid, or false otherwise.
+   * if the expression is valid, or false otherwise. Also sets the type of
+   * the expression.
    */
   bool _validate();
   /**
@@ -379,9 +1031,18 @@ class ExprToken : public Token {
    */
   uint16_t _value;
   /**
-   * A list of tokens in this expression, in postfix notation.
+   * The tokens of this expression, in postfix notation.
    */
-  std::vector<std::shared_ptr<Token>> _postfix;
+  Postfix _postfix;
+  /**
+   * Whether the expression has a value set with assume(), and the value.
+   */
+  bool _assumed;
+  uint16_t _assumedValue;
+  /**
+   * The type of the expression's value.
+   */
+  TypeToken _type;
 };
 
 /**
@@ -396,9 +1057,25 @@ class ArrayExprToken : public Token {
              const std::vector<std::shared_ptr<ParamToken>>& parameters = {},
              const std::vector<std::shared_ptr<LocalVarToken>>& localVars = {});
   size_t size() const { return _exprs.size(); }
-  std::shared_ptr<ExprToken> get(int i) const { return _exprs[i]; }
+  /**
+   * Returns the expression for the element at the given index, which is
+   * built from the literal if the element is a lone literal.
+   */
+  std::shared_ptr<ExprToken> get(int i) const;
+  /**
+   * Returns true if the element at the given index is a lone literal like
+   * "0x1f", whose value is given by literal() without building an
+   * expression for it.
+   */
+  bool isLiteral(int i) const { return nullptr == _exprs[i]; }
+  const LiteralToken& literal(int i) const { return _literals[i]; }
  private:
+  /**
+   * The expression for each element, or a null pointer for an element
+   * that is a lone literal, which is in _literals at the same index.
+   */
   std::vector<std::shared_ptr<ExprToken>> _exprs;
+  std::vector<LiteralToken> _literals;
 };
 
 /**
@@ -412,14 +1089,74 @@ class FunctionCallToken : public Token {
              const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
              const std::vector<std::shared_ptr<ParamToken>>& parameters,
              const std::vector<std::shared_ptr<LocalVarToken>>& localVars);
+  /**
+   * Parses the arguments of a call through a function pointer, where the
+   * target is an expression for the pointer with the given type.
+   */
+  bool parseIndirect(
+        Tokenizer *tokenizer,
+        const std::shared_ptr<ExprToken>& target,
+        const TypeToken& targetType,
+        const std::vector<std::shared_ptr<FunctionToken>>& functions,
+        const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+        const std::vector<std::shared_ptr<ParamToken>>& parameters,
+        const std::vector<std::shared_ptr<LocalVarToken>>& localVars);
   /**
    * Outputs the assembly code for this function call.
    */
   void output(Parser *parser);
+  /**
+   * Makes this call target the function with the given name instead,
+   * removing the arguments at the given indices. Used to point call
+   * sites at specialized copies of a function.
+   */
+  void redirect(const std::string& funcName, const std::vector<size_t>& removed);
+  /**
+   * Returns the name of the called function, or the empty string for a
+   * call through a function pointer.
+   */
   std::string funcName() const { return _funcName; }
+  /**
+   * Returns the expression for the function pointer that is called
+   * through, or a null pointer if the function is called by name.
+   */
+  std::shared_ptr<ExprToken> target() const { return _target; }
+  /**
+   * Returns the expression for the instance of a coroutine that is
+   * resumed, like i in "f[i]()", or a null pointer.
+   */
+  std::shared_ptr<ExprToken> instance() const { return _instance; }
+  /**
+   * Returns the return type of the called function.
+   */
+  TypeToken type() const { return _type; }
+  /**
+   * Appends the expressions evaluated to make the call to exprs, which are
+   * the arguments and the function pointer or coroutine instance if there
+   * is one.
+   */
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
   size_t numArgs() const { return _arguments.size(); }
+  std::shared_ptr<ExprToken> getArg(int i) const { return _arguments.at(i); }
  private:
+  /**
+   * Parses the parenthesized arguments and checks them against the
+   * parameter types of the function being called.
+   */
+  bool _parseArgs(Tokenizer *tokenizer,
+                  const TypeToken& functionType,
+                  const std::vector<std::shared_ptr<FunctionToken>>& functions,
+                  const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+                  const std::vector<std::shared_ptr<ParamToken>>& parameters,
+                  const std::vector<std::shared_ptr<LocalVarToken>>& localVars);
+  /**
+   * Outputs the first two arguments of a builtin into M and N.
+   */
+  void _outputArgsToMN(Parser *parser);
   std::string _funcName;
+  std::shared_ptr<ExprToken> _target;
+  std::shared_ptr<ExprToken> _instance;
+  TypeToken _type;
   std::vector<std::shared_ptr<ExprToken>> _arguments;
 };
 
@@ -452,6 +1189,44 @@ class StatementToken : public Token {
                       const std::string& returnLabel,
                       const std::string& breakLabel = "",
                       const std::string& continueLabel = "");
+  /**
+   * Appends the expressions evaluated directly by this statement to
+   * exprs. Does nothing by default.
+   */
+  virtual void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+  /**
+   * Appends the statements nested directly inside of this statement to
+   * children. Does nothing by default.
+   */
+  virtual void getChildren(
+        std::vector<std::shared_ptr<StatementToken>>& children) const;
+  /**
+   * The deepest that statements can be nested inside each other, where
+   * "if (x) { ... }" is two levels, one for the if statement and one for
+   * the braces. The passes over a function handle each level recursively,
+   * so this keeps deeply nested generated code from overflowing the stack.
+   * A chain of "else if" parts only counts as one level.
+   */
+  static const int MAX_NESTING = 2000;
+ private:
+  /**
+   * Parses the next statement once parse() has checked how deeply it is
+   * nested.
+   */
+  static std::shared_ptr<StatementToken> _parseNested(
+        Tokenizer *tokenizer,
+        const std::vector<std::shared_ptr<FunctionToken>>& functions,
+        const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+        const std::vector<std::shared_ptr<ParamToken>>& parameters,
+        const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+        std::vector<std::shared_ptr<LabelStatement>>& labels,
+        std::vector<std::shared_ptr<GotoStatement>>& gotos,
+        const std::shared_ptr<FunctionToken>& currentFunc,
+        bool inLoop);
+  /**
+   * The number of statements currently being parsed inside each other.
+   */
+  static int _nesting;
 };
 
 /**
@@ -476,6 +1251,12 @@ class CompoundStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getChildren(
+        std::vector<std::shared_ptr<StatementToken>>& children) const;
+  CompoundStatement() { }
+  CompoundStatement(
+        const std::vector<std::shared_ptr<StatementToken>>& statements)
+    : _statements(statements) { }
  private:
   std::vector<std::shared_ptr<StatementToken>> _statements;
 };
@@ -499,6 +1280,7 @@ class LocalVarToken : public StatementToken, public Variable {
 	      const std::string& = "",
 	      const std::string& = "",
 	      const std::string& = "");
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
   /**
    * Sets the location of the start of data as an offset from the frame pointer,
    * used for array variables.
@@ -538,8 +1320,9 @@ class ExprStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
  private:
-  ExprToken _expr;
+  std::shared_ptr<ExprToken> _expr;
 };
 
 /**
@@ -560,8 +1343,10 @@ class VoidStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+  std::shared_ptr<FunctionCallToken> call() const { return _fnCall; }
  private:
-  FunctionCallToken _fnCall;
+  std::shared_ptr<FunctionCallToken> _fnCall;
 };
 
 /**
@@ -576,6 +1361,7 @@ class NullStatement : public StatementToken {
  */
 class IfStatement : public StatementToken {
  public:
+  ~IfStatement();
   bool parse(Tokenizer *tokenizer,
              const std::vector<std::shared_ptr<FunctionToken>>& functions,
              const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
@@ -593,8 +1379,29 @@ class IfStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+  void getChildren(
+        std::vector<std::shared_ptr<StatementToken>>& children) const;
+  /**
+   * Returns the condition that is tested, without a likely() or unlikely()
+   * hint around it.
+   */
+  std::shared_ptr<ExprToken> testedExpr() const;
  private:
-  ExprToken _condExpr;
+  /**
+   * Outputs this if statement up to the statement that goes last before
+   * its end label, and returns that statement without outputting it, so
+   * that a chain of "else if" parts can be output in a loop. The code
+   * that goes after the returned statement is appended to finish.
+   */
+  std::shared_ptr<StatementToken> _outputTest(
+        Parser *parser,
+        const std::shared_ptr<FunctionToken>& function,
+        const std::string& returnLabel,
+        const std::string& breakLabel,
+        const std::string& continueLabel,
+        std::vector<std::function<void()>>& finish);
+  std::shared_ptr<ExprToken> _condExpr;
   std::shared_ptr<StatementToken> _trueStatement;
   std::shared_ptr<StatementToken> _falseStatement;
   bool _hasElse;
@@ -604,9 +1411,60 @@ class IfStatement : public StatementToken {
  * A token representing a generic loop.
  */
 class LoopStatement : public StatementToken {
+ public:
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+  void getChildren(
+        std::vector<std::shared_ptr<StatementToken>>& children) const;
  protected:
+  LoopStatement() : _unswitching(false) { }
+  /**
+   * Tries to output the loop twice, once for each value of the condition
+   * of an if statement in the body that doesn't change while the loop
+   * runs, with a test of the condition up front that picks one. Each copy
+   * only has the branch of the if statement that it takes. Returns false
+   * and outputs nothing if there is no such condition, if the loop calls
+   * a function, or if the copies don't fit in the unswitching budget.
+   */
+  bool _outputUnswitched(Parser *parser,
+                         const std::shared_ptr<FunctionToken>& function,
+                         const std::string& returnLabel);
+  /**
+   * Outputs the body of the loop. When checking array bounds, the loop
+   * variable is limited to the range it can have in the body, if known.
+   */
+  void _outputBody(Parser *parser,
+                   const std::shared_ptr<FunctionToken>& function,
+                   const std::string& returnLabel,
+                   const std::string& breakLabel,
+                   const std::string& continueLabel);
+  /**
+   * Finds the range of values that a variable has whenever the body of the
+   * loop starts. Returns null if no variable's range is known.
+   */
+  virtual std::shared_ptr<Variable> _bodyRange(Parser *parser,
+                                               uint16_t& min,
+                                               uint16_t& max) const;
+  /**
+   * Outputs the loop with its condition tested at the bottom, so that the
+   * jump back to the start is taken and exiting falls through. The loop
+   * expressions are evaluated before each test but the first.
+   */
+  void _outputRotated(Parser *parser,
+                      const std::shared_ptr<FunctionToken>& function,
+                      const std::string& returnLabel,
+                      const std::shared_ptr<ExprToken>& condExpr,
+                      const std::vector<std::shared_ptr<ExprToken>>& loopExprs,
+                      const std::string& startLabel,
+                      const std::string& condLabel,
+                      const std::string& breakLabel,
+                      const std::string& continueLabel);
   std::shared_ptr<ExprToken> _condExpr;
   std::shared_ptr<StatementToken> _body;
+  /**
+   * True while the loop is being output without unswitching, to compare
+   * against the unswitched copies.
+   */
+  bool _unswitching;
 };
 
 /**
@@ -630,7 +1488,30 @@ class ForStatement : public LoopStatement {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+  /**
+   * Returns a single loop that runs the bodies of first and second one
+   * after the other in each iteration, or null if the loops don't have
+   * the same header or if running them together could change what they
+   * compute.
+   */
+  static std::shared_ptr<ForStatement> fuse(
+        const std::shared_ptr<ForStatement>& first,
+        const std::shared_ptr<ForStatement>& second);
+ protected:
+  std::shared_ptr<Variable> _bodyRange(Parser *parser,
+                                       uint16_t& min,
+                                       uint16_t& max) const;
  private:
+  /**
+   * Tries to output the loop fully unrolled, binding the loop variable to
+   * its value in each iteration. Only done in functions that unroll loops,
+   * when the trip count is known at compile time. Returns false and outputs
+   * nothing if the loop can't be unrolled.
+   */
+  bool _outputUnrolled(Parser *parser,
+                       const std::shared_ptr<FunctionToken>& function,
+                       const std::string& returnLabel);
   std::vector<std::shared_ptr<ExprToken>> _initExprs;
   std::vector<std::shared_ptr<ExprToken>> _loopExprs;
 };
@@ -735,11 +1616,38 @@ class ReturnStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
  private:
-  ExprToken _returnExpr;
+  std::shared_ptr<ExprToken> _returnExpr;
   bool _hasExpr;
 };
 
+/**
+ * A token representing a yield statement in a coroutine, like
+ * "yield EXPR;". The coroutine returns the value of EXPR, if any, and
+ * resumes after the yield statement the next time it is called.
+ */
+class YieldStatement : public StatementToken {
+ public:
+  bool parse(Tokenizer *tokenizer,
+             const std::vector<std::shared_ptr<FunctionToken>>& functions,
+             const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+             const std::vector<std::shared_ptr<ParamToken>>& parameters,
+             const std::vector<std::shared_ptr<LocalVarToken>>& localVars,
+             const std::shared_ptr<FunctionToken>& currentFunc);
+  /**
+   * Outputs the assembly code for this statement.
+   */
+  void output(Parser *parser,
+              const std::shared_ptr<FunctionToken>& function,
+              const std::string& returnLabel,
+              const std::string& breakLabel,
+              const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
+ private:
+  std::shared_ptr<ExprToken> _yieldExpr;
+};
+
 /**
  * A token representing a label declaration that can be jumped to
  * with a goto statement. Looks like a name followed by a colon.
@@ -779,7 +1687,11 @@ class LabelStatement : public StatementToken {
  */
 class GotoStatement : public StatementToken {
  public:
-  bool parse(Tokenizer *tokenizer);
+  bool parse(Tokenizer *tokenizer,
+             const std::vector<std::shared_ptr<FunctionToken>>& functions,
+             const std::vector<std::shared_ptr<GlobalVarToken>>& globals,
+             const std::vector<std::shared_ptr<ParamToken>>& parameters,
+             const std::vector<std::shared_ptr<LocalVarToken>>& localVars);
   /**
    * Outputs the assembly code for this statement.
    */
@@ -788,12 +1700,18 @@ class GotoStatement : public StatementToken {
               const std::string& returnLabel,
               const std::string& breakLabel,
               const std::string& continueLabel);
+  void getExprs(std::vector<std::shared_ptr<ExprToken>>& exprs) const;
   /**
-   * Returns the source-level label.
+   * Returns the source-level label, or the empty string for a computed
+   * goto like "goto *EXPR;".
    */
   std::string label() const { return _label; }
  private:
   std::string _label;
+  /**
+   * The expression giving the address to jump to, for a computed goto.
+   */
+  std::shared_ptr<ExprToken> _target;
 };
 
 #endif
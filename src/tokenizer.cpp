@@ -8,8 +8,8 @@
 #include <unistd.h>
 #include "tokenizer.h"
 
-Tokenizer::Tokenizer(char *filename) : _offset(0), _lineNum(1),
-                                       _hasNext(false) {
+Tokenizer::Tokenizer(char *filename) : _filename(filename), _offset(0),
+                                       _lineNum(1), _hasNext(false) {
   std::ifstream inputStream(filename);
   inputStream.seekg(0, std::ios::end);
   _data.reserve(inputStream.tellg());
@@ -67,6 +67,23 @@ AtomToken Tokenizer::getNext() {
       } else {
         multiComment = true;
       }
+    // If next character starts a string like "file.bin", break if we
+    // have a partial token, otherwise take everything up to the closing
+    // quote as the token, including the quotes. A string can't span
+    // lines.
+    } else if ('"' == _data[_offset]) {
+      if (0 == token.length()) {
+        do {
+          token += _data[_offset];
+          _offset++;
+        } while (_offset < _data.length() && '"' != _data[_offset] &&
+                 '\n' != _data[_offset]);
+        if (_offset < _data.length() && '"' == _data[_offset]) {
+          token += _data[_offset];
+          _offset++;
+        }
+      }
+      break;
     // If next two characters form a known two-character operator,
     // break if we have a partial token, otherwise set the next
     // two characters as the token and break.
@@ -122,3 +139,14 @@ AtomToken Tokenizer::peekNext() {
   _hasNext = true;
   return _next;
 }
+
+Tokenizer::Position Tokenizer::position() const {
+  return { _offset, _lineNum, _hasNext, _next };
+}
+
+void Tokenizer::seek(const Position& position) {
+  _offset = position.offset;
+  _lineNum = position.lineNum;
+  _hasNext = position.hasNext;
+  _next = position.next;
+}
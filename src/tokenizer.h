@@ -27,8 +27,31 @@ class Tokenizer {
    * getNext() or peekNext() will return the same token.
    */
   AtomToken peekNext();
+  /**
+   * A point in the token stream, which can be returned to with seek().
+   */
+  struct Position {
+    unsigned int offset;
+    unsigned int lineNum;
+    bool hasNext;
+    AtomToken next;
+  };
+  /**
+   * Returns the current point in the token stream.
+   */
+  Position position() const;
+  /**
+   * Returns to a point in the token stream given by position(), so that
+   * the tokens after it are read again.
+   */
+  void seek(const Position& position);
+  /**
+   * Returns the name of the file being tokenized.
+   */
+  const std::string& filename() const { return _filename; }
 
  private:
+  std::string _filename;
   unsigned int _offset;
   unsigned int _lineNum;
   bool _hasNext;
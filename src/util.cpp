@@ -4,7 +4,12 @@
  */
 
 #include <regex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
+#include "runtime.h"
 
 /**
  * Puts this operand's value in the given register. Only requires
@@ -12,12 +17,14 @@
  */
 void operandValueToReg(Parser *parser,
                        const Operand& operand,
-                       const std::string& reg) {
+                       Reg dest) {
+  const Machine& machine = Machine::current();
+  const std::string& reg = machine.regName(dest);
   if (OperandType::ADDRESS == operand.type()) {
     parser->writeInst("POP " + reg);
     parser->writeInst("LOAD " + reg + " " + reg);
   } else if (OperandType::REGISTER == operand.type()) {
-    parser->writeInst("MOV " + reg + " " + operand.reg());
+    parser->writeInst("MOV " + reg + " " + machine.regName(operand.reg()));
   } else if (OperandType::VALUE == operand.type()) {
     parser->writeInst("POP " + reg);
   } else if (OperandType::LITERAL == operand.type()) {
@@ -40,6 +47,60 @@ std::string toHexStr(uint16_t value, int digits) {
   return "0x" + str;
 }
 
+/**
+ * Appends the four hex digits of the value after "0x", without building
+ * an intermediate string.
+ */
+void appendHexStr(std::string& str, uint16_t value) {
+  static const char digits[] = "0123456789abcdef";
+  char hex[6] = { '0', 'x', digits[(value >> 12) & 0xf],
+                  digits[(value >> 8) & 0xf], digits[(value >> 4) & 0xf],
+                  digits[value & 0xf] };
+  str.append(hex, sizeof(hex));
+}
+
+/**
+ * Maps the file into memory and packs its bytes into words. An empty file
+ * can't be mapped, so it gives no words without being mapped.
+ */
+bool readWords(const std::string& filename, bool bigEndian, bool packBytes,
+               std::vector<uint16_t>& words) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (-1 == fd) {
+    return false;
+  }
+  struct stat info;
+  if (-1 == fstat(fd, &info)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  words.clear();
+  if (0 == size) {
+    close(fd);
+    return true;
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == data) {
+    return false;
+  }
+  const uint8_t *bytes = static_cast<const uint8_t*>(data);
+  if (!packBytes) {
+    words.assign(bytes, bytes + size);
+  } else {
+    words.reserve((size + 1) / 2);
+    for (size_t i = 0; i < size; i += 2) {
+      uint16_t first = bytes[i];
+      uint16_t second = i + 1 < size ? bytes[i + 1] : 0;
+      words.push_back(bigEndian ? (first << 8) | second
+                                : (second << 8) | first);
+    }
+  }
+  munmap(data, size);
+  return true;
+}
+
 /**
  * Returns the opposing paranthesis for (), [], or {} pairs.
  * Returns an empty string if the input is not one of the above.
@@ -85,8 +146,12 @@ bool isLabelDeclaration(const std::string& label) {
  */
 bool isBuiltin(const std::string& funcName) {
   static std::vector<std::string> builtins = { "COLOR", "PIXEL", "TIMERST",
-                                               "TIME", "INPUT", "RND" };
-  return std::find(builtins.begin(), builtins.end(), funcName) != builtins.end();
+                                               "TIME", "INPUT", "RND",
+                                               "likely", "unlikely",
+                                               "decompress", "ABS", "MIN",
+                                               "MAX" };
+  return std::find(builtins.begin(), builtins.end(), funcName) !=
+         builtins.end() || isRuntimeRoutine(funcName);
 }
 
 /**
@@ -164,13 +229,207 @@ std::shared_ptr<LabelStatement> getLabel(
   return nullptr;
 }
 
+/**
+ * Appends the expressions evaluated by the given statement and all of
+ * the statements nested within it to exprs.
+ */
+void collectExprs(const std::shared_ptr<StatementToken>& statement,
+                  std::vector<std::shared_ptr<ExprToken>>& exprs) {
+  std::vector<std::shared_ptr<StatementToken>> statements;
+  collectStatements(statement, statements);
+  for (auto s : statements) {
+    s->getExprs(exprs);
+  }
+}
+
+/**
+ * Appends the given statement and all of the statements nested within it
+ * to statements, each one before the statements nested within it. Uses a
+ * stack of its own rather than recursion, since generated code can nest
+ * statements thousands of levels deep.
+ */
+void collectStatements(const std::shared_ptr<StatementToken>& statement,
+                       std::vector<std::shared_ptr<StatementToken>>& statements) {
+  std::vector<std::shared_ptr<StatementToken>> stack = { statement };
+  std::vector<std::shared_ptr<StatementToken>> children;
+  while (!stack.empty()) {
+    std::shared_ptr<StatementToken> next = stack.back();
+    stack.pop_back();
+    statements.push_back(next);
+    children.clear();
+    next->getChildren(children);
+    stack.insert(stack.end(), children.rbegin(), children.rend());
+  }
+}
+
+/**
+ * Appends the function calls made by the given statement and all of the
+ * statements nested within it to calls.
+ */
+void collectCalls(const std::shared_ptr<StatementToken>& statement,
+                  std::vector<std::shared_ptr<FunctionCallToken>>& calls) {
+  std::vector<std::shared_ptr<StatementToken>> statements;
+  collectStatements(statement, statements);
+  for (auto s : statements) {
+    // Void statements are calls themselves, rather than expressions
+    // containing calls.
+    auto voidStatement = std::dynamic_pointer_cast<VoidStatement>(s);
+    if (nullptr != voidStatement) {
+      calls.push_back(voidStatement->call());
+    }
+    std::vector<std::shared_ptr<ExprToken>> exprs;
+    s->getExprs(exprs);
+    for (auto expr : exprs) {
+      expr->getCalls(calls);
+    }
+  }
+}
+
+/**
+ * Returns true if the given statement is or contains a label declaration
+ * or a yield statement, which can both be jumped to from elsewhere.
+ */
+bool containsLabel(const std::shared_ptr<StatementToken>& statement) {
+  std::vector<std::shared_ptr<StatementToken>> statements;
+  collectStatements(statement, statements);
+  for (auto s : statements) {
+    if (std::dynamic_pointer_cast<LabelStatement>(s) ||
+        std::dynamic_pointer_cast<YieldStatement>(s)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns true if the given statement is or contains a break or continue
+ * statement that would exit a loop surrounding it.
+ */
+bool containsLoopExit(const std::shared_ptr<StatementToken>& statement) {
+  std::vector<std::shared_ptr<StatementToken>> stack = { statement };
+  while (!stack.empty()) {
+    std::shared_ptr<StatementToken> next = stack.back();
+    stack.pop_back();
+    if (std::dynamic_pointer_cast<BreakStatement>(next) ||
+        std::dynamic_pointer_cast<ContinueStatement>(next)) {
+      return true;
+    } else if (!std::dynamic_pointer_cast<LoopStatement>(next)) {
+      // Loops nested inside catch their own breaks and continues.
+      next->getChildren(stack);
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns the statement that runs last when the given statement runs to
+ * the end, looking inside of compound statements.
+ */
+std::shared_ptr<StatementToken> lastStatement(
+      const std::shared_ptr<StatementToken>& statement) {
+  std::shared_ptr<StatementToken> last = statement;
+  std::vector<std::shared_ptr<StatementToken>> children;
+  while (std::dynamic_pointer_cast<CompoundStatement>(last)) {
+    children.clear();
+    last->getChildren(children);
+    if (children.empty()) {
+      break;
+    }
+    last = children.back();
+  }
+  return last;
+}
+
+/**
+ * Returns true if the given statement always ends by jumping elsewhere,
+ * with a return, break, continue, or goto statement.
+ */
+bool endsWithJump(const std::shared_ptr<StatementToken>& statement) {
+  auto last = lastStatement(statement);
+  return std::dynamic_pointer_cast<ReturnStatement>(last) ||
+         std::dynamic_pointer_cast<BreakStatement>(last) ||
+         std::dynamic_pointer_cast<ContinueStatement>(last) ||
+         std::dynamic_pointer_cast<GotoStatement>(last);
+}
+
+/**
+ * Returns true if the statement is a path that is unlikely to be taken,
+ * because it ends by returning early or breaking out of a loop.
+ */
+static bool isUnlikelyPath(const std::shared_ptr<StatementToken>& statement) {
+  if (!statement) {
+    return false;
+  }
+  auto last = lastStatement(statement);
+  return std::dynamic_pointer_cast<ReturnStatement>(last) ||
+         std::dynamic_pointer_cast<BreakStatement>(last);
+}
+
+/**
+ * Predicts whether the true statement of an if statement runs more often
+ * than the false statement, which may be null. Paths that return early or
+ * break out of a loop are assumed to be unlikely, like error handling.
+ */
+Likelihood predictBranch(const std::shared_ptr<StatementToken>& trueStatement,
+                         const std::shared_ptr<StatementToken>& falseStatement) {
+  bool trueUnlikely = isUnlikelyPath(trueStatement);
+  bool falseUnlikely = isUnlikelyPath(falseStatement);
+  if (trueUnlikely == falseUnlikely) {
+    return UNPREDICTED;
+  }
+  return trueUnlikely ? UNLIKELY : LIKELY;
+}
+
+/**
+ * Outputs a list of statements in order. Runs of for loops with the same
+ * header are merged into one loop when that is safe and keeps within the
+ * fusion budget.
+ */
+void outputStatements(
+      Parser *parser,
+      const std::vector<std::shared_ptr<StatementToken>>& statements,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel,
+      const std::string& breakLabel,
+      const std::string& continueLabel) {
+  for (size_t i = 0; i < statements.size(); i++) {
+    std::shared_ptr<StatementToken> statement = statements[i];
+    auto loop = std::dynamic_pointer_cast<ForStatement>(statement);
+    while (loop && i + 1 < statements.size()) {
+      auto next = std::dynamic_pointer_cast<ForStatement>(statements[i + 1]);
+      auto fused = next ? ForStatement::fuse(loop, next) : nullptr;
+      if (!fused) {
+        break;
+      }
+      // The fused loop has one copy of the loop overhead, but could end
+      // up bigger if it no longer unrolls the same way.
+      int separateSize = parser->measure([&]() {
+          loop->output(parser, function, returnLabel, "", "");
+          next->output(parser, function, returnLabel, "", "");
+        });
+      int fusedSize = parser->measure([&]() {
+          fused->output(parser, function, returnLabel, "", "");
+        });
+      if (parser->options().fuseBudget < fusedSize - separateSize) {
+        break;
+      }
+      loop = fused;
+      statement = fused;
+      i++;
+    }
+    parser->setSourceLine(statement->line());
+    statement->output(parser, function, returnLabel, breakLabel,
+                      continueLabel);
+  }
+}
+
 /**
  * Returns true if the given string names a valid type. There
  * are only a few valid types right now so this function
  * is a bit crude.
  */
 bool isType(const std::string& type) {
-  return "void" == type ||  "uint16" == type;
+  return "void" == type ||  "uint16" == type || "fix8_8" == type;
 }
 
 /**
@@ -10,10 +10,7 @@
 #include "tokenizer.h"
 #include "syntax.h"
 #include "parser.h"
-
-#define ADDRESS_SIZE 2
-#define DATA_SIZE    2
-#define INST_SIZE    4
+#include "machine.h"
 
 /**
  * Puts this operand's value in the given register. Only requires
@@ -21,7 +18,7 @@
  */
 void operandValueToReg(Parser *parser,
                        const Operand& operand,
-                       const std::string& reg);
+                       Reg dest);
 /**
  * Returns a hex string of the form "0x0000" for the
  * given value, where digits is the number of digits after
@@ -29,6 +26,22 @@ void operandValueToReg(Parser *parser,
  */
 std::string toHexStr(uint16_t value, int digits = 4);
 
+/**
+ * Appends a hex string of the form "0x0000" for the given value to str.
+ * Faster than toHexStr() for writing out many values.
+ */
+void appendHexStr(std::string& str, uint16_t value);
+
+/**
+ * Reads the bytes of the given file into words, packing two bytes into
+ * each word in big or little endian order, or one byte into each word if
+ * packBytes is false. An odd last byte is packed with a zero byte. The
+ * file is mapped into memory rather than read through a stream. Returns
+ * false if the file can't be read.
+ */
+bool readWords(const std::string& filename, bool bigEndian, bool packBytes,
+               std::vector<uint16_t>& words);
+
 /**
  * Returns the opposing paranthesis for (), [], or {} pairs.
  * Returns an empty string if the input is not one of the above.
@@ -95,6 +108,74 @@ std::shared_ptr<LabelStatement> getLabel(
       const std::string& name,
       const std::vector<std::shared_ptr<LabelStatement>>& labels);
 
+/**
+ * Appends the expressions evaluated by the given statement and all of
+ * the statements nested within it to exprs.
+ */
+void collectExprs(const std::shared_ptr<StatementToken>& statement,
+                  std::vector<std::shared_ptr<ExprToken>>& exprs);
+
+/**
+ * Appends the given statement and all of the statements nested within it
+ * to statements.
+ */
+void collectStatements(const std::shared_ptr<StatementToken>& statement,
+                       std::vector<std::shared_ptr<StatementToken>>& statements);
+
+/**
+ * Appends the function calls made by the given statement and all of the
+ * statements nested within it to calls.
+ */
+void collectCalls(const std::shared_ptr<StatementToken>& statement,
+                  std::vector<std::shared_ptr<FunctionCallToken>>& calls);
+
+/**
+ * Returns true if the given statement is or contains a label declaration
+ * or a yield statement, which can both be jumped to from elsewhere.
+ */
+bool containsLabel(const std::shared_ptr<StatementToken>& statement);
+
+/**
+ * Returns true if the given statement is or contains a break or continue
+ * statement that would exit a loop surrounding it. Break and continue
+ * statements within nested loops are not counted.
+ */
+bool containsLoopExit(const std::shared_ptr<StatementToken>& statement);
+
+/**
+ * Returns the statement that runs last when the given statement runs to
+ * the end, looking inside of compound statements.
+ */
+std::shared_ptr<StatementToken> lastStatement(
+      const std::shared_ptr<StatementToken>& statement);
+
+/**
+ * Returns true if the given statement always ends by jumping elsewhere,
+ * with a return, break, continue, or goto statement.
+ */
+bool endsWithJump(const std::shared_ptr<StatementToken>& statement);
+
+/**
+ * Predicts whether the true statement of an if statement runs more often
+ * than the false statement, which may be null. Paths that return early or
+ * break out of a loop are assumed to be unlikely, like error handling.
+ */
+Likelihood predictBranch(const std::shared_ptr<StatementToken>& trueStatement,
+                         const std::shared_ptr<StatementToken>& falseStatement);
+
+/**
+ * Outputs a list of statements in order. Runs of for loops with the same
+ * header are merged into one loop when that is safe and keeps within the
+ * fusion budget.
+ */
+void outputStatements(
+      Parser *parser,
+      const std::vector<std::shared_ptr<StatementToken>>& statements,
+      const std::shared_ptr<FunctionToken>& function,
+      const std::string& returnLabel,
+      const std::string& breakLabel = "",
+      const std::string& continueLabel = "");
+
 /**
  * Returns true if the given string names a valid type. There
  * are only a few valid types right now so this function
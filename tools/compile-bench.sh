@@ -0,0 +1,142 @@
+#!/bin/bash
+# Consolite Compiler
+# Copyright (c) 2015 Robert Fotino, All Rights Reserved
+#
+# Times the compiler on generated programs of growing size. There are two
+# benchmarks:
+#
+#   nesting - statements nested more and more deeply, to check that
+#             compile time grows linearly with the depth. Each depth is
+#             compiled in three shapes: "ladder", a chain of "else if"
+#             parts like generated dispatch code, "nest", if statements
+#             nested inside each other, and "block", compound statements
+#             nested inside each other. Sizes are depths, and default to
+#             120 240 480 960. Statements other than "else if" parts can
+#             be nested at most 2000 levels deep, counting an if statement
+#             and its braces as two levels, so "nest" is expected to fail
+#             from a depth of 1000 and "block" from a depth of 2000.
+#   table   - programs that are mostly big global data tables, like the
+#             level and sprite data of a game. Each program has tables of
+#             32768 hex literals, with as many tables as it takes to reach
+#             the size, and a main() that reads from each of them. Sizes
+#             are in megabytes, and default to 1 2 4.
+#
+# Usage: tools/compile-bench.sh nesting|table [COMPILER] [SIZE...]
+#
+# The compiler defaults to ./compiler. For each program it prints the
+# exit status, the milliseconds the compile took, and the time relative
+# to the previous size that compiled, which should stay close to the
+# ratio of the sizes. Failed compiles get no ratio, and make the script
+# exit with 1 at the end. Only the compile time is measured, so the
+# programs don't have to fit in memory on the machine.
+
+bench=$1
+compiler=${2:-./compiler}
+shift $(($# < 2 ? $# : 2))
+case $bench in
+  nesting)
+    shapes="ladder nest block"
+    sizes=${*:-120 240 480 960}
+    ;;
+  table)
+    shapes=table
+    sizes=${*:-1 2 4}
+    ;;
+  *)
+    echo "Usage: $0 nesting|table [COMPILER] [SIZE...]" >&2
+    exit 1
+    ;;
+esac
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Prints a table of 32768 elements, 16 to a line. The values don't matter,
+# as long as they aren't all zero.
+table() {
+  awk -v name=$1 'BEGIN {
+    printf "uint16[32768] %s = {\n", name
+    for (i = 0; i < 32768; i++) {
+      printf "0x%04x%s", (i * 40503) % 65536, i < 32767 ? "," : "\n"
+      if (15 == i % 16 && i < 32767) {
+        printf "\n"
+      }
+    }
+    printf "};\n"
+  }'
+}
+
+# Writes the program of the given shape and size to the file.
+generate() {
+  local shape=$1 size=$2 src=$3 i tables=0
+  if [ table == $shape ]; then
+    : > "$src"
+    while [ $(stat -c %s "$src") -lt $((size * 1024 * 1024)) ]; do
+      table t$tables >> "$src"
+      tables=$((tables + 1))
+    done
+    {
+      echo "uint16 x;"
+      echo "void main() {"
+      for ((i = 0; i < tables; i++)); do
+        echo "  x = x + t$i[x];"
+      done
+      echo "}"
+    } >> "$src"
+    return
+  fi
+  {
+    echo "uint16 x;"
+    echo "void main() {"
+    echo "  uint16 y = 0;"
+    case $shape in
+      ladder)
+        echo "  if (x == 0) {"
+        echo "    y = 0;"
+        for ((i = 1; i < size; i++)); do
+          echo "  } else if (x == $i) {"
+          echo "    y = $i;"
+        done
+        echo "  } else {"
+        echo "    y = 1;"
+        echo "  }"
+        ;;
+      nest|block)
+        for ((i = 0; i < size; i++)); do
+          [ nest == $shape ] && echo "if (x != $i) {" || echo "{"
+        done
+        echo "y = 1;"
+        for ((i = 0; i < size; i++)); do
+          echo "}"
+        done
+        ;;
+    esac
+    echo "  x = y;"
+    echo "}"
+  } > "$src"
+}
+
+printf "%-8s %8s %10s %6s %10s %8s\n" shape size bytes status ms ratio
+failed=0
+for shape in $shapes; do
+  prev=
+  for size in $sizes; do
+    src=$dir/$shape$size.c
+    generate $shape $size "$src"
+    bytes=$(stat -c %s "$src")
+    start=$(date +%s%N)
+    "$compiler" "$src" "$dir/out.s" > /dev/null 2>&1
+    status=$?
+    ms=$((($(date +%s%N) - start) / 1000000))
+    [ 0 -lt $ms ] || ms=1
+    ratio=-
+    if [ 0 -ne $status ]; then
+      failed=1
+    elif [ -n "$prev" ]; then
+      ratio=$(awk "BEGIN { printf \"%.2f\", $ms / $prev }")
+    fi
+    printf "%-8s %8d %10d %6d %10d %8s\n" $shape $size $bytes $status $ms \
+           $ratio
+    [ 0 -ne $status ] || prev=$ms
+  done
+done
+exit $failed
@@ -0,0 +1,76 @@
+#!/bin/bash
+# Consolite Compiler
+# Copyright (c) 2015 Robert Fotino, All Rights Reserved
+#
+# Runs the example programs that check the compiler in the simulator, with
+# each set of optimization flags, and compares what they draw with what
+# they are expected to draw.
+#
+# Usage: tools/sim-check.sh [COMPILER] [SIM] [FILE.c...]
+#
+# The compiler defaults to ./compiler, the simulator to ./sim, and the
+# programs to the examples with an "Expect:" line in their header, like
+#
+#   * Expect: 1 2 3 4
+#
+# Such a program prints values by drawing a pixel of color 0xff for each
+# one, in the next column and at the height of the value. The expected
+# screen is drawn by a generated program that draws the listed values the
+# same way, and the framebuffer hashes have to match. A program can also
+# have a line like
+#
+#   * Forbid: POP [LMN]
+#
+# with an extended regular expression that no instruction in its output
+# may match, to check that the compiler doesn't emit code it shouldn't.
+# Prints one line for each program and flag set, and exits with 1 if any
+# of them failed.
+
+compiler=${1:-./compiler}
+sim=${2:-./sim}
+shift $(($# < 2 ? $# : 2))
+files=${*:-$(grep -l '^ \* Expect:' examples/*.c)}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+flagSets=("" "-Os" "-fbounds-check" "-fno-specialize" "-fno-peephole"
+          "-flazy-parse" "-ffuse-budget=256 -funswitch-budget=1024")
+
+# Prints the framebuffer hash that the simulator prints for the program.
+hash() {
+  "$sim" "$1" | awk '"framebuffer" == $1 { print $2 }'
+}
+
+status=0
+for src in $files; do
+  name=$(basename "$src" .c)
+  {
+    echo "void main() {"
+    echo "  COLOR(0xff);"
+    column=0
+    for value in $(sed -n 's/^ \* Expect://p' "$src"); do
+      echo "  PIXEL($column, $value);"
+      column=$((column + 1))
+    done
+    echo "}"
+  } > "$dir/expect.c"
+  if ! "$compiler" "$dir/expect.c" "$dir/expect.s" > /dev/null; then
+    echo "$name: can't compile the expected output" >&2
+    exit 1
+  fi
+  expect=$(hash "$dir/expect.s")
+  forbid=$(sed -n 's/^ \* Forbid: *//p' "$src")
+  for flags in "${flagSets[@]}"; do
+    result=ok
+    if ! "$compiler" $flags "$src" "$dir/$name.s" > /dev/null; then
+      result="compile error"
+    elif [ "$expect" != "$(hash "$dir/$name.s")" ]; then
+      result=FAILED
+    elif [ -n "$forbid" ] &&
+         grep -Eq "^[[:space:]]+($forbid)\$" "$dir/$name.s"; then
+      result="FAILED: $forbid"
+    fi
+    [ ok == "$result" ] || status=1
+    printf "%-20s %-44s %s\n" "$name" "[$flags]" "$result"
+  done
+done
+exit $status
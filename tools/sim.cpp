@@ -0,0 +1,991 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+/**
+ * Runs the assembly output of the compiler without a display, for
+ * benchmarks and for checking what a program draws.
+ *
+ * Usage: sim [-machine=FILE] [-seed=N] [-input=FILE] [-clock=N] [-max=N]
+ *            [-dump=FILE.ppm] [-profile=FILE] [-stacks=FILE]
+ *            [-traffic=FILE] [-line-map=FILE] FILE.s
+ *
+ * The program is assembled once into an array with one decoded instruction
+ * for each instruction slot in memory, and each decoded instruction jumps
+ * straight to the code for the next one, so that nothing is looked up or
+ * parsed while it runs. It stops when the program reaches a JMPI to
+ * itself, which is how the compiler ends main(), or after -max
+ * instructions. PIXEL writes go to a framebuffer in memory, and at the end
+ * the number of instructions and cycles, the speed of the simulator, and a
+ * hash of the framebuffer are printed. The framebuffer can be saved with
+ * -dump.
+ *
+ * Runs are reproducible: RND returns a sequence that only depends on -seed,
+ * and TIME is counted in cycles of the machine description, at -clock
+ * cycles per millisecond (50000 by default). The input file has one line
+ * "MS INPUT_ID VALUE" for each change to an input, which takes effect
+ * MS milliseconds after the program starts, and lines that don't start with
+ * a number are ignored. Inputs start at 0.
+ *
+ * Code is only decoded once, so stores into the program don't change what
+ * runs, and loads from it read 0.
+ *
+ * With -profile or -stacks, every cycle is counted toward the instruction
+ * that took it and the call stack it ran in, which is rebuilt from CALL
+ * and RET. The simulator is deterministic, so this counts exactly what a
+ * sampling profiler would estimate. -profile writes the cycles taken
+ * after each label, the source listing with the share of the cycles each
+ * line took if the compiler wrote a -line-map for the program, and the
+ * assembly listing with the cycles and share of each instruction.
+ * -stacks writes the cycles of each call stack in the collapsed format
+ * that flame graph tools read, one "main;f;g CYCLES" line per stack.
+ * -traffic writes the number of memory accesses made by each function and
+ * source line, split into PUSH and POP, the return addresses of CALL and
+ * RET, LOAD and STOR to the stack, which is where frames are, and LOAD
+ * and STOR to the rest of memory, which is where globals and their
+ * arrays are. The stack is taken to start where the stack pointer is at
+ * the first CALL. Profiling runs at about half the speed.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include "machine.h"
+#include "util.h"
+
+/**
+ * The instructions that the simulator runs, which are looked up in the
+ * machine description by name.
+ */
+enum Code { NOP, INPUT, CALL, RET, LOAD, LOADI, MOV, MOVI, PUSH, POP, ADD,
+            SUB, MUL, DIV, AND, OR, XOR, SHL, SHRA, SHRL, CMP, TST, COLOR,
+            PIXEL, STOR, STORI, TIMERST, TIME, JMP, JMPI, JEQ, JNE, JG, JGE,
+            JA, JAE, JL, JLE, JB, JBE, JO, JNO, JS, JNS, RND, BAD,
+            NUM_CODES };
+static const char *NAMES[NUM_CODES] = {
+  "NOP", "INPUT", "CALL", "RET", "LOAD", "LOADI", "MOV", "MOVI", "PUSH",
+  "POP", "ADD", "SUB", "MUL", "DIV", "AND", "OR", "XOR", "SHL", "SHRA",
+  "SHRL", "CMP", "TST", "COLOR", "PIXEL", "STOR", "STORI", "TIMERST",
+  "TIME", "JMP", "JMPI", "JEQ", "JNE", "JG", "JGE", "JA", "JAE", "JL",
+  "JLE", "JB", "JBE", "JO", "JNO", "JS", "JNS", "RND", ""
+};
+
+static const int SCREEN_WIDTH = 256;
+static const int SCREEN_HEIGHT = 192;
+static const int MEMORY_SIZE = 0x10000;
+
+/**
+ * A decoded instruction. The slots in memory that don't hold an
+ * instruction are decoded as BAD, which stops the simulator.
+ */
+struct Decoded {
+  const void *handler;
+  Code code;
+  uint8_t a;
+  uint8_t b;
+  uint16_t imm;
+  uint16_t cycles;
+};
+
+/**
+ * A change to an input from the input file.
+ */
+struct InputEvent {
+  uint64_t ms;
+  uint16_t id;
+  uint16_t value;
+};
+
+/**
+ * The memory accesses made by some code: PUSH and POP, the return
+ * addresses saved and restored by CALL and RET, and LOAD and STOR to the
+ * stack, where the frames of functions are, or to the rest of memory,
+ * where globals and their arrays are.
+ */
+struct Traffic {
+  uint64_t pushPop;
+  uint64_t calls;
+  uint64_t frame;
+  uint64_t global;
+};
+
+/**
+ * A call stack in the profile, which is the stack of its parent with one
+ * more function called.
+ */
+struct Frame {
+  int parent;
+  uint16_t function;
+  uint64_t cycles;
+  Traffic traffic;
+};
+
+/**
+ * The state of the simulated machine, and the program and profile.
+ */
+struct Sim {
+  std::vector<Decoded> code;
+  std::vector<uint8_t> memory;
+  std::vector<uint16_t> regs;
+  std::vector<uint16_t> inputs;
+  std::vector<InputEvent> events;
+  std::vector<uint8_t> framebuffer;
+  int sp;
+  uint32_t seed;
+  uint64_t cyclesPerMs;
+  uint64_t maxInsts;
+  uint64_t insts;
+  uint64_t cycles;
+  bool halted;
+  uint16_t ip;
+  /**
+   * The lines of the program, and for each instruction slot, the index of
+   * its line, or -1 if it isn't an instruction. The first label at each
+   * slot names the function that a CALL to it enters, and each
+   * instruction is counted toward the last label before it.
+   */
+  std::vector<std::string> text;
+  std::vector<int> textLines;
+  std::vector<std::string> firstLabels;
+  std::vector<std::string> lastLabels;
+  /**
+   * The source file and the source line of each line of the program,
+   * from the line map.
+   */
+  std::string sourceFile;
+  std::vector<int> sourceLines;
+  /**
+   * The cycles taken and memory accessed by each instruction slot and
+   * call stack. The first call stack is the one the program starts in.
+   */
+  bool profile;
+  std::vector<uint64_t> instCycles;
+  std::vector<Traffic> instTraffic;
+  std::vector<Frame> frames;
+};
+
+/**
+ * Parses a number in C syntax. Returns false if it isn't one.
+ */
+static bool parseNumber(const std::string& str, uint32_t& value) {
+  if (str.empty() || !isdigit(str[0])) {
+    return false;
+  }
+  char *end;
+  value = strtoul(str.c_str(), &end, 0);
+  return '\0' == *end && value <= 0xffff;
+}
+
+/**
+ * Assembles the program in the given file into the memory and decoded
+ * instructions of the simulator. Prints an error message and returns false
+ * if it isn't valid.
+ */
+static bool assemble(const std::string& filename, Sim& sim) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  const Machine& machine = Machine::current();
+  const uint32_t instSize = machine.instSize();
+  const uint32_t dataSize = machine.dataSize();
+  std::unordered_map<std::string, uint8_t> regIndex;
+  for (size_t i = 0; i < machine.registers().size(); i++) {
+    regIndex[machine.registers()[i]] = i;
+  }
+  // The first pass finds the address of each label, and the second one
+  // decodes the instructions now that every label is known.
+  std::vector<std::vector<std::string>> lines;
+  std::vector<int> lineNums;
+  std::vector<uint32_t> addresses;
+  std::unordered_map<std::string, uint32_t> labels;
+  std::string lastLabel;
+  uint32_t address = 0;
+  std::string line;
+  for (int lineNum = 1; std::getline(file, line); lineNum++) {
+    sim.text.push_back(line);
+    std::istringstream stream(line);
+    std::vector<std::string> tokens;
+    std::string token;
+    while (stream >> token) {
+      tokens.push_back(token);
+    }
+    if (tokens.empty()) {
+      continue;
+    } else if (1 == tokens.size() && ':' == tokens[0].back()) {
+      lastLabel = tokens[0].substr(0, tokens[0].size() - 1);
+      labels[lastLabel] = address;
+      if (address < MEMORY_SIZE &&
+          sim.firstLabels[address / instSize].empty()) {
+        sim.firstLabels[address / instSize] = lastLabel;
+      }
+      continue;
+    } else if (0 == tokens[0].compare(0, 2, "0x")) {
+      // Data is written big-endian and padded to a whole instruction.
+      for (auto word : tokens) {
+        uint32_t value;
+        if (!parseNumber(word, value)) {
+          _error("Invalid data '" + word + "'.", lineNum);
+          return false;
+        }
+        for (uint32_t i = 0; i < dataSize && address + i < MEMORY_SIZE;
+             i++) {
+          sim.memory[address + i] = value >> (8 * (dataSize - i - 1));
+        }
+        address += dataSize;
+      }
+      address = (address + instSize - 1) / instSize * instSize;
+    } else {
+      lines.push_back(tokens);
+      lineNums.push_back(lineNum);
+      addresses.push_back(address);
+      if (address < MEMORY_SIZE) {
+        sim.textLines[address / instSize] = lineNum - 1;
+        sim.lastLabels[address / instSize] = lastLabel;
+      }
+      address += instSize;
+    }
+    if (MEMORY_SIZE < address) {
+      _error("The program doesn't fit in memory.", lineNum);
+      return false;
+    }
+  }
+  std::unordered_map<std::string, Code> codes;
+  for (int code = 0; code < BAD; code++) {
+    codes[NAMES[code]] = static_cast<Code>(code);
+  }
+  for (size_t i = 0; i < lines.size(); i++) {
+    const Machine::Inst *inst = machine.getInst(lines[i][0]);
+    auto code = codes.find(lines[i][0]);
+    if (!inst || codes.end() == code) {
+      _error("Unknown instruction '" + lines[i][0] + "'.", lineNums[i]);
+      return false;
+    }
+    Decoded& decoded = sim.code[addresses[i] / instSize];
+    decoded.code = code->second;
+    decoded.cycles = inst->cycles;
+    int numRegs = 0;
+    for (size_t j = 1; j < lines[i].size(); j++) {
+      const std::string& arg = lines[i][j];
+      auto reg = regIndex.find(arg);
+      uint32_t value;
+      if (regIndex.end() != reg) {
+        (0 == numRegs++ ? decoded.a : decoded.b) = reg->second;
+      } else if (parseNumber(arg, value)) {
+        decoded.imm = value;
+      } else if (labels.count(arg)) {
+        decoded.imm = labels[arg];
+      } else {
+        _error("Unknown label '" + arg + "'.", lineNums[i]);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads the input file. Prints an error message and returns false if it
+ * isn't valid.
+ */
+static bool readInputs(const std::string& filename, Sim& sim) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  std::string line;
+  for (int lineNum = 1; std::getline(file, line); lineNum++) {
+    std::istringstream stream(line);
+    InputEvent event;
+    if (!(stream >> event.ms)) {
+      continue;
+    } else if (!(stream >> event.id >> event.value)) {
+      _error("Expected 'MS INPUT_ID VALUE'.", lineNum);
+      return false;
+    }
+    sim.events.push_back(event);
+  }
+  std::stable_sort(sim.events.begin(), sim.events.end(),
+                   [](const InputEvent& a, const InputEvent& b) {
+                     return a.ms < b.ms;
+                   });
+  return true;
+}
+
+/**
+ * Reads the line map that the compiler wrote for the program. Prints an
+ * error message and returns false if it isn't valid.
+ */
+static bool readLineMap(const std::string& filename, Sim& sim) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  std::string line;
+  std::getline(file, line);
+  if (0 != line.compare(0, strlen("source "), "source ")) {
+    _error("Expected 'source FILE'.", 1);
+    return false;
+  }
+  sim.sourceFile = line.substr(strlen("source "));
+  sim.sourceLines.assign(sim.text.size(), 0);
+  for (int lineNum = 2; std::getline(file, line); lineNum++) {
+    std::istringstream stream(line);
+    size_t textLine;
+    int sourceLine;
+    if (!(stream >> textLine >> sourceLine) || 0 == textLine ||
+        sim.text.size() < textLine) {
+      _error("Expected 'OUTPUT_LINE SOURCE_LINE' for a line of the "
+             "program.", lineNum);
+      return false;
+    }
+    sim.sourceLines[textLine - 1] = sourceLine;
+  }
+  return true;
+}
+
+/**
+ * Runs the program until it halts, reaches the instruction limit, or runs
+ * into something that isn't an instruction. The profile is only kept if
+ * PROFILE is true, so that the checks for it are left out otherwise.
+ */
+template <bool PROFILE>
+static void run(Sim& sim) {
+  static const void *handlers[NUM_CODES] = {
+    &&nop, &&input, &&call, &&ret, &&load, &&loadi, &&mov, &&movi, &&push,
+    &&pop, &&add, &&sub, &&mul, &&div, &&and_, &&or_, &&xor_, &&shl,
+    &&shra, &&shrl, &&cmp, &&tst, &&color, &&pixel, &&stor, &&stori,
+    &&timerst, &&time, &&jmp, &&jmpi, &&jeq, &&jne, &&jg, &&jge, &&ja,
+    &&jae, &&jl, &&jle, &&jb, &&jbe, &&jo, &&jno, &&js, &&jns, &&rnd, &&bad
+  };
+  for (auto& decoded : sim.code) {
+    decoded.handler = handlers[decoded.code];
+  }
+  Decoded *const code = sim.code.data();
+  uint8_t *const mem = sim.memory.data();
+  uint16_t *const regs = sim.regs.data();
+  uint16_t& sp = regs[sim.sp];
+  const uint64_t maxInsts = sim.maxInsts;
+  uint64_t insts = 0;
+  uint64_t cycles = 0;
+  uint64_t timerStart = 0;
+  size_t nextEvent = 0;
+  uint32_t seed = sim.seed;
+  uint8_t color = 0;
+  bool zero = false, carry = false, sign = false, overflow = false;
+  uint64_t *const instCycles = sim.instCycles.data();
+  Traffic *const instTraffic = sim.instTraffic.data();
+  // The stack starts where the stack pointer is when the program first
+  // calls a function, which is after any arrays the program clears.
+  uint32_t stackStart = MEMORY_SIZE;
+  std::unordered_map<uint64_t, int> children;
+  int frame = 0;
+  const Decoded *d = code;
+  auto read = [mem](uint16_t addr) -> uint16_t {
+    return mem[addr] << 8 | mem[static_cast<uint16_t>(addr + 1)];
+  };
+  auto write = [mem](uint16_t addr, uint16_t value) {
+    mem[addr] = value >> 8;
+    mem[static_cast<uint16_t>(addr + 1)] = value;
+  };
+  auto address = [&d, code]() -> uint16_t {
+    return (d - code) * 4;
+  };
+#define A regs[d->a]
+#define B regs[d->b]
+#define DISPATCH()                           \
+  do {                                       \
+    if (maxInsts <= insts) {                 \
+      goto done;                             \
+    }                                        \
+    insts++;                                 \
+    cycles += d->cycles;                     \
+    if (PROFILE) {                           \
+      instCycles[d - code] += d->cycles;     \
+      sim.frames[frame].cycles += d->cycles; \
+    }                                        \
+    goto *d->handler;                        \
+  } while (0)
+#define COUNT(kind)                          \
+  do {                                       \
+    if (PROFILE) {                           \
+      instTraffic[d - code].kind++;          \
+      sim.frames[frame].traffic.kind++;      \
+    }                                        \
+  } while (0)
+#define COUNT_ACCESS(addr)                   \
+  do {                                       \
+    if (stackStart <= (addr)) {              \
+      COUNT(frame);                          \
+    } else {                                 \
+      COUNT(global);                         \
+    }                                        \
+  } while (0)
+#define NEXT() do { d++; DISPATCH(); } while (0)
+#define JUMP(target) do { d = code + (target) / 4; DISPATCH(); } while (0)
+#define BRANCH(cond) do { if (cond) JUMP(d->imm); NEXT(); } while (0)
+  DISPATCH();
+ nop:
+  NEXT();
+ input:
+  while (nextEvent < sim.events.size() &&
+         sim.events[nextEvent].ms * sim.cyclesPerMs <= cycles) {
+    sim.inputs[sim.events[nextEvent].id] = sim.events[nextEvent].value;
+    nextEvent++;
+  }
+  A = sim.inputs[B];
+  NEXT();
+ call:
+  COUNT(calls);
+  if (PROFILE && MEMORY_SIZE == stackStart) {
+    stackStart = sp;
+  }
+  sp += 2;
+  write(sp, address() + 4);
+  if (PROFILE) {
+    // Each call stack is found from its parent and the function called.
+    uint64_t key = static_cast<uint64_t>(frame) << 16 | d->imm;
+    auto child = children.find(key);
+    if (children.end() == child) {
+      child = children.insert(std::make_pair(key, sim.frames.size())).first;
+      sim.frames.push_back(Frame { frame, d->imm, 0, Traffic() });
+    }
+    frame = child->second;
+  }
+  JUMP(d->imm);
+ ret: {
+    COUNT(calls);
+    uint16_t target = read(sp);
+    sp -= 2 + d->imm;
+    if (PROFILE && 0 < frame) {
+      frame = sim.frames[frame].parent;
+    }
+    if (target % 4) {
+      goto bad;
+    }
+    JUMP(target);
+  }
+ load:
+  COUNT_ACCESS(B);
+  A = read(B);
+  NEXT();
+ loadi:
+  COUNT_ACCESS(d->imm);
+  A = read(d->imm);
+  NEXT();
+ mov:
+  A = B;
+  NEXT();
+ movi:
+  A = d->imm;
+  NEXT();
+ push:
+  COUNT(pushPop);
+  sp += 2;
+  write(sp, A);
+  NEXT();
+ pop:
+  COUNT(pushPop);
+  A = read(sp);
+  sp -= 2;
+  NEXT();
+ add:
+  A += B;
+  NEXT();
+ sub:
+  A -= B;
+  NEXT();
+ mul:
+  A *= B;
+  NEXT();
+ div:
+  A = B ? A / B : 0xffff;
+  NEXT();
+ and_:
+  A &= B;
+  NEXT();
+ or_:
+  A |= B;
+  NEXT();
+ xor_:
+  A ^= B;
+  NEXT();
+ shl:
+  A = B < 16 ? A << B : 0;
+  NEXT();
+ shra:
+  A = static_cast<int16_t>(A) >> (B < 16 ? B : 15);
+  NEXT();
+ shrl:
+  A = B < 16 ? A >> B : 0;
+  NEXT();
+ cmp: {
+    uint16_t result = A - B;
+    zero = 0 == result;
+    carry = A < B;
+    sign = result >> 15;
+    overflow = ((A ^ B) & (A ^ result)) >> 15;
+    NEXT();
+  }
+ tst: {
+    uint16_t result = A & B;
+    zero = 0 == result;
+    sign = result >> 15;
+    carry = overflow = false;
+    NEXT();
+  }
+ color:
+  color = A;
+  NEXT();
+ pixel:
+  if (A < SCREEN_WIDTH && B < SCREEN_HEIGHT) {
+    sim.framebuffer[B * SCREEN_WIDTH + A] = color;
+  }
+  NEXT();
+ stor:
+  COUNT_ACCESS(B);
+  write(B, A);
+  NEXT();
+ stori:
+  COUNT_ACCESS(d->imm);
+  write(d->imm, A);
+  NEXT();
+ timerst:
+  timerStart = cycles;
+  NEXT();
+ time:
+  A = (cycles - timerStart) / sim.cyclesPerMs;
+  NEXT();
+ jmp:
+  if (A % 4) {
+    goto bad;
+  }
+  JUMP(A);
+ jmpi:
+  if (d->imm == address()) {
+    sim.halted = true;
+    goto done;
+  }
+  JUMP(d->imm);
+ jeq:
+  BRANCH(zero);
+ jne:
+  BRANCH(!zero);
+ jg:
+  BRANCH(!zero && sign == overflow);
+ jge:
+  BRANCH(sign == overflow);
+ ja:
+  BRANCH(!carry && !zero);
+ jae:
+  BRANCH(!carry);
+ jl:
+  BRANCH(sign != overflow);
+ jle:
+  BRANCH(zero || sign != overflow);
+ jb:
+  BRANCH(carry);
+ jbe:
+  BRANCH(carry || zero);
+ jo:
+  BRANCH(overflow);
+ jno:
+  BRANCH(!overflow);
+ js:
+  BRANCH(sign);
+ jns:
+  BRANCH(!sign);
+ rnd:
+  seed = seed * 1103515245 + 12345;
+  A = seed >> 16;
+  NEXT();
+ bad:
+  // The instruction was counted before finding out that it isn't one.
+  insts--;
+  cycles -= d->cycles;
+  if (PROFILE) {
+    instCycles[d - code] -= d->cycles;
+    sim.frames[frame].cycles -= d->cycles;
+  }
+ done:
+#undef A
+#undef B
+#undef DISPATCH
+#undef COUNT
+#undef COUNT_ACCESS
+#undef NEXT
+#undef JUMP
+#undef BRANCH
+  sim.ip = address();
+  sim.insts = insts;
+  sim.cycles = cycles;
+}
+
+/**
+ * Writes the cycles and share of the total cycles in front of a line of
+ * a listing, leaving the columns empty for lines that took no cycles.
+ */
+static void writeCycles(std::ostream& out, uint64_t cycles, uint64_t total) {
+  if (0 == cycles) {
+    out << std::setw(22) << "";
+  } else {
+    out << std::setw(14) << cycles << std::setw(7) << std::fixed
+        << std::setprecision(2) << 100.0 * cycles / total << "%";
+  }
+  out << "  ";
+}
+
+/**
+ * Writes the profile report. Returns false if the file can't be written.
+ */
+static bool writeProfile(const std::string& filename, const Sim& sim) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  const uint64_t total = std::max<uint64_t>(sim.cycles, 1);
+  file << "Profile of " << sim.insts << " instructions taking "
+       << sim.cycles << " cycles" << std::endl;
+  // The code after each label, from the most expensive.
+  std::unordered_map<std::string, uint64_t> labelCycles;
+  for (size_t i = 0; i < sim.instCycles.size(); i++) {
+    if (0 < sim.instCycles[i]) {
+      labelCycles[sim.lastLabels[i]] += sim.instCycles[i];
+    }
+  }
+  std::vector<std::pair<uint64_t, std::string>> labels;
+  for (auto entry : labelCycles) {
+    labels.push_back(std::make_pair(entry.second, entry.first));
+  }
+  std::sort(labels.rbegin(), labels.rend());
+  file << std::endl << "Labels:" << std::endl;
+  for (auto label : labels) {
+    writeCycles(file, label.first, total);
+    file << (label.second.empty() ? "(start)" : label.second) << std::endl;
+  }
+  // The source listing, if there is a line map.
+  std::vector<uint64_t> textCycles(sim.text.size(), 0);
+  for (size_t i = 0; i < sim.instCycles.size(); i++) {
+    if (-1 != sim.textLines[i]) {
+      textCycles[sim.textLines[i]] += sim.instCycles[i];
+    }
+  }
+  if (!sim.sourceFile.empty()) {
+    std::vector<uint64_t> sourceCycles;
+    uint64_t unmapped = 0;
+    for (size_t i = 0; i < sim.text.size(); i++) {
+      size_t sourceLine = sim.sourceLines[i];
+      if (0 == sourceLine) {
+        unmapped += textCycles[i];
+        continue;
+      } else if (sourceCycles.size() < sourceLine) {
+        sourceCycles.resize(sourceLine, 0);
+      }
+      sourceCycles[sourceLine - 1] += textCycles[i];
+    }
+    file << std::endl << "Source " << sim.sourceFile << ":" << std::endl;
+    std::ifstream source(sim.sourceFile);
+    std::string line;
+    for (size_t i = 0; std::getline(source, line) || i < sourceCycles.size();
+         i++) {
+      writeCycles(file, i < sourceCycles.size() ? sourceCycles[i] : 0,
+                  total);
+      file << std::setw(5) << i + 1 << "  " << line << std::endl;
+      line.clear();
+    }
+    writeCycles(file, unmapped, total);
+    file << "(code from no single line, like shared subroutines)"
+         << std::endl;
+  }
+  // The assembly listing.
+  file << std::endl << "Assembly:" << std::endl;
+  for (size_t i = 0; i < sim.text.size(); i++) {
+    writeCycles(file, textCycles[i], total);
+    file << sim.text[i] << std::endl;
+  }
+  return file.good();
+}
+
+/**
+ * Returns the name of the function called last in the given call stack.
+ */
+static std::string functionName(const Sim& sim, int frame) {
+  if (0 == frame) {
+    return "start";
+  }
+  uint16_t function = sim.frames[frame].function;
+  std::string name = sim.firstLabels[function / 4];
+  return name.empty() ? toHexStr(function) : name;
+}
+
+/**
+ * Writes the cycles taken in each call stack in the collapsed format read
+ * by flame graph tools. Returns false if the file can't be written.
+ */
+static bool writeStacks(const std::string& filename, const Sim& sim) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  std::vector<std::string> names(sim.frames.size());
+  names[0] = functionName(sim, 0);
+  for (size_t i = 1; i < sim.frames.size(); i++) {
+    // Frames are created after their parents.
+    names[i] = names[sim.frames[i].parent] + ";" + functionName(sim, i);
+  }
+  for (size_t i = 0; i < sim.frames.size(); i++) {
+    if (0 < sim.frames[i].cycles) {
+      file << names[i] << " " << sim.frames[i].cycles << std::endl;
+    }
+  }
+  return file.good();
+}
+
+/**
+ * Adds the memory accesses in from to those in to.
+ */
+static void addTraffic(Traffic& to, const Traffic& from) {
+  to.pushPop += from.pushPop;
+  to.calls += from.calls;
+  to.frame += from.frame;
+  to.global += from.global;
+}
+
+/**
+ * Writes the counts of each kind of memory access, and their total.
+ */
+static void writeTraffic(std::ostream& out, const Traffic& traffic) {
+  out << std::setw(12) << traffic.pushPop << std::setw(12) << traffic.calls
+      << std::setw(12) << traffic.frame << std::setw(12) << traffic.global
+      << std::setw(12)
+      << traffic.pushPop + traffic.calls + traffic.frame + traffic.global
+      << "  ";
+}
+
+/**
+ * Writes the memory accesses made by each function, not counting the
+ * functions it calls, and by each source line if there is a line map.
+ * Returns false if the file can't be written.
+ */
+static bool writeTrafficReport(const std::string& filename, const Sim& sim) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  const char *header = "    PUSH/POP    CALL/RET       frame      global"
+                       "       total  ";
+  std::map<std::string, Traffic> functions;
+  Traffic total = Traffic();
+  for (size_t i = 0; i < sim.frames.size(); i++) {
+    Traffic& traffic = functions[functionName(sim, i)];
+    addTraffic(traffic, sim.frames[i].traffic);
+    addTraffic(total, sim.frames[i].traffic);
+  }
+  std::vector<std::pair<uint64_t, std::string>> order;
+  for (auto entry : functions) {
+    const Traffic& traffic = entry.second;
+    order.push_back(std::make_pair(traffic.pushPop + traffic.calls +
+                                   traffic.frame + traffic.global,
+                                   entry.first));
+  }
+  std::sort(order.rbegin(), order.rend());
+  file << "Memory accesses in " << sim.insts << " instructions. Frame "
+       << "accesses are LOAD and STOR to the stack, and global accesses are "
+       << "to the rest of memory." << std::endl << std::endl
+       << header << "function" << std::endl;
+  writeTraffic(file, total);
+  file << "(all)" << std::endl;
+  for (auto entry : order) {
+    if (0 < entry.first) {
+      writeTraffic(file, functions[entry.second]);
+      file << entry.second << std::endl;
+    }
+  }
+  if (sim.sourceFile.empty()) {
+    return file.good();
+  }
+  // Count the accesses of each source line, in order of line.
+  std::map<int, Traffic> lines;
+  for (size_t i = 0; i < sim.instTraffic.size(); i++) {
+    if (-1 != sim.textLines[i]) {
+      addTraffic(lines[sim.sourceLines[sim.textLines[i]]],
+                 sim.instTraffic[i]);
+    }
+  }
+  std::vector<std::string> source;
+  std::ifstream sourceFile(sim.sourceFile);
+  std::string line;
+  while (std::getline(sourceFile, line)) {
+    source.push_back(line);
+  }
+  file << std::endl << header << "line of " << sim.sourceFile << std::endl;
+  for (auto entry : lines) {
+    const Traffic& traffic = entry.second;
+    if (0 == traffic.pushPop + traffic.calls + traffic.frame +
+        traffic.global) {
+      continue;
+    }
+    writeTraffic(file, traffic);
+    if (0 == entry.first) {
+      file << "(code from no single line, like shared subroutines)";
+    } else {
+      file << std::setw(5) << entry.first << "  "
+           << (entry.first <= (int)source.size() ? source[entry.first - 1]
+                                                 : "");
+    }
+    file << std::endl;
+  }
+  return file.good();
+}
+
+/**
+ * Returns the FNV-1a hash of the framebuffer.
+ */
+static uint64_t hash(const std::vector<uint8_t>& framebuffer) {
+  uint64_t result = 14695981039346656037ULL;
+  for (auto pixel : framebuffer) {
+    result = (result ^ pixel) * 1099511628211ULL;
+  }
+  return result;
+}
+
+/**
+ * Saves the framebuffer as a PPM image, where each 8-bit color has 3 bits
+ * of red, 3 bits of green, and 2 bits of blue. Returns false if the file
+ * can't be written.
+ */
+static bool dump(const std::string& filename,
+                 const std::vector<uint8_t>& framebuffer) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    _error("Could not open '" + filename + "'.");
+    return false;
+  }
+  file << "P6\n" << SCREEN_WIDTH << " " << SCREEN_HEIGHT << "\n255\n";
+  for (auto pixel : framebuffer) {
+    file.put((pixel >> 5) * 255 / 7);
+    file.put((pixel >> 2 & 7) * 255 / 7);
+    file.put((pixel & 3) * 255 / 3);
+  }
+  return file.good();
+}
+
+int main(int argc, char **argv) {
+  Sim sim;
+  sim.seed = 1;
+  sim.cyclesPerMs = 50000;
+  sim.maxInsts = UINT64_MAX;
+  std::string inputFile, dumpFile, programFile, profileFile, stacksFile;
+  std::string lineMapFile, trafficFile;
+  bool usage = false;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strncmp(argv[i], "-machine=", strlen("-machine="))) {
+      if (!Machine::current().load(argv[i] + strlen("-machine="))) {
+        return 1;
+      }
+    } else if (0 == strncmp(argv[i], "-seed=", strlen("-seed="))) {
+      sim.seed = strtoul(argv[i] + strlen("-seed="), NULL, 0);
+    } else if (0 == strncmp(argv[i], "-input=", strlen("-input="))) {
+      inputFile = argv[i] + strlen("-input=");
+    } else if (0 == strncmp(argv[i], "-clock=", strlen("-clock="))) {
+      sim.cyclesPerMs = strtoull(argv[i] + strlen("-clock="), NULL, 0);
+      usage |= 0 == sim.cyclesPerMs;
+    } else if (0 == strncmp(argv[i], "-max=", strlen("-max="))) {
+      sim.maxInsts = strtoull(argv[i] + strlen("-max="), NULL, 0);
+    } else if (0 == strncmp(argv[i], "-dump=", strlen("-dump="))) {
+      dumpFile = argv[i] + strlen("-dump=");
+    } else if (0 == strncmp(argv[i], "-profile=", strlen("-profile="))) {
+      profileFile = argv[i] + strlen("-profile=");
+    } else if (0 == strncmp(argv[i], "-stacks=", strlen("-stacks="))) {
+      stacksFile = argv[i] + strlen("-stacks=");
+    } else if (0 == strncmp(argv[i], "-traffic=", strlen("-traffic="))) {
+      trafficFile = argv[i] + strlen("-traffic=");
+    } else if (0 == strncmp(argv[i], "-line-map=", strlen("-line-map="))) {
+      lineMapFile = argv[i] + strlen("-line-map=");
+    } else if ('-' != argv[i][0] && programFile.empty()) {
+      programFile = argv[i];
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || programFile.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-machine=FILE] [-seed=N] [-input=FILE] [-clock=N]"
+              << " [-max=N] [-dump=FILE.ppm] [-profile=FILE] [-stacks=FILE]"
+              << " [-traffic=FILE] [-line-map=FILE] FILE.s" << std::endl;
+    return 1;
+  }
+  const Machine& machine = Machine::current();
+  if (4 != machine.instSize() || 2 != machine.dataSize() ||
+      2 != machine.addressSize()) {
+    _error("The simulator only supports 4-byte instructions and 2-byte "
+           "data and addresses.");
+    return 1;
+  }
+  auto sp = std::find(machine.registers().begin(), machine.registers().end(),
+                      "SP");
+  sim.sp = sp - machine.registers().begin();
+  sim.code.assign(MEMORY_SIZE / 4, Decoded { NULL, BAD, 0, 0, 0, 0 });
+  sim.memory.assign(MEMORY_SIZE, 0);
+  sim.regs.assign(machine.registers().size(), 0);
+  sim.inputs.assign(0x10000, 0);
+  sim.framebuffer.assign(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+  sim.halted = false;
+  sim.textLines.assign(MEMORY_SIZE / 4, -1);
+  sim.firstLabels.assign(MEMORY_SIZE / 4, "");
+  sim.lastLabels.assign(MEMORY_SIZE / 4, "");
+  sim.profile = !profileFile.empty() || !stacksFile.empty() ||
+                !trafficFile.empty();
+  if (sim.profile) {
+    sim.instCycles.assign(MEMORY_SIZE / 4, 0);
+    sim.instTraffic.assign(MEMORY_SIZE / 4, Traffic());
+    sim.frames.push_back(Frame { 0, 0, 0, Traffic() });
+  }
+  if (!assemble(programFile, sim) ||
+      (!inputFile.empty() && !readInputs(inputFile, sim)) ||
+      (!lineMapFile.empty() && !readLineMap(lineMapFile, sim))) {
+    return 1;
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (sim.profile) {
+    run<true>(sim);
+  } else {
+    run<false>(sim);
+  }
+  std::chrono::duration<double> seconds =
+    std::chrono::steady_clock::now() - start;
+  if (!sim.halted && sim.insts < sim.maxInsts) {
+    _error("Reached address " + toHexStr(sim.ip) +
+           ", which isn't an instruction.");
+  }
+  std::cout << "instructions " << sim.insts << std::endl
+            << "cycles " << sim.cycles << std::endl
+            << "seconds " << seconds.count() << std::endl
+            << "mips " << sim.insts / seconds.count() / 1e6 << std::endl
+            << "framebuffer " << std::hex << hash(sim.framebuffer)
+            << std::dec << std::endl;
+  if ((!dumpFile.empty() && !dump(dumpFile, sim.framebuffer)) ||
+      (!profileFile.empty() && !writeProfile(profileFile, sim)) ||
+      (!stacksFile.empty() && !writeStacks(stacksFile, sim)) ||
+      (!trafficFile.empty() && !writeTrafficReport(trafficFile, sim))) {
+    return 1;
+  }
+  return sim.halted || sim.insts == sim.maxInsts ? 0 : 1;
+}
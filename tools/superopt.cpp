@@ -0,0 +1,686 @@
+/**
+ * Consolite Compiler
+ * Copyright (c) 2015 Robert Fotino, All Rights Reserved
+ */
+
+/**
+ * Finds the peephole table that the compiler loads with -peephole=FILE,
+ * and that is compiled into src/peephole.cpp for the reference core.
+ *
+ * Usage: superopt [-machine=FILE] [-max-length=N] [-min-count=N] FILE.s...
+ *
+ * Reads assembly output from the compiler, built with -fno-peephole, and
+ * collects the straight-line sequences of register instructions in it
+ * that occur at least -min-count times (2 by default). For each one, it
+ * tries every sequence of at most -max-length instructions (3 by default)
+ * over the same registers, and keeps the cheapest ones that compute the
+ * same values and leave the same flags. Candidates are first run on a set
+ * of test inputs, and those that pass are checked on every value of each
+ * register against boundary and random values of the others, which covers
+ * every input when the sequence only reads one register. A replacement
+ * that leaves different flags is only kept with the flags listed as dead,
+ * so that the compiler only uses it where a CMP or TST sets them again
+ * before a conditional jump reads them. Rerun it whenever the machine
+ * description changes, since the cycle counts decide which sequences are
+ * cheaper.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "machine.h"
+
+/**
+ * The instructions that sequences are made of. They only read and write
+ * registers and the flags, so the sequences can be compared by those
+ * alone.
+ */
+enum Code { MOV, MOVI, ADD, SUB, MUL, AND, OR, XOR, SHL, SHRA, SHRL,
+            NUM_CODES };
+static const char *NAMES[NUM_CODES] = {
+  "MOV", "MOVI", "ADD", "SUB", "MUL", "AND", "OR", "XOR", "SHL", "SHRA",
+  "SHRL"
+};
+
+/**
+ * The most registers a sequence can use. More would make the search too
+ * slow to be useful.
+ */
+static const int MAX_REGS = 3;
+
+/**
+ * The longest sequences collected from the assembly.
+ */
+static const int MAX_WINDOW = 4;
+
+struct Op {
+  Code code;
+  int dst;
+  int src;
+  uint16_t imm;
+};
+
+typedef std::vector<Op> Seq;
+
+/**
+ * The bit for the flags in a mask of registers.
+ */
+static const int FLAGS_BIT = 1 << MAX_REGS;
+
+/**
+ * The registers and the flags. Which instructions set the flags, and how,
+ * differs between cores, so every arithmetic and logic instruction is
+ * assumed to set them from its result, and flags set by different
+ * instructions are never equal. flagsOp is NUM_CODES until an instruction
+ * sets them.
+ */
+struct State {
+  uint16_t regs[MAX_REGS];
+  Code flagsOp;
+  bool zero;
+  bool carry;
+  bool sign;
+  bool overflow;
+};
+
+/**
+ * A sequence collected from the assembly, with registers numbered in
+ * order of first use.
+ */
+struct Window {
+  Window() : numRegs(0), count(0) { }
+  Seq seq;
+  int numRegs;
+  int count;
+};
+
+/**
+ * A replacement for a window that passed the tests.
+ */
+struct Candidate {
+  int cycles;
+  Seq seq;
+};
+
+/**
+ * The most candidates kept for each set of dead registers. Only the
+ * cheapest ones are checked on every input, which is slow.
+ */
+static const size_t MAX_CANDIDATES = 64;
+
+/**
+ * Runs the sequence on the state. Returns false if it shifts by 16 or
+ * more, which the machine doesn't define.
+ */
+static bool run(const Seq& seq, State& state) {
+  for (const Op& op : seq) {
+    uint16_t& a = state.regs[op.dst];
+    uint16_t b = MOVI == op.code ? op.imm : state.regs[op.src];
+    uint16_t before = a;
+    switch (op.code) {
+      case MOV: case MOVI: a = b; break;
+      case ADD: a = a + b; break;
+      case SUB: a = a - b; break;
+      case MUL: a = a * b; break;
+      case AND: a &= b; break;
+      case OR: a |= b; break;
+      case XOR: a ^= b; break;
+      case SHL: case SHRA: case SHRL:
+        if (16 <= b) {
+          return false;
+        }
+        a = SHL == op.code ? a << b :
+          SHRA == op.code ? (uint16_t)((int16_t)a >> b) : a >> b;
+        break;
+      default: break;
+    }
+    // Set the flags like CMP does for ADD and SUB, and like TST for the
+    // others.
+    if (MOV != op.code && MOVI != op.code) {
+      state.flagsOp = op.code;
+      state.zero = 0 == a;
+      state.sign = a >> 15;
+      state.carry = ADD == op.code ? a < before :
+        (SUB == op.code ? before < b : false);
+      state.overflow = ADD == op.code ? (~(before ^ b) & (before ^ a)) >> 15 :
+        (SUB == op.code ? ((before ^ b) & (before ^ a)) >> 15 : false);
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns the state with the given register values and the flags not set
+ * by any instruction.
+ */
+static State makeState(const uint16_t *regs) {
+  State state;
+  std::copy(regs, regs + MAX_REGS, state.regs);
+  state.flagsOp = NUM_CODES;
+  state.zero = state.carry = state.sign = state.overflow = false;
+  return state;
+}
+
+/**
+ * Returns the registers written by the sequence, as a bit mask.
+ */
+static int written(const Seq& seq) {
+  int mask = 0;
+  for (const Op& op : seq) {
+    mask |= 1 << op.dst;
+  }
+  return mask;
+}
+
+static int cycles(const Seq& seq) {
+  int total = 0;
+  for (const Op& op : seq) {
+    total += Machine::current().cycles(NAMES[op.code]);
+  }
+  return total;
+}
+
+static std::string hex(uint16_t value) {
+  std::ostringstream out;
+  out << "0x" << std::hex << value;
+  return out.str();
+}
+
+/**
+ * Formats the sequence in the syntax of the peephole table, with register
+ * N written as the Nth lowercase letter.
+ */
+static std::string format(const Seq& seq) {
+  std::string text;
+  for (const Op& op : seq) {
+    text += text.empty() ? "" : "; ";
+    text += std::string(NAMES[op.code]) + " %" + (char)('a' + op.dst) + " ";
+    text += MOVI == op.code ? hex(op.imm) :
+      std::string("%") + (char)('a' + op.src);
+  }
+  return text;
+}
+
+/**
+ * Parses a line of assembly into an instruction, numbering its registers
+ * with the numbering used by the rest of the window. Returns false if it
+ * isn't an instruction that sequences can be made of.
+ */
+static bool parseOp(const std::string& line, std::vector<std::string>& regs,
+                    Op& op) {
+  std::istringstream words(line);
+  std::string name;
+  std::string args[2];
+  std::string extra;
+  if (line.empty() || !isspace(line[0]) ||
+      !(words >> name >> args[0] >> args[1]) || (words >> extra)) {
+    return false;
+  }
+  const char **code = std::find(NAMES, NAMES + NUM_CODES, name);
+  if (NAMES + NUM_CODES == code) {
+    return false;
+  }
+  op.code = (Code)(code - NAMES);
+  const std::vector<std::string>& machineRegs =
+    Machine::current().registers();
+  int nums[2] = { 0, 0 };
+  for (int i = 0; i < 2; i++) {
+    if (1 == i && MOVI == op.code) {
+      char *end = nullptr;
+      long value = strtol(args[i].c_str(), &end, 0);
+      if (args[i].empty() || '\0' != *end || value < 0 || value > 0xffff) {
+        return false;
+      }
+      op.imm = (uint16_t)value;
+      continue;
+    }
+    if ("SP" == args[i] || "FP" == args[i] ||
+        machineRegs.end() == std::find(machineRegs.begin(),
+                                       machineRegs.end(), args[i])) {
+      return false;
+    }
+    auto it = std::find(regs.begin(), regs.end(), args[i]);
+    if (regs.end() == it) {
+      if (MAX_REGS == (int)regs.size()) {
+        return false;
+      }
+      it = regs.insert(regs.end(), args[i]);
+    }
+    nums[i] = it - regs.begin();
+  }
+  op.dst = nums[0];
+  op.src = nums[1];
+  return true;
+}
+
+/**
+ * Collects the windows in the given assembly file.
+ */
+static bool collect(const std::string& filename,
+                    std::map<std::string, Window>& windows) {
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Could not open '" << filename << "'." << std::endl;
+    return false;
+  }
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(file, line)) {
+    lines.push_back(line);
+  }
+  for (size_t start = 0; start < lines.size(); start++) {
+    std::vector<std::string> regs;
+    Seq seq;
+    for (size_t i = start; i < lines.size() && seq.size() < MAX_WINDOW;
+         i++) {
+      Op op;
+      if (!parseOp(lines[i], regs, op)) {
+        break;
+      }
+      seq.push_back(op);
+      Window& window = windows[format(seq)];
+      window.seq = seq;
+      window.numRegs = regs.size();
+      window.count++;
+    }
+  }
+  return true;
+}
+
+/**
+ * Returns the instructions that replacements for the window are made of:
+ * every instruction the machine has over the window's registers, with the
+ * window's constants and a few related ones as immediates.
+ */
+static std::vector<Op> alphabet(const Window& window) {
+  std::set<uint16_t> imms = { 0, 1, 0xffff };
+  for (const Op& op : window.seq) {
+    if (MOVI == op.code) {
+      uint16_t c = op.imm;
+      for (uint16_t related : { c, (uint16_t)(c - 1), (uint16_t)(c + 1),
+                                (uint16_t)-c, (uint16_t)~c }) {
+        imms.insert(related);
+      }
+      if (c < 16) {
+        imms.insert(16 - c);
+      }
+    }
+  }
+  std::vector<Op> ops;
+  for (int code = 0; code < NUM_CODES; code++) {
+    if (!Machine::current().getInst(NAMES[code])) {
+      continue;
+    }
+    for (int dst = 0; dst < window.numRegs; dst++) {
+      if (MOVI == code) {
+        for (uint16_t imm : imms) {
+          ops.push_back({ (Code)code, dst, 0, imm });
+        }
+        continue;
+      }
+      for (int src = 0; src < window.numRegs; src++) {
+        if (MOV != code || src != dst) {
+          ops.push_back({ (Code)code, dst, src, 0 });
+        }
+      }
+    }
+  }
+  return ops;
+}
+
+/**
+ * Returns the registers that the candidate leaves with a different value
+ * than the window for the given input, as a bit mask with FLAGS_BIT set
+ * if the flags are different, or -1 if the input
+ * makes the candidate shift out of range. Inputs that make the window
+ * shift out of range don't constrain the candidate, so they return 0.
+ */
+static int compare(const Window& window, const Seq& candidate,
+                   const State& input) {
+  State expected = input;
+  State actual = input;
+  if (!run(window.seq, expected)) {
+    return 0;
+  } else if (!run(candidate, actual)) {
+    return -1;
+  }
+  int mask = 0;
+  for (int i = 0; i < window.numRegs; i++) {
+    if (expected.regs[i] != actual.regs[i]) {
+      mask |= 1 << i;
+    }
+  }
+  if (expected.flagsOp != actual.flagsOp ||
+      expected.zero != actual.zero || expected.carry != actual.carry ||
+      expected.sign != actual.sign ||
+      expected.overflow != actual.overflow) {
+    mask |= FLAGS_BIT;
+  }
+  return mask;
+}
+
+/**
+ * Returns true if the candidate leaves every register outside of dead
+ * with the same value as the window, for every value of each register
+ * combined with the given values of the others.
+ */
+static bool verify(const Window& window, const Seq& candidate, int dead,
+                   const std::vector<uint16_t>& others) {
+  int numOthers = window.numRegs - 1;
+  size_t combos = 1;
+  for (int i = 0; i < numOthers; i++) {
+    combos *= others.size();
+  }
+  for (int reg = 0; reg < window.numRegs; reg++) {
+    for (size_t combo = 0; combo < combos; combo++) {
+      uint16_t regs[MAX_REGS] = { 0 };
+      State input = makeState(regs);
+      size_t rest = combo;
+      for (int i = 0; i < window.numRegs; i++) {
+        if (i != reg) {
+          input.regs[i] = others[rest % others.size()];
+          rest /= others.size();
+        }
+      }
+      for (uint32_t value = 0; value <= 0xffff; value++) {
+        input.regs[reg] = value;
+        int mask = compare(window, candidate, input);
+        if (-1 == mask || 0 != (mask & ~dead)) {
+          return false;
+        }
+      }
+    }
+    if (1 == window.numRegs) {
+      break;
+    }
+  }
+  return true;
+}
+
+/**
+ * Tries every sequence that starts with prefix and is at most maxLength
+ * long, and keeps the ones that are cheaper than the window and pass the
+ * tests, for each set of registers that they leave with a different value
+ * than the window does.
+ */
+static void search(const Window& window, const std::vector<Op>& ops,
+                   const std::vector<State>& tests, size_t maxLength,
+                   Seq& prefix, int prefixCycles,
+                   std::vector<std::vector<Candidate>>& candidates) {
+  int windowCycles = cycles(window.seq);
+  int windowWritten = written(window.seq);
+  // The register written last holds the result, so it has to be kept.
+  int canDie = (windowWritten & ~(1 << window.seq.back().dst)) | FLAGS_BIT;
+  if (prefixCycles < windowCycles || prefix.size() < window.seq.size()) {
+    int mask = 0;
+    for (const State& test : tests) {
+      int testMask = compare(window, prefix, test);
+      mask |= -1 == testMask ? ~0 : testMask;
+      if (mask & ~canDie) {
+        break;
+      }
+    }
+    for (int dead = 0; 0 == (mask & ~canDie) && dead <= canDie; dead++) {
+      if ((dead & ~canDie) || (dead & mask) != mask) {
+        continue;
+      }
+      std::vector<Candidate>& list = candidates[dead];
+      auto it = list.begin();
+      while (list.end() != it && (it->cycles < prefixCycles ||
+                                  (it->cycles == prefixCycles &&
+                                   it->seq.size() <= prefix.size()))) {
+        it++;
+      }
+      list.insert(it, { prefixCycles, prefix });
+      if (MAX_CANDIDATES < list.size()) {
+        list.pop_back();
+      }
+    }
+  }
+  if (prefix.size() == maxLength) {
+    return;
+  }
+  for (const Op& op : ops) {
+    int opCycles = Machine::current().cycles(NAMES[op.code]);
+    if (prefixCycles + opCycles > windowCycles) {
+      continue;
+    }
+    prefix.push_back(op);
+    search(window, ops, tests, maxLength, prefix, prefixCycles + opCycles,
+           candidates);
+    prefix.pop_back();
+  }
+}
+
+/**
+ * Returns the sequence with its registers numbered in order of first use.
+ */
+static Seq renumber(const Seq& seq) {
+  std::vector<int> numbers(MAX_REGS, -1);
+  int next = 0;
+  Seq result = seq;
+  for (Op& op : result) {
+    for (int *reg : { &op.dst, &op.src }) {
+      if (MOVI == op.code && reg == &op.src) {
+        continue;
+      } else if (-1 == numbers[*reg]) {
+        numbers[*reg] = next++;
+      }
+      *reg = numbers[*reg];
+    }
+  }
+  return result;
+}
+
+/**
+ * Formats a rule that replaces the window with the replacement. A constant
+ * that the rule holds for with any value in its place is written as a
+ * variable, so that the rule also applies to other constants and to
+ * addresses. That is checked on the given sample values.
+ */
+static std::string formatRule(const Window& window, const Seq& replacement,
+                              int dead, const std::vector<uint16_t>& samples,
+                              const std::vector<uint16_t>& others) {
+  std::vector<uint16_t> constants;
+  for (const Op& op : window.seq) {
+    if (MOVI == op.code &&
+        constants.end() == std::find(constants.begin(), constants.end(),
+                                     op.imm)) {
+      constants.push_back(op.imm);
+    }
+  }
+  std::vector<bool> isVar(constants.size(), false);
+  for (size_t i = 0; i < constants.size(); i++) {
+    isVar[i] = true;
+    for (size_t sample = 0; isVar[i] && sample < samples.size(); sample++) {
+      // Put sample values in place of this constant and the ones already
+      // found to be variables.
+      Window test = window;
+      Seq testReplacement = replacement;
+      for (Seq *seq : { &test.seq, &testReplacement }) {
+        for (Op& op : *seq) {
+          auto it = std::find(constants.begin(), constants.end(), op.imm);
+          if (MOVI == op.code && constants.end() != it &&
+              isVar[it - constants.begin()]) {
+            op.imm = samples[(sample + (it - constants.begin())) %
+                             samples.size()];
+          }
+        }
+      }
+      isVar[i] = verify(test, testReplacement, dead, others);
+    }
+  }
+  std::string text = "rule";
+  for (const Seq *seq : { &window.seq, &replacement }) {
+    text += seq == &window.seq ? "" : " =>";
+    std::string insts = format(*seq);
+    // Replace the constants that are variables, which format() writes
+    // as the last word of a MOVI.
+    for (size_t pos = insts.find("MOVI"); std::string::npos != pos;
+         pos = insts.find("MOVI", pos + 1)) {
+      size_t start = insts.find(' ', insts.find(' ', pos) + 1) + 1;
+      size_t end = std::min(insts.find(';', start), insts.size());
+      uint16_t value = strtol(insts.substr(start, end - start).c_str(),
+                              nullptr, 0);
+      size_t index = std::find(constants.begin(), constants.end(), value) -
+        constants.begin();
+      if (index < constants.size() && isVar[index]) {
+        insts.replace(start, end - start, std::string("$") +
+                      (char)('a' + index));
+      }
+    }
+    text += insts.empty() ? "" : " " + insts;
+  }
+  for (int reg = 0; reg < window.numRegs; reg++) {
+    if (dead & (1 << reg)) {
+      text += std::string(std::string::npos == text.find("; dead") ?
+                          "; dead" : "") + " %" + (char)('a' + reg);
+    }
+  }
+  if (dead & FLAGS_BIT) {
+    text += std::string(std::string::npos == text.find("; dead") ?
+                        "; dead" : "") + " FLAGS";
+  }
+  return text;
+}
+
+int main(int argc, char **argv) {
+  size_t maxLength = 3;
+  int minCount = 2;
+  std::string machineSource = "the reference Consolite core";
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strncmp(argv[i], "-machine=", strlen("-machine="))) {
+      machineSource = argv[i] + strlen("-machine=");
+      if (!Machine::current().load(machineSource)) {
+        return 1;
+      }
+    } else if (0 == strncmp(argv[i], "-max-length=",
+                            strlen("-max-length="))) {
+      maxLength = atoi(argv[i] + strlen("-max-length="));
+    } else if (0 == strncmp(argv[i], "-min-count=", strlen("-min-count="))) {
+      minCount = atoi(argv[i] + strlen("-min-count="));
+    } else if ('-' != argv[i][0]) {
+      files.push_back(argv[i]);
+    } else {
+      files.clear();
+      break;
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-machine=FILE] [-max-length=N] [-min-count=N] FILE.s..."
+              << std::endl;
+    return 1;
+  }
+  std::map<std::string, Window> windows;
+  for (auto file : files) {
+    if (!collect(file, windows)) {
+      return 1;
+    }
+  }
+  // Boundary values, then pseudo-random ones from a fixed seed so that the
+  // output is the same every time.
+  std::vector<uint16_t> values = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x100, 0x7fff,
+                                   0x8000, 0x8001, 0xfffe, 0xffff };
+  uint32_t seed = 12345;
+  while (values.size() < 64) {
+    seed = seed * 1103515245 + 12345;
+    values.push_back(seed >> 16);
+  }
+  // Constants are checked on fewer values, since each one takes a check on
+  // every input.
+  std::vector<uint16_t> samples(values.begin(), values.begin() + 8);
+  std::vector<State> tests;
+  for (size_t i = 0; i < values.size(); i++) {
+    uint16_t regs[MAX_REGS];
+    for (int reg = 0; reg < MAX_REGS; reg++) {
+      regs[reg] = values[(i * (reg + 1) + reg * 7) % values.size()];
+    }
+    tests.push_back(makeState(regs));
+  }
+  // Shorter windows first, so that longer ones can be skipped when a
+  // rule for part of them is found.
+  std::vector<const Window *> order;
+  for (auto& entry : windows) {
+    if (minCount <= entry.second.count) {
+      order.push_back(&entry.second);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [](const Window *a, const Window *b) {
+                     return a->seq.size() < b->seq.size();
+                   });
+  std::set<std::string> improved;
+  // The number of times each rule's window occurs, where windows that
+  // differ only in constants that are variables in the rule share a rule.
+  std::map<std::string, int> counts;
+  std::vector<std::string> rules;
+  for (const Window *window : order) {
+    bool partImproved = false;
+    for (size_t length = 1; length < window->seq.size(); length++) {
+      for (size_t start = 0; start + length <= window->seq.size(); start++) {
+        Seq part(window->seq.begin() + start,
+                 window->seq.begin() + start + length);
+        partImproved |= 0 < improved.count(format(renumber(part)));
+      }
+    }
+    if (partImproved) {
+      continue;
+    }
+    std::vector<uint16_t> others(values.begin(), values.begin() +
+                                 (3 == window->numRegs ? 16 : 64));
+    std::vector<std::vector<Candidate>> candidates(FLAGS_BIT << 1);
+    Seq prefix;
+    search(*window, alphabet(*window), tests,
+           std::min(maxLength, window->seq.size()), prefix, 0, candidates);
+    // Check the candidates on every input, cheapest first, and only output
+    // a rule for a set of dead registers if it does better than the rules
+    // for the smaller sets, which apply in more places.
+    std::vector<const Candidate *> best(FLAGS_BIT << 1, nullptr);
+    for (int dead = 0; dead < (FLAGS_BIT << 1); dead++) {
+      for (const Candidate& candidate : candidates[dead]) {
+        if (verify(*window, candidate.seq, dead, others)) {
+          best[dead] = &candidate;
+          break;
+        }
+      }
+      for (int subset = 0; best[dead] && subset < dead; subset++) {
+        if ((subset & dead) == subset && best[subset] &&
+            best[subset]->cycles <= best[dead]->cycles &&
+            best[subset]->seq.size() <= best[dead]->seq.size()) {
+          best[dead] = nullptr;
+        }
+      }
+      if (!best[dead]) {
+        continue;
+      }
+      std::string rule = formatRule(*window, best[dead]->seq, dead, samples,
+                                    samples);
+      if (0 == counts[rule]) {
+        rules.push_back(rule);
+      }
+      counts[rule] += window->count;
+      improved.insert(format(window->seq));
+    }
+  }
+  // The most common windows first, so that the compiler tries the rules
+  // that matter most first.
+  std::stable_sort(rules.begin(), rules.end(),
+                   [&](const std::string& a, const std::string& b) {
+                     return counts[a] > counts[b];
+                   });
+  std::cout << "# Peephole table for " << machineSource << std::endl
+            << "# rule PATTERN => REPLACEMENT; dead REGS" << std::endl;
+  for (auto rule : rules) {
+    std::cout << rule << std::endl;
+  }
+  return 0;
+}